@@ -0,0 +1,345 @@
+#include "bcache.h"
+#include "ide.h"
+#include "../thread/sync.h"
+#include "../thread/thread.h"
+#include "../kernel/memory.h"
+#include "../kernel/debug.h"
+#include "../kernel/interrupt.h"
+#include "../lib/string.h"
+#include "../lib/kernel/stdio-kernel.h"
+#include "../fs/fs.h"
+
+static struct buf_head bufs[BCACHE_BUF_CNT];      // 所有缓冲区
+static struct list hash_table[BCACHE_HASH_SIZE];  // 按(hd, lba)散列的哈希桶
+static struct list lru_list;     // 队首为最近使用的缓冲区,队尾为最久未使用的
+static struct lock bcache_lock;  // 保护以上结构及不忙的缓冲区,读写硬盘时释放
+static struct bcache_stat bstat; // 统计计数
+
+/** 计算(hd, lba)所在的哈希桶 */
+static struct list* bucket_of(struct disk* hd, uint32_t lba) {
+    return &hash_table[((uint32_t) hd / sizeof(struct disk) + lba) % BCACHE_HASH_SIZE];
+}
+
+/** 在哈希桶中查找缓存了hd上扇区lba的缓冲区,找不到返回NULL */
+static struct buf_head* buf_lookup(struct disk* hd, uint32_t lba) {
+    struct list* bucket = bucket_of(hd, lba);
+    struct list_elem* elem = bucket->head.next;
+    while (elem != &bucket->tail) {
+        struct buf_head* bh = elem2entry(struct buf_head, hash_tag, elem);
+        if (bh->hd == hd && bh->lba == lba) {
+            return bh;
+        }
+        elem = elem->next;
+    }
+    return NULL;
+}
+
+/** 将bh移到lru队首 */
+static void buf_touch(struct buf_head* bh) {
+    list_remove(&bh->lru_tag);
+    list_push(&lru_list, &bh->lru_tag);
+}
+
+/**
+ * 持有缓存锁时调用,等待bh的传输完成.等待期间释放缓存锁,
+ * 返回时bh可能已被淘汰改作它用,调用者须重新查找
+ */
+static void buf_wait(struct buf_head* bh) {
+    // 完成回调在硬盘中断中执行,关中断后再检查,避免错过唤醒
+    enum intr_status old_status = intr_disable();
+    if (!bh->busy) {
+        intr_set_status(old_status);
+        return;
+    }
+    // 先挂到等待队列再释放缓存锁,关中断期间完成回调不会执行.
+    // 可能有多个线程同时等待同一缓冲区,所以不用二值信号量
+    list_append(&bh->waiters, &running_thread()->general_tag);
+    lock_release(&bcache_lock);
+    thread_block(TASK_BLOCKED);
+    intr_set_status(old_status);
+    lock_acquire(&bcache_lock);
+}
+
+/** 读入或回写的完成回调,在硬盘中断处理程序中调用 */
+static void buf_io_done(struct ide_request* req) {
+    struct buf_head* bh = req->arg;
+    if (!req->is_write) {
+        bh->valid = true;
+    }
+    bh->busy = false;
+    while (!list_empty(&bh->waiters)) {
+        thread_unblock(elem2entry(struct task_struct, general_tag, list_pop(&bh->waiters)));
+    }
+}
+
+/** 将bh标记为忙,并填好读入或回写它的请求,返回的请求由调用者提交 */
+static struct ide_request* buf_io_prepare(struct buf_head* bh, bool is_write) {
+    bh->busy = true;
+    bh->req.hd = bh->hd;
+    bh->req.lba = bh->lba;
+    bh->req.sec_cnt = 1;
+    bh->req.buf = bh->data;
+    bh->req.is_write = is_write;
+    bh->req.done = buf_io_done;
+    bh->req.arg = bh;
+    bh->req.next_merged = NULL;
+    return &bh->req;
+}
+
+/**
+ * 从lru队尾起找一个可以淘汰的缓冲区,忙的缓冲区不能淘汰
+ * @param clean_only 为true时也跳过脏的缓冲区
+ * @return 找不到时返回NULL
+ */
+static struct buf_head* buf_victim(bool clean_only) {
+    struct list_elem* elem = lru_list.tail.prev;
+    while (elem != &lru_list.head) {
+        struct buf_head* bh = elem2entry(struct buf_head, lru_tag, elem);
+        if (!bh->busy && !(clean_only && bh->valid && bh->dirty)) {
+            return bh;
+        }
+        elem = elem->prev;
+    }
+    return NULL;
+}
+
+/** 把不忙且干净的缓冲区bh改为缓存hd上的扇区lba,内容尚无效 */
+static void buf_assign(struct buf_head* bh, struct disk* hd, uint32_t lba) {
+    if (bh->hd != NULL) {
+        list_remove(&bh->hash_tag);
+    }
+    bh->hd = hd;
+    bh->lba = lba;
+    bh->valid = false;
+    bh->dirty = false;
+    list_push(bucket_of(hd, lba), &bh->hash_tag);
+    buf_touch(bh);
+}
+
+/**
+ * 查找已缓存hd上扇区lba的缓冲区,它正在读入或回写时等待传输完成
+ * @return 找不到时返回NULL,返回的缓冲区不忙且内容有效
+ */
+static struct buf_head* buf_ready(struct disk* hd, uint32_t lba) {
+    struct buf_head* bh;
+    // 忙的缓冲区完成读入后才有效,不忙的缓冲区都是有效的
+    while ((bh = buf_lookup(hd, lba)) != NULL && bh->busy) {
+        buf_wait(bh);
+    }
+    return bh;
+}
+
+/**
+ * 获取缓存hd上扇区lba的缓冲区,不在缓存中时淘汰lru队尾的缓冲区,
+ * 被淘汰的缓冲区若是脏的先写回硬盘.读写硬盘期间释放缓存锁,
+ * 其它线程的未命中可以同时进入硬盘请求队列
+ * @param need_read 未命中时是否需要从硬盘读入原内容,整扇区覆盖写时不需要
+ */
+static struct buf_head* buf_get(struct disk* hd, uint32_t lba, bool need_read) {
+    bool missed = false;
+    while (1) {
+        struct buf_head* bh = buf_ready(hd, lba);
+        if (bh != NULL) {
+            if (!missed) {
+                bstat.hits++;
+            }
+            buf_touch(bh);
+            return bh;
+        }
+        if (!missed) {
+            bstat.misses++;
+            missed = true;
+        }
+        bh = buf_victim(false);
+        if (bh == NULL) {
+            // 所有缓冲区都在传输中,等最久未使用的一个完成后重试
+            buf_wait(elem2entry(struct buf_head, lru_tag, lru_list.tail.prev));
+            continue;
+        }
+        if (bh->valid && bh->dirty) {
+            // 先写回,等待期间其它线程可能缓存了扇区lba,所以完成后重新查找
+            ide_submit(buf_io_prepare(bh, true));
+            bh->dirty = false;
+            bstat.writebacks++;
+            buf_wait(bh);
+            continue;
+        }
+        buf_assign(bh, hd, lba);
+        if (!need_read) {
+            bh->valid = true;
+            return bh;
+        }
+        // 缓冲区忙期间已在哈希桶中,同时未命中同一扇区的线程会等它读入而不是重复读盘
+        ide_submit(buf_io_prepare(bh, false));
+        buf_wait(bh);
+    }
+}
+
+/**
+ * 为从lba起连续未命中的run个扇区各占一个干净的缓冲区,
+ * 串成一个请求提交,由请求队列一条命令读入
+ * @return 实际提交的扇区数,可能因缓冲区不足而少于run
+ */
+static uint32_t batch_submit(struct disk* hd, uint32_t lba, uint32_t run) {
+    struct ide_request* first = NULL;
+    struct ide_request* prev = NULL;
+    uint32_t claimed = 0;
+    while (claimed < run) {
+        struct buf_head* bh = buf_victim(true);
+        if (bh == NULL) {
+            break;
+        }
+        buf_assign(bh, hd, lba + claimed);
+        struct ide_request* req = buf_io_prepare(bh, false);
+        if (prev == NULL) {
+            first = req;
+        } else {
+            prev->next_merged = req;
+        }
+        prev = req;
+        claimed++;
+    }
+    if (first != NULL) {
+        ide_submit(first);
+    }
+    return claimed;
+}
+
+/**
+ * 经缓存从硬盘hd的扇区lba起读取sec_cnt个扇区到buf,
+ * 连续未命中的扇区合并为一次多扇区读盘
+ */
+void bcache_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
+    lock_acquire(&bcache_lock);
+    uint32_t sec_idx = 0;
+    while (sec_idx < sec_cnt) {
+        uint8_t* dst = (uint8_t*) buf + sec_idx * SECTOR_SIZE;
+        uint32_t run = 0;
+        while (sec_idx + run < sec_cnt && run < BCACHE_BATCH_SECS &&
+               buf_lookup(hd, lba + sec_idx + run) == NULL) {
+            run++;
+        }
+        uint32_t batched = run > 1 ? batch_submit(hd, lba + sec_idx, run) : 0;
+        if (batched == 0) {
+            struct buf_head* bh = buf_get(hd, lba + sec_idx, true);
+            memcpy(dst, bh->data, SECTOR_SIZE);
+            sec_idx++;
+            continue;
+        }
+        bstat.misses += batched;
+        if (batched > 1) {
+            bstat.batch_reads++;
+        }
+        // 写dst可能缺页,缺页处理从程序文件读入时会重入本函数,
+        // 这些缓冲区刚移到lru队首,重入的读盘淘汰不到.
+        // 只有等待读盘期间它们才可能被其它线程淘汰,此时改由buf_get重新读入
+        uint32_t batch_idx = 0;
+        while (batch_idx < batched) {
+            struct buf_head* bh = buf_ready(hd, lba + sec_idx + batch_idx);
+            if (bh == NULL) {
+                bh = buf_get(hd, lba + sec_idx + batch_idx, true);
+            }
+            memcpy(dst + batch_idx * SECTOR_SIZE, bh->data, SECTOR_SIZE);
+            batch_idx++;
+        }
+        sec_idx += batched;
+    }
+    lock_release(&bcache_lock);
+}
+
+/** 经缓存读取硬盘hd扇区lba中自offset起的len字节到buf,只需扇区中一部分时免去整扇区的中转缓冲 */
+void bcache_read_part(struct disk* hd, uint32_t lba, uint32_t offset, void* buf, uint32_t len) {
+    ASSERT(offset + len <= SECTOR_SIZE);
+    lock_acquire(&bcache_lock);
+    struct buf_head* bh = buf_get(hd, lba, true);
+    memcpy(buf, bh->data + offset, len);
+    lock_release(&bcache_lock);
+}
+
+/** 将buf中len字节写入缓存中硬盘hd扇区lba的offset处,扇区其余内容不变 */
+void bcache_write_part(struct disk* hd, uint32_t lba, uint32_t offset, const void* buf, uint32_t len) {
+    ASSERT(offset + len <= SECTOR_SIZE);
+    lock_acquire(&bcache_lock);
+    struct buf_head* bh = buf_get(hd, lba, true);
+    memcpy(bh->data + offset, buf, len);
+    bh->dirty = true;
+    lock_release(&bcache_lock);
+}
+
+/** 将buf中sec_cnt个扇区写入缓存,由回写线程或淘汰时写到硬盘hd的扇区lba起 */
+void bcache_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
+    lock_acquire(&bcache_lock);
+    uint32_t sec_idx = 0;
+    while (sec_idx < sec_cnt) {
+        struct buf_head* bh = buf_get(hd, lba + sec_idx, false);
+        memcpy(bh->data, (uint8_t*) buf + sec_idx * SECTOR_SIZE, SECTOR_SIZE);
+        bh->dirty = true;
+        sec_idx++;
+    }
+    lock_release(&bcache_lock);
+}
+
+/** 将所有脏缓冲区写回硬盘 */
+void bcache_sync(void) {
+    lock_acquire(&bcache_lock);
+    // 先一次提交全部脏块,由请求队列按扇区排序并合并相邻扇区,再逐个等待完成.
+    // 等待时释放缓存锁,回写期间其它线程仍可访问不忙的缓冲区
+    uint32_t buf_idx = 0;
+    while (buf_idx < BCACHE_BUF_CNT) {
+        struct buf_head* bh = &bufs[buf_idx];
+        if (!bh->busy && bh->valid && bh->dirty) {
+            ide_submit(buf_io_prepare(bh, true));
+            bh->dirty = false;
+            bstat.writebacks++;
+        }
+        buf_idx++;
+    }
+    buf_idx = 0;
+    while (buf_idx < BCACHE_BUF_CNT) {
+        buf_wait(&bufs[buf_idx]);
+        buf_idx++;
+    }
+    lock_release(&bcache_lock);
+}
+
+/** 打印缓存统计信息 */
+void bcache_stat_print(void) {
+    uint32_t dirty_cnt = 0, buf_idx = 0;
+    while (buf_idx < BCACHE_BUF_CNT) {
+        if (bufs[buf_idx].valid && bufs[buf_idx].dirty) {
+            dirty_cnt++;
+        }
+        buf_idx++;
+    }
+    printk("bcache: bufs %d  hits %d  misses %d  writebacks %d  dirty %d  batch reads %d\n",
+           BCACHE_BUF_CNT, bstat.hits, bstat.misses, bstat.writebacks, dirty_cnt, bstat.batch_reads);
+}
+
+/** 块缓存初始化 */
+void bcache_init(void) {
+    printk("bcache_init start\n");
+    uint32_t pg_cnt = DIV_ROUND_UP(BCACHE_BUF_CNT * SECTOR_SIZE, PG_SIZE);
+    uint8_t* data = get_kernel_pages(pg_cnt);
+    if (data == NULL) {
+        PANIC("bcache_init: alloc buffers failed!");
+    }
+    lock_init(&bcache_lock);
+    list_init(&lru_list);
+    uint32_t idx = 0;
+    while (idx < BCACHE_HASH_SIZE) {
+        list_init(&hash_table[idx++]);
+    }
+    idx = 0;
+    while (idx < BCACHE_BUF_CNT) {
+        bufs[idx].hd = NULL;
+        bufs[idx].valid = false;
+        bufs[idx].dirty = false;
+        bufs[idx].busy = false;
+        list_init(&bufs[idx].waiters);
+        bufs[idx].data = data + idx * SECTOR_SIZE;
+        list_append(&lru_list, &bufs[idx].lru_tag);
+        idx++;
+    }
+    memset(&bstat, 0, sizeof(struct bcache_stat));
+    printk("bcache_init done\n");
+}
@@ -0,0 +1,45 @@
+#ifndef __DEVICE_BCACHE_H
+#define __DEVICE_BCACHE_H
+#include "../lib/stdint.h"
+#include "../kernel/global.h"
+#include "../lib/kernel/list.h"
+#include "ide.h"
+
+#define BCACHE_BUF_CNT 128       // 缓冲区个数,每个缓冲一个扇区
+#define BCACHE_HASH_SIZE 64      // 哈希桶个数
+#define BCACHE_BATCH_SECS 64     // 连续未命中时串成一个请求读入的最大扇区数
+
+/**
+ * 块缓冲区,缓存硬盘hd上扇区lba的内容.
+ * 读写硬盘期间不持有缓存锁,缓冲区标记为忙,忙的缓冲区不会被淘汰,
+ * 要使用它的线程挂到waiters上等待传输完成
+ */
+struct buf_head {
+    struct disk* hd;            // 所属硬盘,为NULL时未缓存任何扇区,也不在哈希桶中
+    uint32_t lba;               // 缓存的扇区地址
+    bool valid;                 // 是否已缓存有效数据
+    bool dirty;                 // 是否被修改过尚未写回硬盘
+    volatile bool busy;         // 是否正在读入或写回,由硬盘中断中的完成回调清除
+    struct list waiters;        // 等待传输完成的线程,传输完成时全部唤醒
+    struct list_elem hash_tag;  // 用于哈希桶中的标记
+    struct list_elem lru_tag;   // 用于lru队列中的标记
+    uint8_t* data;              // 扇区数据
+    struct ide_request req;     // 读入或回写时提交给硬盘请求队列的请求
+};
+
+/** 缓存统计计数 */
+struct bcache_stat {
+    uint32_t hits;        // 命中次数
+    uint32_t misses;      // 未命中次数
+    uint32_t writebacks;  // 脏块写回硬盘的次数
+    uint32_t batch_reads; // 一次读入多个连续扇区的次数
+};
+
+void bcache_init(void);
+void bcache_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt);
+void bcache_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt);
+void bcache_read_part(struct disk* hd, uint32_t lba, uint32_t offset, void* buf, uint32_t len);
+void bcache_write_part(struct disk* hd, uint32_t lba, uint32_t offset, const void* buf, uint32_t len);
+void bcache_sync(void);
+void bcache_stat_print(void);
+#endif
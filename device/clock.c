@@ -0,0 +1,94 @@
+#include "clock.h"
+#include "timer.h"
+#include "../kernel/cpu.h"
+#include "../kernel/interrupt.h"
+#include "../kernel/global.h"
+
+#define NS_PER_SEC 1000000000
+
+/*
+ * 以TSC为时钟源:纳秒数 = base_ns + (TSC - base_tsc) * clock_mult >> clock_shift,
+ * 每个时钟中断把基准推进到当前,使乘积不会超出64位
+ */
+static uint32_t tsc_khz;      // 校准得到的TSC频率,为0时退回以tick计时
+static uint32_t clock_mult;
+static uint32_t clock_shift;
+static uint64_t base_tsc;
+static uint64_t base_ns;
+
+/** *n除以base,商存回*n,返回余数,内核没有libgcc,64位除法用两次divl完成 */
+static uint32_t div64_32(uint64_t* n, uint32_t base) {
+    uint32_t high = (uint32_t) (*n >> 32), low = (uint32_t) *n, rem;
+    uint32_t q_high = high / base;
+    high %= base;
+    asm ("divl %2" : "=a" (low), "=d" (rem) : "rm" (base), "0" (low), "1" (high));
+    *n = (uint64_t) q_high << 32 | low;
+    return rem;
+}
+
+static inline uint64_t cycles_to_ns(uint64_t cycles) {
+    return (cycles * clock_mult) >> clock_shift;
+}
+
+/**
+ * 按频率khz建立TSC时钟源,khz为0表示没有可用的TSC
+ * 在保证clock_mult不超过32位的前提下取最大的clock_shift,换算的精度最高
+ */
+void clock_init(uint32_t khz) {
+    tsc_khz = khz;
+    if (khz == 0) {
+        return;
+    }
+    uint64_t mult;
+    clock_shift = 32;
+    while (1) {
+        mult = 1000000ULL << clock_shift;
+        div64_32(&mult, khz);
+        if ((mult >> 32) == 0) {
+            break;
+        }
+        clock_shift--;
+    }
+    clock_mult = (uint32_t) mult;
+    base_tsc = rdtsc();
+    base_ns = 0;
+}
+
+/** 时钟中断中调用,把换算基准推进到当前 */
+void clock_tick(void) {
+    if (tsc_khz == 0) {
+        return;
+    }
+    uint64_t now = rdtsc();
+    base_ns += cycles_to_ns(now - base_tsc);
+    base_tsc = now;
+}
+
+/** 自开机以来的纳秒数,没有TSC时精度为一个tick */
+uint64_t clock_ns(void) {
+    enum intr_status old_status = intr_disable();
+    uint64_t ns;
+    if (tsc_khz != 0) {
+        ns = base_ns + cycles_to_ns(rdtsc() - base_tsc);
+    } else {
+        ns = (uint64_t) ticks * (NS_PER_SEC / HZ);
+    }
+    intr_set_status(old_status);
+    return ns;
+}
+
+/** TSC的频率,单位kHz */
+uint32_t clock_tsc_khz(void) {
+    return tsc_khz;
+}
+
+/** 把自开机以来的时间写入ts,成功返回0 */
+int32_t sys_clock_gettime(struct timespec* ts) {
+    if (ts == NULL) {
+        return -1;
+    }
+    uint64_t ns = clock_ns();
+    ts->tv_nsec = div64_32(&ns, NS_PER_SEC);
+    ts->tv_sec = (uint32_t) ns;
+    return 0;
+}
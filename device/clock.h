@@ -0,0 +1,16 @@
+#ifndef __DEVICE_CLOCK_H
+#define __DEVICE_CLOCK_H
+#include "../lib/stdint.h"
+
+/** clock_gettime返回的时间,自开机起算 */
+struct timespec {
+    uint32_t tv_sec;
+    uint32_t tv_nsec;  // 不足1秒的纳秒数
+};
+
+void clock_init(uint32_t khz);
+void clock_tick(void);
+uint64_t clock_ns(void);
+uint32_t clock_tsc_khz(void);
+int32_t sys_clock_gettime(struct timespec* ts);
+#endif
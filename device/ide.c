@@ -8,6 +8,7 @@
 #include "../lib/string.h"
 #include "../lib/kernel/io.h"
 #include "timer.h"
+#include "pci.h"
 
 /** 定义硬盘各寄存器的端口号 */
 #define reg_data(channel)	 (channel->port_base + 0)
@@ -22,10 +23,23 @@
 #define reg_alt_status(channel)  (channel->port_base + 0x206)
 #define reg_ctl(channel)	 reg_alt_status(channel)
 
+/** 总线主控ide各寄存器的端口号 */
+#define reg_bm_cmd(channel)	 (channel->bmide_base + 0)
+#define reg_bm_status(channel)	 (channel->bmide_base + 2)
+#define reg_bm_prdt(channel)	 (channel->bmide_base + 4)
+
 /** reg_alt_status寄存器的一些关键位 */
 #define BIT_STAT_BSY 0x80   // 硬盘忙
 #define BIT_STAT_DRDY 0x40  // 驱动器准备好
 #define BIT_STAT_DRQ 0x8    // 数据传输准备好了
+#define BIT_STAT_ERR 0x1    // 上一个命令出错
+
+/** 总线主控寄存器的一些关键位 */
+#define BM_CMD_START 0x1    // 开始dma传输
+#define BM_CMD_READ 0x8     // 控制器向内存写,即读硬盘
+#define BM_STAT_ERR 0x2     // dma传输出错,写1清0
+#define BM_STAT_INTR 0x4    // 硬盘已发出中断,写1清0
+#define PRD_EOT 0x8000      // 最后一个物理区域描述符
 
 /** device寄存器的一些关键位 */
 #define BIT_DEV_MBS 0xa0
@@ -36,6 +50,8 @@
 #define CMD_IDENTITY 0xec      // identify指令
 #define CMD_READ_SECTOR 0x20  // 读扇区指令
 #define CMD_WRITE_SECTOR 0X30  // 写扇区指令
+#define CMD_READ_DMA 0xc8      // dma读扇区指令
+#define CMD_WRITE_DMA 0xca     // dma写扇区指令
 
 /** 定义可读写的最大扇区数,调试使用 */
 #define max_lba ((80*1024*1024/512) - 1)	// 只支持80MB硬盘
@@ -128,90 +144,297 @@ static void write2sector(struct disk* hd, void* buf, uint8_t sec_cnt) {
     outsw(reg_data(hd->my_channel), buf, size_in_byte / 2);
 }
 
-/** 等待30秒 */
-static bool busy_wait(struct disk* hd) {
-    struct ide_channel* channel = hd->my_channel;
-    uint16_t time_limit = 30 * 1000;
-    while (time_limit -= 10 >= 0) {
-        if (!(inb(reg_status(channel)) & BIT_STAT_BSY)) {
-            return inb(reg_status(channel)) & BIT_STAT_DRQ;
+/** 判断能否用dma在硬盘hd与buf间传输 */
+static bool dma_usable(struct disk* hd, void* buf) {
+    // 描述符表只按内核页表翻译物理地址,用户空间的缓冲区可能是写时复制的共享页,
+    // 控制器直接写物理内存会绕过页保护,所以只对内核缓冲区用dma
+    return hd->my_channel->bmide_base != 0 && hd->dma_capable
+           && (uint32_t) buf >= 0xc0000000 && ((uint32_t) buf & 1) == 0;
+}
+
+/**
+ * 从第prd_idx项起为buf起始的size字节构建物理区域描述符,
+ * 虚拟连续的buf按页拆分为物理段
+ * @return 下一个空闲描述符的下标
+ */
+static uint32_t prd_build(struct ide_channel* channel, uint32_t prd_idx,
+                          void* buf, uint32_t size) {
+    uint32_t vaddr = (uint32_t) buf;
+    while (size > 0) {
+        uint32_t chunk = PG_SIZE - (vaddr & 0x00000fff);
+        if (chunk > size) {
+            chunk = size;
+        }
+        uint32_t phy_addr = addr_v2p(vaddr);
+        struct prd_entry* last = prd_idx > 0 ? &channel->prd_table[prd_idx - 1] : NULL;
+        // 与上一段物理连续且不跨64KB边界时合并到上一段
+        if (last != NULL && last->phy_addr + last->byte_cnt == phy_addr
+            && ((last->phy_addr ^ (phy_addr + chunk - 1)) & 0xffff0000) == 0) {
+            last->byte_cnt += chunk;
         } else {
-            mtime_sleep(10); // 睡眠10毫秒
+            channel->prd_table[prd_idx].phy_addr = phy_addr;
+            channel->prd_table[prd_idx].byte_cnt = chunk;
+            channel->prd_table[prd_idx].flag = 0;
+            prd_idx++;
+        }
+        vaddr += chunk;
+        size -= chunk;
+    }
+    return prd_idx;
+}
+
+/** 请求req及合并在其后的请求的总扇区数 */
+static uint32_t batch_secs(struct ide_request* req) {
+    uint32_t secs = 0;
+    while (req != NULL) {
+        secs += req->sec_cnt;
+        req = req->next_merged;
+    }
+    return secs;
+}
+
+/** 为合并后的请求构建描述符表并启动dma传输,传输完成由硬盘中断通知 */
+static void dma_start(struct ide_channel* channel, struct ide_request* req, uint32_t secs) {
+    uint32_t prd_idx = 0;
+    struct ide_request* member = req;
+    while (member != NULL) {
+        prd_idx = prd_build(channel, prd_idx, member->buf, member->sec_cnt * 512);
+        member = member->next_merged;
+    }
+    channel->prd_table[prd_idx - 1].flag = PRD_EOT;
+    outl(reg_bm_prdt(channel), channel->prd_phy_addr);
+    uint8_t bm_cmd = req->is_write ? 0 : BM_CMD_READ;
+    outb(reg_bm_cmd(channel), bm_cmd);
+    // 清除上次遗留的中断和错误状态
+    outb(reg_bm_status(channel), inb(reg_bm_status(channel)) | BM_STAT_INTR | BM_STAT_ERR);
+    select_sector(req->hd, req->lba, secs);
+    cmd_out(channel, req->is_write ? CMD_WRITE_DMA : CMD_READ_DMA);
+    outb(reg_bm_cmd(channel), bm_cmd | BM_CMD_START);
+}
+
+/** pio方式下在当前传输位置读或写一个扇区,并将传输位置后移 */
+static void pio_transfer_sector(struct ide_channel* channel) {
+    struct ide_request* req = channel->xfer_req;
+    void* buf = (void*)((uint32_t) req->buf + channel->xfer_sec * 512);
+    if (req->is_write) {
+        write2sector(req->hd, buf, 1);
+    } else {
+        read_from_sector(req->hd, buf, 1);
+    }
+    if (++channel->xfer_sec == req->sec_cnt) {
+        channel->xfer_req = req->next_merged;
+        channel->xfer_sec = 0;
+    }
+}
+
+/** 不睡眠地等待硬盘可以传输数据,用于中断上下文,成功返回true */
+static bool drq_wait(struct ide_channel* channel) {
+    uint32_t spin = 1000000;
+    while (spin-- > 0) {
+        // 读备用状态寄存器不会应答中断
+        uint8_t status = inb(reg_alt_status(channel));
+        if (!(status & BIT_STAT_BSY)) {
+            return status & BIT_STAT_DRQ;
         }
     }
     return false;
 }
 
-/** 从硬盘读取sec_cnt个扇区到buf */
-void ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
-    ASSERT(lba <= max_lba);;
-    ASSERT(sec_cnt > 0);
-    lock_acquire(&hd->my_channel->lock);
-    // 1.先选中操作的硬盘
-    select_disk(hd);
-    uint32_t secs_op; // 每次操作得到扇区数
-    uint32_t secs_done = 0; // 已完成的扇区数
-    while (secs_done < sec_cnt) {
-        if (secs_done + 256 <= sec_cnt) {
-            secs_op = 256;
-        } else {
-            secs_op = sec_cnt - secs_done;
+/**
+ * 通道空闲时,按电梯算法从请求队列中取出下一个请求并向硬盘发出命令,
+ * 由提交请求的线程和硬盘中断处理程序在关中断的情况下调用
+ */
+static void ide_dispatch(struct ide_channel* channel) {
+    if (channel->cur_req != NULL || list_empty(&channel->req_queue)) {
+        return;
+    }
+    // 队列按起始扇区升序排列,磁头沿升序方向移动,
+    // 取第一个不在磁头之前的请求,到头后折回最小的扇区
+    struct ide_request* req = NULL;
+    struct list_elem* elem = channel->req_queue.head.next;
+    while (elem != &channel->req_queue.tail) {
+        struct ide_request* queued = elem2entry(struct ide_request, req_tag, elem);
+        if (queued->lba >= channel->head_lba) {
+            req = queued;
+            break;
         }
-        // 2.写入待读入的扇区数和起始扇号
-        select_sector(hd, lba + secs_done, secs_op);
-        // 3.执行的命令写入reg_cmd寄存器
-        cmd_out(hd->my_channel, CMD_READ_SECTOR); // 准备开始读数据
-
-        // 在硬盘已经开始工作(开始在内部读/写数据)后才能阻塞自己,等待硬盘
-        // 完成读操作后通过中断处理程序唤醒自己
-        sema_down(&hd->my_channel->disk_done);
-        // 4.检测硬盘状态是否可读
-        if (!busy_wait(hd)) {	 // 若失败
+        elem = elem->next;
+    }
+    if (req == NULL) {
+        req = elem2entry(struct ide_request, req_tag, channel->req_queue.head.next);
+    }
+    list_remove(&req->req_tag);
+    channel->cur_req = req;
+    uint32_t secs = batch_secs(req);
+    channel->head_lba = req->lba + secs;
+    channel->dispatches++;
+
+    select_disk(req->hd);
+    // 合并的请求全部可用dma时才用dma传输
+    bool use_dma = true;
+    struct ide_request* member = req;
+    while (member != NULL) {
+        use_dma = use_dma && dma_usable(member->hd, member->buf);
+        member = member->next_merged;
+    }
+    channel->cur_dma = use_dma;
+    if (use_dma) {
+        dma_start(channel, req, secs);
+        return;
+    }
+    channel->xfer_req = req;
+    channel->xfer_sec = 0;
+    select_sector(req->hd, req->lba, secs);
+    cmd_out(channel, req->is_write ? CMD_WRITE_SECTOR : CMD_READ_SECTOR);
+    // pio写要先送出第一个扇区,之后每写完一个扇区硬盘发一次中断
+    if (req->is_write) {
+        if (!drq_wait(channel)) {
             char error[64];
-            sprintf(error, "%s read sector %d failed!!!!!!\n", hd->name, lba);
+            sprintf(error, "%s write sector %d failed!!!!!!\n", req->hd->name, req->lba);
             PANIC(error);
         }
-        // 5.将数据从硬盘的缓冲区取出
-        read_from_sector(hd, (void*)((uint32_t)buf + secs_done * 512), secs_op);
-        secs_done += secs_op;
+        pio_transfer_sector(channel);
     }
-    lock_release(&hd->my_channel->lock);
 }
 
-/** 将buf中sec_cnt扇区数据写入硬盘 */
-void ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
+/**
+ * 尝试把req与队列中相邻且同方向的请求合并,合并后一次命令完成
+ * @return 合并成功返回true
+ */
+static bool queue_merge(struct ide_channel* channel, struct ide_request* req) {
+    struct list_elem* elem = channel->req_queue.head.next;
+    while (elem != &channel->req_queue.tail) {
+        struct ide_request* queued = elem2entry(struct ide_request, req_tag, elem);
+        elem = elem->next;
+        if (queued->hd != req->hd || queued->is_write != req->is_write) {
+            continue;
+        }
+        uint32_t secs = batch_secs(queued);
+        uint32_t req_secs = batch_secs(req);
+        // 一条命令最多传输256个扇区
+        if (secs + req_secs > 256) {
+            continue;
+        }
+        if (queued->lba + secs == req->lba) {
+            // 接在末尾
+            struct ide_request* tail = queued;
+            while (tail->next_merged != NULL) {
+                tail = tail->next_merged;
+            }
+            tail->next_merged = req;
+            channel->merges++;
+            return true;
+        }
+        if (req->lba + req_secs == queued->lba) {
+            // 接在前面,由req代替queued排在队列中
+            struct ide_request* tail = req;
+            while (tail->next_merged != NULL) {
+                tail = tail->next_merged;
+            }
+            tail->next_merged = queued;
+            list_insert_before(&queued->req_tag, &req->req_tag);
+            list_remove(&queued->req_tag);
+            channel->merges++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * 提交一个读写请求后立即返回,请求完成后在硬盘中断处理程序中调用req->done,
+ * 回调返回前req及其缓冲区都不能被释放或修改.
+ * 调用者可以经next_merged预先串起同一硬盘上扇区依次相邻、方向相同的多个请求,
+ * 它们作为一个整体排队,单个请求的next_merged须为NULL
+ */
+void ide_submit(struct ide_request* req) {
+    uint32_t secs = batch_secs(req);
+    ASSERT(req->sec_cnt > 0 && secs <= 256);
+    ASSERT(req->lba + secs - 1 <= max_lba);
+    struct ide_channel* channel = req->hd->my_channel;
+    enum intr_status old_status = intr_disable();
+    if (!queue_merge(channel, req)) {
+        // 按起始扇区升序插入队列
+        struct list_elem* elem = channel->req_queue.head.next;
+        while (elem != &channel->req_queue.tail) {
+            struct ide_request* queued = elem2entry(struct ide_request, req_tag, elem);
+            if (queued->lba > req->lba) {
+                break;
+            }
+            elem = elem->next;
+        }
+        list_insert_before(elem, &req->req_tag);
+    }
+    ide_dispatch(channel);
+    intr_set_status(old_status);
+}
+
+/** 当前请求传输完毕,依次回调其中每个请求并派发下一个请求 */
+static void ide_complete(struct ide_channel* channel) {
+    struct ide_request* req = channel->cur_req;
+    channel->cur_req = NULL;
+    while (req != NULL) {
+        // 回调中可能重用req,先取出后继
+        struct ide_request* next = req->next_merged;
+        req->next_merged = NULL;
+        req->done(req);
+        req = next;
+    }
+    ide_dispatch(channel);
+}
+
+/** 等待硬盘就绪,最多30秒,每次查询之间睡眠而不占用cpu */
+static bool busy_wait(struct disk* hd) {
+    struct ide_channel* channel = hd->my_channel;
+    int32_t time_limit = 30 * 1000;
+    while ((time_limit -= 10) >= 0) {
+        if (!(inb(reg_status(channel)) & BIT_STAT_BSY)) {
+            return inb(reg_status(channel)) & BIT_STAT_DRQ;
+        } else {
+            mtime_sleep(10); // 睡眠10毫秒
+        }
+    }
+    return false;
+}
+
+/** ide_read和ide_write的完成回调,唤醒等待的线程 */
+static void ide_sync_done(struct ide_request* req) {
+    sema_up((struct semaphore*) req->arg);
+}
+
+/** 提交请求并阻塞到完成,每个请求最多256个扇区 */
+static void ide_sync_rw(struct disk* hd, uint32_t lba, void* buf,
+                        uint32_t sec_cnt, bool is_write) {
     ASSERT(lba <= max_lba);
     ASSERT(sec_cnt > 0);
-    lock_acquire(&hd->my_channel->lock);
-    // 1.先选择要操作的硬盘
-    select_disk(hd);
-    uint32_t secs_op; // 每次操作的扇区数
+    struct semaphore done;
+    sema_init(&done, 0);
+    struct ide_request req;
     uint32_t secs_done = 0; // 已完成的扇区数
     while (secs_done < sec_cnt) {
-        if (secs_done + 256 <= sec_cnt) {
-            secs_op = 256;
-        } else {
-            secs_op = sec_cnt - secs_done;
-        }
-        // 2.写入待写入的扇区数和起始扇区号
-        select_sector(hd, lba + secs_done, secs_op);
-        // 3.执行的命令写入reg_cmd寄存器
-        cmd_out(hd->my_channel, CMD_WRITE_SECTOR); // 准备开始写数据
-        // 4.检测硬盘状态是否可读
-        if (!busy_wait(hd)) {
-            char error[64];
-            sprintf(error, "%s write sector %d failed!!!!!!\n", hd->name, lba);
-            PANIC(error);
-        }
-        // 5.将数据写入硬盘
-        write2sector(hd, (void*)((uint32_t)buf + secs_done * 512), secs_op);
-
+        req.hd = hd;
+        req.lba = lba + secs_done;
+        req.sec_cnt = sec_cnt - secs_done < 256 ? sec_cnt - secs_done : 256;
+        req.buf = (void*)((uint32_t)buf + secs_done * 512);
+        req.is_write = is_write;
+        req.done = ide_sync_done;
+        req.arg = &done;
+        req.next_merged = NULL;
+        ide_submit(&req);
         // 在硬盘响应期间阻塞自己
-        sema_down(&hd->my_channel->disk_done);
-        secs_done += secs_op;
+        sema_down(&done);
+        secs_done += req.sec_cnt;
     }
+}
+
+/** 从硬盘读取sec_cnt个扇区到buf */
+void ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
+    ide_sync_rw(hd, lba, buf, sec_cnt, false);
+}
 
-    lock_release(&hd->my_channel->lock);
+/** 将buf中sec_cnt扇区数据写入硬盘 */
+void ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
+    ide_sync_rw(hd, lba, buf, sec_cnt, true);
 }
 
 /** 将dst中len个相邻字节交换位置后存入buf */
@@ -248,6 +471,9 @@ static void identify_disk(struct disk* hd) {
     printk("      MODULE: %s\n", buf);
     uint32_t sectors = *(uint32_t*)&id_info[60 * 2];
     printk("      SECTORS: %d\n", sectors);
+    // 第49字的第8位表示支持dma
+    hd->dma_capable = (*(uint16_t*)&id_info[49 * 2] & 0x100) != 0;
+    printk("      DMA: %s\n", hd->dma_capable && hd->my_channel->bmide_base ? "yes" : "no");
     printk("      CAPACITY: %dMB\n", sectors * 512 / 1024 / 1024);
 }
 
@@ -307,14 +533,53 @@ static bool partition_info(struct list_elem* pelem, int arg UNUSED) {
     return false;
 }
 
+/** 处理通道上正在传输的请求产生的中断 */
+static void request_intr(struct ide_channel* channel) {
+    struct ide_request* req = channel->cur_req;
+    channel->expecting_intr = false;
+    if (channel->cur_dma) {
+        outb(reg_bm_cmd(channel), req->is_write ? 0 : BM_CMD_READ); // 停止dma
+        uint8_t bm_status = inb(reg_bm_status(channel));
+        outb(reg_bm_status(channel), bm_status | BM_STAT_INTR | BM_STAT_ERR);
+        // 读取状态寄存器使硬盘控制器认为此次中断已被处理
+        if ((bm_status & BM_STAT_ERR) || (inb(reg_status(channel)) & BIT_STAT_ERR)) {
+            char error[64];
+            sprintf(error, "%s dma %s sector %d failed!!!!!!\n",
+                    req->hd->name, req->is_write ? "write" : "read", req->lba);
+            PANIC(error);
+        }
+        ide_complete(channel);
+        return;
+    }
+    uint8_t status = inb(reg_status(channel));
+    if (status & BIT_STAT_ERR) {
+        char error[64];
+        sprintf(error, "%s %s sector %d failed!!!!!!\n",
+                req->hd->name, req->is_write ? "write" : "read", req->lba);
+        PANIC(error);
+    }
+    // pio读每准备好一个扇区发一次中断,写每写完一个扇区发一次中断
+    if (!req->is_write) {
+        pio_transfer_sector(channel);
+    } else if (channel->xfer_req != NULL) {
+        pio_transfer_sector(channel);
+        return;
+    }
+    if (channel->xfer_req == NULL) {
+        ide_complete(channel);
+    }
+}
+
 /** 硬盘中断处理程序 */
 void intr_hd_handler(uint8_t irq_no) {
     ASSERT(irq_no == 0x2e || irq_no == 0x2f);
     uint8_t ch_no = irq_no - 0x2e;
     struct ide_channel* channel = &channels[ch_no];
     ASSERT(channel->irq_no == irq_no);
-    // 每次读写硬盘时都会申请锁,保证了数据的一致性
-    if (channel->expecting_intr) {
+    if (channel->cur_req != NULL) {
+        request_intr(channel);
+    } else if (channel->expecting_intr) {
+        // 初始化阶段identify等直接发出的命令
         channel->expecting_intr = false;
         // 唤醒正在等待硬盘的任务
         sema_up(&channel->disk_done);
@@ -324,6 +589,35 @@ void intr_hd_handler(uint8_t irq_no) {
     }
 }
 
+/** 打印各通道请求队列的统计信息 */
+void ide_stat_print(void) {
+    uint8_t channel_no = 0;
+    while (channel_no < channel_cnt) {
+        struct ide_channel* channel = &channels[channel_no];
+        printk("%s: dispatches %d  merges %d  dma %s\n", channel->name,
+               channel->dispatches, channel->merges, channel->bmide_base ? "on" : "off");
+        channel_no++;
+    }
+}
+
+/** 查找pci总线上的ide控制器,返回其总线主控寄存器的起始端口号,没有则返回0 */
+static uint16_t bmide_probe(void) {
+    struct pci_dev pdev;
+    // 类代码1为大容量存储控制器,子类1为ide控制器
+    if (!pci_find_class(0x01, 0x01, &pdev)) {
+        return 0;
+    }
+    // 基址寄存器4是总线主控寄存器所在的io空间
+    uint32_t bar4 = pci_config_read(&pdev, PCI_BAR4);
+    if (!(bar4 & 0x1) || (bar4 & 0xfffc) == 0) {
+        return 0;
+    }
+    uint32_t cmd = pci_config_read(&pdev, PCI_COMMAND);
+    pci_config_write(&pdev, PCI_COMMAND, cmd | PCI_CMD_IO | PCI_CMD_BUS_MASTER);
+    printk("   bus master ide at 0x%x\n", bar4 & 0xfffc);
+    return bar4 & 0xfffc;
+}
+
 /** 硬盘数据结构初始化 */
 void ide_init() {
     printk("ide_init start\n");
@@ -334,6 +628,8 @@ void ide_init() {
     channel_cnt = (uint8_t) DIV_ROUND_UP(hd_cnt, 2);
     struct ide_channel* channel;
     uint8_t channel_no = 0, dev_no = 0;
+    // 找不到总线主控ide时所有通道都用pio方式
+    uint16_t bmide_base = bmide_probe();
     // 处理每个通道上的硬盘
     while (channel_no < channel_cnt) {
         channel = &channels[channel_no];
@@ -355,7 +651,20 @@ void ide_init() {
             default:break;
         }
         channel->expecting_intr = false;
+        // 每个通道的总线主控寄存器占8个端口
+        channel->bmide_base = 0;
+        if (bmide_base != 0) {
+            channel->prd_table = get_kernel_pages(1);
+            if (channel->prd_table != NULL) {
+                channel->prd_phy_addr = addr_v2p((uint32_t) channel->prd_table);
+                channel->bmide_base = bmide_base + channel_no * 8;
+            }
+        }
         lock_init(&channel->lock);
+        list_init(&channel->req_queue);
+        channel->cur_req = NULL;
+        channel->head_lba = 0;
+        channel->merges = channel->dispatches = 0;
         // 初始化为0,目的是向硬盘控制器请求数据后,硬盘驱动sema_down此信号量会阻塞线程
         // 直到硬盘完成后通过发中断,由中断处理程序将此信号量sema_up,唤醒线程
         sema_init(&channel->disk_done, 0);
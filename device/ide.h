@@ -14,7 +14,6 @@ struct partition {
     struct super_block* sb;     // 本分区的超级块
     struct bitmap block_bitmap; // 块位图
     struct bitmap inode_bitmap; // i结点位图
-    struct list open_inodes;    // 本分区打开的i结点队列
 };
 
 /** 硬盘结构 */
@@ -22,10 +21,35 @@ struct disk {
     char name[8];                     // 本硬盘的名称
     struct ide_channel* my_channel;   // 此块硬盘属于哪个ide通道
     uint8_t dev_no;                   // 本硬盘是主0 还是从1
+    bool dma_capable;                 // 硬盘是否支持dma传输
     struct partition prim_parts[4];   // 主分区顶多是4个
     struct partition logic_parts[8];  // 逻辑分区数量可以无限,这里限制为8个
 };
 
+/** 物理区域描述符,描述dma传输所用的一段物理内存 */
+struct prd_entry {
+    uint32_t phy_addr;   // 物理内存起始地址
+    uint16_t byte_cnt;   // 字节数,0表示64KB
+    uint16_t flag;       // 最高位为1表示最后一个描述符
+} __attribute__ ((packed));
+
+struct ide_request;
+/** 读写请求完成时的回调函数类型,在硬盘中断处理程序中调用 */
+typedef void ide_done_func(struct ide_request* req);
+
+/** 硬盘读写请求 */
+struct ide_request {
+    struct disk* hd;             // 要读写的硬盘
+    uint32_t lba;                // 起始扇区
+    uint32_t sec_cnt;            // 扇区数,最多256
+    void* buf;                   // 数据缓冲区
+    bool is_write;               // 是否是写请求
+    ide_done_func* done;         // 完成回调
+    void* arg;                   // 供回调使用的参数
+    struct ide_request* next_merged; // 与本请求相邻、合并在其后一起传输的请求
+    struct list_elem req_tag;    // 用于通道请求队列中的标记
+};
+
 /** ata通道结构 */
 struct ide_channel {
     char name[8];                 // 本ata通道名称
@@ -35,6 +59,17 @@ struct ide_channel {
     bool expecting_intr;          // 表示等待硬盘的中断
     struct semaphore disk_done;   // 用于阻塞、唤醒驱动程序
     struct disk devices[2];       // 一个通道上连接两个硬盘,一主一从
+    uint16_t bmide_base;          // 总线主控寄存器的起始端口号,为0表示不支持dma
+    struct prd_entry* prd_table;  // dma使用的物理区域描述符表
+    uint32_t prd_phy_addr;        // 描述符表的物理地址
+    struct list req_queue;        // 待处理的请求队列,按起始扇区升序排列
+    struct ide_request* cur_req;  // 正在传输的请求,合并的请求挂在其后
+    bool cur_dma;                 // 当前请求是否以dma方式传输
+    struct ide_request* xfer_req; // pio传输进行到的请求
+    uint32_t xfer_sec;            // pio传输在xfer_req中已完成的扇区数
+    uint32_t head_lba;            // 磁头位置,即上一次派发的请求的结束扇区
+    uint32_t dispatches;          // 向硬盘发出的命令数
+    uint32_t merges;              // 被合并的请求数
 };
 
 void intr_hd_handler(uint8_t irq_no);
@@ -44,4 +79,6 @@ extern struct ide_channel channels[];
 extern struct list partition_list;
 void ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt);
 void ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt);
+void ide_submit(struct ide_request* req);
+void ide_stat_print(void);
 #endif
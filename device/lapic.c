@@ -0,0 +1,94 @@
+#include "lapic.h"
+#include "../kernel/cpu.h"
+#include "../kernel/memory.h"
+#include "../lib/kernel/print.h"
+
+#define MSR_APIC_BASE 0x1b
+#define APIC_BASE_ENABLE (1 << 11)  // IA32_APIC_BASE中的全局开关
+
+/* lapic寄存器相对基址的偏移 */
+#define LAPIC_ID 0x020          // 高8位为apic id
+#define LAPIC_EOI 0x0b0
+#define LAPIC_SVR 0x0f0         // 伪中断向量寄存器
+#define LAPIC_ICR_LOW 0x300     // 中断命令寄存器,写入低32位时发出核间中断
+#define LAPIC_ICR_HIGH 0x310    // 高8位为目标的apic id
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INIT 0x380  // 初始计数,写入后开始倒数
+#define LAPIC_TIMER_CUR 0x390   // 当前计数
+#define LAPIC_TIMER_DIV 0x3e0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_SPURIOUS_VECTOR 0x2f  // 与8259A的伪中断一样由general_intr_handler忽略
+#define LAPIC_TIMER_DIV16 0x3       // 计时器按总线频率的1/16计数
+#define LAPIC_ICR_PENDING (1 << 12) // 核间中断还未发送出去
+
+static volatile uint32_t* lapic;  // lapic寄存器映射后的地址
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t val) {
+    lapic[reg / 4] = val;
+}
+
+/**
+ * 检测并打开local APIC,映射其寄存器,计时器先保持屏蔽,
+ * 须在创建第一个进程之前调用
+ * @return cpu没有lapic时返回false
+ */
+bool lapic_init(void) {
+    uint32_t edx = cpuid(1, NULL, NULL, NULL);
+    if ((edx & (CPUID_APIC | CPUID_MSR)) != (CPUID_APIC | CPUID_MSR)) {
+        put_str("   local apic not supported\n");
+        return false;
+    }
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    if (!(base & APIC_BASE_ENABLE)) {
+        wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+    }
+    lapic = mmio_map((uint32_t) base & 0xfffff000);
+    lapic_ap_init();
+    put_str("   local apic enabled\n");
+    return true;
+}
+
+/** 打开当前cpu的lapic,计时器保持屏蔽.各cpu的lapic映射在同一地址,AP启动时直接调用 */
+void lapic_ap_init(void) {
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+}
+
+/** 当前cpu的apic id */
+uint8_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+/**
+ * 向apic id为apic_id的cpu发送核间中断并等待发送完成
+ * @param icr 中断命令寄存器的低32位,LAPIC_IPI_*与向量号的组合
+ */
+void lapic_ipi(uint8_t apic_id, uint32_t icr) {
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t) apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile ("pause");
+    }
+}
+
+/** 通知lapic当前中断已处理完 */
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/** 设置计时器的LVT并写入初始计数count,计时器随即开始倒数,count为0时停止 */
+void lapic_timer_set(uint32_t lvt, uint32_t count) {
+    lapic_write(LAPIC_LVT_TIMER, lvt);
+    lapic_write(LAPIC_TIMER_INIT, count);
+}
+
+/** 计时器的当前计数,单次模式下倒数到0后保持为0 */
+uint32_t lapic_timer_count(void) {
+    return lapic_read(LAPIC_TIMER_CUR);
+}
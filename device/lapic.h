@@ -0,0 +1,22 @@
+#ifndef __DEVICE_LAPIC_H
+#define __DEVICE_LAPIC_H
+#include "../lib/stdint.h"
+#include "../kernel/global.h"
+
+/* lapic计时器LVT中的位,低8位为中断向量号 */
+#define LAPIC_LVT_MASKED (1 << 16)      // 屏蔽计时器中断
+#define LAPIC_TIMER_PERIODIC (1 << 17)  // 周期模式,否则为单次模式
+
+/* 核间中断命令,低8位为向量号 */
+#define LAPIC_IPI_FIXED 0x00004000    // 以低8位为向量号的普通中断
+#define LAPIC_IPI_INIT 0x00004500     // INIT,使目标cpu复位后等待SIPI
+#define LAPIC_IPI_STARTUP 0x00004600  // SIPI,目标cpu从物理地址(低8位 << 12)处以实模式开始执行
+
+bool lapic_init(void);
+void lapic_ap_init(void);
+uint8_t lapic_id(void);
+void lapic_ipi(uint8_t apic_id, uint32_t icr);
+void lapic_eoi(void);
+void lapic_timer_set(uint32_t lvt, uint32_t count);
+uint32_t lapic_timer_count(void);
+#endif
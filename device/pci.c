@@ -0,0 +1,61 @@
+#include "pci.h"
+#include "../lib/kernel/io.h"
+
+/** 配置空间访问机制#1使用的端口 */
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/** 构造访问pdev配置空间offset处双字的地址 */
+static uint32_t config_addr(struct pci_dev* pdev, uint8_t offset) {
+    return 0x80000000 | ((uint32_t) pdev->bus << 16) | ((uint32_t) pdev->dev << 11)
+           | ((uint32_t) pdev->func << 8) | (offset & 0xfc);
+}
+
+/** 读取pdev配置空间offset处的双字 */
+uint32_t pci_config_read(struct pci_dev* pdev, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, config_addr(pdev, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+/** 向pdev配置空间offset处写入双字data */
+void pci_config_write(struct pci_dev* pdev, uint8_t offset, uint32_t data) {
+    outl(PCI_CONFIG_ADDRESS, config_addr(pdev, offset));
+    outl(PCI_CONFIG_DATA, data);
+}
+
+/**
+ * 枚举所有总线上的设备,查找类代码为class_code、子类为subclass的第一个功能
+ * @param pdev 找到时存入其位置
+ * @return 找到返回true
+ */
+bool pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_dev* pdev) {
+    uint32_t bus = 0;
+    while (bus < 256) {
+        pdev->bus = bus;
+        uint8_t dev = 0;
+        while (dev < 32) {
+            pdev->dev = dev;
+            pdev->func = 0;
+            // 厂商号为0xffff表示设备不存在
+            if ((pci_config_read(pdev, 0) & 0xffff) != 0xffff) {
+                // 头类型最高位为1表示多功能设备
+                uint8_t func_cnt = (pci_config_read(pdev, PCI_HEADER_TYPE) >> 16) & 0x80 ? 8 : 1;
+                uint8_t func = 0;
+                while (func < func_cnt) {
+                    pdev->func = func;
+                    uint32_t id = pci_config_read(pdev, 0);
+                    uint32_t class_reg = pci_config_read(pdev, PCI_CLASS);
+                    if ((id & 0xffff) != 0xffff
+                        && (class_reg >> 24) == class_code
+                        && ((class_reg >> 16) & 0xff) == subclass) {
+                        return true;
+                    }
+                    func++;
+                }
+            }
+            dev++;
+        }
+        bus++;
+    }
+    return false;
+}
@@ -0,0 +1,26 @@
+#ifndef __DEVICE_PCI_H
+#define __DEVICE_PCI_H
+#include "../lib/stdint.h"
+#include "../kernel/global.h"
+
+/** 配置空间中的一些寄存器偏移 */
+#define PCI_COMMAND 0x04     // 命令寄存器(低16位)
+#define PCI_CLASS 0x08       // 类代码(高24位)及版本号
+#define PCI_HEADER_TYPE 0x0c // 头类型在此双字的第16~23位
+#define PCI_BAR4 0x20        // 基址寄存器4
+
+/** 命令寄存器的一些关键位 */
+#define PCI_CMD_IO 0x1         // 允许响应io空间访问
+#define PCI_CMD_BUS_MASTER 0x4 // 允许作为总线主控发起dma
+
+/** 用总线号、设备号、功能号定位一个pci功能 */
+struct pci_dev {
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t func;
+};
+
+uint32_t pci_config_read(struct pci_dev* pdev, uint8_t offset);
+void pci_config_write(struct pci_dev* pdev, uint8_t offset, uint32_t data);
+bool pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_dev* pdev);
+#endif
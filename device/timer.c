@@ -7,20 +7,63 @@
 #include "../kernel/debug.h"
 #include "../lib/kernel/print.h"
 #include "../kernel/interrupt.h"
+#include "../kernel/cpu.h"
+#include "lapic.h"
+#include "clock.h"
+#include "../kernel/smp.h"
+
+#if HZ < 19 || HZ > 1000
+#error "HZ must be within [19, 1000]"
+#endif
 
-#define IRQ0_FREQUENCY	   100
 #define INPUT_FREQUENCY	   1193180
-#define COUNTER0_VALUE	   INPUT_FREQUENCY / IRQ0_FREQUENCY
+#define COUNTER0_VALUE	   (INPUT_FREQUENCY / HZ)
 #define CONTRER0_PORT	   0x40
 #define COUNTER0_NO	   0
 #define COUNTER_MODE	   2
+#define ONESHOT_MODE	   0   // 计到0时产生一次中断后停止
 #define READ_WRITE_LATCH   3
 #define PIT_CONTROL_PORT   0x43
+#define PIT_READ_BACK_STATUS0 0xe2 // 读回命令,只锁存计数器0的状态
+#define PIT_STATUS_OUT	   0x80   // 状态字节中OUT引脚的电平
+#define COUNTER2_PORT	   0x42
+#define COUNTER2_NO	   2
+#define PIT_GATE_PORT	   0x61   // 位0为计数器2的门控,位1接扬声器,位5为计数器2的OUT
+#define PIC_M_DATA	   0x21
+#define TIMER_VECTOR	   0x20
+#define CALIBRATE_MS	   50     // 开机校准TSC和lapic计时器所用的时长
+#define TICKLESS_MAX_TICKS (HZ / 4) // idle一次最多跳过的tick数,使TSC时钟源两次推进的间隔不会过长
 
-#define mil_seconds_per_intr (1000 / IRQ0_FREQUENCY)
+/* 分层时间轮:每级64个槽,第l级的一个槽跨2^(6l)个tick,4级共覆盖2^24个tick */
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 4
 
 uint32_t ticks;          // ticks是内核自中断开启以来总共的嘀嗒数
 
+static struct list timer_wheel[TW_LEVELS][TW_SIZE];
+static uint32_t wheel_tick; // 时间轮下一个要处理的tick,追在ticks之后
+
+/** 产生时钟中断的设备,有lapic时用其计时器,否则用PIT */
+struct clock_event {
+    const char* name;
+    uint32_t tick_count;                // 一个tick的计数
+    uint32_t max_count;                 // 单次定时的最大计数
+    void (*set_periodic)(void);
+    void (*set_oneshot)(uint32_t count);
+    uint32_t (*count_left)(void);       // 本周期或本次单次定时剩余的计数
+    bool (*oneshot_fired)(void);        // 单次定时是否已到期
+    void (*ack)(void);                  // 在中断处理中通知设备,可为NULL
+};
+
+static struct clock_event* clock_event;
+
+/* idle停机时时钟处于单次模式,以下记录本次单次定时 */
+static uint32_t oneshot_ticks;  // 到期时ticks增加的数量,为0表示处于周期模式
+static uint32_t oneshot_count;  // 写入的计数值
+static uint32_t oneshot_phase;  // 改为单次模式时当前tick已经过去的计数
+
 /* 把操作的计数器counter_no、读写锁属性rwl、计数器模式counter_mode写入模式控制寄存器并赋予初始值counter_value */
 static void frequency_set(uint8_t counter_port, \
 			  uint8_t counter_no, \
@@ -32,7 +75,232 @@ static void frequency_set(uint8_t counter_port, \
 /* 先写入counter_value的低8位 */
    outb(counter_port, (uint8_t)counter_value);
 /* 再写入counter_value的高8位 */
-   outb(counter_port, (uint8_t)counter_value >> 8);
+   outb(counter_port, (uint8_t)(counter_value >> 8));
+}
+
+/** 锁存并读出计数器0的当前计数 */
+static uint16_t pit_count_read(void) {
+    outb(PIT_CONTROL_PORT, COUNTER0_NO << 6);
+    uint8_t low = inb(CONTRER0_PORT);
+    uint8_t high = inb(CONTRER0_PORT);
+    return (uint16_t) (high << 8 | low);
+}
+
+/** 单次模式下计数器0是否已计到0,此时中断已发出或即将发出 */
+static bool pit_oneshot_fired(void) {
+    outb(PIT_CONTROL_PORT, PIT_READ_BACK_STATUS0);
+    return inb(CONTRER0_PORT) & PIT_STATUS_OUT;
+}
+
+static uint32_t pit_count_left(void) {
+    return pit_count_read();
+}
+
+static void pit_set_periodic(void) {
+    frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+}
+
+static void pit_set_oneshot(uint32_t count) {
+    frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, ONESHOT_MODE, count);
+}
+
+static struct clock_event pit_event = {
+    "pit", COUNTER0_VALUE, 0xffff, pit_set_periodic, pit_set_oneshot,
+    pit_count_left, pit_oneshot_fired, NULL
+};
+
+static struct clock_event lapic_event;
+
+static void lapic_set_periodic(void) {
+    lapic_timer_set(TIMER_VECTOR | LAPIC_TIMER_PERIODIC, lapic_event.tick_count);
+}
+
+static void lapic_set_oneshot(uint32_t count) {
+    lapic_timer_set(TIMER_VECTOR, count);
+}
+
+static bool lapic_oneshot_fired(void) {
+    return lapic_timer_count() == 0;
+}
+
+static struct clock_event lapic_event = {
+    "lapic", 0, 0xffffffff, lapic_set_periodic, lapic_set_oneshot,
+    lapic_timer_count, lapic_oneshot_fired, lapic_eoi
+};
+
+/**
+ * 用PIT的计数器2定时CALIBRATE_MS毫秒,测出这段时间内TSC走过的周期数,
+ * use_lapic为true时同时测出lapic计时器的计数
+ */
+static void timer_calibrate(bool use_lapic, uint32_t* tsc_cycles, uint32_t* lapic_counts) {
+    // 打开计数器2的门控,断开扬声器
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+    uint16_t count = INPUT_FREQUENCY * CALIBRATE_MS / 1000;
+    frequency_set(COUNTER2_PORT, COUNTER2_NO, READ_WRITE_LATCH, ONESHOT_MODE, count);
+    if (use_lapic) {
+        lapic_timer_set(LAPIC_LVT_MASKED, 0xffffffff);
+    }
+    uint32_t tsc_start = (uint32_t) rdtsc();
+    while (!(inb(PIT_GATE_PORT) & 0x20));
+    *tsc_cycles = (uint32_t) rdtsc() - tsc_start;
+    if (use_lapic) {
+        *lapic_counts = 0xffffffff - lapic_timer_count();
+        lapic_timer_set(LAPIC_LVT_MASKED, 0);
+    }
+}
+
+/** 按到期时间把t挂到时间轮中离现在最近又能容纳它的一级上,须关中断 */
+static void wheel_insert(struct timer* t) {
+    uint32_t expires = t->expires;
+    uint32_t delta = expires - wheel_tick;
+    if ((int32_t) delta < 0) {
+        // 已经过期的挂到马上要处理的槽
+        expires = wheel_tick;
+        delta = 0;
+    }
+    uint32_t level = 0;
+    while (level < TW_LEVELS - 1 && delta >= (1U << (TW_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= (1U << (TW_BITS * TW_LEVELS))) {
+        // 超出时间轮的范围,先挂在最高级最远的槽,下放时会按真实的expires重新挂
+        expires = wheel_tick + (1U << (TW_BITS * TW_LEVELS)) - 1;
+    }
+    uint32_t idx = (expires >> (TW_BITS * level)) & TW_MASK;
+    list_append(&timer_wheel[level][idx], &t->tag);
+}
+
+/** 把第level级idx槽中的定时器按剩余时间重新挂到低级上,返回idx */
+static uint32_t wheel_cascade(uint32_t level, uint32_t idx) {
+    struct list* slot = &timer_wheel[level][idx];
+    struct list moving;
+    list_init(&moving);
+    while (!list_empty(slot)) {
+        list_append(&moving, list_pop(slot));
+    }
+    while (!list_empty(&moving)) {
+        wheel_insert(elem2entry(struct timer, tag, list_pop(&moving)));
+    }
+    return idx;
+}
+
+/** 处理到当前tick为止所有到期的定时器 */
+static void timer_run(void) {
+    while ((int32_t) (ticks - wheel_tick) >= 0) {
+        uint32_t idx = wheel_tick & TW_MASK;
+        // 第0级转完一圈时,从上一级取下一个槽的定时器下放,上一级也转完一圈时再往上取
+        uint32_t level = 1;
+        while (idx == 0 && level < TW_LEVELS) {
+            idx = wheel_cascade(level, (wheel_tick >> (TW_BITS * level)) & TW_MASK);
+            level++;
+        }
+        struct list* slot = &timer_wheel[0][wheel_tick & TW_MASK];
+        // 先推进wheel_tick,回调中重新加入的已过期定时器会挂到下一个槽而非本槽
+        wheel_tick++;
+        while (!list_empty(slot)) {
+            struct timer* t = elem2entry(struct timer, tag, list_pop(slot));
+            t->pending = false;
+            t->func(t->arg);
+        }
+    }
+}
+
+/** 初始化定时器t,到期时调用func(arg) */
+void timer_setup(struct timer* t, timer_func func, void* arg) {
+    t->func = func;
+    t->arg = arg;
+    t->pending = false;
+}
+
+/** 让t在第expires个tick到期,t已在等待时改为新的到期时间 */
+void timer_add(struct timer* t, uint32_t expires) {
+    enum intr_status old_status = intr_disable();
+    if (t->pending) {
+        list_remove(&t->tag);
+    }
+    t->expires = expires;
+    t->pending = true;
+    wheel_insert(t);
+    intr_set_status(old_status);
+}
+
+/** 取消t,返回t取消前是否还在等待到期 */
+bool timer_cancel(struct timer* t) {
+    enum intr_status old_status = intr_disable();
+    bool pending = t->pending;
+    if (pending) {
+        list_remove(&t->tag);
+        t->pending = false;
+    }
+    intr_set_status(old_status);
+    return pending;
+}
+
+/** 时间前进n个tick,都记在当前任务上,并处理这期间到期的定时器 */
+static void ticks_advance(uint32_t n) {
+    struct task_struct* cur_thread = running_thread();
+    cur_thread->elapsed_ticks += n;  // 记录此线程占用的cpu时间嘀
+    uint32_t old_ticks = ticks;
+    ticks += n;  //从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
+    clock_tick();
+    timer_run();
+    if (mlfq && ticks / MLFQ_BOOST_TICKS != old_ticks / MLFQ_BOOST_TICKS) {
+        thread_boost();
+    }
+}
+
+/**
+ * idle停机前调用,须关中断:接下来几个tick都没有定时器到期时,
+ * 把时钟改为单次模式,直到有定时器到期或时间轮需要下放时才产生中断
+ */
+void timer_idle_enter(void) {
+    if (cpu_id() != 0) {
+        return;  // 只有BSP的时钟推进时间轮,AP停机时保持周期中断
+    }
+    uint32_t max_ticks = clock_event->max_count / clock_event->tick_count;
+    if (max_ticks > TICKLESS_MAX_TICKS) {
+        max_ticks = TICKLESS_MAX_TICKS;
+    }
+    // 时钟中断处理完后wheel_tick总是ticks + 1,第n个tick之前都无事可做时可以跳过
+    uint32_t n = 1;
+    while (n < max_ticks) {
+        uint32_t t = ticks + n;
+        if ((t & TW_MASK) == 0 || !list_empty(&timer_wheel[0][t & TW_MASK])) {
+            break;
+        }
+        n++;
+    }
+    if (n == 1) {
+        return;
+    }
+    // 本tick已过去的部分从单次定时中扣除,到期时正好落在原来第n个tick的位置
+    oneshot_phase = clock_event->tick_count - clock_event->count_left();
+    oneshot_count = n * clock_event->tick_count - oneshot_phase;
+    oneshot_ticks = n;
+    clock_event->set_oneshot(oneshot_count);
+}
+
+/** idle被时钟之外的中断唤醒后调用,按单次定时已走过的时间补上ticks,恢复周期模式 */
+void timer_idle_exit(void) {
+    if (cpu_id() != 0) {
+        return;
+    }
+    enum intr_status old_status = intr_disable();
+    // 单次定时已到期时交给随后的时钟中断处理
+    if (oneshot_ticks != 0 && !clock_event->oneshot_fired()) {
+        uint32_t tick_count = clock_event->tick_count;
+        uint32_t elapsed = oneshot_count - clock_event->count_left() + oneshot_phase;
+        uint32_t n = elapsed / tick_count + (elapsed % tick_count >= tick_count / 2);
+        if (n >= oneshot_ticks) {
+            n = oneshot_ticks - 1; // 第oneshot_ticks个tick上的定时器留给时钟中断,不能提前
+        }
+        oneshot_ticks = 0;
+        clock_event->set_periodic();
+        if (n > 0) {
+            ticks_advance(n);
+        }
+    }
+    intr_set_status(old_status);
 }
 
 /* 时钟的中断处理函数 */
@@ -41,37 +309,96 @@ static void intr_timer_handler(void) {
 
    ASSERT(cur_thread->stack_magic == 0x19870916);         // 检查栈是否溢出
 
-   cur_thread->elapsed_ticks++;	  // 记录此线程占用的cpu时间嘀
-   ticks++;	  //从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
-
-   if (cur_thread->ticks == 0) {	  // 若进程时间片用完就开始调度新的进程上cpu
-      schedule(); 
+   if (clock_event->ack != NULL) {
+      clock_event->ack();
+   }
+   if (cpu_id() != 0) {
+      // AP的时钟只用于本cpu的时间片,系统时间和定时器由BSP的时钟中断推进
+      cur_thread->elapsed_ticks++;
+   } else if (oneshot_ticks != 0) {
+      // idle停机期间的单次定时到期,一次补上跳过的tick并恢复周期模式
+      clock_event->set_periodic();
+      ticks_advance(oneshot_ticks);
+      oneshot_ticks = 0;
+   } else {
+      ticks_advance(1);
+   }
+   // 若进程时间片用完,或有更高级别的任务被唤醒,就开始调度新的进程上cpu
+   if (cur_thread->ticks == 0 || this_cpu()->need_resched) {
+      schedule();
    } else {				  // 将当前进程的时间片-1
       cur_thread->ticks--;
    }
 }
 
-/** 以tick为单位的sleep,任何时间形式的sleep会转换此ticks形式 */
+/** 睡眠定时器的回调,唤醒睡眠的线程 */
+static void sleep_timeout(void* arg) {
+    thread_unblock((struct task_struct*) arg);
+}
+
+/** 以tick为单位的sleep,任何时间形式的sleep会转换此ticks形式,睡眠期间阻塞,不占用cpu */
 static void ticks_to_sleep(uint32_t sleep_sticks) {
-    uint32_t start_tick = ticks;
-    // 若间隔的ticks数不够便让出cpu
-    while (ticks - start_tick < sleep_sticks) {
-        thread_yield();
-    }
+    struct timer t;
+    timer_setup(&t, sleep_timeout, running_thread());
+    enum intr_status old_status = intr_disable();
+    timer_add(&t, ticks + sleep_sticks);
+    thread_block(TASK_BLOCKED);
+    // 被其它途径提前唤醒时,t还在时间轮上,不能随栈帧一起失效
+    timer_cancel(&t);
+    intr_set_status(old_status);
 }
 
 /** 以毫秒为单位的sleep */
 void mtime_sleep(uint32_t m_seconds) {
-    uint32_t sleep_ticks = DIV_ROUND_UP(m_seconds, mil_seconds_per_intr);
+    uint32_t sleep_ticks = DIV_ROUND_UP(m_seconds * HZ, 1000);
     ASSERT(sleep_ticks > 0);
     ticks_to_sleep(sleep_ticks);
 }
 
-/* 初始化PIT8253 */
+/** 时钟中断是否由lapic计时器产生,只有这样AP才有自己的时钟中断 */
+bool timer_lapic_tick(void) {
+    return clock_event == &lapic_event;
+}
+
+/** AP启动时以与BSP相同的周期打开自己的lapic计时器 */
+void timer_ap_init(void) {
+    lapic_set_periodic();
+}
+
+/**
+ * 初始化时钟:用PIT校准TSC和lapic计时器,有lapic时由其计时器产生时钟中断并屏蔽PIT的IRQ0,
+ * 否则设置8253的定时周期.要映射lapic的寄存器,须在创建第一个进程之前调用
+ */
 void timer_init() {
    put_str("timer_init start\n");
-   /* 设置8253的定时周期,也就是发中断的周期 */
-   frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
-   register_handler(0x20, intr_timer_handler);
+   uint32_t level, idx;
+   for (level = 0; level < TW_LEVELS; level++) {
+      for (idx = 0; idx < TW_SIZE; idx++) {
+         list_init(&timer_wheel[level][idx]);
+      }
+   }
+   bool use_lapic = lapic_init();
+   uint32_t tsc_cycles = 0, lapic_counts = 0;
+   timer_calibrate(use_lapic, &tsc_cycles, &lapic_counts);
+   if (cpuid(1, NULL, NULL, NULL) & CPUID_TSC) {
+      clock_init(tsc_cycles / CALIBRATE_MS);
+      put_str("   tsc khz: 0x");
+      put_int(tsc_cycles / CALIBRATE_MS);
+      put_str("\n");
+   } else {
+      clock_init(0);
+   }
+   register_handler(TIMER_VECTOR, intr_timer_handler);
+   lapic_event.tick_count = lapic_counts * (1000 / CALIBRATE_MS) / HZ;
+   if (use_lapic && lapic_event.tick_count > 0) {
+      clock_event = &lapic_event;
+      outb(PIC_M_DATA, inb(PIC_M_DATA) | 0x01);
+   } else {
+      clock_event = &pit_event;
+   }
+   clock_event->set_periodic();
+   put_str("   tick source: ");
+   put_str((char*) clock_event->name);
+   put_str("\n");
    put_str("timer_init done\n");
 }
@@ -1,7 +1,33 @@
 #ifndef __DEVICE_TIME_H
 #define __DEVICE_TIME_H
 #include "stdint.h"
+#include "../lib/kernel/list.h"
+
+/* 每秒的时钟中断数,可在编译时用-DHZ=...修改,取值在[19, 1000]之间 */
+#ifndef HZ
+#define HZ 100
+#endif
+
+/** 定时器到期时在时钟中断中以关中断的状态调用,不能阻塞 */
+typedef void (*timer_func)(void* arg);
+
+/** 挂在时间轮上的内核定时器,由使用者提供存储 */
+struct timer {
+    struct list_elem tag; // 在时间轮槽中的标记
+    uint32_t expires;     // 到期的tick
+    timer_func func;
+    void* arg;
+    bool pending;         // 是否在时间轮上等待到期
+};
+
+extern uint32_t ticks;
 void timer_init(void);
+bool timer_lapic_tick(void);
+void timer_ap_init(void);
+void timer_setup(struct timer* t, timer_func func, void* arg);
+void timer_add(struct timer* t, uint32_t expires);
+bool timer_cancel(struct timer* t);
+void timer_idle_enter(void);
+void timer_idle_exit(void);
 void mtime_sleep(uint32_t m_seconds);
 #endif
-
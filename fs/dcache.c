@@ -0,0 +1,163 @@
+#include "dcache.h"
+#include "fs.h"
+#include "../kernel/interrupt.h"
+#include "../lib/string.h"
+#include "../lib/kernel/stdio-kernel.h"
+
+static struct dentry dentries[DCACHE_SIZE];        // 所有缓存项
+static struct list dcache_hash[DCACHE_HASH_SIZE];  // 按(分区, 父目录, 文件名)散列的哈希桶
+static struct list dcache_lru;  // 队首为最近使用的缓存项,队尾最先被淘汰
+static struct dcache_stat dstat;
+static uint32_t dcache_gen;     // 每次使缓存项失效时递增,防止扫描目录期间的增删被旧结果覆盖
+
+/** 计算(part, parent_ino, name)所在的哈希桶 */
+static struct list* bucket_of(struct partition* part, uint32_t parent_ino, const char* name) {
+    uint32_t hash = (uint32_t) part / sizeof(struct partition) + parent_ino;
+    while (*name) {
+        hash = hash * 31 + (uint8_t) *name++;
+    }
+    return &dcache_hash[hash % DCACHE_HASH_SIZE];
+}
+
+/** 查找缓存项,找不到返回NULL,调用者需关中断 */
+static struct dentry* dentry_find(struct partition* part, uint32_t parent_ino, const char* name) {
+    struct list* bucket = bucket_of(part, parent_ino, name);
+    struct list_elem* elem = bucket->head.next;
+    while (elem != &bucket->tail) {
+        struct dentry* de = elem2entry(struct dentry, hash_tag, elem);
+        if (de->part == part && de->parent_ino == parent_ino && !strcmp(de->name, name)) {
+            return de;
+        }
+        elem = elem->next;
+    }
+    return NULL;
+}
+
+/** 使缓存项失效并移到lru队尾优先重用,调用者需关中断 */
+static void dentry_drop(struct dentry* de) {
+    list_remove(&de->hash_tag);
+    de->in_use = false;
+    list_remove(&de->lru_tag);
+    list_append(&dcache_lru, &de->lru_tag);
+}
+
+/**
+ * 在目录项缓存中查找目录parent_ino下的文件name
+ * @param dir_e 命中存在的文件时存入其目录项
+ * @param gen 未命中时存入当前的失效计数,扫描目录后原样交给dcache_add
+ * @return 命中存在的文件返回1,命中不存在的文件返回0,未命中返回-1
+ */
+int32_t dcache_lookup(struct partition* part, uint32_t parent_ino,
+                      const char* name, struct dir_entry* dir_e, uint32_t* gen) {
+    int32_t ret = -1;
+    enum intr_status old_status = intr_disable();
+    *gen = dcache_gen;
+    if (strlen(name) >= MAX_FILE_NAME_LEN) {
+        intr_set_status(old_status);
+        return -1;
+    }
+    struct dentry* de = dentry_find(part, parent_ino, name);
+    if (de == NULL) {
+        dstat.misses++;
+    } else {
+        list_remove(&de->lru_tag);
+        list_push(&dcache_lru, &de->lru_tag);
+        if (de->negative) {
+            dstat.neg_hits++;
+            ret = 0;
+        } else {
+            dstat.hits++;
+            memset(dir_e, 0, sizeof(struct dir_entry));
+            strcpy(dir_e->filename, de->name);
+            dir_e->i_no = de->i_no;
+            dir_e->f_type = de->f_type;
+            ret = 1;
+        }
+    }
+    intr_set_status(old_status);
+    return ret;
+}
+
+/**
+ * 缓存扫描目录的结果,dir_e为NULL表示目录parent_ino下没有文件name.
+ * 扫描期间可能睡眠,若有缓存项失效(gen已变),扫描结果可能已过时,不缓存
+ */
+void dcache_add(struct partition* part, uint32_t parent_ino,
+                const char* name, struct dir_entry* dir_e, uint32_t gen) {
+    if (strlen(name) >= MAX_FILE_NAME_LEN) return;
+    enum intr_status old_status = intr_disable();
+    if (gen != dcache_gen) {
+        intr_set_status(old_status);
+        return;
+    }
+    struct dentry* de = dentry_find(part, parent_ino, name);
+    if (de == NULL) {
+        // 重用lru队尾的缓存项
+        de = elem2entry(struct dentry, lru_tag, dcache_lru.tail.prev);
+        if (de->in_use) {
+            list_remove(&de->hash_tag);
+        }
+        de->part = part;
+        de->parent_ino = parent_ino;
+        strcpy(de->name, name);
+        de->in_use = true;
+        list_push(bucket_of(part, parent_ino, name), &de->hash_tag);
+    }
+    de->negative = dir_e == NULL;
+    if (dir_e != NULL) {
+        de->i_no = dir_e->i_no;
+        de->f_type = dir_e->f_type;
+    }
+    list_remove(&de->lru_tag);
+    list_push(&dcache_lru, &de->lru_tag);
+    intr_set_status(old_status);
+}
+
+/** 目录parent_ino下的文件name被创建或删除时使其缓存项失效 */
+void dcache_invalidate(struct partition* part, uint32_t parent_ino, const char* name) {
+    enum intr_status old_status = intr_disable();
+    dcache_gen++;
+    struct dentry* de = dentry_find(part, parent_ino, name);
+    if (de != NULL) {
+        dentry_drop(de);
+    }
+    intr_set_status(old_status);
+}
+
+/** 目录dir_ino被删除时使其下所有缓存项失效,避免inode编号重用后命中旧的内容 */
+void dcache_purge_dir(struct partition* part, uint32_t dir_ino) {
+    enum intr_status old_status = intr_disable();
+    dcache_gen++;
+    uint32_t idx = 0;
+    while (idx < DCACHE_SIZE) {
+        struct dentry* de = &dentries[idx];
+        if (de->in_use && de->part == part && de->parent_ino == dir_ino) {
+            dentry_drop(de);
+        }
+        idx++;
+    }
+    intr_set_status(old_status);
+}
+
+/** 打印目录项缓存统计信息 */
+void dcache_stat_print(void) {
+    printk("dcache: hits %d  negative hits %d  misses %d\n",
+           dstat.hits, dstat.neg_hits, dstat.misses);
+}
+
+/** 目录项缓存初始化 */
+void dcache_init(void) {
+    uint32_t idx = 0;
+    while (idx < DCACHE_HASH_SIZE) {
+        list_init(&dcache_hash[idx++]);
+    }
+    list_init(&dcache_lru);
+    idx = 0;
+    while (idx < DCACHE_SIZE) {
+        dentries[idx].in_use = false;
+        list_append(&dcache_lru, &dentries[idx].lru_tag);
+        idx++;
+    }
+    memset(&dstat, 0, sizeof(struct dcache_stat));
+    dcache_gen = 0;
+}
@@ -0,0 +1,40 @@
+#ifndef __FS_DCACHE_H
+#define __FS_DCACHE_H
+#include "../lib/stdint.h"
+#include "../kernel/global.h"
+#include "../lib/kernel/list.h"
+#include "../device/ide.h"
+#include "dir.h"
+
+#define DCACHE_SIZE 128      // 目录项缓存的项数
+#define DCACHE_HASH_SIZE 64  // 哈希桶个数
+
+/** 目录项缓存项,记录目录parent_ino下名为name的文件,negative表示确认不存在 */
+struct dentry {
+    struct partition* part;         // 所在分区
+    uint32_t parent_ino;            // 父目录的inode编号
+    char name[MAX_FILE_NAME_LEN];   // 文件名
+    bool negative;                  // 为true表示父目录中没有此文件
+    uint32_t i_no;                  // 文件的inode编号
+    enum file_types f_type;         // 文件类型
+    bool in_use;                    // 是否已缓存了内容
+    struct list_elem hash_tag;      // 用于哈希桶中的标记
+    struct list_elem lru_tag;       // 用于lru队列中的标记
+};
+
+/** 目录项缓存统计计数 */
+struct dcache_stat {
+    uint32_t hits;       // 命中存在的文件的次数
+    uint32_t neg_hits;   // 命中不存在的文件的次数
+    uint32_t misses;     // 未命中而扫描目录的次数
+};
+
+void dcache_init(void);
+int32_t dcache_lookup(struct partition* part, uint32_t parent_ino,
+                      const char* name, struct dir_entry* dir_e, uint32_t* gen);
+void dcache_add(struct partition* part, uint32_t parent_ino,
+                const char* name, struct dir_entry* dir_e, uint32_t gen);
+void dcache_invalidate(struct partition* part, uint32_t parent_ino, const char* name);
+void dcache_purge_dir(struct partition* part, uint32_t dir_ino);
+void dcache_stat_print(void);
+#endif
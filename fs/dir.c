@@ -7,10 +7,14 @@
 #include "../kernel/global.h"
 #include "../kernel/debug.h"
 #include "../kernel/memory.h"
+#include "../kernel/slab.h"
 #include "../lib/string.h"
 #include "super_block.h"
+#include "../device/bcache.h"
+#include "dcache.h"
 
 struct dir root_dir; // 根目录
+static struct kmem_cache* dir_slab; // 打开目录的对象cache
 
 /** 打开根目录 */
 void open_root_dir(struct partition* part) {
@@ -25,12 +29,376 @@ void open_root_dir(struct partition* part) {
  * @return 返回目录指针
  */
 struct dir* dir_open(struct partition* part, uint32_t inode_no) {
-    struct dir* pdir = (struct dir*)sys_malloc(sizeof(struct dir));
+    struct dir* pdir = kmem_cache_alloc(dir_slab);
     pdir->inode = inode_open(part, inode_no);
     pdir->dir_pos = 0;
     return pdir;
 }
 
+/** 目录项文件名的散列值,决定其在已建索引的目录中落入哪个叶子块 */
+static uint32_t dir_name_hash(const char* name) {
+    uint32_t hash = 0;
+    while (*name) {
+        hash = hash * 31 + (uint8_t) *name++;
+    }
+    return hash;
+}
+
+/**
+ * 在目录第0块中找到记录索引块地址的隐藏目录项
+ * @param io_buf 存放第0块内容,至少1扇区
+ * @return 隐藏目录项在io_buf中的位置,目录未建索引时返回NULL
+ */
+static struct dir_entry* dir_index_slot(struct partition* part, struct inode* dir_inode, void* io_buf) {
+    uint32_t dir_entry_per_sec = SECTOR_SIZE / part->sb->dir_entry_size;
+    struct dir_entry* dir_e = (struct dir_entry*) io_buf;
+    bcache_read(part->my_disk, dir_inode->i_sectors[0], io_buf, 1);
+    uint32_t dir_entry_idx = 0;
+    while (dir_entry_idx < dir_entry_per_sec) {
+        if ((dir_e + dir_entry_idx)->f_type == FT_DIRINDEX) {
+            return dir_e + dir_entry_idx;
+        }
+        dir_entry_idx++;
+    }
+    return NULL;
+}
+
+/** 在索引中二分查找散列值hash所在的叶子,返回索引项下标 */
+static uint32_t dir_index_find(struct dir_index_block* index, uint32_t hash) {
+    uint32_t low = 0, high = index->count;
+    // 找最后一个entries[i].hash <= hash的索引项,第0项的hash为0,必然满足
+    while (high - low > 1) {
+        uint32_t mid = (low + high) / 2;
+        if (index->entries[mid].hash <= hash) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/** 按散列值升序排列n个目录项,hashes与ents同步交换 */
+static void dir_entries_sort(struct dir_entry* ents, uint32_t* hashes, uint32_t n) {
+    struct dir_entry tmp;
+    uint32_t idx = 1;
+    while (idx < n) {
+        uint32_t hash = hashes[idx];
+        memcpy(&tmp, &ents[idx], sizeof(struct dir_entry));
+        uint32_t pos = idx;
+        while (pos > 0 && hashes[pos - 1] > hash) {
+            hashes[pos] = hashes[pos - 1];
+            memcpy(&ents[pos], &ents[pos - 1], sizeof(struct dir_entry));
+            pos--;
+        }
+        hashes[pos] = hash;
+        memcpy(&ents[pos], &tmp, sizeof(struct dir_entry));
+        idx++;
+    }
+}
+
+/** 在目录中找一个尚未分配的块序号并为其分配扇区,失败返回-1 */
+static int32_t dir_block_add(struct partition* part, struct inode* dir_inode, uint32_t* block_idx) {
+    uint32_t idx = 1;
+    while (idx < DIR_MAX_BLOCKS) {
+        if (inode_block_lba(part, dir_inode, idx) == 0) {
+            *block_idx = idx;
+            return inode_block_alloc(part, dir_inode, idx);
+        }
+        idx++;
+    }
+    return -1;
+}
+
+/**
+ * 撤销目录索引,回收索引块.叶子块中的目录项原地保留,
+ * 目录退回线性扫描的格式依然完整可用
+ */
+static void dir_index_drop(struct partition* part, struct inode* dir_inode, void* io_buf) {
+    struct dir_entry* index_de = dir_index_slot(part, dir_inode, io_buf);
+    if (index_de == NULL) {
+        return;
+    }
+    uint32_t block_bitmap_idx = index_de->i_no - part->sb->data_start_lba;
+    bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
+    bitmap_sync(part, block_bitmap_idx, BLOCK_BITMAP);
+    memset(index_de, 0, part->sb->dir_entry_size);
+    bcache_write(part->my_disk, dir_inode->i_sectors[0], io_buf, 1);
+}
+
+/**
+ * 在已建索引的目录中查找名为name的目录项,只需读第0块、索引块和一个叶子块
+ * @return 找到返回1,不存在返回0,目录未建索引返回-1
+ */
+static int32_t dir_index_lookup(struct partition* part, struct inode* dir_inode,
+                                const char* name, struct dir_entry* dir_e) {
+    // .和..始终在第0块,交给线性扫描即可
+    if (!strcmp(name, ".") || !strcmp(name, "..")) {
+        return -1;
+    }
+    uint8_t* buf = (uint8_t*) sys_malloc(SECTOR_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+    struct dir_entry* index_de = dir_index_slot(part, dir_inode, buf);
+    if (index_de == NULL) {
+        sys_free(buf);
+        return -1;
+    }
+    struct dir_index_block* index = (struct dir_index_block*) buf;
+    bcache_read(part->my_disk, index_de->i_no, buf, 1);
+    ASSERT(index->magic == DIR_INDEX_MAGIC);
+    uint32_t leaf = dir_index_find(index, dir_name_hash(name));
+    bcache_read(part->my_disk, inode_block_lba(part, dir_inode, index->entries[leaf].block_idx), buf, 1);
+
+    uint32_t dir_entry_size = part->sb->dir_entry_size;
+    uint32_t dir_entry_per_sec = SECTOR_SIZE / dir_entry_size;
+    struct dir_entry* p_de = (struct dir_entry*) buf;
+    uint32_t dir_entry_idx = 0;
+    while (dir_entry_idx < dir_entry_per_sec) {
+        if (p_de->f_type != FT_UNKNOWN && !strcmp(p_de->filename, name)) {
+            memcpy(dir_e, p_de, dir_entry_size);
+            sys_free(buf);
+            return 1;
+        }
+        dir_entry_idx++;
+        p_de++;
+    }
+    sys_free(buf);
+    return 0;
+}
+
+/**
+ * 为目录建立索引: 把.和..以外的目录项按散列值排序后重新分布到各叶子块,
+ * 再在第0块写入指向索引块的隐藏目录项.任何一步失败都保持原来的线性格式
+ */
+static void dir_index_build(struct partition* part, struct inode* dir_inode) {
+    uint32_t dir_entry_size = part->sb->dir_entry_size;
+    uint32_t dir_entry_per_sec = SECTOR_SIZE / dir_entry_size;
+    uint32_t ent_cnt = dir_inode->i_size / dir_entry_size - 2;
+    // 块序号数组有600多字节,与扇区缓冲一起放在堆上,内核栈与pcb共用一页
+    uint8_t* buf = (uint8_t*) sys_malloc(SECTOR_SIZE * 2 + (DIR_INDEX_MAX * 2 + 1) * 4 + DIR_MAX_BLOCKS);
+    struct dir_entry* ents = (struct dir_entry*) sys_malloc(ent_cnt * (dir_entry_size + 4));
+    if (buf == NULL || ents == NULL) {
+        goto out;
+    }
+    uint32_t* hashes = (uint32_t*) (ents + ent_cnt);
+    struct dir_index_block* index = (struct dir_index_block*) (buf + SECTOR_SIZE);
+    uint32_t* leaf_blocks = (uint32_t*) (buf + SECTOR_SIZE * 2);   // DIR_INDEX_MAX项
+    uint32_t* leaf_start = leaf_blocks + DIR_INDEX_MAX;            // DIR_INDEX_MAX + 1项
+    uint8_t* old_blocks = (uint8_t*) (leaf_start + DIR_INDEX_MAX + 1); // 原来存放目录项的块序号,重新用作叶子块
+    uint32_t old_cnt = 0, leaf_cnt = 0, n = 0;
+
+    // 1.收集全部目录项
+    uint32_t block_idx = 0;
+    while (block_idx < DIR_MAX_BLOCKS) {
+        uint32_t block_lba = inode_block_lba(part, dir_inode, block_idx);
+        if (block_lba == 0) {
+            block_idx++;
+            continue;
+        }
+        bcache_read(part->my_disk, block_lba, buf, 1);
+        struct dir_entry* p_de = (struct dir_entry*) buf;
+        uint32_t dir_entry_idx = 0;
+        while (dir_entry_idx < dir_entry_per_sec) {
+            if (p_de->f_type != FT_UNKNOWN && p_de->f_type != FT_DIRINDEX &&
+                strcmp(p_de->filename, ".") && strcmp(p_de->filename, "..")) {
+                if (n == ent_cnt) {
+                    goto out; // 与i_size不符,不冒险改动目录
+                }
+                memcpy(&ents[n], p_de, dir_entry_size);
+                hashes[n] = dir_name_hash(p_de->filename);
+                n++;
+            }
+            dir_entry_idx++;
+            p_de++;
+        }
+        if (block_idx != 0) {
+            old_blocks[old_cnt++] = block_idx;
+        }
+        block_idx++;
+    }
+    dir_entries_sort(ents, hashes, n);
+
+    // 2.划分叶子块,散列值相同的目录项必须落在同一叶子中
+    uint32_t pos = 0;
+    while (pos < n) {
+        if (leaf_cnt == DIR_INDEX_MAX) {
+            goto out;
+        }
+        leaf_start[leaf_cnt++] = pos;
+        uint32_t end = pos + (n - pos < DIR_LEAF_FILL ? n - pos : DIR_LEAF_FILL);
+        while (end < n && hashes[end] == hashes[end - 1] && end - pos < dir_entry_per_sec) {
+            end++;
+        }
+        if (end < n && hashes[end] == hashes[end - 1]) {
+            goto out;
+        }
+        pos = end;
+    }
+    leaf_start[leaf_cnt] = n;
+
+    // 3.准备叶子块和索引块,先复用原有的块,不够再分配
+    uint32_t leaf_idx = 0;
+    while (leaf_idx < leaf_cnt) {
+        if (leaf_idx < old_cnt) {
+            leaf_blocks[leaf_idx] = old_blocks[leaf_idx];
+        } else if (dir_block_add(part, dir_inode, &leaf_blocks[leaf_idx]) == -1) {
+            goto out; // 已分配的块暂为空块,不影响线性扫描
+        }
+        leaf_idx++;
+    }
+    int32_t index_lba = block_bitmap_alloc(part);
+    if (index_lba == -1) {
+        goto out;
+    }
+    bitmap_sync(part, index_lba - part->sb->data_start_lba, BLOCK_BITMAP);
+
+    // 4.写叶子块,多出来的旧块清空
+    memset(index, 0, SECTOR_SIZE);
+    index->magic = DIR_INDEX_MAGIC;
+    index->count = leaf_cnt;
+    leaf_idx = 0;
+    while (leaf_idx < old_cnt || leaf_idx < leaf_cnt) {
+        memset(buf, 0, SECTOR_SIZE);
+        if (leaf_idx < leaf_cnt) {
+            memcpy(buf, &ents[leaf_start[leaf_idx]],
+                   (leaf_start[leaf_idx + 1] - leaf_start[leaf_idx]) * dir_entry_size);
+            index->entries[leaf_idx].hash = leaf_idx == 0 ? 0 : hashes[leaf_start[leaf_idx]];
+            index->entries[leaf_idx].block_idx = leaf_blocks[leaf_idx];
+            block_idx = leaf_blocks[leaf_idx];
+        } else {
+            block_idx = old_blocks[leaf_idx];
+        }
+        bcache_write(part->my_disk, inode_block_lba(part, dir_inode, block_idx), buf, 1);
+        leaf_idx++;
+    }
+    bcache_write(part->my_disk, index_lba, index, 1);
+
+    // 5.第0块只留下.和..,并写入指向索引块的隐藏目录项
+    bcache_read(part->my_disk, dir_inode->i_sectors[0], buf, 1);
+    struct dir_entry* p_de = (struct dir_entry*) buf;
+    struct dir_entry* index_de = NULL;
+    uint32_t dir_entry_idx = 0;
+    while (dir_entry_idx < dir_entry_per_sec) {
+        if (strcmp(p_de->filename, ".") && strcmp(p_de->filename, "..")) {
+            memset(p_de, 0, dir_entry_size);
+            if (index_de == NULL) {
+                index_de = p_de;
+            }
+        }
+        dir_entry_idx++;
+        p_de++;
+    }
+    ASSERT(index_de != NULL);
+    index_de->i_no = index_lba;
+    index_de->f_type = FT_DIRINDEX;
+    bcache_write(part->my_disk, dir_inode->i_sectors[0], buf, 1);
+out:
+    if (ents != NULL) {
+        sys_free(ents);
+    }
+    if (buf != NULL) {
+        sys_free(buf);
+    }
+}
+
+/**
+ * 向已建索引的目录中插入目录项,叶子块已满时按散列值一分为二
+ * @return 成功返回1,失败返回0,目录未建索引或索引已撤销返回-1
+ */
+static int32_t dir_index_insert(struct partition* part, struct inode* dir_inode,
+                                struct dir_entry* p_de, void* io_buf) {
+    struct dir_entry* index_de = dir_index_slot(part, dir_inode, io_buf);
+    if (index_de == NULL) {
+        return -1;
+    }
+    uint32_t dir_entry_size = part->sb->dir_entry_size;
+    uint32_t dir_entry_per_sec = SECTOR_SIZE / dir_entry_size;
+    uint32_t index_lba = index_de->i_no;
+    // 索引块 + 分裂时暂存的dir_entry_per_sec+1个目录项
+    uint8_t* buf = (uint8_t*) sys_malloc(SECTOR_SIZE + (dir_entry_per_sec + 1) * dir_entry_size);
+    if (buf == NULL) {
+        return 0;
+    }
+    struct dir_index_block* index = (struct dir_index_block*) buf;
+    struct dir_entry* ents = (struct dir_entry*) (buf + SECTOR_SIZE);
+    bcache_read(part->my_disk, index_lba, index, 1);
+    ASSERT(index->magic == DIR_INDEX_MAGIC);
+
+    uint32_t leaf = dir_index_find(index, dir_name_hash(p_de->filename));
+    uint32_t leaf_lba = inode_block_lba(part, dir_inode, index->entries[leaf].block_idx);
+    bcache_read(part->my_disk, leaf_lba, io_buf, 1);
+    struct dir_entry* dir_e = (struct dir_entry*) io_buf;
+    uint32_t dir_entry_idx = 0;
+    while (dir_entry_idx < dir_entry_per_sec) {
+        if ((dir_e + dir_entry_idx)->f_type == FT_UNKNOWN) {
+            memcpy(dir_e + dir_entry_idx, p_de, dir_entry_size);
+            bcache_write(part->my_disk, leaf_lba, io_buf, 1);
+            dir_inode->i_size += dir_entry_size;
+            sys_free(buf);
+            return 1;
+        }
+        dir_entry_idx++;
+    }
+
+    // 叶子块已满,连同新目录项按散列值排序后从中间分裂
+    uint32_t hashes[SECTOR_SIZE / sizeof(struct dir_entry) + 1];
+    uint32_t n = dir_entry_per_sec + 1;
+    memcpy(ents, io_buf, dir_entry_per_sec * dir_entry_size);
+    memcpy(&ents[dir_entry_per_sec], p_de, dir_entry_size);
+    dir_entry_idx = 0;
+    while (dir_entry_idx < n) {
+        hashes[dir_entry_idx] = dir_name_hash(ents[dir_entry_idx].filename);
+        dir_entry_idx++;
+    }
+    dir_entries_sort(ents, hashes, n);
+    // 分裂点不能落在散列值相同的一串目录项中间
+    uint32_t split = n / 2;
+    while (split < n && hashes[split] == hashes[split - 1]) {
+        split++;
+    }
+    if (split == n) {
+        split = n / 2;
+        while (split > 0 && hashes[split] == hashes[split - 1]) {
+            split--;
+        }
+    }
+    if (split == 0 || index->count == DIR_INDEX_MAX) {
+        // 无法再分裂,撤销索引退回线性格式
+        sys_free(buf);
+        dir_index_drop(part, dir_inode, io_buf);
+        return -1;
+    }
+    uint32_t new_block_idx;
+    int32_t new_lba = dir_block_add(part, dir_inode, &new_block_idx);
+    if (new_lba == -1) {
+        printk("alloc block bitmap for sync_dir_entry failed\n");
+        sys_free(buf);
+        return 0;
+    }
+    memset(io_buf, 0, SECTOR_SIZE);
+    memcpy(io_buf, ents, split * dir_entry_size);
+    bcache_write(part->my_disk, leaf_lba, io_buf, 1);
+    memset(io_buf, 0, SECTOR_SIZE);
+    memcpy(io_buf, &ents[split], (n - split) * dir_entry_size);
+    bcache_write(part->my_disk, new_lba, io_buf, 1);
+
+    // 新叶子的索引项插在原叶子之后
+    uint32_t idx = index->count;
+    while (idx > leaf + 1) {
+        index->entries[idx] = index->entries[idx - 1];
+        idx--;
+    }
+    index->entries[leaf + 1].hash = hashes[split];
+    index->entries[leaf + 1].block_idx = new_block_idx;
+    index->count++;
+    bcache_write(part->my_disk, index_lba, index, 1);
+    dir_inode->i_size += dir_entry_size;
+    sys_free(buf);
+    return 1;
+}
+
 /**
  * 在part分区内的pdir目录下查找名为name的文件或目录
  * @param part 分区
@@ -41,22 +409,17 @@ struct dir* dir_open(struct partition* part, uint32_t inode_no) {
  */
 bool search_dir_entry(struct partition* part, struct dir* pdir,
                       const char* name, struct dir_entry* dir_e) {
-    uint32_t block_cnt = 140; // 12个直接块 + 128个1级间接块 = 140块
-    // 存储所有的数据块信息占用的字节大小
-    uint32_t* all_blocks = (uint32_t*) sys_malloc(48 + 512);
-    if (all_blocks == NULL) {
-        printk("search_dir_entry: sys_malloc for all_blocks failed");
-        return false;
+    // 先查目录项缓存,确认存在或不存在都无需扫描目录
+    uint32_t gen = 0;
+    int32_t cached = dcache_lookup(part, pdir->inode->i_no, name, dir_e, &gen);
+    if (cached != -1) {
+        return cached == 1;
     }
-    uint32_t block_idx = 0;
-    while (block_idx < 12) {
-        all_blocks[block_idx] = pdir->inode->i_sectors[block_idx];
-        block_idx++;
-    }
-    block_idx = 0;
-    if (pdir->inode->i_sectors[12] != 0) {
-        // 若含有1级间接块表
-        ide_read(part->my_disk, pdir->inode->i_sectors[12], all_blocks + 12, 1);
+    // 已建索引的目录只需读一个叶子块
+    int32_t indexed = dir_index_lookup(part, pdir->inode, name, dir_e);
+    if (indexed != -1) {
+        dcache_add(part, pdir->inode->i_no, name, indexed == 1 ? dir_e : NULL, gen);
+        return indexed == 1;
     }
     // 写目录项的时候已保证目录项不跨扇区,这样读目录项时容易
     // 处理, 只申请容纳1个扇区的内存
@@ -67,19 +430,21 @@ bool search_dir_entry(struct partition* part, struct dir* pdir,
     uint32_t dir_entry_cnt = SECTOR_SIZE / dir_entry_size;
 
     // 开始在所有块中查找目录项
-    while (block_idx < block_cnt) {
-        if (all_blocks[block_idx] == 0) {
+    uint32_t block_idx = 0;
+    while (block_idx < DIR_MAX_BLOCKS) {
+        uint32_t block_lba = inode_block_lba(part, pdir->inode, block_idx);
+        if (block_lba == 0) {
             block_idx++;
             continue;
         }
-        ide_read(part->my_disk, all_blocks[block_idx], buf, 1);
+        bcache_read(part->my_disk, block_lba, buf, 1);
         uint32_t dir_entry_idx = 0;
         while (dir_entry_idx < dir_entry_cnt) {
             // 若找到了,就复制整个目录项
             if (!strcmp(p_de->filename, name)) {
                 memcpy(dir_e, p_de, dir_entry_size);
+                dcache_add(part, pdir->inode->i_no, name, dir_e, gen);
                 sys_free(buf);
-                sys_free(all_blocks);
                 return true;
             }
             dir_entry_idx++;
@@ -90,8 +455,9 @@ bool search_dir_entry(struct partition* part, struct dir* pdir,
         p_de = (struct dir_entry *) buf;
         memset(buf, 0, SECTOR_SIZE);
     }
+    // 记下不存在,再次查找同名文件时无需扫描
+    dcache_add(part, pdir->inode->i_no, name, NULL, gen);
     sys_free(buf);
-    sys_free(all_blocks);
     return false;
 }
 
@@ -101,7 +467,15 @@ void dir_close(struct dir* dir) {
         return;
     }
     inode_close(dir->inode);
-    sys_free(dir);
+    kmem_cache_free(dir_slab, dir);
+}
+
+/** 创建打开目录的对象cache */
+void dir_init(void) {
+    dir_slab = kmem_cache_create("dir", sizeof(struct dir), 0, NULL);
+    if (dir_slab == NULL) {
+        PANIC("dir_init: create slab cache failed!");
+    }
 }
 
 /**
@@ -120,98 +494,38 @@ void create_dir_entry(char* filename, uint32_t inode_no,
     p_de->f_type = file_type;
 }
 
-/**
- * 将目录项p_de写入父目录中,io_buf由主调函数提供
- * @param parent_dir 父目录
- * @param p_de 目录项
- * @param io_buf io缓冲区
- * @return
- */
-bool sync_dir_entry(struct dir* parent_dir, struct dir_entry* p_de, void* io_buf) {
-    struct inode* dir_inode = parent_dir->inode;
-    uint32_t dir_size = dir_inode->i_size;
-    uint32_t dir_entry_size = cur_part->sb->dir_entry_size;
-
-    ASSERT(dir_size % dir_entry_size == 0);
-
-    uint32_t dir_entry_per_sec = 512 / dir_entry_size;
-
-    int32_t block_lba = -1;
-    // 将该目录的所有扇区地址(12个直接块 + 128个间接块)存入all_blocks
-    uint8_t block_idx = 0;
-    uint32_t all_blocks[140] = {0};
-    // 将12个直接块直接存入all_blocks
-    while (block_idx < 12) {
-        all_blocks[block_idx] = dir_inode->i_sectors[block_idx];
-        block_idx++;
-    }
+/** 线性扫描目录,把目录项p_de写入第一个空位,已有块都满时再分配新块 */
+static bool dir_linear_insert(struct partition* part, struct inode* dir_inode,
+                              struct dir_entry* p_de, void* io_buf) {
+    uint32_t dir_entry_size = part->sb->dir_entry_size;
+    uint32_t dir_entry_per_sec = SECTOR_SIZE / dir_entry_size;
     // dir_e用来在io_buf中遍历目录项
     struct dir_entry* dir_e = (struct dir_entry*)io_buf;
-    int32_t block_bitmap_idx = -1;
-    // 开始遍历所有块以寻找目录空位,若已有扇区中没有空闲位,
-    // 在不超过文件大小的情况下申请扇区来存储新目录项
-    block_idx = 0;
+    uint32_t block_idx = 0;
     // 文件(包括目录)最大支持12个直接块+128个间接块＝140个块
-    while (block_idx < 140) {
-        block_bitmap_idx = -1;
-        if (all_blocks[block_idx] == 0) {
-            block_lba = block_bitmap_alloc(cur_part);
+    while (block_idx < DIR_MAX_BLOCKS) {
+        int32_t block_lba = inode_block_lba(part, dir_inode, block_idx);
+        if (block_lba == 0) {
+            block_lba = inode_block_alloc(part, dir_inode, block_idx);
             if (block_lba == -1) {
                 printk("alloc block bitmap for sync_dir_entry failed\n");
                 return false;
             }
-            // 每分配一个块就同步一次block_bitmap
-            block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-            ASSERT(block_bitmap_idx != -1);
-            bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-
-            block_bitmap_idx = -1;
-            if (block_idx < 12) { // 若是直接块
-                dir_inode->i_sectors[block_idx] = all_blocks[block_idx] = block_lba;
-            } else if (block_idx == 12) {
-                // 若是尚未分配1级间接块表(block_idx等于12表示第0个间接块地址为0)
-                // 将上面分配的块作为一级间接块表地址
-                dir_inode->i_sectors[12] = block_lba;
-                block_lba = -1;
-                // 再分间接块
-                block_lba = block_bitmap_alloc(cur_part);
-
-                if (block_lba == -1) {
-                    block_bitmap_idx = dir_inode->i_sectors[12] - cur_part->sb->data_start_lba;
-                    bitmap_set(&cur_part->block_bitmap, block_bitmap_idx, 0);
-                    dir_inode->i_sectors[12] = 0;
-                    printk("alloc block bitmap for sync_dir_entry failed\n");
-                    return false;
-                }
-                // 每分配一个块就同步一次block_bitmap
-                block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-                ASSERT(block_bitmap_idx != -1);
-                bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-
-                all_blocks[12] = block_lba;
-                // 把新分配的第0个间接块地址写入一级间接块表
-                ide_write(cur_part->my_disk, dir_inode->i_sectors[12], all_blocks + 12, 1);
-            } else { // 若是间接块未分配
-                all_blocks[block_idx] = block_lba;
-                // 把新分配的第(block_idx-12)个间接块地址写入一级间接块表
-                ide_write(cur_part->my_disk, dir_inode->i_sectors[12], all_blocks + 12, 1);
-            }
-            // 再将新目录项p_de写入新分配的间接块
-            memset(io_buf, 0, 512);
+            // 将新目录项p_de写入新分配的块
+            memset(io_buf, 0, SECTOR_SIZE);
             memcpy(io_buf, p_de, dir_entry_size);
-            ide_write(cur_part->my_disk, all_blocks[block_idx], io_buf, 1);
+            bcache_write(part->my_disk, block_lba, io_buf, 1);
             dir_inode->i_size += dir_entry_size;
             return true;
         }
         // 若block_idx块已存在,将其读入内存,然后在该块中查找空目录项
-        ide_read(cur_part->my_disk, all_blocks[block_idx], io_buf, 1);
-        uint8_t dir_entry_idx = 0;
+        bcache_read(part->my_disk, block_lba, io_buf, 1);
+        uint32_t dir_entry_idx = 0;
         while (dir_entry_idx < dir_entry_per_sec) {
             if ((dir_e + dir_entry_idx)->f_type == FT_UNKNOWN) {
                 // FT_UNKNOWN为0,无论是初始化或是删除文件后,都会将f_type置为FT_UNKNOWN.
                 memcpy(dir_e + dir_entry_idx, p_de, dir_entry_size);
-                ide_write(cur_part->my_disk, all_blocks[block_idx], io_buf, 1);
-
+                bcache_write(part->my_disk, block_lba, io_buf, 1);
                 dir_inode->i_size += dir_entry_size;
                 return true;
             }
@@ -223,19 +537,38 @@ bool sync_dir_entry(struct dir* parent_dir, struct dir_entry* p_de, void* io_buf
     return false;
 }
 
+/**
+ * 将目录项p_de写入父目录中,io_buf由主调函数提供.
+ * 目录可能分配新块,父目录inode由调用者同步
+ * @param parent_dir 父目录
+ * @param p_de 目录项
+ * @param io_buf io缓冲区
+ * @return
+ */
+bool sync_dir_entry(struct dir* parent_dir, struct dir_entry* p_de, void* io_buf) {
+    struct inode* dir_inode = parent_dir->inode;
+    uint32_t dir_entry_size = cur_part->sb->dir_entry_size;
+
+    ASSERT(dir_inode->i_size % dir_entry_size == 0);
+    int32_t ret = dir_index_insert(cur_part, dir_inode, p_de, io_buf);
+    if (ret != -1) {
+        return ret == 1;
+    }
+    if (!dir_linear_insert(cur_part, dir_inode, p_de, io_buf)) {
+        return false;
+    }
+    // 目录项数刚越过阈值时为目录建立索引
+    if (dir_inode->i_size / dir_entry_size == DIR_INDEX_THRESHOLD + 1) {
+        dir_index_build(cur_part, dir_inode);
+    }
+    return true;
+}
+
 /** 把分区part目录pdir中编号为inode_no的目录项删除 */
 bool delete_dir_entry(struct partition* part, struct dir* pdir,
                       uint32_t inode_no, void* io_buf) {
     struct inode* dir_inode = pdir->inode;
-    uint32_t block_idx = 0, all_blocks[140] = {0};
-    // 收集目录全部块地址
-    while (block_idx < 12) {
-        all_blocks[block_idx] = dir_inode->i_sectors[block_idx];
-        block_idx++;
-    }
-    if (dir_inode->i_sectors[12]) {
-        ide_read(part->my_disk, dir_inode->i_sectors[12], all_blocks + 12, 1);
-    }
+    uint32_t block_idx, block_lba;
     // 目录项在存储时保证不会跨扇区
     uint32_t dir_entry_size = part->sb->dir_entry_size;
     uint32_t dir_entry_per_sec = (SECTOR_SIZE / dir_entry_size); // 每扇区最大目录项数目
@@ -244,22 +577,26 @@ bool delete_dir_entry(struct partition* part, struct dir* pdir,
     struct dir_entry* dir_entry_found = NULL;
     uint8_t dir_entry_idx, dir_entry_cnt;
     bool is_dir_first_block = false; // 目录的第1个块
+    bool indexed = false;            // 已建索引的目录不回收叶子块,否则索引会指向已释放的块
     // 遍历所有块,寻找目录项
     block_idx = 0;
-    while (block_idx < 140) {
+    while (block_idx < DIR_MAX_BLOCKS) {
         is_dir_first_block = false;
-        if (all_blocks[block_idx] == 0) {
+        block_lba = inode_block_lba(part, dir_inode, block_idx);
+        if (block_lba == 0) {
             block_idx++;
             continue;
         }
         dir_entry_idx = dir_entry_cnt = 0;
         memset(io_buf, 0, SECTOR_SIZE);
         // 读取扇区,获得目录项
-        ide_read(part->my_disk, all_blocks[block_idx], io_buf, 1);
+        bcache_read(part->my_disk, block_lba, io_buf, 1);
         // 遍历所有目录项,统计该扇区的目录项数量以及是否有待删除的目录项
         while (dir_entry_idx < dir_entry_per_sec) {
             struct dir_entry* temp = (dir_e + dir_entry_idx);
-            if (temp->f_type != FT_UNKNOWN) {
+            if (temp->f_type == FT_DIRINDEX) {
+                indexed = true;
+            } else if (temp->f_type != FT_UNKNOWN) {
                 if (!strcmp(temp->filename, ".")) {
                     is_dir_first_block = true;
                 } else if (strcmp(temp->filename, ".") &&
@@ -281,42 +618,12 @@ bool delete_dir_entry(struct partition* part, struct dir* pdir,
         // 在此扇区中找到目录项后,清除该目录项并判断是否回收扇区,随后退出循环直接返回
         ASSERT(dir_entry_cnt >= 1);
         // 除目录第1个扇区外,若该扇区上只有该目录项自己,则将整个扇区回收
-        if (dir_entry_cnt == 1 && !is_dir_first_block) {
-            // a.在块位图中回收该块
-            uint32_t block_bitmap_idx = all_blocks[block_idx] - part->sb->data_start_lba;
-            bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
-            bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-            // b.将块地址从数组i_sectors或索引表中去掉
-            if (block_idx < 12) {
-                dir_inode->i_sectors[block_idx] = 0;
-            } else { // 在一级间接索引表中擦除该间接块地址
-                uint32_t indirect_blocks = 0;
-                uint32_t indirect_block_idx = 12;
-                while (indirect_block_idx < 140) {
-                    if (all_blocks[indirect_block_idx] != 0) {
-                        indirect_blocks++;
-                    }
-                    indirect_block_idx++;
-                }
-                ASSERT(indirect_blocks > 1);
-                if (indirect_blocks > 1) {
-                    // 间接索引表中还包括其它间接块,仅在索引表中擦除当前这个间接块地址
-                    all_blocks[block_idx] = 0;
-                    ide_write(part->my_disk, dir_inode->i_sectors[12], all_blocks + 12, 1);
-                } else {
-                    // 间接索引表中就当前这1个间接块,直接把间接索引表所在的块回收,然后擦除间接索引表块地址
-                    // 回收间接索引表所在的块
-                    block_bitmap_idx = dir_inode->i_sectors[12] - part->sb->data_start_lba;
-                    bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
-                    bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-
-                    // 将间接索引表地址清0
-                    dir_inode->i_sectors[12] = 0;
-                }
-            }
+        if (dir_entry_cnt == 1 && !is_dir_first_block && !indexed) {
+            // 回收该块,并从i_sectors或间接块表中去掉,间接块表因此变空时一并回收
+            inode_block_free(part, dir_inode, block_idx);
         } else { // 仅将该目录清空
             memset(dir_entry_found, 0, dir_entry_size);
-            ide_write(part->my_disk, all_blocks[block_idx], io_buf, 1);
+            bcache_write(part->my_disk, block_lba, io_buf, 1);
         }
         // 更新i结点信息并同步到硬盘
         ASSERT(dir_inode->i_size >= dir_entry_size);
@@ -334,37 +641,29 @@ bool delete_dir_entry(struct partition* part, struct dir* pdir,
 struct dir_entry* dir_read(struct dir* dir) {
     struct dir_entry* dir_e = (struct dir_entry*) dir->dir_buf;
     struct inode* dir_inode = dir->inode;
-    uint32_t all_blocks[140] = {0}, block_cnt = 12;
-    uint32_t block_idx = 0, dir_entry_idx = 0;
-    while (block_idx < 12) {
-        all_blocks[block_idx] = dir_inode->i_sectors[block_idx];
-        block_idx++;
-    }
-    if (dir_inode->i_sectors[12] != 0) { // 若含有一级间接块表
-        ide_read(cur_part->my_disk, dir_inode->i_sectors[12], all_blocks + 12, 1);
-        block_cnt = 140;
-    }
-    block_idx = 0;
+    uint32_t block_idx = 0, block_lba, dir_entry_idx = 0;
     // 当前目录项的偏移,此项用来判断是不是之前已经返回过的目录项
     uint32_t cur_dir_entry_pos = 0;
     uint32_t dir_entry_size = cur_part->sb->dir_entry_size;
     // 一扇区可容纳的页目录项
     uint32_t dir_entry_per_sec = SECTOR_SIZE / dir_entry_size;
     // 因为此目录可能删除了某些文件或子目录,所以要遍历所有块
-    while (block_idx < block_cnt) {
+    while (block_idx < DIR_MAX_BLOCKS) {
         if (dir->dir_pos >= dir_inode->i_size) {
             return NULL;
         }
-        if (all_blocks[block_idx] == 0) { // 空数据块直接跳过
+        block_lba = inode_block_lba(cur_part, dir_inode, block_idx);
+        if (block_lba == 0) { // 空数据块直接跳过
             block_idx++;
             continue;
         }
         memset(dir_e, 0, SECTOR_SIZE);
-        ide_read(cur_part->my_disk, all_blocks[block_idx], dir_e, 1);
+        bcache_read(cur_part->my_disk, block_lba, dir_e, 1);
         dir_entry_idx = 0;
         // 遍历扇区内所有目录项
         while (dir_entry_idx < dir_entry_per_sec) {
-            if ((dir_e + dir_entry_idx)->f_type != FT_UNKNOWN) {
+            if ((dir_e + dir_entry_idx)->f_type != FT_UNKNOWN &&
+                (dir_e + dir_entry_idx)->f_type != FT_DIRINDEX) {
                 // 判断是不是最新的目录项,避免返回之前已经返回过的目录项
                 if (cur_dir_entry_pos < dir->dir_pos) {
                     cur_dir_entry_pos += dir_entry_size;
@@ -393,17 +692,14 @@ bool dir_is_empty(struct dir* dir) {
 /** 在父目录parent_dir中删除子目录 */
 int32_t dir_remove(struct dir* parent_dir, struct dir* child_dir) {
     struct inode* child_dir_inode = child_dir->inode;
-    // 空目录只在inode->i_sectors[0]中有扇区,其它扇区应该为空
-    int32_t block_idx = 1;
-    while (block_idx < 13) {
-        ASSERT(child_dir_inode->i_sectors[block_idx] == 0);
-        block_idx++;
-    }
+    // 未建索引的空目录只在inode->i_sectors[0]中有扇区,
+    // 建过索引的目录还留有空的叶子块,交由inode_release一并回收
     void* io_buf = sys_malloc(SECTOR_SIZE * 2);
     if (io_buf == NULL) {
         printk("dir_remove: malloc for io_buf failed!\n");
         return -1;
     }
+    dir_index_drop(cur_part, child_dir_inode, io_buf);
     // 在父目录parent_dir中删除子目录child_dir对应的目录项
     delete_dir_entry(cur_part, parent_dir, child_dir_inode->i_no, io_buf);
     // 回收inode中i_sectors中所占用的扇区,并同步inode_bitmap和block_bitmap
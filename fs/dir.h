@@ -7,6 +7,27 @@
 #include "../kernel/global.h"
 
 #define MAX_FILE_NAME_LEN 16  // 最大文件名长度
+#define DIR_MAX_BLOCKS 140    // 目录最多占用的块数(12个直接块 + 128个一级间接块)
+
+/** 目录索引: 目录项超过阈值后按文件名散列分布到各叶子块,
+    查找时二分索引块定位唯一的叶子块,不必扫描整个目录 */
+#define DIR_INDEX_THRESHOLD 84          // 目录项(含.和..)超过此数时建立索引,约4个扇区
+#define DIR_INDEX_MAGIC 0x48545245      // "HTRE"
+#define DIR_INDEX_MAX 63                // 索引块最多记录的叶子块数
+#define DIR_LEAF_FILL 14                // 建立索引时每个叶子块填入的目录项数,留出空位推迟分裂
+
+/** 索引项,覆盖散列值在[hash, 下一项的hash)内的文件名 */
+struct dir_index_entry {
+    uint32_t hash;       // 该叶子块内最小的散列值,第0项固定为0
+    uint32_t block_idx;  // 叶子块在目录内的块序号
+};
+
+/** 索引块,正好占一个扇区,地址记录在目录第0块的隐藏目录项中 */
+struct dir_index_block {
+    uint32_t magic;
+    uint32_t count;      // 叶子块个数
+    struct dir_index_entry entries[DIR_INDEX_MAX];
+};
 
 /** 目录结构 */
 struct dir {
@@ -25,6 +46,7 @@ extern struct dir root_dir; // 根目录
 void open_root_dir(struct partition* part);
 struct dir* dir_open(struct partition* part, uint32_t inode_no);
 void dir_close(struct dir* dir);
+void dir_init(void);
 bool search_dir_entry(struct partition* part, struct dir* dir, const char* name, struct dir_entry* dir_e);
 void create_dir_entry(char* filename, uint32_t inode_no, uint8_t file_type, struct dir_entry* p_de);
 bool sync_dir_entry(struct dir* parent_dir, struct dir_entry* p_de, void* io_buf);
@@ -9,6 +9,8 @@
 #include "../lib/string.h"
 #include "../thread/thread.h"
 #include "../kernel/global.h"
+#include "../device/bcache.h"
+#include "dcache.h"
 
 #define DEFAULT_SETS 1
 
@@ -85,6 +87,25 @@ int32_t block_bitmap_alloc(struct partition* part) {
     return part->sb->data_start_lba + bit_idx;
 }
 
+/**
+ * 优先分配扇区goal_lba对应的数据块,使文件的块在硬盘上连续,
+ * 该块已被占用时退回普通的分配
+ * @param part 分区
+ * @param goal_lba 期望的块地址,为0时不指定
+ * @return 返回数据块地址
+ */
+int32_t block_bitmap_alloc_near(struct partition* part, uint32_t goal_lba) {
+    if (goal_lba >= part->sb->data_start_lba) {
+        uint32_t bit_idx = goal_lba - part->sb->data_start_lba;
+        if (bit_idx < part->block_bitmap.btmp_bytes_len * 8 &&
+            !bitmap_scan_test(&part->block_bitmap, bit_idx)) {
+            bitmap_set(&part->block_bitmap, bit_idx, 1);
+            return goal_lba;
+        }
+    }
+    return block_bitmap_alloc(part);
+}
+
 /**
  * 将内存中bitmap第bit_idx位所在的512字节(扇区)同步到硬盘
  * @param part 分区
@@ -107,7 +128,7 @@ void bitmap_sync(struct partition* part, uint32_t bit_idx, uint8_t btmp_type) {
             break;
         default:break;
     }
-    ide_write(part->my_disk, sec_lba, bitmap_off, 1);
+    bcache_write(part->my_disk, sec_lba, bitmap_off, 1);
 }
 
 /**
@@ -130,20 +151,15 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
         printk("in file_create: allocate inode failed!\n");
         return -1;
     }
-    // inode要从堆内存中申请,不可生成局部变量(函数退出时会释放)
-    // 因为file_table数组中的文件描述符的inode指针要指向它
-    struct task_struct* cur = running_thread();
-    // 备份当前进程的页表地址,inode所需的空间必须由内核内存池来分配
-    uint32_t* page_backup = cur->pgdir;
-    cur->pgdir = NULL;
-    struct inode* new_file_node = (struct inode*)sys_malloc(sizeof(struct inode));
-    cur->pgdir = page_backup;
+    // inode不可生成局部变量(函数退出时会释放),因为file_table数组中的文件描述符的inode指针要指向它
+    struct inode* new_file_node = inode_alloc();
     if (new_file_node == NULL) {
-        printk("file_create: sys_malloc for inode failded\n");
+        printk("file_create: alloc inode failded\n");
         rollback_step = 1;
         goto rollback;
     }
     inode_init(inode_no, new_file_node); // 初始化inode
+    inode_set_extents(new_file_node);    // 普通文件只在末尾追加,用extent映射
     // 返回的是file_table数组的下标
     int fd_idx = get_free_slot_in_global();
     if (fd_idx == -1) {
@@ -167,6 +183,8 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
         rollback_step = 3;
         goto rollback;
     }
+    // 父目录中原先不存在此文件的缓存项已失效
+    dcache_invalidate(cur_part, parent_dir->inode->i_no, filename);
     // 2. 将父目录inode的内容同步到硬盘
     memset(io_buf, 0, 1024);
     inode_sync(cur_part, parent_dir->inode, io_buf);
@@ -175,9 +193,8 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
     inode_sync(cur_part, new_file_node, io_buf);
     // 4.将inode_bitmap位同步到硬盘
     bitmap_sync(cur_part, inode_no, INODE_BITMAP);
-    // 5.将创建的文件inode添加到open_inodes链表,便于后续使用
-    list_push(&cur_part->open_inodes, &new_file_node->inode_tag);
-    new_file_node->i_open_cnts = 1;
+    // 5.将创建的文件inode加入inode缓存,便于后续使用
+    inode_cache_add(cur_part, new_file_node);
 
     sys_free(io_buf);
     // 将文件结构表下标安装到pcb的文件描述符表中,并返回安装的位置
@@ -187,7 +204,7 @@ rollback:
         case 3:
             memset(&file_table[fd_idx], 0, sizeof(struct file));
         case 2:
-            sys_free(new_file_node);
+            inode_free(new_file_node);
         case 1:
             // 如果新文件的inode创建失败,之前位图分配的inode_no也要恢复
             bitmap_set(&cur_part->inode_bitmap, inode_no, 0);
@@ -244,9 +261,10 @@ int32_t file_close(struct file* file) {
  * @return 成功则返回写入的字节数,失败返回-1
  */
 int32_t file_write(struct file* file, const void* buf, uint32_t count) {
-    if ((file->fd_inode->i_size + count) > BLOCK_SIZE*140) {
-        // 文件目前最大只支持512*140=71680字节
-        printk("exceed max file_size 71680 bytes, write file failed!\n");
+    struct inode* inode = file->fd_inode;
+    if (count > (uint32_t) BLOCK_SIZE * INODE_MAX_BLOCKS - inode->i_size) {
+        // 12个直接块 + 一级、二级、三级间接块,约1GB
+        printk("exceed max file_size %d bytes, write file failed!\n", BLOCK_SIZE * INODE_MAX_BLOCKS);
         return -1;
     }
     uint8_t* io_buf = sys_malloc(BLOCK_SIZE);
@@ -254,171 +272,51 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
         printk("file_write: sys_malloc for io_buf failed!\n");
         return -1;
     }
-    // 用来记录文件所有块的位置
-    uint32_t* all_blocks = sys_malloc(BLOCK_SIZE + 48);
-    if (all_blocks == NULL) {
-        printk("file_write: sys_malloc for all_blocks failed!\n");
-        return -1;
-    }
     const uint8_t* src = buf; // src指向buf中待写入的数据
     uint32_t bytes_written = 0; // 记录已写入的数据大小
     uint32_t size_left = count; // 记录未写入的数据大小
-    int32_t block_lba = -1; // 块地址
-    uint32_t block_bitmap_idx = 0; // 记录block对应于块位图中的索引
     uint32_t sec_idx; // 用来索引扇区
-    uint32_t sec_lba; // 扇区地址
+    int32_t sec_lba; // 扇区地址
     uint32_t sec_off_bytes; // 扇区内字节偏移量
     uint32_t sec_left_bytes; // 扇区内剩余字节量
-    int32_t chunk_size; // 每次写入硬盘的数据块大小
-    int32_t indirect_block_table; // 用来获取一级间接块表地址
-    uint32_t block_idx; // 块索引
-    if (file->fd_inode->i_sectors[0] == 0) {
-        // 文件是第一次写则先为其分配一个块
-        block_lba = block_bitmap_alloc(cur_part);
-        if (block_lba == -1) {
-            printk("file_write: block_bitmap_alloc failed\n");
-            return -1;
-        }
-        file->fd_inode->i_sectors[0] = block_lba;
-
-        // 每分配一个块就将位图同步到硬盘
-        block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-        ASSERT(block_bitmap_idx != 0);
-        bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-    }
-    // 写入count个字节前,该文件已经占用的块数
-    uint32_t file_has_used_blocks = file->fd_inode->i_size / BLOCK_SIZE + 1;
-    // 存储count字节后该文件将占用的块数
-    uint32_t file_will_use_blocks = (file->fd_inode->i_size + count) / BLOCK_SIZE + 1;
-    ASSERT(file_will_use_blocks <= 140);
-    // 通过此增量判断是否需要分配扇区,如增量为0,表示原扇区够用
-    uint32_t add_blocks = file_will_use_blocks - file_has_used_blocks;
-    if (add_blocks == 0) {
-        // 在同一扇区内写数据,不涉及到分配新扇区
-        if (file_has_used_blocks <= 12) {
-            block_idx = file_has_used_blocks - 1;
-            all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
-        } else {
-            // 未写入数据之前已经占用了间接块,需要将间接块地址读出来
-            ASSERT(file->fd_inode->i_sectors[12] != 0);
-            indirect_block_table = file->fd_inode->i_sectors[12];
-            ide_read(cur_part->my_disk, indirect_block_table, all_blocks + 12, 1);
-        }
-    } else {
-        // 若有增量,涉及到分配新扇区以及是否分配一级间接块表,分三种情况
-        if (file_will_use_blocks <= 12) {
-            // 第一种情况: 12个直接块够用
-            // 先将有剩余空间的可继续用的扇区地址写入all_blocks
-            block_idx = file_has_used_blocks - 1;
-            ASSERT(file->fd_inode->i_sectors[block_idx] != 0);
-            all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
-            // 再将后续要用的扇区分配好后写入all_blocks
-            block_idx = file_has_used_blocks; // 指向第一个要分配的新扇区
-            while (block_idx < file_will_use_blocks) {
-                block_lba = block_bitmap_alloc(cur_part);
-                if (block_lba == -1) {
-                    printk("file_write: block_bitmap_alloc for situation 1 failed\n");
-                    return -1;
-                }
-                // 写文件时,不应该存在块未使用但已经分配扇区的情况,当文件删除时,就会把块地址清0
-                ASSERT(file->fd_inode->i_sectors[block_idx] == 0);
-                file->fd_inode->i_sectors[block_idx] = all_blocks[block_idx] = block_lba;
-                // 每分配一个块就将位图同步到硬盘
-                block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-                bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-                block_idx++; // 下一个分配的新扇区
-            }
-        } else if (file_has_used_blocks <= 12 && file_will_use_blocks > 12) {
-            // 第二种情况: 旧数据在12个直接块内, 新数据将使用间接块
-            // 先将有剩余空间的可继续用的扇区地址收集到all_blocks
-            block_idx = file_has_used_blocks - 1;
-            all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
-
-            // 创建一级间接块表
-            block_lba = block_bitmap_alloc(cur_part);
-            if (block_lba == -1) {
-                printk("file_write: block_bitmap_alloc for situation 2 failed\n");
-                return -1;
-            }
-            ASSERT(file->fd_inode->i_sectors[12] == 0);  // 确保一级间接块表未分配
-            indirect_block_table = file->fd_inode->i_sectors[12] = block_lba;
-            // 第一个未使用的块
-            block_idx = file_has_used_blocks;
-            while (block_idx < file_will_use_blocks) {
-                block_lba = block_bitmap_alloc(cur_part);
-                if (block_lba == -1) {
-                    printk("file_write: block_bitmap_alloc for situation 2 failed\n");
-                    return -1;
-                }
-                if (block_idx < 12) {
-                    ASSERT(file->fd_inode->i_sectors[block_idx] == 0); // 确保尚未分配扇区地址
-                    file->fd_inode->i_sectors[block_idx] = all_blocks[block_idx] = block_lba;
-                } else {
-                    // 间接块只写入到all_block数组中,待全部分配完成后一次性同步到硬盘
-                    all_blocks[block_idx] = block_lba;
-                }
-                // 每分配一个块就将位图同步到硬盘
-                block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-                bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-                block_idx++; // 下一个新扇区
-            }
-            // 同步一级间接块表到硬盘
-            ide_write(cur_part->my_disk, indirect_block_table, all_blocks + 12, 1);
-        } else if (file_has_used_blocks > 12) {
-            // 第三种情况: 新数据占用间接块
-            ASSERT(file->fd_inode->i_sectors[12] != 0);
-            // 获取一级间接块地址
-            indirect_block_table = file->fd_inode->i_sectors[12];
-            // 已经使用的间接块也将被读入all_blocks
-            ide_read(cur_part->my_disk, indirect_block_table, all_blocks + 12, 1);
-            // 第一个未使用的间接块
-            block_idx = file_has_used_blocks;
-            while (block_idx < file_will_use_blocks) {
-                block_lba = block_bitmap_alloc(cur_part);
-                if (block_lba == -1) {
-                    printk("file_write: block_bitmap_alloc for situation 3 failed\n");
-                    return -1;
-                }
-                all_blocks[block_idx++] = block_lba;
-                // 每分配一个块就将位图同步到硬盘
-                block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-                bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-            }
-            // 将间接块表同步到硬盘
-            ide_write(cur_part->my_disk, indirect_block_table, all_blocks + 12, 1);
-        }
-    }
-    bool first_write_block = true; // 含有剩余空间的扇区标识
+    uint32_t chunk_size; // 每次写入硬盘的数据块大小
     // 置fd_pos为文件大小-1,下面在写数据时随时更新
-    file->fd_pos = file->fd_inode->i_size - 1;
+    file->fd_pos = inode->i_size - 1;
     while (bytes_written < count) {
-        memset(io_buf, 0, BLOCK_SIZE);
-        sec_idx = file->fd_inode->i_size / BLOCK_SIZE;
-        sec_lba = all_blocks[sec_idx];
-        sec_off_bytes = file->fd_inode->i_size % BLOCK_SIZE;
+        sec_idx = inode->i_size / BLOCK_SIZE;
+        sec_off_bytes = inode->i_size % BLOCK_SIZE;
         sec_left_bytes = BLOCK_SIZE - sec_off_bytes;
-
         // 判断此次写入硬盘的数据大小
         chunk_size = size_left < sec_left_bytes ? size_left : sec_left_bytes;
-        if (first_write_block) {
-            ide_read(cur_part->my_disk, sec_lba, io_buf, 1);
-            first_write_block = false;
+
+        // 由块映射找到扇区,块尚未分配则分配新块(沿途的间接块表一并分配)
+        sec_lba = inode_block_lba(cur_part, inode, sec_idx);
+        if (sec_lba == 0) {
+            sec_lba = inode_block_alloc(cur_part, inode, sec_idx);
+            if (sec_lba == -1) {
+                printk("file_write: block_bitmap_alloc failed\n");
+                break;
+            }
+            memset(io_buf, 0, BLOCK_SIZE);
+        } else if (sec_off_bytes != 0) {
+            // 含有剩余空间的扇区,先读出已有数据
+            bcache_read(cur_part->my_disk, sec_lba, io_buf, 1);
+        } else {
+            memset(io_buf, 0, BLOCK_SIZE);
         }
         memcpy(io_buf + sec_off_bytes, src, chunk_size);
-        ide_write(cur_part->my_disk, sec_lba, io_buf, 1);
-        printk("file write at lba 0x%x\n", sec_lba);    //调试,完成后去掉
+        bcache_write(cur_part->my_disk, sec_lba, io_buf, 1);
 
         src += chunk_size;  // 将指针推移到下个新数据
-        file->fd_inode->i_size += chunk_size;
+        inode->i_size += chunk_size;
         file->fd_pos += chunk_size;
         bytes_written += chunk_size;
         size_left -= chunk_size;
     }
     // 同步inode信息到硬盘, 回收写文件时分配的空间
-    inode_sync(cur_part, file->fd_inode, io_buf);
-    sys_free(all_blocks);
+    inode_sync(cur_part, inode, io_buf);
     sys_free(io_buf);
-    return bytes_written;
+    return (bytes_written == 0 && count != 0) ? -1 : (int32_t) bytes_written;
 }
 
 /**
@@ -440,80 +338,41 @@ int32_t file_read(struct file* file, void* buf, uint32_t count) {
     uint8_t* io_buf = sys_malloc(BLOCK_SIZE);
     if (io_buf == NULL) {
         printk("file_read: sys_malloc for io_buf failed!\n");
-    }
-    uint32_t* all_blocks = (uint32_t*)sys_malloc(BLOCK_SIZE + 48);
-    if (all_blocks == NULL) {
-        printk("file_read: sys_malloc for all_blocks failed!\n");
         return -1;
     }
-    // 起始数据块所在的地址
-    uint32_t block_read_start_idx = file->fd_pos / BLOCK_SIZE;
-    // 结束数据块所在的地址
-    uint32_t block_read_end_idx = (file->fd_pos + size) / BLOCK_SIZE;
-    // 增量为0,表示在一个扇区
-    uint32_t add_blocks =  block_read_end_idx - block_read_start_idx;
-    ASSERT(block_read_start_idx < 139 && block_read_end_idx < 139);
-    int32_t indirect_block_table; // 用来获取一级间接块地址
-    uint32_t block_idx; // 获取待读的块地址
-
-    if (add_blocks == 0) { // 在同一数据块内读数据,不涉及到跨数据块(扇区)读取
-        ASSERT(block_read_end_idx == block_read_start_idx);
-        if (block_read_end_idx < 12) {
-            block_idx = block_read_end_idx;
-            all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
-        } else {
-            // 如果是间接块,需要把间接块表中的数据块信息读取出来
-            indirect_block_table = file->fd_inode->i_sectors[12];
-            ide_read(cur_part->my_disk, indirect_block_table, all_blocks + 12, 1);
-        }
-    } else { // 若要读取多个块
-        if (block_read_end_idx < 12) {
-            // 第一种情况: 起始块和终止块属于直接块
-            block_idx = block_read_start_idx;
-            while (block_idx <= block_read_end_idx) {
-                all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
-                block_idx++;
-            }
-        } else if (block_read_start_idx < 12 && block_read_end_idx >= 12) {
-            // 第二种情况: 数据需要跨直接块和间接块两类
-            block_idx = block_read_start_idx;
-            // 先读取全部的直接块
-            while  (block_idx < 12) {
-                all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
-                block_idx++;
-            }
-            ASSERT(file->fd_inode->i_sectors[12] != 0);
-            // 再将间接块地址写入all_blocks
-            indirect_block_table = file->fd_inode->i_sectors[12];
-            ide_read(cur_part->my_disk, indirect_block_table, all_blocks + 12, 1);
-        } else {
-            // 第三种情况: 数据在间接块中
-            ASSERT(file->fd_inode->i_sectors[12] != 0);
-            indirect_block_table = file->fd_inode->i_sectors[12];
-            ide_read(cur_part->my_disk, indirect_block_table, all_blocks + 12, 1);
-        }
-    }
-    // 用到的数据块地址已经收集到all_blocks中,开始读数据
-    uint32_t sec_idx, sec_lba, sec_off_bytes, sec_left_bytes;
+    // 经块映射找到扇区,间接块表由inode缓存,顺序读时不必反复读盘
+    uint32_t sec_idx, sec_lba, sec_off_bytes, sec_left_bytes, run;
     uint32_t bytes_read = 0, chunk_size;
     while (bytes_read < size) {
         sec_idx = file->fd_pos / BLOCK_SIZE;
-        sec_lba = all_blocks[sec_idx];
         sec_off_bytes = file->fd_pos % BLOCK_SIZE;
         sec_left_bytes = BLOCK_SIZE - sec_off_bytes;
         chunk_size = size_left < sec_left_bytes ? size_left : sec_left_bytes;
 
-        memset(io_buf, 0, BLOCK_SIZE);
-        ide_read(cur_part->my_disk, sec_lba, io_buf, 1);
-        memcpy(buf_dst, io_buf + sec_off_bytes, chunk_size);
+        if (sec_off_bytes == 0 && size_left >= BLOCK_SIZE) {
+            // 整块读取: 硬盘上连续存放的若干块一次直接读入目标缓冲区
+            sec_lba = inode_block_map(cur_part, file->fd_inode, sec_idx, size_left / BLOCK_SIZE, &run);
+            chunk_size = run * BLOCK_SIZE;
+            if (sec_lba == 0) {
+                memset(buf_dst, 0, chunk_size); // 未分配的块按全0处理
+            } else {
+                bcache_read(cur_part->my_disk, sec_lba, buf_dst, run);
+            }
+        } else {
+            sec_lba = inode_block_lba(cur_part, file->fd_inode, sec_idx);
+            if (sec_lba == 0) {
+                memset(buf_dst, 0, chunk_size);
+            } else {
+                bcache_read(cur_part->my_disk, sec_lba, io_buf, 1);
+                memcpy(buf_dst, io_buf + sec_off_bytes, chunk_size);
+            }
+        }
 
         buf_dst += chunk_size;
         file->fd_pos += chunk_size;
         bytes_read += chunk_size;
         size_left -= chunk_size;
     }
-    sys_free(all_blocks);
     sys_free(io_buf);
     return bytes_read;
 }
-
@@ -7,14 +7,19 @@
 #include "../lib/kernel/list.h"
 #include "../lib/string.h"
 #include "../device/ide.h"
+#include "../device/bcache.h"
+#include "dcache.h"
 #include "../kernel/global.h"
 #include "../kernel/debug.h"
 #include "../kernel/memory.h"
+#include "../kernel/slab.h"
 #include "file.h"
 #include "../device/console.h"
 #include "../device/ioqueue.h"
 #include "../device/keyboard.h"
 #include "../shell/pipe.h"
+#include "../device/timer.h"
+#include "../thread/thread.h"
 
 struct partition* cur_part;   // 默认情况下操作的分区
 
@@ -32,7 +37,7 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
 
         memset(sb_buf, 0, SECTOR_SIZE);
         // 读入超级块
-        ide_read(hd, cur_part->start_lba + 1,  sb_buf, 1);
+        bcache_read(hd, cur_part->start_lba + 1,  sb_buf, 1);
         // 把sb_buf中超级块的信息复制到分区的超级块sb中
         memcpy(cur_part->sb, sb_buf, sizeof(struct super_block));
 
@@ -43,7 +48,13 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
         }
         cur_part->block_bitmap.btmp_bytes_len = sb_buf->block_bitmap_sects * SECTOR_SIZE;
         // 从硬盘读入块位图到分区的block_bitmap.bits
-        ide_read(hd, sb_buf->block_bitmap_lba, cur_part->block_bitmap.bits, sb_buf->block_bitmap_sects);
+        bcache_read(hd, sb_buf->block_bitmap_lba, cur_part->block_bitmap.bits, sb_buf->block_bitmap_sects);
+        // 块位图较大,建立摘要位图以便分配时跳过已满的区域
+        uint32_t* summary = sys_malloc(BITMAP_SUMMARY_BYTES(cur_part->block_bitmap.btmp_bytes_len));
+        if (summary == NULL) {
+            PANIC("alloc memory failed!");
+        }
+        bitmap_summary_init(&cur_part->block_bitmap, summary);
 
         /** 将硬盘上的inode位图读入到内存 */
         cur_part->inode_bitmap.bits = (uint8_t*)sys_malloc(sb_buf->inode_bitmap_sects * SECTOR_SIZE);
@@ -52,9 +63,8 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
         }
         cur_part->inode_bitmap.btmp_bytes_len = sb_buf->inode_bitmap_sects * SECTOR_SIZE;
         // 从硬盘读入inode位图到分区的inode_bitmap.bits
-        ide_read(hd, sb_buf->inode_bitmap_lba, cur_part->inode_bitmap.bits, sb_buf->inode_bitmap_sects);
+        bcache_read(hd, sb_buf->inode_bitmap_lba, cur_part->inode_bitmap.bits, sb_buf->inode_bitmap_sects);
 
-        list_init(&cur_part->open_inodes);
         printk("mount %s done!\n", part->name);
         // 只有返回true是list_traversal才会停止遍历,减少后续无意义的遍历
         return true;
@@ -69,7 +79,7 @@ static void partition_format(struct partition* part) {
     // inode位图占用的扇区数,最多支持4096个文件
     uint32_t inode_bitmap_sects = DIV_ROUND_UP(MAX_FILES_PER_PART, BITS_PER_SECTOR);
     // inode表需要占用的扇区数
-    uint32_t inode_table_sects = DIV_ROUND_UP(((sizeof(struct inode) * MAX_FILES_PER_PART)), SECTOR_SIZE);
+    uint32_t inode_table_sects = DIV_ROUND_UP(((INODE_DISK_SIZE * MAX_FILES_PER_PART)), SECTOR_SIZE);
     // 已使用的扇区数
     uint32_t used_sects = boot_sector_sects + super_block_sects + inode_bitmap_sects + inode_table_sects;
     uint32_t free_sects = part->sec_cnt - used_sects; // 空闲的扇区数
@@ -84,7 +94,7 @@ static void partition_format(struct partition* part) {
 
     /** 超级块初始化 */
     struct super_block sb;
-    sb.magic = 0x19590318;
+    sb.magic = SUPER_BLOCK_MAGIC;
     sb.sec_cnt = part->sec_cnt;
     sb.inode_cnt = MAX_FILES_PER_PART;
     sb.part_lba_base = part->start_lba;
@@ -116,7 +126,7 @@ static void partition_format(struct partition* part) {
     /*************************************
      * 1.将超级块写入本分区的1扇区(跨过引导扇区)*
      *************************************/
-    ide_write(hd, part->start_lba + 1, &sb, 1);
+    bcache_write(hd, part->start_lba + 1, &sb, 1);
     printk("   super_block_lba:0x%x\n", part->start_lba + 1);
 
     // 找出数据量最大的元信息,用其尺寸做存储缓冲区
@@ -142,7 +152,7 @@ static void partition_format(struct partition* part) {
     while (bit_idx <= block_bitmap_last_bit) {
         buf[block_bitmap_last_byte] &= ~(1 << bit_idx++);
     }
-    ide_write(hd, sb.block_bitmap_lba, buf, sb.block_bitmap_sects);
+    bcache_write(hd, sb.block_bitmap_lba, buf, sb.block_bitmap_sects);
 
     /**********************************************
      * 3.将inode位图块初始化并写入sb.inode_bitmap_lba *
@@ -151,7 +161,7 @@ static void partition_format(struct partition* part) {
     memset(buf, 0, buf_size);
     buf[0] |= 0x01; // 第0个inode分给了根目录
     // inode_table中4096个inode,位图inode_bitmap刚好占用一个扇区
-    ide_write(hd, sb.inode_bitmap_sects, buf, sb.inode_bitmap_sects);
+    bcache_write(hd, sb.inode_bitmap_sects, buf, sb.inode_bitmap_sects);
 
     /********************************************
      * 4.将inode数组初始化并写入sb.inode_table_lba *
@@ -161,7 +171,7 @@ static void partition_format(struct partition* part) {
     i->i_size = sb.dir_entry_size * 2; // .和..
     i->i_no = 0; // 根目录占inode数组中第0个node
     i->i_sectors[0] = sb.data_start_lba;
-    ide_write(hd, sb.inode_table_lba, buf, sb.inode_table_sects);
+    bcache_write(hd, sb.inode_table_lba, buf, sb.inode_table_sects);
 
     /***************************************
      * 5.将根目录初始化并写入sb.data_start_lba *
@@ -181,7 +191,7 @@ static void partition_format(struct partition* part) {
     p_de->f_type = FT_DIRECTORY;
 
     // 往根目录所在的数据块里面写入根目录的目录项
-    ide_write(hd, sb.data_start_lba, buf, 1);
+    bcache_write(hd, sb.data_start_lba, buf, 1);
     printk("   root_dir_lba:0x%x\n", sb.data_start_lba);
     printk("%s format done\n", part->name);
     sys_free(buf);
@@ -387,10 +397,7 @@ int32_t sys_close(int32_t fd) {
         uint32_t global_fd = fd_local2global(fd);
         if (is_pipe(fd)) {
             // 如果此管道上的描述符都被关闭,释放管道的环形缓冲区
-            if (--file_table[global_fd].fd_pos == 0) {
-                mfree_page(PF_KERNEL, file_table[global_fd].fd_inode, 1);
-                file_table[global_fd].fd_inode = NULL;
-            }
+            pipe_release(global_fd);
             ret = 0;
         } else {
             ret = file_close(&file_table[global_fd]);
@@ -507,6 +514,8 @@ int32_t sys_unlink(const char* pathname) {
 
    struct dir* parent_dir = searched_record.parent_dir;
    delete_dir_entry(cur_part, parent_dir, inode_no, io_buf);
+   dcache_invalidate(cur_part, parent_dir->inode->i_no,
+                     strrchr(searched_record.searched_path, '/') + 1);
    inode_release(cur_part, inode_no);
    sys_free(io_buf);
    dir_close(searched_record.parent_dir);
@@ -584,7 +593,7 @@ int32_t sys_mkdir(const char* pathname) {
    memcpy(p_de->filename, "..", 2);
    p_de->i_no = parent_dir->inode->i_no;
    p_de->f_type = FT_DIRECTORY;
-   ide_write(cur_part->my_disk, new_dir_inode.i_sectors[0], io_buf, 1);
+   bcache_write(cur_part->my_disk, new_dir_inode.i_sectors[0], io_buf, 1);
 
    new_dir_inode.i_size = 2 * cur_part->sb->dir_entry_size;
 
@@ -599,6 +608,8 @@ int32_t sys_mkdir(const char* pathname) {
       goto rollback;
    }
 
+   dcache_invalidate(cur_part, parent_dir->inode->i_no, dirname);
+
    /* 父目录的inode同步到硬盘 */
    memset(io_buf, 0, SECTOR_SIZE * 2);
    inode_sync(cur_part, parent_dir->inode, io_buf);
@@ -698,6 +709,10 @@ int32_t sys_rmdir(const char* pathname) {
 	    if (!dir_remove(searched_record.parent_dir, dir)) {
 	       retval = 0;
 	    }
+	    // 目录项已删除,其下的缓存项也随inode编号一起作废
+	    dcache_invalidate(cur_part, searched_record.parent_dir->inode->i_no,
+	                      strrchr(searched_record.searched_path, '/') + 1);
+	    dcache_purge_dir(cur_part, inode_no);
 	 }
 	 dir_close(dir);
       }
@@ -713,7 +728,7 @@ static uint32_t get_parent_dir_inode_nr(uint32_t child_inode_nr, void* io_buf) {
     uint32_t block_lba = child_dir_inode->i_sectors[0];
     ASSERT(block_lba >= cur_part->sb->data_start_lba);
     inode_close(child_dir_inode);
-    ide_read(cur_part->my_disk, block_lba, io_buf, 1);
+    bcache_read(cur_part->my_disk, block_lba, io_buf, 1);
     struct dir_entry* dir_e = (struct dir_entry*)io_buf;
     // 第0个目录项是".",第1个目录项是".."
     ASSERT(dir_e[1].i_no < 4096 && dir_e[1].f_type == FT_DIRECTORY);
@@ -732,31 +747,21 @@ static uint32_t get_parent_dir_inode_nr(uint32_t child_inode_nr, void* io_buf) {
 static int get_child_dir_name(uint32_t p_inode_no, uint32_t c_inode_no,
                               char* path, void* io_buf) {
     struct inode* parent_dir_inode = inode_open(cur_part, p_inode_no);
-    // 填充all_blocks,将该目录所占扇区地址全部写入all_blocks
-    uint8_t block_idx = 0;
-    uint32_t all_blocks[140] = {0}, block_cnt = 12;
-    while (block_idx < 12) {
-        all_blocks[block_idx] = parent_dir_inode->i_sectors[block_idx];
-        block_idx++;
-    }
-    if (parent_dir_inode->i_sectors[12] != 0) {
-        ide_read(cur_part->my_disk, parent_dir_inode->i_sectors[12], all_blocks + 12, 1);
-        block_cnt = 140;
-    }
-    inode_close(parent_dir_inode);
-
     struct dir_entry* dir_e = (struct dir_entry*)io_buf;
     uint32_t dir_entry_size = cur_part->sb->dir_entry_size;
     uint32_t dir_entry_per_sec = 512 / dir_entry_size;
-    block_idx = 0;
-    while (block_idx < block_cnt) {
-        if (all_blocks[block_idx]) {
-            ide_read(cur_part->my_disk, all_blocks[block_idx], io_buf, 1);
+    uint32_t block_idx = 0, block_lba;
+    while (block_idx < DIR_MAX_BLOCKS) {
+        block_lba = inode_block_lba(cur_part, parent_dir_inode, block_idx);
+        if (block_lba) {
+            bcache_read(cur_part->my_disk, block_lba, io_buf, 1);
             uint8_t dir_e_idx = 0;
             while (dir_e_idx < dir_entry_per_sec) {
-                if ((dir_e + dir_e_idx)->i_no == c_inode_no) {
+                if ((dir_e + dir_e_idx)->f_type == FT_DIRECTORY &&
+                    (dir_e + dir_e_idx)->i_no == c_inode_no) {
                     strcat(path, "/");
                     strcat(path, (dir_e + dir_e_idx)->filename);
+                    inode_close(parent_dir_inode);
                     return 0;
                 }
                 dir_e_idx++;
@@ -764,6 +769,7 @@ static int get_child_dir_name(uint32_t p_inode_no, uint32_t c_inode_no,
         }
         block_idx++;
     }
+    inode_close(parent_dir_inode);
     return -1;
 }
 
@@ -873,6 +879,8 @@ void sys_help(void) {
        rm: remove a regular file\n\
        pwd: show current work directory\n\
        ps: show process information\n\
+       cachestat: show kernel cache statistics\n\
+       bench: run a benchmark, list them without argument\n\
        touch: create a new file\n\
        echo: write some bytes to the file or create a new file\n\
        clear: clear screen\n\
@@ -881,6 +889,25 @@ void sys_help(void) {
        ctrl+u: clear input\n\n");
 }
 
+/** 显示内核缓存统计信息 */
+void sys_cachestat(void) {
+    kmem_cache_stat_print();
+    malloc_stat_print();
+    dcache_stat_print();
+    inode_cache_stat_print();
+    bcache_stat_print();
+    ide_stat_print();
+}
+
+/** 回写线程,定期先将脏inode写入块缓存,再将脏缓冲区写回硬盘 */
+static void fs_flush_thread(void* arg UNUSED) {
+    while (1) {
+        mtime_sleep(FS_FLUSH_INTERVAL);
+        inode_cache_sync();
+        bcache_sync();
+    }
+}
+
 /** 在磁盘上搜索文件系统,若没有则格式化分区创建文件系统 */
 void filesys_init() {
     uint8_t channel_no = 0, dev_no, part_idx = 0;
@@ -890,6 +917,9 @@ void filesys_init() {
     if (sb_buf == NULL) {
         PANIC("alloc memory failed!");
     }
+    inode_cache_init();
+    dcache_init();
+    dir_init();
     printk("searching filesystem......\n");
     while (channel_no < channel_cnt) {
         dev_no = 0;
@@ -908,9 +938,9 @@ void filesys_init() {
                 if (part->sec_cnt != 0) {
                     memset(sb_buf, 0, SECTOR_SIZE);
                     // 读出分区的超级块,根据魔数是否正确来判断是否存在文件系统
-                    ide_read(hd, part->start_lba + 1, sb_buf, 1);
+                    bcache_read(hd, part->start_lba + 1, sb_buf, 1);
                     // 只支持自己的文件系统 其它的不能识别 直接格式化成自己的
-                    if (sb_buf->magic == 0x19590318) {
+                    if (sb_buf->magic == SUPER_BLOCK_MAGIC) {
                         printk("%s has filesystem\n", part->name);
                         printk("root: 0x%x\n", sb_buf->data_start_lba);
                     } else {
@@ -938,5 +968,6 @@ void filesys_init() {
     while (fd_idx < MAX_FILE_OPEN) {
         file_table[fd_idx++].fd_inode = NULL;
     }
+    thread_start("fsflush", 10, fs_flush_thread, NULL);
 }
 
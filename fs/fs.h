@@ -7,6 +7,7 @@
 #define BITS_PER_SECTOR 4096    // 每扇区的位数
 #define SECTOR_SIZE 512         // 扇区字节大小
 #define BLOCK_SIZE SECTOR_SIZE  // 块字节大小
+#define FS_FLUSH_INTERVAL 1000  // 回写线程两次回写间隔的毫秒数
 
 #define MAX_PATH_LEN 512        // 路径最大长度
 
@@ -14,7 +15,8 @@
 enum file_types {
     FT_UNKNOWN,	  // 不支持的文件类型
     FT_REGULAR,	  // 普通文件
-    FT_DIRECTORY  // 目录
+    FT_DIRECTORY, // 目录
+    FT_DIRINDEX   // 目录索引(隐藏目录项,不计入目录大小)
 };
 
 /** 打开文件的选项 */
@@ -68,4 +70,5 @@ int32_t sys_stat(const char* path, struct stat* buf);
 void sys_putchar(char char_asci);
 uint32_t fd_local2global(uint32_t local_fd);
 void sys_help(void);
+void sys_cachestat(void);
 #endif
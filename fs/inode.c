@@ -4,12 +4,24 @@
 #include "../kernel/global.h"
 #include "../kernel/debug.h"
 #include "../kernel/memory.h"
+#include "../kernel/slab.h"
 #include "../kernel/interrupt.h"
 #include "../lib/kernel/list.h"
 #include "../lib/kernel/stdio-kernel.h"
 #include "../lib/string.h"
 #include "super_block.h"
 #include "../device/ide.h"
+#include "../device/bcache.h"
+#include "../thread/sync.h"
+#include "../thread/thread.h"
+
+static struct list inode_hash[INODE_HASH_SIZE]; // 按(分区, inode编号)散列的已缓存inode
+static struct list inode_lru;  // 无人打开的inode,队首为最近关闭的
+static uint32_t lru_cnt;       // inode_lru中的inode数
+static struct lock icache_lock; // 保护以上结构
+static struct inode_cache_stat icache_stat;
+static struct kmem_cache* inode_slab;  // 内存中inode的对象cache
+static struct kmem_cache* ind_slab;    // 间接块表缓存的对象cache
 
 /** 用来存储inode位置 */
 struct inode_position {
@@ -30,7 +42,7 @@ static void inode_locate(struct partition* part, uint32_t inode_no,
     ASSERT(inode_no < 4096);
     uint32_t inode_table_lba = part->sb->inode_table_lba;
 
-    uint32_t inode_size = sizeof(struct inode);
+    uint32_t inode_size = INODE_DISK_SIZE;
     // 第inode_no号inode相对于inode_table_lba的字节偏移量
     uint32_t off_size = inode_no * inode_size;
     // 第inode_no号inode相对于inode_table_lba的扇区偏移量
@@ -49,14 +61,38 @@ static void inode_locate(struct partition* part, uint32_t inode_no,
     inode_pos->off_size = off_size_in_sec;
 }
 
+/** 计算(part, inode_no)所在的哈希桶 */
+static struct list* bucket_of(struct partition* part, uint32_t inode_no) {
+    return &inode_hash[((uint32_t) part / sizeof(struct partition) + inode_no) % INODE_HASH_SIZE];
+}
+
+/** 构造inode对象,未附带间接块表缓存 */
+static void inode_ctor(void* obj) {
+    ((struct inode*) obj)->i_ind_cache = NULL;
+}
+
+/** 从inode对象cache分配inode,位于内核空间,被所有任务共享 */
+struct inode* inode_alloc(void) {
+    return kmem_cache_alloc(inode_slab);
+}
+
+/** 释放inode及其间接块表缓存 */
+void inode_free(struct inode* inode) {
+    if (inode->i_ind_cache != NULL) {
+        kmem_cache_free(ind_slab, inode->i_ind_cache);
+        inode->i_ind_cache = NULL;
+    }
+    kmem_cache_free(inode_slab, inode);
+}
+
 /**
  * 将inode写入到分区part
  * @param part   分区
  * @param inode  要操作的inode
  * @param io_buf 用于硬盘io的缓冲区
  */
-void inode_sync(struct partition* part, struct inode* inode, void* io_buf) {
-    uint8_t inode_no = inode->i_no;
+static void inode_write(struct partition* part, struct inode* inode, void* io_buf) {
+    uint32_t inode_no = inode->i_no;
     struct inode_position inode_pos;
     inode_locate(part, inode_no, &inode_pos);
     ASSERT(inode_pos.sec_lba <= part->start_lba + part->sec_cnt);
@@ -64,7 +100,7 @@ void inode_sync(struct partition* part, struct inode* inode, void* io_buf) {
     // 硬盘中的inode成员inode_tag和i_open_cnts是不需要的
     // 它们只在内存中记录链表位置和被多少进程共享
     struct inode pure_inode;
-    memcpy(&pure_inode, inode, sizeof(struct inode));
+    memcpy(&pure_inode, inode, INODE_DISK_SIZE);
 
     // 以下inode的三个成员只存在于内存中,现将inode同步到硬盘,清掉这三项
     pure_inode.i_open_cnts = 0;
@@ -76,18 +112,73 @@ void inode_sync(struct partition* part, struct inode* inode, void* io_buf) {
     // 读出来和再和新的内容合并成一扇区后再写入
     if (inode_pos.two_sec) { // 若是跨越了两个扇区,就要读出两个扇区再写入两个扇区
         // inode在format中写入硬盘时是连续写入的,所以读入2块扇区
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
+        bcache_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
         // 开始将待写入的inode拼入这2个扇区中的相应位置
-        memcpy(inode_buf + inode_pos.off_size, &pure_inode, sizeof(struct inode));
+        memcpy(inode_buf + inode_pos.off_size, &pure_inode, INODE_DISK_SIZE);
         // 将拼接好的数据写入硬盘
-        ide_write(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
+        bcache_write(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
     } else { // 若只是1个扇区
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
-        memcpy(inode_buf + inode_pos.off_size, &pure_inode, sizeof(struct inode));
-        ide_write(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+        bcache_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+        memcpy(inode_buf + inode_pos.off_size, &pure_inode, INODE_DISK_SIZE);
+        bcache_write(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+    }
+}
+
+/**
+ * 同步inode,已在inode缓存中的inode只置脏,由inode_cache_sync或淘汰时统一写回,
+ * 尚未加入缓存的新inode直接写入
+ * @param part   分区
+ * @param inode  要操作的inode
+ * @param io_buf 用于硬盘io的缓冲区
+ */
+void inode_sync(struct partition* part, struct inode* inode, void* io_buf) {
+    if (inode->i_cached) {
+        inode->i_dirty = true;
+        return;
+    }
+    inode_write(part, inode, io_buf);
+}
+
+/** 将inode从缓存中移除并释放,调用者需持有icache_lock */
+static void inode_drop(struct inode* inode) {
+    list_remove(&inode->inode_tag);
+    inode->i_cached = false;
+    inode_free(inode);
+}
+
+/** 淘汰lru队尾的inode直至数量不超过INODE_LRU_MAX,调用者需持有icache_lock */
+static void inode_lru_shrink(void) {
+    void* io_buf = NULL;
+    while (lru_cnt > INODE_LRU_MAX) {
+        struct inode* victim = elem2entry(struct inode, lru_tag, inode_lru.tail.prev);
+        list_remove(&victim->lru_tag);
+        lru_cnt--;
+        if (victim->i_dirty) {
+            if (io_buf == NULL) {
+                io_buf = sys_malloc(1024);
+            }
+            inode_write(victim->i_part, victim, io_buf);
+            icache_stat.writebacks++;
+        }
+        inode_drop(victim);
+        icache_stat.evictions++;
+    }
+    if (io_buf != NULL) {
+        sys_free(io_buf);
     }
 }
 
+/** 将新建的inode加入缓存,打开数置为1 */
+void inode_cache_add(struct partition* part, struct inode* inode) {
+    lock_acquire(&icache_lock);
+    inode->i_part = part;
+    inode->i_cached = true;
+    inode->i_dirty = false;
+    inode->i_open_cnts = 1;
+    list_push(bucket_of(part, inode->i_no), &inode->inode_tag);
+    lock_release(&icache_lock);
+}
+
 /***
  * 根据inode号返回相应的inode
  * @param part  分区
@@ -95,64 +186,120 @@ void inode_sync(struct partition* part, struct inode* inode, void* io_buf) {
  * @return 编号对应的inode
  */
 struct inode* inode_open(struct partition* part, uint32_t inode_no) {
-    // 先在已打开的inode链表中查找inode,此链表是为提速创建的缓冲区
-    struct list_elem* elem = part->open_inodes.head.next;
+    lock_acquire(&icache_lock);
+    // 先在inode缓存中查找,无人打开的inode仍留在缓存中,再次打开无需读盘
+    struct list* bucket = bucket_of(part, inode_no);
+    struct list_elem* elem = bucket->head.next;
     struct inode* inode_found;
-    while (elem != &part->open_inodes.tail) {
+    while (elem != &bucket->tail) {
         inode_found = elem2entry(struct inode, inode_tag, elem);
-        if (inode_found->i_no == inode_no) {
-            inode_found->i_open_cnts++;
+        if (inode_found->i_part == part && inode_found->i_no == inode_no) {
+            if (inode_found->i_open_cnts++ == 0) {
+                list_remove(&inode_found->lru_tag);
+                lru_cnt--;
+            }
+            icache_stat.hits++;
+            lock_release(&icache_lock);
             return inode_found;
         }
         elem = elem->next;
     }
-    // 由于open_inodes链表中找不到,下面从硬盘读入此inode并加入到链表
+    icache_stat.misses++;
+    // 由于缓存中找不到,下面从硬盘读入此inode并加入到缓存
     struct inode_position inode_pos;
     // inode信息会存入inode_pos
     inode_locate(part, inode_no, &inode_pos);
-    // 为使通过sys_malloc创建的新inode被所有任务共享,需要将inode置于
-    // 内核空间,故需要临时将cur_pbc->pgdir置为空
-    struct task_struct* cur = running_thread();
-    uint32_t* cur_pagedir_bak = cur->pgdir;
-    cur->pgdir = NULL;
-    // 此时inode分配的内存位于内核区
-    inode_found = (struct inode*)sys_malloc(sizeof(struct inode));
-    // 恢复pgdir
-    cur->pgdir = cur_pagedir_bak;
+    // 为使新inode被所有任务共享,需要将inode置于内核空间
+    inode_found = inode_alloc();
     char* inode_buf;
     if (inode_pos.two_sec) { // 考虑跨扇区的情况
         inode_buf = (char*)sys_malloc(1024);
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
+        bcache_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
     } else {
         inode_buf = (char*)sys_malloc(512);
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+        bcache_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
     }
-    memcpy(inode_found, inode_buf + inode_pos.off_size, sizeof(struct inode));
-    // 将构造好的inode放入分区的open_inodes链表,方便后续查找
-    list_push(&part->open_inodes, &inode_found->inode_tag);
-    inode_found->i_open_cnts = 1;
-
+    memcpy(inode_found, inode_buf + inode_pos.off_size, INODE_DISK_SIZE);
     sys_free(inode_buf);
+    // 将构造好的inode放入缓存,方便后续查找
+    inode_found->i_part = part;
+    inode_found->i_cached = true;
+    inode_found->i_dirty = false;
+    inode_found->i_ind_cache = NULL;
+    inode_found->i_open_cnts = 1;
+    list_push(bucket, &inode_found->inode_tag);
+    lock_release(&icache_lock);
     return inode_found;
 }
 
 /**
- * 关闭inode或减少inode的打开数
+ * 关闭inode或减少inode的打开数,无人打开的inode进入lru队列留在缓存中
  * @param inode 操作的目标inode
  */
 void inode_close(struct inode* inode) {
-    // 若没有进程再打开此文件,将此inode去掉并释放空间
-    enum intr_status old_status = intr_disable();
+    lock_acquire(&icache_lock);
     if (--inode->i_open_cnts == 0) {
-        list_remove(&inode->inode_tag);
-        // 确保释放内存时也是从内核内存池中释放
-        struct task_struct* cur = running_thread();
-        uint32_t* cur_pagedir_bak = cur->pgdir;
-        cur->pgdir = NULL;
-        sys_free(inode);
-        cur->pgdir = cur_pagedir_bak;
+        if (inode->i_cached) {
+            list_push(&inode_lru, &inode->lru_tag);
+            lru_cnt++;
+            inode_lru_shrink();
+        } else {
+            inode_free(inode);
+        }
+    }
+    lock_release(&icache_lock);
+}
+
+/** 将缓存中所有脏inode写回 */
+void inode_cache_sync(void) {
+    lock_acquire(&icache_lock);
+    void* io_buf = NULL;
+    uint32_t bucket_idx = 0;
+    while (bucket_idx < INODE_HASH_SIZE) {
+        struct list_elem* elem = inode_hash[bucket_idx].head.next;
+        while (elem != &inode_hash[bucket_idx].tail) {
+            struct inode* inode = elem2entry(struct inode, inode_tag, elem);
+            if (inode->i_dirty) {
+                if (io_buf == NULL) {
+                    io_buf = sys_malloc(1024);
+                }
+                inode->i_dirty = false;
+                inode_write(inode->i_part, inode, io_buf);
+                icache_stat.writebacks++;
+            }
+            elem = elem->next;
+        }
+        bucket_idx++;
+    }
+    if (io_buf != NULL) {
+        sys_free(io_buf);
+    }
+    lock_release(&icache_lock);
+}
+
+/** 打印inode缓存统计信息 */
+void inode_cache_stat_print(void) {
+    printk("icache: unused %d  hits %d  misses %d  evictions %d  writebacks %d\n",
+           lru_cnt, icache_stat.hits, icache_stat.misses,
+           icache_stat.evictions, icache_stat.writebacks);
+    printk("indirect: hits %d  misses %d\n", icache_stat.ind_hits, icache_stat.ind_misses);
+}
+
+/** inode缓存初始化 */
+void inode_cache_init(void) {
+    uint32_t bucket_idx = 0;
+    while (bucket_idx < INODE_HASH_SIZE) {
+        list_init(&inode_hash[bucket_idx++]);
+    }
+    list_init(&inode_lru);
+    lru_cnt = 0;
+    lock_init(&icache_lock);
+    memset(&icache_stat, 0, sizeof(struct inode_cache_stat));
+    inode_slab = kmem_cache_create("inode", sizeof(struct inode), 0, inode_ctor);
+    ind_slab = kmem_cache_create("inode_ind", sizeof(struct inode_ind_cache), 0, NULL);
+    if (inode_slab == NULL || ind_slab == NULL) {
+        PANIC("inode_cache_init: create slab cache failed!");
     }
-    intr_set_status(old_status);
 }
 
 /** 将硬盘分区part上的inode清空 */
@@ -165,50 +312,642 @@ void inode_delete(struct partition* part, uint32_t inode_no, void* io_buf) {
     char* inode_buf = (char*)io_buf;
     if (inode_pos.two_sec) { // inode跨扇区,读入两个扇区
         // 将原硬盘上的内容先读出来
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
+        bcache_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
         // 将inode_buf清0
-        memset(inode_buf + inode_pos.off_size, 0, sizeof(struct inode));
+        memset(inode_buf + inode_pos.off_size, 0, INODE_DISK_SIZE);
         // 用清0的数据覆盖磁盘
-        ide_write(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
+        bcache_write(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
     } else { // 未跨扇区,只读入一个扇区
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
-        memset(inode_buf + inode_pos.off_size, 0, sizeof(struct inode));
-        ide_write(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+        bcache_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+        memset(inode_buf + inode_pos.off_size, 0, INODE_DISK_SIZE);
+        bcache_write(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+    }
+}
+
+/** 分配间接块表缓存,失败时返回NULL,此时退化为每次读盘 */
+static struct inode_ind_cache* ind_cache_of(struct inode* inode) {
+    if (inode->i_ind_cache == NULL) {
+        struct inode_ind_cache* cache = kmem_cache_alloc(ind_slab);
+        if (cache == NULL) {
+            return NULL;
+        }
+        memset(cache, 0, sizeof(struct inode_ind_cache));
+        inode->i_ind_cache = cache;
+    }
+    return inode->i_ind_cache;
+}
+
+/**
+ * 从间接块表(或extent叶子块)table_lba的第idx个字起读取cnt个字到out
+ * @param level 该表与数据块相隔的层数,0表示表项直接指向数据块
+ */
+static void ind_words_get(struct partition* part, struct inode* inode, uint32_t table_lba,
+                          uint32_t level, uint32_t idx, uint32_t cnt, uint32_t* out) {
+    struct inode_ind_cache* cache = ind_cache_of(inode);
+    uint32_t gen = 0;
+    enum intr_status old_status = intr_disable();
+    if (cache != NULL) {
+        if (cache->lba[level] == table_lba) {
+            memcpy(out, &cache->blocks[level][idx], cnt * 4);
+            icache_stat.ind_hits++;
+            intr_set_status(old_status);
+            return;
+        }
+        gen = cache->gen;
+    }
+    icache_stat.ind_misses++;
+    intr_set_status(old_status);
+
+    // 整张表放在堆上:内核栈与pcb共用一页,本函数还会在缺页处理读程序文件时嵌套调用
+    uint32_t* table = cache != NULL ? sys_malloc(SECTOR_SIZE) : NULL;
+    if (table == NULL) {
+        // 没有缓存可填或内存不足时只读出需要的字
+        bcache_read_part(part->my_disk, table_lba, idx * 4, out, cnt * 4);
+        return;
+    }
+    bcache_read(part->my_disk, table_lba, table, 1);
+    old_status = intr_disable();
+    // 读盘期间若有人修改过间接块表,读到的内容可能已旧,不放入缓存
+    if (cache->gen == gen) {
+        memcpy(cache->blocks[level], table, SECTOR_SIZE);
+        cache->lba[level] = table_lba;
+    }
+    intr_set_status(old_status);
+    memcpy(out, &table[idx], cnt * 4);
+    sys_free(table);
+}
+
+/** 读取间接块表table_lba的第idx项 */
+static uint32_t ind_entry_get(struct partition* part, struct inode* inode,
+                              uint32_t table_lba, uint32_t level, uint32_t idx) {
+    uint32_t entry;
+    ind_words_get(part, inode, table_lba, level, idx, 1, &entry);
+    return entry;
+}
+
+/**
+ * 把values中的cnt个字写入间接块表(或extent叶子块)table_lba的第idx个字起并写回
+ * @return 修改后该表是否已全部为空
+ */
+static bool ind_words_set(struct partition* part, struct inode* inode, uint32_t table_lba,
+                          uint32_t level, uint32_t idx, const uint32_t* values, uint32_t cnt) {
+    // 直接改写缓存中的扇区,不在栈上放整张表
+    bcache_write_part(part->my_disk, table_lba, idx * 4, values, cnt * 4);
+    struct inode_ind_cache* cache = inode->i_ind_cache;
+    if (cache != NULL) {
+        enum intr_status old_status = intr_disable();
+        cache->gen++;
+        if (cache->lba[level] == table_lba) {
+            memcpy(&cache->blocks[level][idx], values, cnt * 4);
+        }
+        intr_set_status(old_status);
+    }
+    // 分段读出检查是否全空
+    uint32_t words[16];
+    uint32_t offset = 0;
+    while (offset < SECTOR_SIZE) {
+        bcache_read_part(part->my_disk, table_lba, offset, words, sizeof(words));
+        idx = 0;
+        while (idx < sizeof(words) / 4) {
+            if (words[idx++] != 0) {
+                return false;
+            }
+        }
+        offset += sizeof(words);
+    }
+    return true;
+}
+
+/** 把间接块表table_lba的第idx项改为value并写回,返回该表是否已全部为空 */
+static bool ind_entry_set(struct partition* part, struct inode* inode,
+                          uint32_t table_lba, uint32_t level, uint32_t idx, uint32_t value) {
+    return ind_words_set(part, inode, table_lba, level, idx, &value, 1);
+}
+
+/** 分配一个块并同步块位图,失败返回-1 */
+static int32_t data_block_alloc(struct partition* part) {
+    int32_t block_lba = block_bitmap_alloc(part);
+    if (block_lba == -1) {
+        return -1;
+    }
+    bitmap_sync(part, block_lba - part->sb->data_start_lba, BLOCK_BITMAP);
+    return block_lba;
+}
+
+/** 回收块block_lba并同步块位图 */
+static void data_block_free(struct partition* part, uint32_t block_lba) {
+    uint32_t block_bitmap_idx = block_lba - part->sb->data_start_lba;
+    ASSERT(block_bitmap_idx > 0);
+    bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
+    bitmap_sync(part, block_bitmap_idx, BLOCK_BITMAP);
+}
+
+/** 分配一张清零的间接块表,失败返回-1 */
+static int32_t ind_table_alloc(struct partition* part) {
+    // sys_malloc返回的内存已清零
+    uint32_t* table = sys_malloc(SECTOR_SIZE);
+    if (table == NULL) {
+        return -1;
+    }
+    int32_t table_lba = data_block_alloc(part);
+    if (table_lba != -1) {
+        bcache_write(part->my_disk, table_lba, table, 1);
+    }
+    sys_free(table);
+    return table_lba;
+}
+
+/** 回收间接块表table_lba,并使缓存中对应的项失效 */
+static void ind_table_free(struct partition* part, struct inode* inode, uint32_t table_lba) {
+    struct inode_ind_cache* cache = inode->i_ind_cache;
+    if (cache != NULL) {
+        enum intr_status old_status = intr_disable();
+        cache->gen++;
+        uint32_t level = 0;
+        while (level < INODE_IND_LEVELS) {
+            if (cache->lba[level] == table_lba) {
+                cache->lba[level] = 0;
+            }
+            level++;
+        }
+        intr_set_status(old_status);
+    }
+    data_block_free(part, table_lba);
+}
+
+/**
+ * 把块序号block_idx换算为i_sectors中的起点和沿途各级间接块表内的下标
+ * @param slot 存放i_sectors中的下标
+ * @param offsets 依次存放各级间接块表内的下标
+ * @return 间接层数,0表示直接块
+ */
+static uint32_t block_path(uint32_t block_idx, uint32_t* slot, uint32_t* offsets) {
+    if (block_idx < INODE_DIRECT_BLOCKS) {
+        *slot = block_idx;
+        return 0;
+    }
+    block_idx -= INODE_DIRECT_BLOCKS;
+    if (block_idx < INODE_PTRS_PER_BLOCK) {
+        *slot = 12;
+        offsets[0] = block_idx;
+        return 1;
+    }
+    block_idx -= INODE_PTRS_PER_BLOCK;
+    if (block_idx < INODE_PTRS_PER_BLOCK * INODE_PTRS_PER_BLOCK) {
+        *slot = 13;
+        offsets[0] = block_idx / INODE_PTRS_PER_BLOCK;
+        offsets[1] = block_idx % INODE_PTRS_PER_BLOCK;
+        return 2;
+    }
+    block_idx -= INODE_PTRS_PER_BLOCK * INODE_PTRS_PER_BLOCK;
+    *slot = 14;
+    offsets[0] = block_idx / (INODE_PTRS_PER_BLOCK * INODE_PTRS_PER_BLOCK);
+    offsets[1] = block_idx / INODE_PTRS_PER_BLOCK % INODE_PTRS_PER_BLOCK;
+    offsets[2] = block_idx % INODE_PTRS_PER_BLOCK;
+    return 3;
+}
+
+/** 回收从block_lba起连续的cnt个块,位图的每个扇区只同步一次 */
+static void block_range_free(struct partition* part, uint32_t block_lba, uint32_t cnt) {
+    uint32_t bit_idx = block_lba - part->sb->data_start_lba;
+    uint32_t bit_end = bit_idx + cnt;
+    ASSERT(bit_idx > 0);
+    while (bit_idx < bit_end) {
+        bitmap_set(&part->block_bitmap, bit_idx, 0);
+        bit_idx++;
+        // 跨过位图的一个扇区(4096位)或到达末尾时同步
+        if (bit_idx % 4096 == 0 || bit_idx == bit_end) {
+            bitmap_sync(part, bit_idx - 1, BLOCK_BITMAP);
+        }
+    }
+}
+
+/** 设置inode按extent映射数据块,只应用于尚无数据块的inode */
+void inode_set_extents(struct inode* inode) {
+    memset(inode->i_sectors, 0, sizeof(inode->i_sectors));
+    struct extent_header* root = (struct extent_header*) inode->i_sectors;
+    root->eh_max = EXT_INLINE_MAX;
+    inode->i_flags |= INODE_FL_EXTENTS;
+}
+
+/** 读取extent叶子块leaf_lba的第pos项,pos为-1时读取节点头 */
+static void ext_leaf_get(struct partition* part, struct inode* inode, uint32_t leaf_lba,
+                         int32_t pos, void* out) {
+    if (pos == -1) {
+        ind_words_get(part, inode, leaf_lba, 0, 0, sizeof(struct extent_header) / 4, out);
+    } else {
+        ind_words_get(part, inode, leaf_lba, 0, (sizeof(struct extent_header) + pos * sizeof(struct extent)) / 4,
+                      sizeof(struct extent) / 4, out);
+    }
+}
+
+/** 写入extent叶子块leaf_lba的第pos项,pos为-1时写入节点头 */
+static void ext_leaf_set(struct partition* part, struct inode* inode, uint32_t leaf_lba,
+                         int32_t pos, const void* in) {
+    if (pos == -1) {
+        ind_words_set(part, inode, leaf_lba, 0, 0, in, sizeof(struct extent_header) / 4);
+    } else {
+        ind_words_set(part, inode, leaf_lba, 0, (sizeof(struct extent_header) + pos * sizeof(struct extent)) / 4,
+                      in, sizeof(struct extent) / 4);
+    }
+}
+
+/** 在按ee_block升序排列的cnt项中二分查找最后一个ee_block <= block_idx的项,都不满足时返回-1 */
+static int32_t ext_search_inline(struct extent* ents, uint32_t cnt, uint32_t block_idx) {
+    int32_t low = 0, high = cnt - 1, found = -1;
+    while (low <= high) {
+        int32_t mid = (low + high) / 2;
+        if (ents[mid].ee_block <= block_idx) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return found;
+}
+
+/**
+ * 在extent树中查找第block_idx块
+ * @param run 找到时存放该extent内自block_idx起的连续块数
+ * @return 扇区地址,该块未映射时返回0
+ */
+static uint32_t ext_lookup(struct partition* part, struct inode* inode, uint32_t block_idx, uint32_t* run) {
+    struct extent_header* root = (struct extent_header*) inode->i_sectors;
+    struct extent* ents = (struct extent*) (root + 1);
+    struct extent ext;
+    int32_t pos = ext_search_inline(ents, root->eh_entries, block_idx);
+    if (pos == -1) {
+        return 0;
+    }
+    if (root->eh_depth == 0) {
+        ext = ents[pos];
+    } else {
+        // 在叶子块中二分查找,叶子块经间接块表缓存读取
+        uint32_t leaf_lba = ents[pos].ee_start;
+        struct extent_header hdr;
+        ext_leaf_get(part, inode, leaf_lba, -1, &hdr);
+        int32_t low = 0, high = hdr.eh_entries - 1, found = -1;
+        while (low <= high) {
+            int32_t mid = (low + high) / 2;
+            ext_leaf_get(part, inode, leaf_lba, mid, &ext);
+            if (ext.ee_block <= block_idx) {
+                found = mid;
+                low = mid + 1;
+            } else {
+                high = mid - 1;
+            }
+        }
+        if (found == -1) {
+            return 0;
+        }
+        ext_leaf_get(part, inode, leaf_lba, found, &ext);
+    }
+    if (block_idx >= ext.ee_block + ext.ee_len) {
+        return 0;
+    }
+    *run = ext.ee_block + ext.ee_len - block_idx;
+    return ext.ee_start + block_idx - ext.ee_block;
+}
+
+/**
+ * 取得最后一个extent
+ * @param leaf_lba 存放其所在叶子块的扇区地址,位于i_sectors中时为0
+ * @return 在所在节点中的下标,尚无extent时返回-1
+ */
+static int32_t ext_last(struct partition* part, struct inode* inode, struct extent* ext, uint32_t* leaf_lba) {
+    struct extent_header* root = (struct extent_header*) inode->i_sectors;
+    struct extent* ents = (struct extent*) (root + 1);
+    *leaf_lba = 0;
+    if (root->eh_entries == 0) {
+        return -1;
+    }
+    if (root->eh_depth == 0) {
+        *ext = ents[root->eh_entries - 1];
+        return root->eh_entries - 1;
+    }
+    struct extent_header hdr;
+    *leaf_lba = ents[root->eh_entries - 1].ee_start;
+    ext_leaf_get(part, inode, *leaf_lba, -1, &hdr);
+    ASSERT(hdr.eh_entries > 0);
+    ext_leaf_get(part, inode, *leaf_lba, hdr.eh_entries - 1, ext);
+    return hdr.eh_entries - 1;
+}
+
+/** 分配一个叶子块,写入节点头和第一个extent,失败返回-1 */
+static int32_t ext_leaf_alloc(struct partition* part, struct inode* inode, struct extent* first) {
+    int32_t leaf_lba = ind_table_alloc(part);
+    if (leaf_lba == -1) {
+        return -1;
+    }
+    struct extent_header hdr = {1, EXT_LEAF_MAX, 0, 0};
+    ext_leaf_set(part, inode, leaf_lba, 0, first);
+    ext_leaf_set(part, inode, leaf_lba, -1, &hdr);
+    return leaf_lba;
+}
+
+/** 在extent树末尾追加一个extent,树满时返回-1 */
+static int32_t ext_append(struct partition* part, struct inode* inode, struct extent* ext) {
+    struct extent_header* root = (struct extent_header*) inode->i_sectors;
+    struct extent* ents = (struct extent*) (root + 1);
+    if (root->eh_depth == 0) {
+        if (root->eh_entries < EXT_INLINE_MAX) {
+            ents[root->eh_entries++] = *ext;
+            return 0;
+        }
+        // 内联的extent已满,将其移入新叶子块,根改为一项索引
+        int32_t leaf_lba = ext_leaf_alloc(part, inode, &ents[0]);
+        if (leaf_lba == -1) {
+            return -1;
+        }
+        uint32_t pos = 1;
+        while (pos < EXT_INLINE_MAX) {
+            ext_leaf_set(part, inode, leaf_lba, pos, &ents[pos]);
+            pos++;
+        }
+        struct extent_header hdr = {EXT_INLINE_MAX, EXT_LEAF_MAX, 0, 0};
+        ext_leaf_set(part, inode, leaf_lba, -1, &hdr);
+        ents[0].ee_start = leaf_lba;
+        ents[0].ee_len = 0;
+        memset(&ents[1], 0, sizeof(struct extent) * (EXT_INLINE_MAX - 1));
+        root->eh_entries = 1;
+        root->eh_depth = 1;
+    }
+    // 追加到最后一个叶子块,叶子块已满则新建叶子
+    uint32_t leaf_lba = ents[root->eh_entries - 1].ee_start;
+    struct extent_header hdr;
+    ext_leaf_get(part, inode, leaf_lba, -1, &hdr);
+    if (hdr.eh_entries < EXT_LEAF_MAX) {
+        ext_leaf_set(part, inode, leaf_lba, hdr.eh_entries, ext);
+        hdr.eh_entries++;
+        ext_leaf_set(part, inode, leaf_lba, -1, &hdr);
+        return 0;
+    }
+    if (root->eh_entries == EXT_INLINE_MAX) {
+        printk("extent tree of inode %d is full\n", inode->i_no);
+        return -1;
+    }
+    int32_t new_leaf = ext_leaf_alloc(part, inode, ext);
+    if (new_leaf == -1) {
+        return -1;
+    }
+    ents[root->eh_entries].ee_block = ext->ee_block;
+    ents[root->eh_entries].ee_start = new_leaf;
+    ents[root->eh_entries].ee_len = 0;
+    root->eh_entries++;
+    return 0;
+}
+
+/**
+ * 为extent映射的inode分配第block_idx块.文件只在末尾追加块,
+ * 优先分配紧接最后一个extent的扇区,成功时只需把该extent加长
+ */
+static int32_t ext_alloc(struct partition* part, struct inode* inode, uint32_t block_idx) {
+    struct extent last;
+    uint32_t leaf_lba, goal = 0;
+    int32_t pos = ext_last(part, inode, &last, &leaf_lba);
+    if (pos != -1) {
+        ASSERT(block_idx >= last.ee_block + last.ee_len);
+        if (block_idx == last.ee_block + last.ee_len) {
+            goal = last.ee_start + last.ee_len;
+        }
+    }
+    int32_t block_lba = block_bitmap_alloc_near(part, goal);
+    if (block_lba == -1) {
+        return -1;
+    }
+    bitmap_sync(part, block_lba - part->sb->data_start_lba, BLOCK_BITMAP);
+    if (goal != 0 && (uint32_t) block_lba == goal) {
+        last.ee_len++;
+        if (leaf_lba == 0) {
+            ((struct extent*) ((struct extent_header*) inode->i_sectors + 1))[pos] = last;
+        } else {
+            ext_leaf_set(part, inode, leaf_lba, pos, &last);
+        }
+        return block_lba;
+    }
+    struct extent ext = {block_idx, block_lba, 1};
+    if (ext_append(part, inode, &ext) == -1) {
+        block_range_free(part, block_lba, 1);
+        return -1;
     }
+    return block_lba;
+}
+
+/** 回收extent树中的所有数据块和叶子块 */
+static void ext_release(struct partition* part, struct inode* inode) {
+    struct extent_header* root = (struct extent_header*) inode->i_sectors;
+    struct extent* ents = (struct extent*) (root + 1);
+    uint32_t idx = 0;
+    if (root->eh_depth == 0) {
+        while (idx < root->eh_entries) {
+            block_range_free(part, ents[idx].ee_start, ents[idx].ee_len);
+            idx++;
+        }
+        return;
+    }
+    uint8_t* leaf = (uint8_t*)sys_malloc(SECTOR_SIZE);
+    if (leaf == NULL) {
+        printk("inode_release: sys_malloc for extent leaf failed, blocks leaked\n");
+        return;
+    }
+    struct extent_header* hdr = (struct extent_header*) leaf;
+    struct extent* leaf_ents = (struct extent*) (hdr + 1);
+    while (idx < root->eh_entries) {
+        bcache_read(part->my_disk, ents[idx].ee_start, leaf, 1);
+        uint32_t pos = 0;
+        while (pos < hdr->eh_entries) {
+            block_range_free(part, leaf_ents[pos].ee_start, leaf_ents[pos].ee_len);
+            pos++;
+        }
+        ind_table_free(part, inode, ents[idx].ee_start);
+        idx++;
+    }
+    sys_free(leaf);
+}
+
+/**
+ * 获取inode第block_idx个数据块的扇区地址
+ * @param part 分区
+ * @param inode inode
+ * @param block_idx 块在文件内的序号
+ * @return 扇区地址,该块尚未分配时返回0
+ */
+uint32_t inode_block_lba(struct partition* part, struct inode* inode, uint32_t block_idx) {
+    ASSERT(block_idx < INODE_MAX_BLOCKS);
+    if (inode->i_flags & INODE_FL_EXTENTS) {
+        uint32_t run;
+        return ext_lookup(part, inode, block_idx, &run);
+    }
+    uint32_t slot, offsets[INODE_IND_LEVELS];
+    uint32_t depth = block_path(block_idx, &slot, offsets);
+    uint32_t lba = inode->i_sectors[slot];
+    uint32_t level = 0;
+    while (level < depth && lba != 0) {
+        lba = ind_entry_get(part, inode, lba, depth - 1 - level, offsets[level]);
+        level++;
+    }
+    return lba;
+}
+
+/**
+ * 获取inode第block_idx个数据块的扇区地址,以及自此起在硬盘上连续存放的块数,
+ * 使调用者可以一次读入多个扇区
+ * @param max_cnt 最多关心的块数
+ * @param run 存放连续块数,至少为1
+ * @return 扇区地址,该块尚未分配时返回0
+ */
+uint32_t inode_block_map(struct partition* part, struct inode* inode, uint32_t block_idx,
+                         uint32_t max_cnt, uint32_t* run) {
+    ASSERT(max_cnt > 0);
+    uint32_t block_lba, cnt = 1;
+    if (inode->i_flags & INODE_FL_EXTENTS) {
+        block_lba = ext_lookup(part, inode, block_idx, &cnt);
+    } else {
+        // 逐块比较,间接块表有缓存,代价很小
+        block_lba = inode_block_lba(part, inode, block_idx);
+        while (block_lba != 0 && cnt < max_cnt && block_idx + cnt < INODE_MAX_BLOCKS &&
+               inode_block_lba(part, inode, block_idx + cnt) == block_lba + cnt) {
+            cnt++;
+        }
+    }
+    *run = block_lba == 0 ? 1 : (cnt < max_cnt ? cnt : max_cnt);
+    return block_lba;
+}
+
+/**
+ * 为inode的第block_idx个数据块分配扇区,沿途缺少的间接块表一并分配.
+ * 块位图在此同步到硬盘,inode本身由调用者同步
+ * @param part 分区
+ * @param inode inode
+ * @param block_idx 块在文件内的序号,该块应尚未分配
+ * @return 成功返回新块的扇区地址,失败返回-1
+ */
+int32_t inode_block_alloc(struct partition* part, struct inode* inode, uint32_t block_idx) {
+    ASSERT(block_idx < INODE_MAX_BLOCKS);
+    if (inode->i_flags & INODE_FL_EXTENTS) {
+        return ext_alloc(part, inode, block_idx);
+    }
+    uint32_t slot, offsets[INODE_IND_LEVELS];
+    uint32_t depth = block_path(block_idx, &slot, offsets);
+    int32_t block_lba;
+    if (depth == 0) {
+        ASSERT(inode->i_sectors[slot] == 0);
+        block_lba = data_block_alloc(part);
+        if (block_lba != -1) {
+            inode->i_sectors[slot] = block_lba;
+        }
+        return block_lba;
+    }
+    // 沿途缺少的间接块表已挂入上一级,分配中途失败时也无需回滚,释放inode时一并回收
+    if (inode->i_sectors[slot] == 0) {
+        int32_t table_lba = ind_table_alloc(part);
+        if (table_lba == -1) {
+            return -1;
+        }
+        inode->i_sectors[slot] = table_lba;
+    }
+    uint32_t table_lba = inode->i_sectors[slot];
+    uint32_t level = 0;
+    while (level + 1 < depth) {
+        uint32_t next_lba = ind_entry_get(part, inode, table_lba, depth - 1 - level, offsets[level]);
+        if (next_lba == 0) {
+            int32_t new_table = ind_table_alloc(part);
+            if (new_table == -1) {
+                return -1;
+            }
+            next_lba = new_table;
+            ind_entry_set(part, inode, table_lba, depth - 1 - level, offsets[level], next_lba);
+        }
+        table_lba = next_lba;
+        level++;
+    }
+    ASSERT(ind_entry_get(part, inode, table_lba, 0, offsets[depth - 1]) == 0);
+    block_lba = data_block_alloc(part);
+    if (block_lba == -1) {
+        return -1;
+    }
+    ind_entry_set(part, inode, table_lba, 0, offsets[depth - 1], block_lba);
+    return block_lba;
+}
+
+/**
+ * 回收inode的第block_idx个数据块,因此变空的间接块表逐级回收.
+ * 块位图在此同步到硬盘,inode本身由调用者同步
+ */
+void inode_block_free(struct partition* part, struct inode* inode, uint32_t block_idx) {
+    ASSERT(block_idx < INODE_MAX_BLOCKS);
+    // extent映射的普通文件只追加写,不会单独回收某一块
+    ASSERT(!(inode->i_flags & INODE_FL_EXTENTS));
+    uint32_t slot, offsets[INODE_IND_LEVELS], tables[INODE_IND_LEVELS];
+    uint32_t depth = block_path(block_idx, &slot, offsets);
+    uint32_t lba = inode->i_sectors[slot];
+    uint32_t level = 0;
+    while (level < depth && lba != 0) {
+        tables[level] = lba;
+        lba = ind_entry_get(part, inode, lba, depth - 1 - level, offsets[level]);
+        level++;
+    }
+    if (lba == 0) {
+        return;
+    }
+    data_block_free(part, lba);
+    // 自下而上清除表项,表还有其它块时停止
+    while (level > 0) {
+        level--;
+        if (!ind_entry_set(part, inode, tables[level], depth - 1 - level, offsets[level], 0)) {
+            return;
+        }
+        ind_table_free(part, inode, tables[level]);
+    }
+    inode->i_sectors[slot] = 0;
+}
+
+/** 回收间接块表table_lba及其下所有的块,level为该表与数据块相隔的层数 */
+static void ind_tree_release(struct partition* part, struct inode* inode,
+                             uint32_t table_lba, uint32_t level) {
+    uint32_t* table = (uint32_t*)sys_malloc(SECTOR_SIZE);
+    if (table == NULL) {
+        printk("inode_release: sys_malloc for indirect table failed, blocks leaked\n");
+        return;
+    }
+    bcache_read(part->my_disk, table_lba, table, 1);
+    uint32_t idx = 0;
+    while (idx < INODE_PTRS_PER_BLOCK) {
+        if (table[idx] != 0) {
+            if (level == 0) {
+                data_block_free(part, table[idx]);
+            } else {
+                ind_tree_release(part, inode, table[idx], level - 1);
+            }
+        }
+        idx++;
+    }
+    sys_free(table);
+    ind_table_free(part, inode, table_lba);
 }
 
 /** 回收inode的数据块和inode本身 */
 void inode_release(struct partition* part, uint32_t inode_no) {
     struct inode* inode_to_del = inode_open(part, inode_no);
     ASSERT(inode_to_del->i_no == inode_no);
-    // 1.回收inode占用的所有块
-    uint8_t block_idx = 0, block_cnt = 12;
-    uint32_t block_bitmap_idx;
-    uint32_t all_blocks[140] = {0}; // 12个直接块 + 128个间接块
-    while (block_idx < 12) {
-        all_blocks[block_idx] = inode_to_del->i_sectors[block_idx];
-        block_idx++;
-    }
-    if (inode_to_del->i_sectors[12] != 0) {
-        // 将一级间接块表中的数据块地址全部读取到all_blocks中
-        ide_read(part->my_disk, inode_to_del->i_sectors[12], all_blocks + 12, 1);
-        block_cnt = 140;
-        // 回收一级间接块表占用的空间
-        block_bitmap_idx = inode_to_del->i_sectors[12] - part->sb->data_start_lba;
-        ASSERT(block_bitmap_idx > 0);
-        bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
-        bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-    }
-    // 回收all_blocks中所有收集到的inode的块地址
-    block_idx = 0;
-    while (block_idx < block_cnt) {
-        if (all_blocks[block_idx] != 0) {
-            block_bitmap_idx = all_blocks[block_idx] - part->sb->data_start_lba;
-            ASSERT(block_bitmap_idx > 0);
-            bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
-            bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-        }
-        block_idx++;
+    // 1.回收inode占用的所有块,间接块表逐级递归回收
+    uint32_t slot = 0;
+    if (inode_to_del->i_flags & INODE_FL_EXTENTS) {
+        ext_release(part, inode_to_del);
+        slot = 15;
+    }
+    while (slot < INODE_DIRECT_BLOCKS) {
+        if (inode_to_del->i_sectors[slot] != 0) {
+            data_block_free(part, inode_to_del->i_sectors[slot]);
+        }
+        slot++;
+    }
+    while (slot < 15) {
+        if (inode_to_del->i_sectors[slot] != 0) {
+            ind_tree_release(part, inode_to_del, inode_to_del->i_sectors[slot], slot - INODE_DIRECT_BLOCKS);
+        }
+        slot++;
     }
     // 2.回收该inode所占用的inode
     bitmap_set(&part->inode_bitmap, inode_no, 0);
@@ -218,7 +957,13 @@ void inode_release(struct partition* part, uint32_t inode_no) {
     void* io_buf = sys_malloc(1024);
     inode_delete(part, inode_no, io_buf);
     sys_free(io_buf);
-    inode_close(inode_to_del);
+    // 已删除的inode不能再留在缓存中,否则编号被重新分配后会命中旧的内容
+    lock_acquire(&icache_lock);
+    inode_to_del->i_dirty = false;
+    if (--inode_to_del->i_open_cnts == 0) {
+        inode_drop(inode_to_del);
+    }
+    lock_release(&icache_lock);
 }
 
 /** 初始化new_inode */
@@ -226,10 +971,14 @@ void inode_init(uint32_t inode_no, struct inode* new_inode) {
     new_inode->i_no = inode_no;
     new_inode->i_size = 0;
     new_inode->i_open_cnts = 0;
+    new_inode->i_cached = false;
+    new_inode->i_dirty = false;
+    new_inode->i_flags = 0;
+    new_inode->i_ind_cache = NULL;
     // 初始化索引块数组i_sectors
     uint8_t sec_idx = 0;
-    while (sec_idx < 13) {
-        // i_sectors[12]为一级间接块地址
+    while (sec_idx < 15) {
+        // i_sectors[12-14]为各级间接块表地址
         new_inode->i_sectors[sec_idx] = 0;
         sec_idx++;
     }
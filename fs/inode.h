@@ -13,14 +13,88 @@ struct inode {
 
     uint32_t i_open_cnts; // 记录此文件被打开的次数
     bool write_deny;      // 写文件不能并行,进程写文件时进行此标识
-    // i_sectors[0-11]是直接块,i_sectors[12]用来存储一级间接块指针
-    uint32_t i_sectors[13];
-    struct list_elem inode_tag;
+    uint32_t i_flags;     // inode标志,见INODE_FL_*
+    // i_sectors[0-11]是直接块,i_sectors[12]、[13]、[14]分别指向一级、二级、三级间接块表;
+    // 置INODE_FL_EXTENTS时i_sectors改为存放extent树的根
+    uint32_t i_sectors[15];
+    struct list_elem inode_tag;   // 用于inode缓存哈希桶中的标记
+
+    /** 以上是硬盘上inode的内容,以下成员只存在于内存中 */
+    struct partition* i_part;     // inode所在的分区
+    struct list_elem lru_tag;     // 无人打开时在lru队列中的标记
+    bool i_cached;                // 是否在inode缓存中
+    bool i_dirty;                 // 被修改过尚未写回
+    struct inode_ind_cache* i_ind_cache; // 最近访问的间接块表,首次访问间接块时分配
+};
+
+/** 硬盘上每个inode的字节大小 */
+#define INODE_DISK_SIZE ((uint32_t) offset(struct inode, i_part))
+
+#define INODE_DIRECT_BLOCKS 12   // 直接块数
+#define INODE_PTRS_PER_BLOCK 128 // 每个间接块表容纳的块地址数
+#define INODE_IND_LEVELS 3       // 间接块的最大层数
+/** 单个文件最多占用的块数: 直接块 + 一级 + 二级 + 三级间接块 */
+#define INODE_MAX_BLOCKS (INODE_DIRECT_BLOCKS + INODE_PTRS_PER_BLOCK + \
+                          INODE_PTRS_PER_BLOCK * INODE_PTRS_PER_BLOCK + \
+                          INODE_PTRS_PER_BLOCK * INODE_PTRS_PER_BLOCK * INODE_PTRS_PER_BLOCK)
+
+#define INODE_FL_EXTENTS 0x1 // 数据块按extent映射
+
+/** extent: 文件内从ee_block起的ee_len个块连续存放在从ee_start起的扇区中.
+    在索引节点中ee_start为下一级叶子块的扇区地址,ee_len不用 */
+struct extent {
+    uint32_t ee_block;  // 起始块序号
+    uint32_t ee_start;  // 起始扇区地址
+    uint32_t ee_len;    // 块数
+};
+
+/** extent树节点头,位于i_sectors或叶子块的开头,其后紧跟各项 */
+struct extent_header {
+    uint16_t eh_entries;  // 有效项数
+    uint16_t eh_max;      // 最多容纳的项数
+    uint16_t eh_depth;    // 0表示各项为extent,1表示各项为指向叶子块的索引
+    uint16_t eh_pad;
+};
+
+#define EXT_INLINE_MAX 4   // i_sectors中可容纳的extent或索引数
+#define EXT_LEAF_MAX 42    // 一个叶子块可容纳的extent数
+
+/** 间接块表缓存,第level项缓存最近访问的、与数据块相隔level层的间接块表.
+    顺序读写时同一张表会被连续访问128次,只有第一次需要读盘 */
+struct inode_ind_cache {
+    uint32_t lba[INODE_IND_LEVELS];   // 各项缓存的表所在扇区,0表示无效
+    uint32_t gen;                     // 每次修改间接块表时递增,防止读盘期间缓存被旧内容覆盖
+    uint32_t blocks[INODE_IND_LEVELS][INODE_PTRS_PER_BLOCK];
+};
+
+#define INODE_HASH_SIZE 64   // inode缓存哈希桶个数
+#define INODE_LRU_MAX 64     // 最多缓存的无人打开的inode数
+
+/** inode缓存统计计数 */
+struct inode_cache_stat {
+    uint32_t hits;        // 命中次数
+    uint32_t misses;      // 未命中而读盘的次数
+    uint32_t evictions;   // 从lru淘汰的次数
+    uint32_t writebacks;  // 脏inode写回的次数
+    uint32_t ind_hits;    // 间接块表缓存命中次数
+    uint32_t ind_misses;  // 间接块表缓存未命中次数
 };
+struct inode* inode_alloc(void);
+void inode_free(struct inode* inode);
 struct inode* inode_open(struct partition* part, uint32_t inode_no);
 void inode_sync(struct partition* part, struct inode* inode, void* io_buf);
 void inode_init(uint32_t inode_no, struct inode* new_inode);
 void inode_close(struct inode* inode);
 void inode_release(struct partition* part, uint32_t inode_no);
 void inode_delete(struct partition* part, uint32_t inode_no, void* io_buf);
+uint32_t inode_block_lba(struct partition* part, struct inode* inode, uint32_t block_idx);
+int32_t inode_block_alloc(struct partition* part, struct inode* inode, uint32_t block_idx);
+void inode_block_free(struct partition* part, struct inode* inode, uint32_t block_idx);
+uint32_t inode_block_map(struct partition* part, struct inode* inode, uint32_t block_idx,
+                         uint32_t max_cnt, uint32_t* run);
+void inode_set_extents(struct inode* inode);
+void inode_cache_init(void);
+void inode_cache_add(struct partition* part, struct inode* inode);
+void inode_cache_sync(void);
+void inode_cache_stat_print(void);
 #endif
@@ -2,6 +2,9 @@
 #define __FS_SUPER_BLOCK_H
 #include "../lib/stdint.h"
 
+/** 文件系统魔数,硬盘格式不兼容地变化时更换,使旧分区被重新格式化 */
+#define SUPER_BLOCK_MAGIC 0x1959031a
+
 /** 超级块 */
 struct super_block {
     uint32_t magic;               // 用来标识文件系统的类型
@@ -0,0 +1,536 @@
+#include "bench.h"
+#include "global.h"
+#include "memory.h"
+#include "cpu.h"
+#include "../thread/thread.h"
+#include "../userprog/process.h"
+#include "../device/timer.h"
+#include "../device/clock.h"
+#include "smp.h"
+#include "interrupt.h"
+#include "../lib/string.h"
+#include "../lib/kernel/bitmap.h"
+#include "../lib/kernel/stdio-kernel.h"
+
+/** 基准测试项 */
+struct bench_item {
+    const char* name;
+    const char* desc;
+    void (*run)(void);
+};
+
+/** 读时间戳计数器,基准测试只关心两次读数之差的低32位 */
+static uint32_t rdtsc_low(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return low;
+}
+
+/**
+ * 测试用内核线程的结尾:挂起自己,等启动它的任务用bench_thread_reap回收.
+ * 线程不能用thread_exit回收自己,pcb和内核栈在切换走之前还要使用
+ */
+static void bench_thread_hang(void) {
+    thread_block(TASK_HANGING);
+}
+
+/** 等线程t在bench_thread_hang中挂起后回收它的pcb */
+static void bench_thread_reap(struct task_struct* t) {
+    while (1) {
+        // 关中断后看到挂起状态时,t已在schedule中切换走,不再使用自己的栈
+        enum intr_status old_status = intr_disable();
+        if (t->status == TASK_HANGING) {
+            thread_exit(t, false);
+            intr_set_status(old_status);
+            return;
+        }
+        intr_set_status(old_status);
+        thread_yield();
+    }
+}
+
+/********************  bitmap  ********************/
+
+#define BENCH_BITMAP_PAGES 4  // 测试位图的页数,共131072位
+#define BENCH_BITMAP_ROUNDS 20
+
+/** 改写前的位图扫描:逐字节跳过0xff,再逐位检查连续空闲位,作为对照 */
+static int bitmap_scan_bytewise(struct bitmap* btmp, uint32_t cnt) {
+    uint32_t idx_byte = 0;
+    while (idx_byte < btmp->btmp_bytes_len && 0xff == btmp->bits[idx_byte]) {
+        idx_byte++;
+    }
+    if (idx_byte == btmp->btmp_bytes_len) {
+        return -1;
+    }
+    int idx_bit = 0;
+    while ((uint8_t)(BITMAP_MASK << idx_bit) & btmp->bits[idx_byte]) {
+        idx_bit++;
+    }
+    int bit_idx_start = idx_byte * 8 + idx_bit;
+    if (cnt == 1) {
+        return bit_idx_start;
+    }
+    uint32_t bit_left = (btmp->btmp_bytes_len * 8 - bit_idx_start);
+    uint32_t next_bit = (uint32_t) (bit_idx_start + 1);
+    uint32_t count = 1;
+    bit_idx_start = -1;
+    while (bit_left-- > 0) {
+        if (!bitmap_scan_test(btmp, next_bit)) {
+            count++;
+        } else {
+            count = 0;
+        }
+        if (count == cnt) {
+            bit_idx_start = next_bit - cnt + 1;
+            break;
+        }
+        next_bit++;
+    }
+    return bit_idx_start;
+}
+
+/** 分别用旧实现、不带摘要和带摘要的新实现扫描btmp,打印每次扫描的平均周期数 */
+static void bitmap_bench_case(const char* title, struct bitmap* btmp,
+                              uint32_t* summary, uint32_t cnt) {
+    uint32_t round, start, cycles_old, cycles_word, cycles_summary;
+    int idx_old = -1, idx_new = -1;
+
+    start = rdtsc_low();
+    for (round = 0; round < BENCH_BITMAP_ROUNDS; round++) {
+        idx_old = bitmap_scan_bytewise(btmp, cnt);
+    }
+    cycles_old = (rdtsc_low() - start) / BENCH_BITMAP_ROUNDS;
+
+    btmp->summary = NULL;
+    start = rdtsc_low();
+    for (round = 0; round < BENCH_BITMAP_ROUNDS; round++) {
+        btmp->hint = 0; // 每次都从头找,与旧实现的first-fit对齐
+        idx_new = bitmap_scan(btmp, cnt);
+    }
+    cycles_word = (rdtsc_low() - start) / BENCH_BITMAP_ROUNDS;
+
+    bitmap_summary_init(btmp, summary);
+    start = rdtsc_low();
+    for (round = 0; round < BENCH_BITMAP_ROUNDS; round++) {
+        btmp->hint = 0;
+        idx_new = bitmap_scan(btmp, cnt);
+    }
+    cycles_summary = (rdtsc_low() - start) / BENCH_BITMAP_ROUNDS;
+    btmp->summary = NULL;
+
+    printk("%s cnt=%d: bit %d/%d  bytewise %d  word %d  word+summary %d cycles/scan\n",
+           title, cnt, idx_old, idx_new, cycles_old, cycles_word, cycles_summary);
+}
+
+/** 在大位图上比较新旧位图扫描,稀疏图只在末尾留空,碎片图每字节中间有两个空闲位 */
+static void bench_bitmap(void) {
+    struct bitmap btmp;
+    btmp.btmp_bytes_len = BENCH_BITMAP_PAGES * PG_SIZE;
+    btmp.bits = get_kernel_pages(BENCH_BITMAP_PAGES);
+    btmp.hint = 0;
+    btmp.summary = NULL;
+    uint32_t* summary = get_kernel_pages(1);
+    if (btmp.bits == NULL || summary == NULL) {
+        printk("bench bitmap: alloc memory failed\n");
+        return;
+    }
+    uint32_t total = btmp.btmp_bytes_len * 8;
+
+    // 稀疏:只有最后1/8处有一段16位空闲
+    memset(btmp.bits, 0xff, btmp.btmp_bytes_len);
+    bitmap_set_range(&btmp, total - total / 8, 16, 0);
+    bitmap_bench_case("sparse", &btmp, summary, 1);
+    bitmap_bench_case("sparse", &btmp, summary, 16);
+
+    // 碎片:每个字节只有第3、4位空闲,连续8位的空闲区只在末尾
+    memset(btmp.bits, 0xe7, btmp.btmp_bytes_len);
+    bitmap_set_range(&btmp, total - 64, 8, 0);
+    bitmap_bench_case("fragmented", &btmp, summary, 1);
+    bitmap_bench_case("fragmented", &btmp, summary, 8);
+
+    mfree_page(PF_KERNEL, summary, 1);
+    mfree_page(PF_KERNEL, btmp.bits, BENCH_BITMAP_PAGES);
+}
+
+/********************  string  ********************/
+
+#define BENCH_STRING_BUF 8192 // 源和目的缓冲区各占的字节数,留出错开对齐的余量
+#define BENCH_STRING_ROUNDS 64
+
+/** 改写前的逐字节memcpy,作为对照 */
+static void memcpy_bytewise(void* dst_, const void* src_, uint32_t size) {
+    uint8_t* dst = dst_;
+    const uint8_t* src = src_;
+    while (size-- > 0) {
+        *dst++ = *src++;
+    }
+}
+
+/** 改写前的逐字节memset,作为对照 */
+static void memset_bytewise(void* dst_, uint8_t value, uint32_t size) {
+    uint8_t* dst = dst_;
+    while (size-- > 0) {
+        *dst++ = value;
+    }
+}
+
+/** 每100个周期处理的字节数 */
+static uint32_t bytes_per_100cycles(uint32_t size, uint32_t cycles) {
+    return cycles == 0 ? 0 : size * 100 / cycles;
+}
+
+/** 以size字节、dst偏移misalign测一组memcpy/memset,打印平均周期数和吞吐 */
+static void string_bench_case(uint8_t* dst, uint8_t* src, uint32_t size, uint32_t misalign) {
+    uint32_t round, start, c_cpy_old, c_cpy, c_set_old, c_set;
+    dst += misalign;
+
+    start = rdtsc_low();
+    for (round = 0; round < BENCH_STRING_ROUNDS; round++) {
+        memcpy_bytewise(dst, src, size);
+    }
+    c_cpy_old = (rdtsc_low() - start) / BENCH_STRING_ROUNDS;
+
+    start = rdtsc_low();
+    for (round = 0; round < BENCH_STRING_ROUNDS; round++) {
+        memcpy(dst, src, size);
+    }
+    c_cpy = (rdtsc_low() - start) / BENCH_STRING_ROUNDS;
+
+    start = rdtsc_low();
+    for (round = 0; round < BENCH_STRING_ROUNDS; round++) {
+        memset_bytewise(dst, round, size);
+    }
+    c_set_old = (rdtsc_low() - start) / BENCH_STRING_ROUNDS;
+
+    start = rdtsc_low();
+    for (round = 0; round < BENCH_STRING_ROUNDS; round++) {
+        memset(dst, round, size);
+    }
+    c_set = (rdtsc_low() - start) / BENCH_STRING_ROUNDS;
+
+    printk("%d B +%d: memcpy %d -> %d cycles (%d -> %d B/100cyc)  memset %d -> %d cycles (%d -> %d B/100cyc)\n",
+           size, misalign, c_cpy_old, c_cpy,
+           bytes_per_100cycles(size, c_cpy_old), bytes_per_100cycles(size, c_cpy),
+           c_set_old, c_set,
+           bytes_per_100cycles(size, c_set_old), bytes_per_100cycles(size, c_set));
+}
+
+/** 比较逐字节与rep movs/stos(及SSE2)实现的memcpy和memset在16B、512B、4KB上的吞吐 */
+static void bench_string(void) {
+    uint8_t* buf = get_kernel_pages(BENCH_STRING_BUF * 2 / PG_SIZE);
+    if (buf == NULL) {
+        printk("bench string: alloc memory failed\n");
+        return;
+    }
+    uint8_t* src = buf;
+    uint8_t* dst = buf + BENCH_STRING_BUF;
+    uint32_t idx;
+    for (idx = 0; idx < BENCH_STRING_BUF; idx++) {
+        src[idx] = idx;
+    }
+    printk("sse2 copy: %s\n", string_use_sse2 ? "on" : "off");
+    uint32_t sizes[] = {16, 512, 4096};
+    for (idx = 0; idx < sizeof(sizes) / sizeof(sizes[0]); idx++) {
+        string_bench_case(dst, src, sizes[idx], 0);
+        string_bench_case(dst, src, sizes[idx], 3);
+    }
+    memcpy(dst, src, 4096);
+    if (memcmp(dst, src, 4096) != 0) {
+        printk("bench string: memcpy result mismatch\n");
+    }
+    mfree_page(PF_KERNEL, buf, BENCH_STRING_BUF * 2 / PG_SIZE);
+}
+
+/********************  tlb  ********************/
+
+#define BENCH_TLB_ORDER 8                // 测试区为2^8页即1MB,超出TLB的容量
+#define BENCH_TLB_PAGES (1 << BENCH_TLB_ORDER)
+#define BENCH_TLB_ALIAS 0xff800000       // 页目录第1022项,loader已为其建好页表,用作4KB页的别名映射
+#define BENCH_TLB_ROUNDS 8
+
+/** 每轮先重新加载cr3模拟进程切换,再每页读1个双字,返回每页的平均周期数 */
+static uint32_t tlb_touch_cycles(volatile uint32_t* base) {
+    uint32_t round, idx, cycles = 0;
+    uint32_t sum UNUSED = 0;
+    for (round = 0; round < BENCH_TLB_ROUNDS; round++) {
+        tlb_flush();
+        uint32_t start = rdtsc_low();
+        for (idx = 0; idx < BENCH_TLB_PAGES; idx++) {
+            sum += base[idx * (PG_SIZE / 4)];
+        }
+        cycles += rdtsc_low() - start;
+    }
+    return cycles / (BENCH_TLB_ROUNDS * BENCH_TLB_PAGES);
+}
+
+/** 每轮先重新加载cr3,再把前半区复制到后半区,返回每轮的平均周期数 */
+static uint32_t tlb_copy_cycles(uint8_t* base) {
+    uint32_t round, cycles = 0;
+    for (round = 0; round < BENCH_TLB_ROUNDS; round++) {
+        tlb_flush();
+        uint32_t start = rdtsc_low();
+        memcpy(base + BENCH_TLB_PAGES / 2 * PG_SIZE, base, BENCH_TLB_PAGES / 2 * PG_SIZE);
+        cycles += rdtsc_low() - start;
+    }
+    return cycles / BENCH_TLB_ROUNDS;
+}
+
+/**
+ * 同一段物理内存分别经线性映射区(支持时为4MB全局大页)和4KB非全局页的别名访问,
+ * 比较进程切换后逐页访问和大块复制的开销
+ */
+static void bench_tlb(void) {
+    uint32_t edx = cpuid(1, NULL, NULL, NULL);
+    uint32_t phy = palloc_pages(PF_KERNEL, BENCH_TLB_ORDER);
+    if (phy == 0) {
+        printk("bench tlb: alloc memory failed\n");
+        return;
+    }
+    uint8_t* direct = (uint8_t*) (phy + KERNEL_VADDR_START);
+    uint8_t* alias = (uint8_t*) BENCH_TLB_ALIAS;
+    uint32_t idx;
+    for (idx = 0; idx < BENCH_TLB_PAGES; idx++) {
+        *pte_ptr(BENCH_TLB_ALIAS + idx * PG_SIZE) = (phy + idx * PG_SIZE) | PG_US_S | PG_RW_W | PG_P_1;
+    }
+    tlb_flush();
+    printk("kernel map: %s pages%s\n", (edx & CPUID_PSE) ? "4MB" : "4KB",
+           (edx & (CPUID_PSE | CPUID_PGE)) == (CPUID_PSE | CPUID_PGE) ? ", global" : "");
+    printk("touch %d pages after cr3 reload: 4KB alias %d  kernel map %d cycles/page\n",
+           BENCH_TLB_PAGES, tlb_touch_cycles((uint32_t*) alias), tlb_touch_cycles((uint32_t*) direct));
+    printk("memcpy %d KB after cr3 reload: 4KB alias %d  kernel map %d cycles\n",
+           BENCH_TLB_PAGES / 2 * PG_SIZE / 1024, tlb_copy_cycles(alias), tlb_copy_cycles(direct));
+
+    for (idx = 0; idx < BENCH_TLB_PAGES; idx++) {
+        *pte_ptr(BENCH_TLB_ALIAS + idx * PG_SIZE) = 0;
+    }
+    tlb_flush();
+    pfree_pages(PF_KERNEL, phy, BENCH_TLB_ORDER);
+}
+
+/********************  ctxsw  ********************/
+
+#define BENCH_CTXSW_ROUNDS 2000
+
+static volatile uint32_t ctxsw_left; // 还需往返的次数
+
+/** 与调用者轮流让出cpu,调用者数完后挂起 */
+static void ctxsw_partner(void* arg UNUSED) {
+    while (ctxsw_left > 0) {
+        thread_yield();
+    }
+    bench_thread_hang();
+}
+
+/** 当前任务与一个内核线程互相thread_yield,打印每次切换的平均周期数和cr3加载次数 */
+static void ctxsw_bench_case(bool lazy) {
+    lazy_tlb = lazy;
+    ctxsw_left = BENCH_CTXSW_ROUNDS;
+    struct task_struct* partner = thread_start("ctxsw", default_prio, ctxsw_partner, NULL);
+    uint32_t reloads = cr3_reloads;
+    uint32_t start = rdtsc_low();
+    while (ctxsw_left > 0) {
+        ctxsw_left--;
+        thread_yield();
+    }
+    uint32_t cycles = rdtsc_low() - start;
+    reloads = cr3_reloads - reloads;
+    bench_thread_reap(partner); // ctxsw_partner看到计数归0后挂起
+    lazy_tlb = true;
+    printk("%s: %d cycles/switch  cr3 reloads %d in %d switches\n",
+           lazy ? "lazy tlb" : "always reload", cycles / (BENCH_CTXSW_ROUNDS * 2),
+           reloads, BENCH_CTXSW_ROUNDS * 2);
+}
+
+/** 比较每次调度都重新加载cr3与lazy TLB下的上下文切换延迟 */
+static void bench_ctxsw(void) {
+    ctxsw_bench_case(false);
+    ctxsw_bench_case(true);
+}
+
+/********************  sched  ********************/
+
+#define BENCH_SCHED_HOGS 2          // 一直占用cpu的内核线程数
+#define BENCH_SCHED_SAMPLES 16      // 统计的唤醒次数
+#define BENCH_SCHED_WARMUP_TICKS 100 // 开头不统计的tick数,让计算型线程先用完几个时间片
+#define BENCH_SCHED_GAP 2           // 相邻两次唤醒至少间隔的tick数
+
+static struct task_struct* volatile sched_waiter; // 被反复唤醒的调用者
+static volatile uint32_t sched_wake_tsc;   // 最近一次唤醒时的时间戳
+static volatile uint32_t sched_wake_tick;  // 最近一次唤醒时的tick
+static volatile bool sched_hog_stop;
+
+/** 计算型线程,一直不让出cpu,每隔几个tick像键盘中断唤醒shell那样唤醒一次调用者 */
+static void sched_hog(void* arg UNUSED) {
+    while (!sched_hog_stop) {
+        enum intr_status old_status = intr_disable();
+        if (sched_waiter->status == TASK_BLOCKED && ticks - sched_wake_tick >= BENCH_SCHED_GAP) {
+            sched_wake_tick = ticks;
+            sched_wake_tsc = rdtsc_low();
+            thread_unblock(sched_waiter);
+        }
+        intr_set_status(old_status);
+    }
+    bench_thread_hang();
+}
+
+/** 调用者在计算型线程运行时反复阻塞,打印从被唤醒到重新上cpu的平均和最大延迟 */
+static void sched_bench_case(bool feedback) {
+    // 先把所有任务提回最高级,关闭反馈后大家同在一级,与原来单一的FIFO就绪队列相同
+    enum intr_status old_status = intr_disable();
+    thread_boost();
+    mlfq = feedback;
+    intr_set_status(old_status);
+    sched_waiter = running_thread();
+    sched_hog_stop = false;
+    sched_wake_tick = ticks;
+    struct task_struct* hogs[BENCH_SCHED_HOGS];
+    uint32_t idx = 0;
+    while (idx < BENCH_SCHED_HOGS) {
+        hogs[idx++] = thread_start("hog", default_prio, sched_hog, NULL);
+    }
+    uint32_t start_tick = ticks, samples = 0, sum = 0, max_cycles = 0, max_ticks = 0;
+    while (samples < BENCH_SCHED_SAMPLES) {
+        old_status = intr_disable();
+        thread_block(TASK_BLOCKED);
+        uint32_t cycles = rdtsc_low() - sched_wake_tsc;
+        uint32_t lat_ticks = ticks - sched_wake_tick;
+        intr_set_status(old_status);
+        if (ticks - start_tick < BENCH_SCHED_WARMUP_TICKS) {
+            continue;
+        }
+        sum += cycles / BENCH_SCHED_SAMPLES;
+        if (cycles > max_cycles) {
+            max_cycles = cycles;
+        }
+        if (lat_ticks > max_ticks) {
+            max_ticks = lat_ticks;
+        }
+        samples++;
+    }
+    sched_hog_stop = true;
+    for (idx = 0; idx < BENCH_SCHED_HOGS; idx++) {
+        bench_thread_reap(hogs[idx]);
+    }
+    mlfq = true;
+    printk("%s: wakeup latency avg %d  max %d cycles (max %d ticks) with %d cpu hogs\n",
+           feedback ? "mlfq + preempt" : "fifo", sum, max_cycles, max_ticks, BENCH_SCHED_HOGS);
+}
+
+/** 比较单一FIFO就绪队列与多级反馈队列下,计算型负载中交互任务被唤醒后的调度延迟 */
+static void bench_sched(void) {
+    sched_bench_case(false);
+    sched_bench_case(true);
+}
+
+/********************  clock  ********************/
+
+#define BENCH_CLOCK_READS 1000
+
+/** 打印读一次时钟的开销,以及mtime_sleep实际睡眠的时长与请求的偏差 */
+static void bench_clock(void) {
+    printk("tsc %d khz, HZ %d, tick %d us\n", clock_tsc_khz(), HZ, 1000000 / HZ);
+    uint32_t idx = 0;
+    volatile uint32_t sink = 0;
+    uint32_t start = rdtsc_low();
+    while (idx++ < BENCH_CLOCK_READS) {
+        sink += (uint32_t) clock_ns();
+    }
+    printk("clock_ns: %d cycles per read\n", (rdtsc_low() - start) / BENCH_CLOCK_READS);
+    uint32_t sleep_ms[] = {1, 10, 25};
+    for (idx = 0; idx < sizeof(sleep_ms) / sizeof(sleep_ms[0]); idx++) {
+        uint64_t begin = clock_ns();
+        mtime_sleep(sleep_ms[idx]);
+        uint32_t slept_us = (uint32_t) (clock_ns() - begin) / 1000;
+        printk("mtime_sleep(%d): slept %d us\n", sleep_ms[idx], slept_us);
+    }
+}
+
+/********************  smp  ********************/
+
+#define BENCH_SMP_LOOPS 50000000  // 每个计算型线程的循环次数
+
+static volatile uint32_t smp_workers_left;
+
+/** 开着中断做固定量计算的内核线程,可以与其它cpu上的同类线程并行 */
+static void smp_worker(void* arg UNUSED) {
+    volatile uint32_t sink = 0;
+    uint32_t idx = 0;
+    while (idx++ < BENCH_SMP_LOOPS) {
+        sink += idx;
+    }
+    enum intr_status old_status = intr_disable();
+    smp_workers_left--;
+    intr_set_status(old_status);
+    bench_thread_hang();
+}
+
+/** 自开机以来的毫秒数,经timespec换算,避免64位除法 */
+static uint32_t smp_now_ms(void) {
+    struct timespec ts;
+    sys_clock_gettime(&ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** 同时启动workers个计算型线程,返回全部完成所用的毫秒数 */
+static uint32_t smp_bench_case(uint32_t workers) {
+    struct task_struct* threads[SMP_MAX_CPUS];
+    uint32_t start = smp_now_ms();
+    smp_workers_left = workers;
+    uint32_t idx = 0;
+    while (idx < workers) {
+        threads[idx++] = thread_start("smp_worker", default_prio, smp_worker, NULL);
+    }
+    // 等待时睡眠,不与工作线程争抢cpu
+    while (smp_workers_left > 0) {
+        mtime_sleep(1);
+    }
+    uint32_t elapsed = smp_now_ms() - start;
+    for (idx = 0; idx < workers; idx++) {
+        bench_thread_reap(threads[idx]);
+    }
+    return elapsed > 0 ? elapsed : 1;
+}
+
+/**
+ * 比较1个与每个cpu 1个计算型线程完成同样的每线程工作量所用的时间.
+ * 工作线程开着中断运行,不进内核锁,衡量的只是计算型负载的扩展性
+ */
+static void bench_smp(void) {
+    uint32_t one = smp_bench_case(1);
+    uint32_t all = smp_bench_case(cpu_cnt);
+    printk("cpus %d: 1 worker %d ms, %d workers %d ms, throughput x%d.%d\n",
+           cpu_cnt, one, cpu_cnt, all,
+           cpu_cnt * one / all, cpu_cnt * one * 10 / all % 10);
+}
+
+static struct bench_item bench_items[] = {
+    {"bitmap", "bitmap scan: byte-wise vs word-at-a-time vs summary", bench_bitmap},
+    {"string", "memcpy/memset: byte loop vs rep movs/stos at 16B/512B/4KB", bench_string},
+    {"tlb", "page touch and memcpy after cr3 reload: 4KB alias vs kernel map", bench_tlb},
+    {"ctxsw", "thread_yield ping-pong: cr3 reload on every switch vs lazy tlb", bench_ctxsw},
+    {"sched", "wakeup latency under cpu hogs: fifo vs mlfq with preemption", bench_sched},
+    {"clock", "clock_ns read cost and mtime_sleep accuracy at the current HZ", bench_clock},
+    {"smp", "cpu-bound kernel threads: 1 worker vs one worker per cpu", bench_smp},
+};
+
+#define BENCH_ITEM_CNT (sizeof(bench_items) / sizeof(bench_items[0]))
+
+/** 运行名为name的内核基准测试,name为空或不存在时列出所有测试项,成功返回0,否则返回-1 */
+int32_t sys_bench(const char* name) {
+    uint32_t idx = 0;
+    if (name != NULL) {
+        while (idx < BENCH_ITEM_CNT) {
+            if (!strcmp(bench_items[idx].name, name)) {
+                bench_items[idx].run();
+                return 0;
+            }
+            idx++;
+        }
+    }
+    printk("bench items:\n");
+    for (idx = 0; idx < BENCH_ITEM_CNT; idx++) {
+        printk("       %s: %s\n", bench_items[idx].name, bench_items[idx].desc);
+    }
+    return -1;
+}
@@ -0,0 +1,6 @@
+#ifndef __KERNEL_BENCH_H
+#define __KERNEL_BENCH_H
+#include "../lib/stdint.h"
+
+int32_t sys_bench(const char* name);
+#endif
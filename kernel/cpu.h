@@ -0,0 +1,76 @@
+#ifndef __KERNEL_CPU_H
+#define __KERNEL_CPU_H
+#include "../lib/stdint.h"
+#include "global.h"
+
+/* cpuid 1号功能edx中的特性位 */
+#define CPUID_PSE  (1 << 3)   // 4MB大页
+#define CPUID_TSC  (1 << 4)   // rdtsc
+#define CPUID_MSR  (1 << 5)   // rdmsr/wrmsr
+#define CPUID_APIC (1 << 9)   // 片上的local APIC
+#define CPUID_PGE  (1 << 13)  // 全局页
+#define CPUID_FXSR (1 << 24)  // fxsave/fxrstor
+#define CPUID_SSE2 (1 << 26)
+
+/* 控制寄存器中的位 */
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+/* 执行cpuid的leaf号功能,返回edx,其余输出寄存器存入非NULL的指针 */
+static inline uint32_t cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx) {
+    uint32_t a = leaf, b, c = 0, d;
+    asm volatile ("cpuid" : "+a" (a), "=b" (b), "+c" (c), "=d" (d));
+    if (eax != NULL) *eax = a;
+    if (ebx != NULL) *ebx = b;
+    if (ecx != NULL) *ecx = c;
+    return d;
+}
+
+static inline uint32_t cr0_read(void) {
+    uint32_t cr0;
+    asm volatile ("movl %%cr0, %0" : "=r" (cr0));
+    return cr0;
+}
+
+static inline void cr0_write(uint32_t cr0) {
+    asm volatile ("movl %0, %%cr0" : : "r" (cr0) : "memory");
+}
+
+static inline uint32_t cr4_read(void) {
+    uint32_t cr4;
+    asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+    return cr4;
+}
+
+/* 改写cr4,其中PGE位的变化会刷新包括全局页在内的整个TLB */
+static inline void cr4_write(uint32_t cr4) {
+    asm volatile ("movl %0, %%cr4" : : "r" (cr4) : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile ("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return (uint64_t) high << 32 | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    asm volatile ("wrmsr" : : "c" (msr), "a" ((uint32_t) val), "d" ((uint32_t) (val >> 32)));
+}
+
+/* 读取64位的时间戳计数器 */
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return (uint64_t) high << 32 | low;
+}
+
+/* 重新加载cr3,刷新TLB中的非全局页 */
+static inline void tlb_flush(void) {
+    uint32_t cr3;
+    asm volatile ("movl %%cr3, %0; movl %0, %%cr3" : "=r" (cr3) : : "memory");
+}
+#endif
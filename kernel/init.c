@@ -9,20 +9,42 @@
 #include "../userprog/tss.h"
 #include "../userprog/syscall-init.h"
 #include "../device/ide.h"
+#include "../device/bcache.h"
 #include "../fs/fs.h"
+#include "../shell/pipe.h"
+#include "../lib/string.h"
+#include "cpu.h"
+#include "smp.h"
+
+/* 若cpu支持SSE2则打开SSE指令并让memcpy复制大块内存时使用 */
+static void sse_init(void) {
+    uint32_t edx = cpuid(1, NULL, NULL, NULL);
+    if ((edx & (CPUID_FXSR | CPUID_SSE2)) != (CPUID_FXSR | CPUID_SSE2)) {
+        put_str("   sse2 not supported\n");
+        return;
+    }
+    cr0_write((cr0_read() & ~CR0_EM) | CR0_MP);
+    cr4_write(cr4_read() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    string_use_sse2 = 1;
+    put_str("   sse2 enabled\n");
+}
 
 void init_all() {
     put_str("init_all\n");
     idt_init();    // 初始化中断
+    sse_init();    // 检测并打开SSE2
     mem_init();	  // 初始化内存管理系统
+    timer_init();  // 初始化时钟,lapic的寄存器页须在第一个进程复制内核页目录项之前映射
     thread_init(); // 初始化线程相关结构
-    timer_init();  // 初始化PIT
     console_init(); // 控制台初始化
     keyboard_init();  // 键盘初始化
     tss_init();  // tss初始化
     syscall_init(); // 初始化系统调用
+    smp_init();     // 启动其它cpu,开中断后它们才开始调度
     intr_enable();    // 后面的ide_init需要打开中断
     ide_init();	     // 初始化硬盘
+    bcache_init();   // 初始化块缓存
     filesys_init(); // 初始化文件系统
+    pipe_init();    // 初始化管道
 }
 
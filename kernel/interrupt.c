@@ -3,6 +3,8 @@
 #include "global.h"
 #include "../lib/kernel/io.h"
 #include "../lib/kernel/print.h"
+#include "../thread/spinlock.h"
+#include "smp.h"
 
 #define PIC_M_CTRL 0x20        // 这里用的可编程中断控制器8259A,主片的控制端口是0x20
 #define PIC_M_DATA 0x21        // 主片的数据端口是0x21
@@ -33,6 +35,17 @@ char* intr_name[IDT_DESC_CNT];
 intr_handler idt_table[IDT_DESC_CNT]; // 定义中断处理程序数组,在kernel.S中定义的intrxxxEntry只是中断处理程序的入口,最终调用是在idt_table中
 extern intr_handler intr_entry_table[IDT_DESC_CNT];	    // 声明引用定义在kernel.S中的中断处理函数入口数组
 
+/*
+ * 内核锁:单cpu时关中断即可保证代码段不被打断,多个cpu时关中断的代码段还须互斥.
+ * 有AP上线后,cpu关着中断时(进入中断或关中断)总是持有内核锁,开中断前释放,
+ * 原来依赖关中断的代码因而在cpu之间串行执行,用户态和开着中断的内核代码可以并行.
+ * 这是一把全局锁,并没有拆成各子系统的自旋锁:系统调用经中断门进入,整个执行期间
+ * 都持有它,中断处理和调度也是如此,所以内核路径同一时刻只有一个cpu在执行,
+ * 不随cpu数扩展,能扩展的只有用户态计算和开着中断运行的内核线程
+ */
+static struct spinlock kernel_lock;
+static volatile int32_t kernel_lock_owner = -1;  // 持有内核锁的cpu
+
 /* 初始化可编程中断控制器8259A */
 static void pic_init(void) {
 
@@ -80,7 +93,7 @@ static void idt_desc_init(void) {
 }
 
 /* 通用的中断处理函数,一般用在异常出现时的处理 */
-static void general_intr_handler(uint8_t vec_nr) {
+void general_intr_handler(uint8_t vec_nr) {
     if (vec_nr == 0x27 || vec_nr == 0x2f) {
         // IRQ7和IRQ15会产生伪中断,无需处理 0x2f是从片8259A上的最后一个IRQ引脚,保留项
         return;
@@ -141,6 +154,24 @@ static void exception_init(void) {
     intr_name[19] = "#XF SIMD Floating-Point Exception";
 }
 
+/** 当前cpu还未持有内核锁时获取它,须在关中断时调用,kernel.S进入中断时也经此获取 */
+void intr_lock(void) {
+    if (!smp_active || kernel_lock_owner == (int32_t) cpu_id()) {
+        return;
+    }
+    spin_lock(&kernel_lock);
+    kernel_lock_owner = cpu_id();
+}
+
+/** 当前cpu持有内核锁时释放它,开中断之前或从中断返回到开中断的上下文之前调用 */
+void intr_unlock(void) {
+    if (!smp_active || kernel_lock_owner != (int32_t) cpu_id()) {
+        return;
+    }
+    kernel_lock_owner = -1;
+    spin_unlock(&kernel_lock);
+}
+
 /* 开中断并返回开中断前的状态 */
 enum intr_status intr_enable() {
     enum intr_status old_status;
@@ -149,7 +180,8 @@ enum intr_status intr_enable() {
         return old_status;
     } else {
         old_status = INTR_OFF;
-        asm volatile("sti");
+        intr_unlock();
+        asm volatile("sti" : : : "memory");
         return old_status;
     }
 }
@@ -160,6 +192,7 @@ enum intr_status intr_disable() {
     if (INTR_ON == intr_get_status()) {
         old_status = INTR_ON;
         asm volatile("cli" : : : "memory"); // 关中断,cli指令将IF位置0
+        intr_lock();
         return old_status;
     } else {
         old_status = INTR_OFF;
@@ -172,6 +205,13 @@ enum intr_status intr_set_status(enum intr_status status) {
     return status & INTR_ON ? intr_enable() : intr_disable();
 }
 
+/** 须在关中断时调用:开中断并停机,被中断唤醒并处理完中断后返回,返回时为开中断状态 */
+void intr_halt(void) {
+    intr_unlock();
+    // sti之后的一条指令执行完才响应中断,中断不会在hlt之前被处理掉
+    asm volatile ("sti; hlt" : : : "memory");
+}
+
 /* 获取当前中断状态 */
 enum intr_status intr_get_status() {
     uint32_t eflags = 0;
@@ -191,8 +231,12 @@ void idt_init() {
     idt_desc_init();	   // 初始化中断描述符表
     exception_init();    // 异常名称初始化并注册默认的中断处理函数
     pic_init();		   // 初始化8259A
+    idt_load();
+    put_str("idt_init done\n");
+}
 
+/** 加载idt,所有cpu共用一张idt,AP启动时也要加载 */
+void idt_load(void) {
     uint64_t idt_operand = ((sizeof(idt) - 1) | ((uint64_t)(uint32_t)idt << 16));
     asm volatile("lidt %0" : : "m"(idt_operand));
-    put_str("idt_init done\n");
 }
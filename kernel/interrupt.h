@@ -3,6 +3,7 @@
 #include "../lib/stdint.h"
 typedef void* intr_handler;
 void idt_init(void);
+void idt_load(void);
 
 /* 定义中断的两种状态:
  * INTR_OFF 值为 0,表示关中断
@@ -16,5 +17,9 @@ enum intr_status intr_get_status(void);
 enum intr_status intr_set_status(enum intr_status);
 enum intr_status intr_enable(void);
 enum intr_status intr_disable(void);
+void intr_lock(void);
+void intr_unlock(void);
+void intr_halt(void);
 void register_handler(uint8_t vector_no, intr_handler function);
+void general_intr_handler(uint8_t vec_nr);
 #endif
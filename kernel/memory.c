@@ -9,6 +9,10 @@
 #include "../thread/sync.h"
 #include "interrupt.h"
 #include "../lib/kernel/stdio-kernel.h"
+#include "../userprog/exec.h"
+#include "slab.h"
+#include "cpu.h"
+#include "../userprog/process.h"
 
 #define PG_SIZE 4096
 
@@ -22,15 +26,29 @@
 #define PDE_IDX(addr) ((addr & 0xffc00000) >> 22)
 #define PTE_IDX(addr) ((addr & 0x003ff000) >> 12)
 
-/* 0xc0000000是内核从虚地址3G起. 0x100000指跨过低端1M内存,使虚拟地址在逻辑上连续 */
-#define K_HEAP_START 0xc0100000
+#define LARGE_PG_SIZE 0x400000 // PSE大页的大小
+
+/** 页框在伙伴系统中的信息 */
+struct page_frame {
+    struct list_elem free_tag;  // 作为空闲块首页框时在free_area中的标记
+    uint8_t order;              // 空闲块的阶,块大小为2^order页,仅对空闲块首页框有效
+    uint8_t free;               // 是否为空闲块的首页框
+    void* slab;                 // 页框被slab使用时指向其slab描述符
+};
 
 /* 内存池结构,生成两个实例用于管理内核内存池和用户内存池 */
 struct pool {
-    struct bitmap pool_bitmap;  // 本内存池用到的位图结构,用于管理物理内存
+    struct bitmap pool_bitmap;  // 伙伴系统建立之前用于分配物理内存的位图
     uint32_t phy_addr_start;    // 本内存池所管理物理内存的起始地址
     uint32_t pool_size;         // 本内存池字节容量
     struct lock lock;           // 申请内存时互斥
+
+    /** 伙伴系统,块按物理页框号对齐,2^order页的块起始页框号是2^order的倍数 */
+    struct page_frame* frames;  // 每个页框的伙伴信息,为NULL表示伙伴系统尚未建立
+    uint32_t start_pfn;         // 本内存池第一个页框的页框号
+    uint32_t frame_cnt;         // 本内存池管理的页框数
+    struct list free_area[BUDDY_MAX_ORDER + 1]; // 各阶空闲块链表
+    uint32_t free_cnt[BUDDY_MAX_ORDER + 1];     // 各阶空闲块数
 };
 
 /** 内存仓库元信息 */
@@ -42,37 +60,62 @@ struct arena {
     bool large;
 };
 
+/** sys_malloc/sys_free的统计信息 */
+struct malloc_stat {
+    uint32_t mallocs;    // sys_malloc调用次数
+    uint32_t frees;      // sys_free调用次数
+    uint32_t lock_ops;   // 获取内存池锁的次数
+    uint32_t mag_allocs; // 直接从弹匣分配的次数
+    uint32_t mag_frees;  // 直接放入弹匣的次数
+    uint32_t refills;    // 弹匣批量补充次数
+    uint32_t drains;     // 弹匣批量归还次数
+    uint32_t run_hits;   // 大块内存直接取自页块缓存的次数
+    uint32_t run_puts;   // 大块内存释放时放入页块缓存的次数
+    uint32_t zero_faults; // 缺页时按需补上清0页框的次数
+};
+
+/** 缺页异常错误码中的位 */
+#define PF_ERR_P 1  // 为1表示页存在,是保护性异常;为0表示页不存在
+#define PF_ERR_W 2  // 为1表示由写操作引起
+#define PF_ERR_U 4  // 为1表示异常发生在用户态
+
 struct mem_block_desc k_block_descs[DESC_CNT]; // 内核内存块描述符
+static struct malloc_stat malloc_stat; // 统计值只用于观察,不加锁,允许少量误差
 struct pool kernel_pool, user_pool;  // 生成内核内存池和用户内存池
-struct virtual_addr kernel_vaddr;     // 此结构是用来给内核分配虚拟地址
 
-// 在pf表示的虚拟内存池中申请pg_cnt个虚拟页,
-// 成功则返回虚拟页的起始地址,失败则返回NULL
-static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt) {
-    int vaddr_start = 0, bit_idx_start = -1;
-    uint32_t cnt = 0;
-    if (pf == PF_KERNEL) {
-        bit_idx_start = bitmap_scan(&kernel_vaddr.vaddr_bitmap, pg_cnt);
-        if (bit_idx_start == -1) {
-            return NULL;
-        }
-        while (cnt < pg_cnt) {
-            bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
-        }
-        vaddr_start = kernel_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
-    } else {
-        // 用户内存池
-        struct task_struct* cur = running_thread();
-        bit_idx_start = bitmap_scan(&cur->userprog_vaddr.vaddr_bitmap, pg_cnt);
-        if (bit_idx_start == -1) {
-            return NULL;
-        }
-        while (cnt <  pg_cnt) {
-            bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
-        }
-        vaddr_start = cur->userprog_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
+// 用户物理内存池中每个页框的引用数,写时复制的fork会让多个进程共享同一页框
+static uint16_t* user_page_refs;
+// 写时复制时用来中转页数据的内核缓冲区,缺页处理在关中断下进行,故可共用一页
+static uint8_t cow_buf[PG_SIZE] __attribute__ ((aligned (PG_SIZE)));
+
+// 在当前进程的虚拟内存池中申请pg_cnt个虚拟页,
+// 成功则返回虚拟页的起始地址,失败则返回NULL.
+// 内核页位于线性映射区,虚拟地址由物理地址决定,不经过这里
+static void* vaddr_get(uint32_t pg_cnt) {
+    struct task_struct* cur = running_thread();
+    int bit_idx_start = bitmap_scan(&cur->userprog_vaddr.vaddr_bitmap, pg_cnt);
+    if (bit_idx_start == -1) {
+        return NULL;
+    }
+    bitmap_set_range(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt, 1);
+    return (void*) (cur->userprog_vaddr.vaddr_start + bit_idx_start * PG_SIZE);
+}
+
+/** 在当前进程的虚拟内存池中申请按两页对齐的两个虚拟页,先多占一页,再退还不对齐的一头 */
+static void* vaddr_get_pair(void) {
+    uint32_t vaddr = (uint32_t) vaddr_get(3);
+    if (vaddr == 0) {
+        return NULL;
+    }
+    uint32_t spare = vaddr + 2 * PG_SIZE;
+    if (vaddr & PG_SIZE) {
+        spare = vaddr;
+        vaddr += PG_SIZE;
     }
-    return (void*)vaddr_start;
+    struct task_struct* cur = running_thread();
+    bitmap_set(&cur->userprog_vaddr.vaddr_bitmap,
+               (spare - cur->userprog_vaddr.vaddr_start) / PG_SIZE, 0);
+    return (void*) vaddr;
 }
 
 /* 得到虚拟地址vaddr对应的pte指针 */
@@ -91,19 +134,226 @@ uint32_t* pde_ptr(uint32_t vaddr) {
     return pde;
 }
 
+/**
+ * 从伙伴系统分配2^order个物理上连续的页框,
+ * 没有合适的块时拆分更高阶的块,多出的一半挂回低一阶的空闲链表
+ * @return 起始物理地址,失败返回0
+ */
+static uint32_t buddy_alloc(struct pool* m_pool, uint32_t order) {
+    enum intr_status old_status = intr_disable();
+    uint32_t cur_order = order;
+    while (cur_order <= BUDDY_MAX_ORDER && list_empty(&m_pool->free_area[cur_order])) {
+        cur_order++;
+    }
+    if (cur_order > BUDDY_MAX_ORDER) {
+        intr_set_status(old_status);
+        return 0;
+    }
+    struct page_frame* frame = elem2entry(struct page_frame, free_tag,
+                                          list_pop(&m_pool->free_area[cur_order]));
+    m_pool->free_cnt[cur_order]--;
+    frame->free = false;
+    uint32_t idx = frame - m_pool->frames;
+    while (cur_order > order) {
+        cur_order--;
+        struct page_frame* half = &m_pool->frames[idx + (1 << cur_order)];
+        half->order = cur_order;
+        half->free = true;
+        list_push(&m_pool->free_area[cur_order], &half->free_tag);
+        m_pool->free_cnt[cur_order]++;
+    }
+    intr_set_status(old_status);
+    return (m_pool->start_pfn + idx) * PG_SIZE;
+}
+
+/** 将以pg_phy_addr起始的2^order页归还伙伴系统,伙伴块也空闲时逐级合并 */
+static void buddy_free(struct pool* m_pool, uint32_t pg_phy_addr, uint32_t order) {
+    uint32_t pfn = pg_phy_addr / PG_SIZE;
+    ASSERT(pfn >= m_pool->start_pfn && pfn < m_pool->start_pfn + m_pool->frame_cnt);
+    enum intr_status old_status = intr_disable();
+    while (order < BUDDY_MAX_ORDER) {
+        uint32_t buddy_pfn = pfn ^ (1 << order);
+        if (buddy_pfn < m_pool->start_pfn || buddy_pfn >= m_pool->start_pfn + m_pool->frame_cnt) {
+            break;
+        }
+        struct page_frame* buddy = &m_pool->frames[buddy_pfn - m_pool->start_pfn];
+        if (!buddy->free || buddy->order != order) {
+            break;
+        }
+        list_remove(&buddy->free_tag);
+        buddy->free = false;
+        m_pool->free_cnt[order]--;
+        pfn &= ~(1 << order); // 合并后的块从两者中较低的地址开始
+        order++;
+    }
+    struct page_frame* frame = &m_pool->frames[pfn - m_pool->start_pfn];
+    ASSERT(!frame->free);
+    frame->order = order;
+    frame->free = true;
+    list_push(&m_pool->free_area[order], &frame->free_tag);
+    m_pool->free_cnt[order]++;
+    intr_set_status(old_status);
+}
+
+/** 建立内存池的伙伴系统,位图中已分配的页框保持占用,空闲页框逐页放入并自然合并 */
+static void buddy_init(struct pool* m_pool, struct page_frame* frames) {
+    m_pool->start_pfn = m_pool->phy_addr_start / PG_SIZE;
+    m_pool->frame_cnt = m_pool->pool_bitmap.btmp_bytes_len * 8;
+    uint32_t order = 0;
+    while (order <= BUDDY_MAX_ORDER) {
+        list_init(&m_pool->free_area[order]);
+        m_pool->free_cnt[order] = 0;
+        order++;
+    }
+    memset(frames, 0, m_pool->frame_cnt * sizeof(struct page_frame));
+    m_pool->frames = frames;
+    uint32_t idx = 0;
+    while (idx < m_pool->frame_cnt) {
+        if (!bitmap_scan_test(&m_pool->pool_bitmap, idx)) {
+            buddy_free(m_pool, (m_pool->start_pfn + idx) * PG_SIZE, 0);
+        }
+        idx++;
+    }
+}
+
+/** 能容纳pg_cnt页的最小阶 */
+static uint32_t pages_order(uint32_t pg_cnt) {
+    uint32_t order = 0;
+    while ((1U << order) < pg_cnt) {
+        order++;
+    }
+    return order;
+}
+
 /* 在m_pool指向的物理内存池中分配1个物理页
  * 成功则返回页框的物理地址m失败则返回NULL */
 static void* palloc(struct pool* m_pool) {
-    /* 扫描或者设置位图要保证原子操作*/
-    int bit_idx = bitmap_scan(&m_pool->pool_bitmap, 1);
-    if (bit_idx == -1) {
-        return NULL;
+    uint32_t page_phyaddr;
+    if (m_pool->frames != NULL) {
+        page_phyaddr = buddy_alloc(m_pool, 0);
+        if (page_phyaddr == 0) {
+            return NULL;
+        }
+    } else {
+        // 伙伴系统建立之前的启动阶段,扫描位图分配
+        int bit_idx = bitmap_scan(&m_pool->pool_bitmap, 1);
+        if (bit_idx == -1) {
+            return NULL;
+        }
+        bitmap_set(&m_pool->pool_bitmap, bit_idx, 1); //将此位bit_idx置1
+        page_phyaddr = ((bit_idx * PG_SIZE) + m_pool->phy_addr_start);
+    }
+    if (m_pool == &user_pool) {
+        // 新分配的用户页框只被当前映射引用
+        user_page_refs[(page_phyaddr - user_pool.phy_addr_start) / PG_SIZE] = 1;
     }
-    bitmap_set(&m_pool->pool_bitmap, bit_idx, 1); //将此位bit_idx置1
-    uint32_t page_phyaddr = ((bit_idx * PG_SIZE) + m_pool->phy_addr_start);
     return (void*) page_phyaddr;
 }
 
+/**
+ * 在m_pool中分配pg_cnt个物理上连续的页框,按2^order分配后把尾部多出的页归还
+ * @return 起始物理地址,伙伴系统未建立或没有足够大的连续块时返回0
+ */
+static uint32_t palloc_contig(struct pool* m_pool, uint32_t pg_cnt) {
+    uint32_t order = pages_order(pg_cnt);
+    if (m_pool->frames == NULL || order > BUDDY_MAX_ORDER) {
+        return 0;
+    }
+    uint32_t phy_start = buddy_alloc(m_pool, order);
+    if (phy_start == 0) {
+        return 0;
+    }
+    // 尾部多出的页按能对齐的最大块逐块归还
+    uint32_t idx = pg_cnt, end = 1 << order;
+    while (idx < end) {
+        uint32_t free_order = 0;
+        while ((idx & ((2U << free_order) - 1)) == 0 && idx + (2U << free_order) <= end) {
+            free_order++;
+        }
+        buddy_free(m_pool, phy_start + idx * PG_SIZE, free_order);
+        idx += 1 << free_order;
+    }
+    if (m_pool == &user_pool) {
+        idx = 0;
+        while (idx < pg_cnt) {
+            user_page_refs[(phy_start - user_pool.phy_addr_start) / PG_SIZE + idx++] = 1;
+        }
+    }
+    return phy_start;
+}
+
+/**
+ * 从pf内存池分配2^order个物理上连续且按2^order页对齐的页框,
+ * 供DMA缓冲区、大页映射等需要连续物理内存的场合,不建立映射
+ * @return 起始物理地址,失败返回0
+ */
+uint32_t palloc_pages(enum pool_flags pf, uint32_t order) {
+    struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
+    ASSERT(mem_pool->frames != NULL && order <= BUDDY_MAX_ORDER);
+    return palloc_contig(mem_pool, 1 << order);
+}
+
+/** 内核虚拟页vaddr所在页框的信息 */
+static struct page_frame* kernel_frame_of(const void* vaddr) {
+    uint32_t pfn = ((uint32_t) vaddr - KERNEL_VADDR_START) / PG_SIZE;
+    ASSERT(pfn >= kernel_pool.start_pfn && pfn < kernel_pool.start_pfn + kernel_pool.frame_cnt);
+    return &kernel_pool.frames[pfn - kernel_pool.start_pfn];
+}
+
+/** 记录内核虚拟页vaddr所在页框属于哪个slab,slab为NULL表示不再属于slab */
+void page_slab_set(const void* vaddr, void* slab) {
+    kernel_frame_of(vaddr)->slab = slab;
+}
+
+/** 返回内核虚拟地址vaddr所在页框所属的slab */
+void* page_slab_get(const void* vaddr) {
+    return kernel_frame_of(vaddr)->slab;
+}
+
+/** 归还palloc_pages分配的页框 */
+void pfree_pages(enum pool_flags pf, uint32_t pg_phy_addr, uint32_t order) {
+    struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
+    if (mem_pool == &user_pool) {
+        uint32_t idx = 0;
+        while (idx < (1U << order)) {
+            ASSERT(user_page_refs[(pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE + idx] == 1);
+            user_page_refs[(pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE + idx++] = 0;
+        }
+    }
+    buddy_free(mem_pool, pg_phy_addr, order);
+}
+
+/** 增加用户页框pg_phy_addr的引用数,fork共享页框时调用 */
+void page_ref_inc(uint32_t pg_phy_addr) {
+    ASSERT(pg_phy_addr >= user_pool.phy_addr_start);
+    uint32_t bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
+    ASSERT(user_page_refs[bit_idx] > 0);
+    user_page_refs[bit_idx]++;
+}
+
+/** 减少用户页框pg_phy_addr的引用数,返回剩余的引用数 */
+static uint16_t page_ref_dec(uint32_t pg_phy_addr) {
+    uint32_t bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
+    ASSERT(user_page_refs[bit_idx] > 0);
+    return --user_page_refs[bit_idx];
+}
+
+/** 确保当前页表中虚拟地址vaddr所在的页表存在,不存在则分配并清0,失败返回false */
+bool page_table_create(uint32_t vaddr) {
+    uint32_t* pde = pde_ptr(vaddr);
+    if (*pde & 0x00000001) {
+        return true;
+    }
+    // 页表中用到的页框一律从内核空间分配
+    uint32_t pde_phyaddr = (uint32_t) palloc(&kernel_pool);
+    if (pde_phyaddr == 0) {
+        return false;
+    }
+    *pde = (pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+    memset((void*) ((uint32_t) pte_ptr(vaddr) & 0xfffff000), 0, PG_SIZE);
+    return true;
+}
+
 /* 页表中添加虚拟地址_vaddr与物理地址_page_phyaddr的映射 */
 static void page_table_add(void* _vaddr, void* _page_phyaddr) {
     uint32_t vaddr = (uint32_t) _vaddr, page_phyaddr = (uint32_t) _page_phyaddr;
@@ -137,22 +387,40 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr) {
         *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
     }
 }
-/* 分配pg_cnt个页空间,成功则返回虚拟地址,失败时返回NULL */
-void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
-    ASSERT(pg_cnt > 0 && pg_cnt < 3840);
-    /* 1.通过vaddr_get在虚拟内存池中申请虚拟地址
-     * 2.通过palloc在物理内存中申请物理页
-     * 3.通过page_table_add将以上得到的虚拟内存地址和物理地址在页表中完成映射 */
-    void* vaddr_start = vaddr_get(pf, pg_cnt);
-    if (vaddr_start == NULL) {
-        return NULL;
+/**
+ * 从内核物理内存池分配pg_cnt个物理上连续的页框,
+ * 线性映射区中早已有映射,无须修改页表
+ * @return 页框在线性映射区中的虚拟地址,失败返回NULL
+ */
+static void* kernel_pages_alloc(uint32_t pg_cnt) {
+    uint32_t page_phyaddr;
+    if (pg_cnt == 1) {
+        page_phyaddr = (uint32_t) palloc(&kernel_pool);
+    } else if (kernel_pool.frames != NULL) {
+        page_phyaddr = palloc_contig(&kernel_pool, pg_cnt);
+    } else {
+        // 伙伴系统建立之前在位图中找连续的空闲页框
+        int bit_idx = bitmap_scan(&kernel_pool.pool_bitmap, pg_cnt);
+        if (bit_idx == -1) {
+            return NULL;
+        }
+        bitmap_set_range(&kernel_pool.pool_bitmap, bit_idx, pg_cnt, 1);
+        page_phyaddr = kernel_pool.phy_addr_start + bit_idx * PG_SIZE;
     }
+    return page_phyaddr == 0 ? NULL : (void*) (page_phyaddr + KERNEL_VADDR_START);
+}
+
+/** 为已占用的用户虚拟页vaddr_start起的pg_cnt页分配物理页并建立映射 */
+static void* user_pages_map(void* vaddr_start, uint32_t pg_cnt) {
     uint32_t vaddr = (uint32_t) vaddr_start, cnt = pg_cnt;
-    struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
+    struct pool* mem_pool = &user_pool;
+    // 多页时先向伙伴系统要一整块物理上连续的页框,没有足够大的块再逐页分配
+    uint32_t phy_contig = pg_cnt > 1 ? palloc_contig(mem_pool, pg_cnt) : 0;
 
-    // 因为虚拟地址是连续的,但物理地址可以不是连续的,所以逐个映射
+    // 虚拟地址是连续的,物理地址可以不是连续的,所以逐个映射
     while (cnt-- > 0) {
-        void* page_phyaddr = palloc(mem_pool);
+        void* page_phyaddr = phy_contig != 0 ?
+                             (void*) (phy_contig + (pg_cnt - cnt - 1) * PG_SIZE) : palloc(mem_pool);
         if (page_phyaddr == NULL) {
             // 失败时要将曾经已申请的虚拟地址和物理页全部回滚，在将来完成内存回收时再补充
             // todo
@@ -164,6 +432,22 @@ void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
     return vaddr_start;
 }
 
+/* 分配pg_cnt个页空间,成功则返回虚拟地址,失败时返回NULL */
+void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
+    ASSERT(pg_cnt > 0 && pg_cnt < 3840);
+    if (pf == PF_KERNEL) {
+        return kernel_pages_alloc(pg_cnt);
+    }
+    /* 1.通过vaddr_get在虚拟内存池中申请虚拟地址
+     * 2.通过palloc在物理内存中申请物理页
+     * 3.通过page_table_add将以上得到的虚拟内存地址和物理地址在页表中完成映射 */
+    void* vaddr_start = vaddr_get(pg_cnt);
+    if (vaddr_start == NULL) {
+        return NULL;
+    }
+    return user_pages_map(vaddr_start, pg_cnt);
+}
+
 /** 从内核物理内存池中申请pg_cnt页内存,成功则返回其虚拟地址,失败则返回NULL */
 void* get_kernel_pages(uint32_t pg_cnt) {
     lock_acquire(&kernel_pool.lock);
@@ -199,14 +483,9 @@ void* get_a_page(enum pool_flags pf, uint32_t vaddr) {
         bit_idx = (vaddr - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
         ASSERT(bit_idx >= 0);
         bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx, 1);
-
-    } else if (cur->pgdir == NULL && pf == PF_KERNEL){
-        // 如果是内核线程申请内核内存,就修改kernel_vaddr.
-        bit_idx = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-        ASSERT(bit_idx > 0);
-        bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx, 1);
     } else {
-        PANIC("get_a_page:not allow kernel alloc userspace or user alloc kernelspace by get_a_page");
+        // 内核页的虚拟地址由线性映射决定,不能指定
+        PANIC("get_a_page:only user process can alloc userspace by get_a_page");
     }
 
     void* page_phyaddr = palloc(mem_pool);
@@ -235,23 +514,107 @@ void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr) {
 
 /** 得到虚拟地址映射到的物理地址 */
 uint32_t addr_v2p(uint32_t vaddr) {
+    uint32_t* pde = pde_ptr(vaddr);
+    if (*pde & PG_PS_1) {
+        // 4MB大页没有页表,pde的高10位就是物理页的起始地址
+        return (*pde & 0xffc00000) + (vaddr & 0x003fffff);
+    }
     uint32_t* pte = pte_ptr(vaddr);
     // 取pte的高20位就是物理页的起始地址,然后加上虚拟地址的低12位
     // 最终得到的就是物理地址
     return ((*pte & 0xfffff000) + (vaddr & 0x00000fff));
 }
 
-/** 返回arena中第idx个内存块的地址 */
+/** desc的arena所占的页数,2K内存块的arena跨两页 */
+static uint32_t arena_pages(struct mem_block_desc* desc) {
+    return desc->block_size == ARENA_PAIR_BLOCK ? 2 : 1;
+}
+
+/** 返回arena中第idx个内存块的地址,2K内存块的arena头部独占开头的2KB */
 static struct mem_block* arena2block(struct arena* a, uint32_t idx) {
-    return (struct mem_block*) ((uint32_t)a + sizeof(struct arena) +
-                                idx * a->desc->block_size);
+    uint32_t first = a->desc->block_size == ARENA_PAIR_BLOCK ? ARENA_PAIR_BLOCK : sizeof(struct arena);
+    return (struct mem_block*) ((uint32_t)a + first + idx * a->desc->block_size);
 }
 
-/** 返回内存块b所在的arena地址 */
+/**
+ * 返回内存块b所在的arena地址.其它规格的内存块和大块内存在页内的偏移都是
+ * sizeof(struct arena)加16的倍数,只有2K内存块按2KB对齐,其arena按两页对齐
+ */
 static struct arena* block2arena(struct mem_block* b) {
+    if (((uint32_t)b & (ARENA_PAIR_BLOCK - 1)) == 0) {
+        return (struct arena*) ((uint32_t)b & ~(2 * PG_SIZE - 1));
+    }
     return (struct arena*) ((uint32_t)b & 0xfffff000);
 }
 
+/**
+ * 分配desc的一个arena.2K内存块的arena须按两页对齐:内核池的两页是伙伴系统的1阶块,
+ * 在线性映射下虚拟地址同样对齐;用户池另行申请对齐的虚拟地址
+ */
+static struct arena* arena_alloc(enum pool_flags PF, struct mem_block_desc* desc) {
+    if (arena_pages(desc) == 1) {
+        return malloc_page(PF, 1);
+    }
+    if (PF == PF_KERNEL) {
+        struct arena* a = malloc_page(PF_KERNEL, 2);
+        ASSERT(((uint32_t) a & PG_SIZE) == 0);
+        return a;
+    }
+    void* vaddr = vaddr_get_pair();
+    return vaddr == NULL ? NULL : user_pages_map(vaddr, 2);
+}
+
+/** 从desc的free_list取一个内存块,没有空闲块时新建arena,须持有内存池的锁 */
+static struct mem_block* block_take(enum pool_flags PF, struct mem_block_desc* desc) {
+    struct arena* a;
+    struct mem_block* b;
+    // 当mem_block_desc的free_list没有可用的mem_block
+    // 就创建新的arena提供mem_block
+    if (list_empty(&desc->free_list)) {
+        a = arena_alloc(PF, desc);
+        if (a == NULL) {
+            return NULL;
+        }
+        memset(a, 0, arena_pages(desc) * PG_SIZE);
+        // 对于分配的小块内存,将desc置为相应内存块描述符
+        // cnt置为此arena可用的内存块数,large为false
+        a->desc = desc;
+        a->large = false;
+        a->cnt = desc->blocks_per_arena;
+        uint32_t block_idx;
+
+        enum intr_status old_status = intr_disable();
+        // 开始将arena拆分成内存块,并添加到内存块描述符的free_list中
+        for (block_idx = 0;block_idx < desc->blocks_per_arena;block_idx++) {
+            b = arena2block(a, block_idx);
+            ASSERT(!elem_find(&a->desc->free_list, &b->free_elem));
+            list_append(&a->desc->free_list, &b->free_elem);
+        }
+        intr_set_status(old_status);
+    }
+    b = elem2entry(struct mem_block, free_elem, list_pop(&desc->free_list));
+    a = block2arena(b); // 获取内存块b所在的arena
+    a->cnt--;
+    return b;
+}
+
+/** 将内存块b放回其arena的free_list,arena中的块都空闲时释放arena,须持有内存池的锁 */
+static void block_put(enum pool_flags PF, struct mem_block* b) {
+    struct arena* a = block2arena(b);
+    // 先将内存块回收到free_list
+    list_append(&a->desc->free_list, &b->free_elem);
+    // 再判断此arena中的内存块是否都是空闲,如果是就释放arena
+    if (++a->cnt == a->desc->blocks_per_arena) {
+        uint32_t block_idx;
+        for (block_idx = 0;block_idx < a->desc->blocks_per_arena;block_idx++) {
+            b = arena2block(a, block_idx);
+            ASSERT(elem_find(&a->desc->free_list, &b->free_elem));
+            list_remove(&b->free_elem);
+        }
+        mfree_page(PF, a, arena_pages(a->desc));
+    }
+}
+
 /** 在堆中申请size字节内存 */
 void* sys_malloc(uint32_t size) {
     enum pool_flags PF;
@@ -278,15 +641,43 @@ void* sys_malloc(uint32_t size) {
     }
     struct arena* a;
     struct mem_block* b;
-    lock_acquire(&mem_pool->lock);
-    // 超过最大内存块1024,就分配页框
-    if (size > 1024) {
-        // 向上取整需要的页框数
+    malloc_stat.mallocs++;
+    // 超过最大内存块2048,就分配页框
+    if (size > ARENA_PAIR_BLOCK) {
+        // 向上取整需要的页框数,不超过RUN_MAX_PAGES时再取整到2的幂,先查已映射的页块缓存
         uint32_t pg_cnt = DIV_ROUND_UP(size + sizeof(struct arena), PG_SIZE);
+        if (pg_cnt <= RUN_MAX_PAGES) {
+            uint32_t run_class = 0;
+            while ((1U << run_class) < pg_cnt) {
+                run_class++;
+            }
+            pg_cnt = 1 << run_class;
+            struct mem_run_cache* rc = &cur_thread->run_caches[run_class];
+            if (rc->cnt > 0) {
+                a = rc->runs[--rc->cnt];
+                cur_thread->run_cache_pages -= pg_cnt;
+                malloc_stat.run_hits++;
+                memset(a + 1, 0, size);
+                return (void*) (a + 1);
+            }
+        }
+        if (PF == PF_USER) {
+            // 用户进程只占用虚拟地址,页在第一次访问时由缺页异常补上清0的页框,无须再清0
+            a = vaddr_get(pg_cnt);
+            if (a == NULL) {
+                return NULL;
+            }
+            a->desc = NULL;
+            a->cnt = pg_cnt;
+            a->large = true;
+            return (void*) (a + 1);
+        }
+        lock_acquire(&mem_pool->lock);
+        malloc_stat.lock_ops++;
         a = malloc_page(PF, pg_cnt);
         if (a != NULL) {
             // 将分配的内存清0
-            memset(a, 0, pg_cnt * PG_SIZE);
+            memset(a + 1, 0, size);
             // 对于分配的大块页框,将desc置为NULL,cnt置为页框数,large为true
             a->desc = NULL;
             a->cnt = pg_cnt;
@@ -297,7 +688,7 @@ void* sys_malloc(uint32_t size) {
             lock_release(&mem_pool->lock);
             return NULL;
         }
-    } else { // 若申请的内存小于1024字节,则在各种规格的mem_block_desc中去适配
+    } else { // 若申请的内存不超过2048字节,则在各种规格的mem_block_desc中去适配
         uint32_t desc_idx;
         // 从内存块描述符中匹配合适的内存规格块
         for (desc_idx = 0;desc_idx < DESC_CNT;desc_idx++) {
@@ -306,38 +697,25 @@ void* sys_malloc(uint32_t size) {
                 break;
             }
         }
-        // 当mem_block_desc的free_list没有可用的mem_block
-        // 就创建新的arena提供mem_block
-        if (list_empty(&descs[desc_idx].free_list)) {
-            a = malloc_page(PF, 1); // 分配1页内存作为arena
-            if (a == NULL) {
-                lock_release(&mem_pool->lock);
-                return NULL;
+        // 弹匣只被当前任务访问,不空时无须加锁,空了才持锁一次从arena批量补充
+        struct mem_magazine* mag = &cur_thread->mags[desc_idx];
+        if (mag->cnt == 0) {
+            lock_acquire(&mem_pool->lock);
+            malloc_stat.lock_ops++;
+            while (mag->cnt < MAG_BATCH && (b = block_take(PF, &descs[desc_idx])) != NULL) {
+                mag->blocks[mag->cnt++] = b;
             }
-            memset(a, 0, PG_SIZE);
-            // 对于分配的小块内存,将desc置为相应内存块描述符
-            // cnt置为此arena可用的内存块数,large为false
-            a->desc = &descs[desc_idx];
-            a->large = false;
-            a->cnt = descs[desc_idx].blocks_per_arena;
-            uint32_t block_idx;
-
-            enum intr_status old_status = intr_disable();
-            // 开始将arena拆分成内存块,并添加到内存块描述符的free_list中
-            for (block_idx = 0;block_idx < descs[desc_idx].blocks_per_arena;block_idx++) {
-                b = arena2block(a, block_idx);
-                ASSERT(!elem_find(&a->desc->free_list, &b->free_elem));
-                list_append(&a->desc->free_list, &b->free_elem);
+            lock_release(&mem_pool->lock);
+            malloc_stat.refills++;
+            if (mag->cnt == 0) {
+                return NULL;
             }
-            intr_set_status(old_status);
+        } else {
+            malloc_stat.mag_allocs++;
         }
         // 开始分配内存块
-        b = elem2entry(struct mem_block, free_elem, list_pop(&(descs[desc_idx].free_list)));
+        b = mag->blocks[--mag->cnt];
         memset(b, 0, descs[desc_idx].block_size);
-
-        a = block2arena(b); // 获取内存块b所在的arena
-        a->cnt--;
-        lock_release(&mem_pool->lock);
         return (void*) b;
     }
 }
@@ -347,121 +725,228 @@ void pfree(uint32_t pg_phy_addr) {
     struct pool* mem_pool;
     uint32_t bit_idx = 0;
     if (pg_phy_addr >= user_pool.phy_addr_start) { // 用户物理池
+        // 页框仍被其它进程共享时只减少引用数
+        if (page_ref_dec(pg_phy_addr) > 0) {
+            return;
+        }
         mem_pool = &user_pool;
         bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
     } else { // 内核物理池
         mem_pool = &kernel_pool;
         bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
     }
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);
+    if (mem_pool->frames != NULL) {
+        buddy_free(mem_pool, pg_phy_addr, 0);
+    } else {
+        bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);
+    }
 }
 
-/** 去掉页表中虚拟地址vaddr的映射,只去掉vaddr对应的pte */
-static void page_table_pte_remove(uint32_t vaddr) {
+/**
+ * 解除用户进程虚拟页vaddr的映射并释放其物理页框,
+ * 不修改虚拟地址位图,vaddr未映射时什么都不做
+ */
+void page_unmap(uint32_t vaddr) {
+    uint32_t* pde = pde_ptr(vaddr);
+    // pde不存在时不能访问pte,否则会引发缺页异常
+    if (!(*pde & PG_P_1)) return;
     uint32_t* pte = pte_ptr(vaddr);
-    *pte &= ~PG_P_1; // 将页表项pte的P位置0
-    asm volatile ("invlpg %0"::"m" (vaddr):"memory");    //更新tlb
+    if (!(*pte & PG_P_1)) return;
+    lock_acquire(&user_pool.lock);
+    pfree(*pte & 0xfffff000);
+    lock_release(&user_pool.lock);
+    *pte = 0; // 连同PG_COW_1等标记一起清除
+    asm volatile ("invlpg %0"::"m" (vaddr):"memory");
 }
 
-/** 在虚拟地址池中释放以_vaddr起始的连续pg_cnt个虚拟页地址 */
-static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
-    uint32_t bit_idx_start = 0, vaddr = (uint32_t) _vaddr, cnt = 0;
-
-    if (pf == PF_KERNEL) { // 内核虚拟内存池
-        bit_idx_start = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-        while (cnt < pg_cnt) {
-            bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 0);
-        }
-    } else { // 用户虚拟内存池
-        struct task_struct* cur_thread = running_thread();
-        bit_idx_start = (vaddr - cur_thread->userprog_vaddr.vaddr_start) / PG_SIZE;
-        while (cnt < pg_cnt) {
-            bitmap_set(&cur_thread->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 0);
-        }
-    }
+/** 在当前进程的虚拟地址池中释放以_vaddr起始的连续pg_cnt个虚拟页地址 */
+static void vaddr_remove(void* _vaddr, uint32_t pg_cnt) {
+    struct task_struct* cur_thread = running_thread();
+    uint32_t bit_idx_start = ((uint32_t) _vaddr - cur_thread->userprog_vaddr.vaddr_start) / PG_SIZE;
+    bitmap_set_range(&cur_thread->userprog_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt, 0);
 }
 
 /** 释放以虚拟地址vaddr为起始的cnt个物理页 */
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
-    uint32_t pg_phy_addr;
     uint32_t vaddr = (uint32_t) _vaddr, page_cnt = 0;
     ASSERT(pg_cnt >= 1 && vaddr % PG_SIZE == 0);
-    pg_phy_addr = addr_v2p(vaddr); // 获取虚拟地址vaddr对应的物理地址
-    // 确保待释放的物理内存在低端1M+1k大小的页目录+1k大小的页表地址范围外
-    ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= 0x102000);
-    if (pg_phy_addr >= user_pool.phy_addr_start) { // 位于用户内存池
-        vaddr -= PG_SIZE;
+    if (pf == PF_USER) { // 位于用户内存池
+        // 按需分配的页可能从未被访问而没有映射,page_unmap只回收已映射的页
         while (page_cnt < pg_cnt) {
-            vaddr += PG_SIZE;
-            pg_phy_addr = addr_v2p(vaddr);
-            // 确保物理地址属于用户物理内存池
-            ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= user_pool.phy_addr_start);
-            // 先将对应的物理页归还到内存池
-            pfree(pg_phy_addr);
-            // 再从页表中清除此虚拟地址所在的页表项pte
-            page_table_pte_remove(vaddr);
+            page_unmap(vaddr + page_cnt * PG_SIZE);
             page_cnt++;
         }
         // 清空虚拟地址的位图的相应位
-        vaddr_remove(pf, _vaddr, page_cnt);
+        vaddr_remove(_vaddr, page_cnt);
     } else { // 位于内核内存池
-        vaddr -= PG_SIZE;
+        // 线性映射区中物理页连续,只归还页框,映射保持不变
+        uint32_t pg_phy_addr = vaddr - KERNEL_VADDR_START;
+        ASSERT(pg_phy_addr >= kernel_pool.phy_addr_start &&
+               pg_phy_addr + pg_cnt * PG_SIZE <= user_pool.phy_addr_start);
         while (page_cnt < pg_cnt) {
-            vaddr += PG_SIZE;
-            pg_phy_addr = addr_v2p(vaddr);
-            // 确保释放的物理内存只属于内核物理内存池中
-            ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= kernel_pool.phy_addr_start &&
-                   pg_phy_addr < user_pool.phy_addr_start);
-            // 先将对应的物理页归还到内存池中
-            pfree(pg_phy_addr);
-            // 再从页表中清除此虚拟地址所对应的页表项pte
-            page_table_pte_remove(vaddr);
+            pfree(pg_phy_addr + page_cnt * PG_SIZE);
             page_cnt++;
         }
-        // 清空虚拟地址的位图的相应位
-        vaddr_remove(pf, _vaddr, page_cnt);
     }
 }
 
+/** 将大块内存a留在任务的页块缓存中,不解除映射,缓存已满或页数不合规格时返回false */
+static bool run_cache_put(struct task_struct* cur_thread, struct arena* a) {
+    uint32_t run_class = 0;
+    while (run_class < RUN_CLASS_CNT && (1U << run_class) != a->cnt) {
+        run_class++;
+    }
+    if (run_class == RUN_CLASS_CNT || cur_thread->run_cache_pages + a->cnt > RUN_CACHE_PAGES) {
+        return false;
+    }
+    struct mem_run_cache* rc = &cur_thread->run_caches[run_class];
+    if (rc->cnt == RUN_CACHE_MAX) {
+        return false;
+    }
+    rc->runs[rc->cnt++] = a;
+    cur_thread->run_cache_pages += a->cnt;
+    malloc_stat.run_puts++;
+    return true;
+}
+
 /** 回收内存ptr */
 void sys_free(void* ptr) {
     ASSERT(ptr != NULL);
     if (ptr != NULL) {
         enum pool_flags PF;
         struct pool* mem_pool;
+        struct mem_block_desc* descs;
+        struct task_struct* cur_thread = running_thread();
         // 判断是线程还是进程
-        if (running_thread()->pgdir == NULL) {
+        if (cur_thread->pgdir == NULL) {
 //            ASSERT((uint32_t)ptr >= K_HEAP_START);
             PF = PF_KERNEL;
             mem_pool = &kernel_pool;
+            descs = k_block_descs;
         } else {
             PF = PF_USER;
             mem_pool = &user_pool;
+            descs = cur_thread->u_block_desc;
         }
-        lock_acquire(&mem_pool->lock);
         struct mem_block* b = ptr;
         struct arena* a = block2arena(b);
         ASSERT(a->large == 0 || a->large == 1);
-        if (a->desc == NULL && a->large == true) { // 大于1024字节
+        malloc_stat.frees++;
+        if (a->desc == NULL && a->large == true) { // 大于2048字节
+            if (run_cache_put(cur_thread, a)) {
+                return;
+            }
+            lock_acquire(&mem_pool->lock);
+            malloc_stat.lock_ops++;
             mfree_page(PF, a, a->cnt);
-        } else { // 小于等于1024字节
-            // 先将内存块回收到free_list
-            list_append(&a->desc->free_list, &b->free_elem);
-            // 再判断此arena中的内存块是否都是空闲,如果是就释放arena
-            if (++a->cnt == a->desc->blocks_per_arena) {
-                uint32_t block_idx;
-                for (block_idx = 0;block_idx < a->desc->blocks_per_arena;block_idx++) {
-                    b = arena2block(a, block_idx);
-                    ASSERT(elem_find(&a->desc->free_list, &b->free_elem));
-                    list_remove(&b->free_elem);
-                }
-                mfree_page(PF, a, 1);
+            lock_release(&mem_pool->lock);
+            return;
+        }
+        // 小于等于2048字节,属于本任务的内存块描述符时放入弹匣
+        uint32_t desc_idx = ((uint32_t) a->desc - (uint32_t) descs) / sizeof(struct mem_block_desc);
+        if (desc_idx >= DESC_CNT || a->desc != &descs[desc_idx]) {
+            lock_acquire(&mem_pool->lock);
+            malloc_stat.lock_ops++;
+            block_put(PF, b);
+            lock_release(&mem_pool->lock);
+            return;
+        }
+        struct mem_magazine* mag = &cur_thread->mags[desc_idx];
+        if (mag->cnt == MAG_SIZE) {
+            // 弹匣满了,持锁一次把最早放入的一批内存块归还arena,较热的块留在弹匣中
+            lock_acquire(&mem_pool->lock);
+            malloc_stat.lock_ops++;
+            uint32_t idx = 0;
+            while (idx < MAG_BATCH) {
+                block_put(PF, mag->blocks[idx++]);
             }
+            while (idx < MAG_SIZE) {
+                mag->blocks[idx - MAG_BATCH] = mag->blocks[idx];
+                idx++;
+            }
+            mag->cnt -= MAG_BATCH;
+            lock_release(&mem_pool->lock);
+            malloc_stat.drains++;
+        } else {
+            malloc_stat.mag_frees++;
         }
-        lock_release(&mem_pool->lock);
+        mag->blocks[mag->cnt++] = b;
     }
 }
 
+/**
+ * 把task弹匣中缓存的内存块全部归还arena,空闲的arena随之释放.
+ * 内核线程可由任何任务代为归还;用户进程的内存块位于其自己的地址空间,须由它自己调用
+ */
+void mag_drain(struct task_struct* task) {
+    enum pool_flags PF = task->pgdir == NULL ? PF_KERNEL : PF_USER;
+    struct pool* mem_pool = PF == PF_KERNEL ? &kernel_pool : &user_pool;
+    ASSERT(PF == PF_KERNEL || task == running_thread());
+    lock_acquire(&mem_pool->lock);
+    uint32_t desc_idx = 0;
+    while (desc_idx < DESC_CNT) {
+        struct mem_magazine* mag = &task->mags[desc_idx];
+        while (mag->cnt > 0) {
+            block_put(PF, mag->blocks[--mag->cnt]);
+        }
+        desc_idx++;
+    }
+    lock_release(&mem_pool->lock);
+}
+
+/** 释放task页块缓存中的全部页块,调用规则同mag_drain */
+void run_cache_drain(struct task_struct* task) {
+    enum pool_flags PF = task->pgdir == NULL ? PF_KERNEL : PF_USER;
+    struct pool* mem_pool = PF == PF_KERNEL ? &kernel_pool : &user_pool;
+    ASSERT(PF == PF_KERNEL || task == running_thread());
+    lock_acquire(&mem_pool->lock);
+    uint32_t run_class = 0;
+    while (run_class < RUN_CLASS_CNT) {
+        struct mem_run_cache* rc = &task->run_caches[run_class];
+        while (rc->cnt > 0) {
+            struct arena* a = rc->runs[--rc->cnt];
+            task->run_cache_pages -= a->cnt;
+            mfree_page(PF, a, a->cnt);
+        }
+        run_class++;
+    }
+    lock_release(&mem_pool->lock);
+}
+
+/**
+ * 将当前进程的堆结尾调整为new_brk,收缩时释放新结尾之上已分配的页,
+ * 扩展时只修改结尾,新页在第一次访问时按需分配
+ * @param new_brk 为0或超出堆区时不作调整
+ * @return 调整后的堆结尾
+ */
+uint32_t sys_brk(uint32_t new_brk) {
+    struct task_struct* cur = running_thread();
+    if (cur->pgdir == NULL) {
+        return 0;
+    }
+    if (new_brk < USER_HEAP_START || new_brk > USER_HEAP_START + USER_HEAP_SIZE) {
+        return cur->brk;
+    }
+    uint32_t vaddr = (new_brk + PG_SIZE - 1) & 0xfffff000;
+    uint32_t old_end = (cur->brk + PG_SIZE - 1) & 0xfffff000;
+    while (vaddr < old_end) {
+        page_unmap(vaddr);
+        vaddr += PG_SIZE;
+    }
+    cur->brk = new_brk;
+    return new_brk;
+}
+
+/** 打印sys_malloc/sys_free的弹匣统计,lock_ops与调用次数之比即持锁比例 */
+void malloc_stat_print(void) {
+    printk("malloc: mallocs %d  frees %d  pool lock %d\n",
+           malloc_stat.mallocs, malloc_stat.frees, malloc_stat.lock_ops);
+    printk("magazine: alloc hits %d  free hits %d  refills %d  drains %d\n",
+           malloc_stat.mag_allocs, malloc_stat.mag_frees, malloc_stat.refills, malloc_stat.drains);
+    printk("page runs: hits %d  cached frees %d\n", malloc_stat.run_hits, malloc_stat.run_puts);
+    printk("demand-zero faults: %d\n", malloc_stat.zero_faults);
+}
+
 /** 初始化内存池 */
 static void mem_pool_init(uint32_t all_mem) {
     put_str("   mem_pool_init start\n");
@@ -520,16 +1005,62 @@ static void mem_pool_init(uint32_t all_mem) {
 
     lock_init(&kernel_pool.lock);
     lock_init(&user_pool.lock);
+    put_str("   mem_pool_init done\n");
+}
 
-    /* 初始化虚拟地址的位图,按实际物理内存大小生成数组 */
-    // 用于维护内核堆的虚拟地址,所以要和内核内存池大小一致
-    kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_length;
-    // 位图的数组指向一块未使用的内存,目前定位在内核物理内存池和用户物理内存池之后
-    kernel_vaddr.vaddr_bitmap.bits = (void*) (MEM_BITMAP_BASE + kbm_length + ubm_length);
+/**
+ * 把物理地址[0, 用户内存池起始)线性映射到KERNEL_VADDR_START,内核代码、数据和内核内存池都在其中.
+ * cpu支持PSE时用4MB大页,支持PGE时再标为全局页,切换进程重新加载cr3时不会被刷出TLB;
+ * 否则在loader建好的页表中逐页映射.
+ * 进程页目录复制的是这些pde,所以须在创建第一个进程之前完成
+ */
+static void kernel_map_init(void) {
+    uint32_t edx = cpuid(1, NULL, NULL, NULL);
+    uint32_t map_end = user_pool.phy_addr_start;
+    uint32_t page_phyaddr;
+    if (edx & CPUID_PSE) {
+        // 先打开PSE再写入大页pde,否则PS位被忽略,pde会被当作指向页表
+        cr4_write(cr4_read() | CR4_PSE);
+        uint32_t global = edx & CPUID_PGE ? PG_G_1 : 0;
+        for (page_phyaddr = 0; page_phyaddr < map_end; page_phyaddr += LARGE_PG_SIZE) {
+            *pde_ptr(KERNEL_VADDR_START + page_phyaddr) =
+                    page_phyaddr | global | PG_PS_1 | PG_US_U | PG_RW_W | PG_P_1;
+        }
+        if (global) {
+            // 打开PGE会刷新整个TLB,其后缓存的大页才带全局标记
+            cr4_write(cr4_read() | CR4_PGE);
+        } else {
+            tlb_flush();
+        }
+        put_str("   kernel mapped by 4MB pages");
+        put_str(global ? ", global\n" : "\n");
+    } else {
+        // 低端1M已由loader映射
+        for (page_phyaddr = 0x100000; page_phyaddr < map_end; page_phyaddr += PG_SIZE) {
+            *pte_ptr(KERNEL_VADDR_START + page_phyaddr) = page_phyaddr | PG_US_U | PG_RW_W | PG_P_1;
+        }
+        tlb_flush();
+        put_str("   kernel mapped by 4KB pages\n");
+    }
+}
 
-    kernel_vaddr.vaddr_start = K_HEAP_START;
-    bitmap_init(&kernel_vaddr.vaddr_bitmap);
-    put_str("   mem_pool_init done\n");
+static uint32_t mmio_next = MMIO_VADDR_START; // 设备映射区中下一个空闲页
+
+/**
+ * 把物理地址phy_addr所在的一页设备寄存器映射到设备映射区,禁止缓存且只有内核可访问.
+ * 与kernel_map_init一样,新建的页表只有之后创建的进程才能看到,须在创建第一个进程之前调用
+ * @return phy_addr对应的虚拟地址
+ */
+void* mmio_map(uint32_t phy_addr) {
+    uint32_t vaddr = mmio_next;
+    ASSERT(vaddr - MMIO_VADDR_START < LARGE_PG_SIZE);
+    if (!page_table_create(vaddr)) {
+        PANIC("mmio_map: create page table failed!");
+    }
+    *pte_ptr(vaddr) = (phy_addr & 0xfffff000) | PG_PCD_1 | PG_US_S | PG_RW_W | PG_P_1;
+    asm volatile ("invlpg %0" : : "m" (*(char*) vaddr) : "memory");
+    mmio_next += PG_SIZE;
+    return (void*) (vaddr | (phy_addr & 0xfff));
 }
 
 /** 初始化内存块描述符 */
@@ -539,25 +1070,111 @@ void block_desc_init(struct mem_block_desc* desc_array) {
     for (desc_idx = 0; desc_idx < DESC_CNT;desc_idx++) {
         desc_array[desc_idx].block_size = block_size;
         // 初始化arena中的内存块数量
-        desc_array[desc_idx].blocks_per_arena =
-                (PG_SIZE - sizeof(struct arena)) / block_size;
+        if (block_size == ARENA_PAIR_BLOCK) {
+            desc_array[desc_idx].blocks_per_arena = (2 * PG_SIZE - ARENA_PAIR_BLOCK) / block_size;
+        } else {
+            desc_array[desc_idx].blocks_per_arena = (PG_SIZE - sizeof(struct arena)) / block_size;
+        }
         list_init(&desc_array[desc_idx].free_list);
         block_size *= 2;
     }
 }
 
-/** 根据物理页框地址pg_phy_addr将相应内存的位图清0,不改动页表 */
+/** 将物理页框pg_phy_addr归还内存池,不改动页表 */
 void free_a_phy_page(uint32_t pg_phy_addr) {
-    struct pool* mem_pool;
-    uint32_t bit_idx = 0;
-    if (pg_phy_addr >= user_pool.phy_addr_start) {
-        mem_pool = &user_pool;
-        bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
+    pfree(pg_phy_addr);
+}
+
+/**
+ * 处理写时复制页的写异常:页框只剩自己引用时直接恢复写权限,
+ * 否则分配新页框,复制原页内容后让当前进程独占新页框
+ * @param vaddr 引起异常的虚拟地址
+ * @return 不是写时复制页或内存不足时返回false
+ */
+static bool cow_page_copy(uint32_t vaddr) {
+    uint32_t* pde = pde_ptr(vaddr);
+    uint32_t* pte = pte_ptr(vaddr);
+    if (!(*pde & 0x00000001) || !(*pte & 0x00000001) || !(*pte & PG_COW_1)) {
+        return false;
+    }
+    uint32_t page_vaddr = vaddr & 0xfffff000;
+    uint32_t old_phyaddr = *pte & 0xfffff000;
+    uint32_t bit_idx = (old_phyaddr - user_pool.phy_addr_start) / PG_SIZE;
+    lock_acquire(&user_pool.lock);
+    if (user_page_refs[bit_idx] == 1) {
+        // 其它共享者都已经复制或退出,当前进程独占此页
+        *pte = (*pte & ~PG_COW_1) | PG_RW_W;
     } else {
-        mem_pool = &kernel_pool;
-        bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
+        // 先分配页框,palloc之后到复制结束前不会阻塞,cow_buf不会被其它任务改写
+        void* new_phyaddr = palloc(&user_pool);
+        if (new_phyaddr == NULL) {
+            lock_release(&user_pool.lock);
+            return false;
+        }
+        memcpy(cow_buf, (void*) page_vaddr, PG_SIZE);
+        *pte = (uint32_t) new_phyaddr | ((*pte & 0x00000fff & ~PG_COW_1) | PG_RW_W);
+        asm volatile ("invlpg %0"::"m" (*(char*) page_vaddr):"memory");
+        memcpy((void*) page_vaddr, cow_buf, PG_SIZE);
+        user_page_refs[bit_idx]--;
+    }
+    asm volatile ("invlpg %0"::"m" (*(char*) page_vaddr):"memory");
+    lock_release(&user_pool.lock);
+    return true;
+}
+
+/**
+ * 为当前进程虚拟地址位图中已占用但尚未映射的页补上清0的页框.
+ * 大块堆内存、brk堆区和用户栈都只占用虚拟地址,第一次访问时才经此分配物理页
+ * @return vaddr未被占用或内存不足时返回false
+ */
+static bool anon_page_in(uint32_t vaddr) {
+    struct task_struct* cur = running_thread();
+    if (vaddr < cur->userprog_vaddr.vaddr_start) {
+        return false;
+    }
+    uint32_t bit_idx = (vaddr - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
+    if (!bitmap_scan_test(&cur->userprog_vaddr.vaddr_bitmap, bit_idx)) {
+        return false;
     }
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);
+    uint32_t vaddr_page = vaddr & 0xfffff000;
+    // 堆区中只有brk之下的页可用
+    if (vaddr_page >= USER_HEAP_START && vaddr_page < USER_HEAP_START + USER_HEAP_SIZE
+        && vaddr_page >= cur->brk) {
+        return false;
+    }
+    if (get_a_page_without_opvaddrbitmap(PF_USER, vaddr_page) == NULL) {
+        return false;
+    }
+    memset((void*) vaddr_page, 0, PG_SIZE);
+    malloc_stat.zero_faults++;
+    return true;
+}
+
+/** 缺页异常处理函数,无法处理的异常交给general_intr_handler打印后悬停 */
+static void intr_page_fault_handler(uint32_t vec_nr) {
+    // kernel.S的VECTOR宏在调用处理函数前最后压入的是中断号,
+    // 参数vec_nr所在的位置正是intr_stack的起始处,由此可取得错误码
+    struct intr_stack* frame = (struct intr_stack*) &vec_nr;
+    uint32_t fault_vaddr;
+    asm ("movl %%cr2, %0" : "=r" (fault_vaddr));
+    struct task_struct* cur = running_thread();
+    // 只处理用户进程在用户空间中的缺页,内核态访问用户页同样会走到这里
+    if (cur->pgdir != NULL && fault_vaddr < 0xc0000000) {
+        if ((frame->err_code & PF_ERR_P) && (frame->err_code & PF_ERR_W)) {
+            // 写时复制页
+            if (cow_page_copy(fault_vaddr)) {
+                return;
+            }
+        } else if (!(frame->err_code & PF_ERR_P)) {
+            // 尚未读入的程序段页,或按需清0的堆和栈页.
+            // 程序段页读入失败时不能当作清0页,交给下面打印后悬停
+            int32_t seg = segment_page_in(fault_vaddr);
+            if (seg == 1 || (seg == 0 && anon_page_in(fault_vaddr))) {
+                return;
+            }
+        }
+    }
+    general_intr_handler((uint8_t) vec_nr);
 }
 
 /* 内存管理部分初始化入口 */
@@ -565,7 +1182,29 @@ void mem_init() {
     put_str("mem_init start\n");
     uint32_t mem_bytes_total = (*(uint32_t*)(0xb00));
     mem_pool_init(mem_bytes_total); // 初始化内存池
+    kernel_map_init();
     block_desc_init(k_block_descs);
+    // 用户物理内存池每个页框对应一个16位的引用数
+    uint32_t user_pages = user_pool.pool_bitmap.btmp_bytes_len * 8;
+    user_page_refs = get_kernel_pages(DIV_ROUND_UP(user_pages * sizeof(uint16_t), PG_SIZE));
+    if (user_page_refs == NULL) {
+        PANIC("mem_init: alloc user_page_refs failed!");
+    }
+    // 伙伴系统的页框信息数组也在启动阶段用位图分配,之后两个内存池都改由伙伴系统管理
+    uint32_t kernel_pages = kernel_pool.pool_bitmap.btmp_bytes_len * 8;
+    struct page_frame* kernel_frames =
+            get_kernel_pages(DIV_ROUND_UP(kernel_pages * sizeof(struct page_frame), PG_SIZE));
+    struct page_frame* user_frames =
+            get_kernel_pages(DIV_ROUND_UP(user_pages * sizeof(struct page_frame), PG_SIZE));
+    if (kernel_frames == NULL || user_frames == NULL) {
+        PANIC("mem_init: alloc buddy frames failed!");
+    }
+    buddy_init(&kernel_pool, kernel_frames);
+    buddy_init(&user_pool, user_frames);
+    slab_init();
+    // 置cr0的WP位,使内核写只读页时同样触发缺页异常,写时复制对内核态的写也能生效
+    asm volatile ("movl %%cr0, %%eax; orl $0x10000, %%eax; movl %%eax, %%cr0" : : : "eax", "memory");
+    register_handler(0x0e, intr_page_fault_handler);
     put_str("mem_init done\n");
 }
 
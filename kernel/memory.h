@@ -16,6 +16,15 @@ enum pool_flags {
 #define	 PG_RW_W  2	// R/W 属性位值, 读/写/执行
 #define	 PG_US_S  0	// U/S 属性位值, 系统级
 #define	 PG_US_U  4	// U/S 属性位值, 用户级
+#define	 PG_PS_1  0x80	// 页目录项的PS位,为1表示直接映射4MB大页
+#define	 PG_G_1   0x100	// 全局页,cr4的PGE打开后重新加载cr3时不会被刷出TLB
+#define	 PG_COW_1 0x200	// AVL位中的第0位,标记该页为写时复制的共享页
+#define	 PG_PCD_1 0x10	// 禁止缓存,用于设备寄存器
+
+/* 内核空间起始,物理地址[0, 用户内存池起始)线性映射于此,内核内存池的页都经此访问 */
+#define KERNEL_VADDR_START 0xc0000000
+/* 设备寄存器的映射区,占页目录第1020项 */
+#define MMIO_VADDR_START 0xff000000
 
 /* 用于虚拟地址管理 */
 struct virtual_addr {
@@ -35,7 +44,29 @@ struct mem_block_desc {
     struct list free_list;    // 目前可用的mem_block链表
 };
 
-#define DESC_CNT 7  // 内存块描述符大小
+#define DESC_CNT 8  // 内存块规格数,16字节到2048字节
+#define ARENA_PAIR_BLOCK 2048 // 最大的内存块,其arena跨两页,头部之后放3块
+#define MAG_SIZE 8  // 每个弹匣最多缓存的内存块数
+#define MAG_BATCH (MAG_SIZE / 2) // 弹匣每次批量补充或归还的内存块数
+
+/** 任务私有的内存块弹匣,每种规格一个,只被所属任务访问,存取无须加锁 */
+struct mem_magazine {
+    uint32_t cnt;                         // 弹匣中的内存块数
+    struct mem_block* blocks[MAG_SIZE];   // 栈式存放,最后放入的最先取出
+};
+
+#define RUN_CLASS_CNT 5      // 大块内存按页数分级,依次为1、2、4、8、16页
+#define RUN_MAX_PAGES (1 << (RUN_CLASS_CNT - 1))
+#define RUN_CACHE_MAX 2      // 每级最多缓存的页块数
+#define RUN_CACHE_PAGES 16   // 每个任务最多缓存的总页数
+
+/** 任务私有的已映射页块缓存,释放的大块内存不解除映射,留给同级的下次分配 */
+struct mem_run_cache {
+    uint32_t cnt;
+    void* runs[RUN_CACHE_MAX]; // 页块起始处的arena
+};
+struct task_struct;
+#define BUDDY_MAX_ORDER 10  // 伙伴系统最大块为2^10页,即4MB
 
 extern struct pool kernel_pool, user_pool;
 void mem_init(void);
@@ -51,7 +82,19 @@ void block_desc_init(struct mem_block_desc* desc_array);
 void* sys_malloc(uint32_t size);
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
 void pfree(uint32_t pg_phy_addr);
+uint32_t palloc_pages(enum pool_flags pf, uint32_t order);
+void pfree_pages(enum pool_flags pf, uint32_t pg_phy_addr, uint32_t order);
+void page_slab_set(const void* vaddr, void* slab);
+void* page_slab_get(const void* vaddr);
 void sys_free(void* ptr);
+void mag_drain(struct task_struct* task);
+void run_cache_drain(struct task_struct* task);
+uint32_t sys_brk(uint32_t new_brk);
+void malloc_stat_print(void);
 void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr);
 void free_a_phy_page(uint32_t pg_phy_addr);
+void page_ref_inc(uint32_t pg_phy_addr);
+bool page_table_create(uint32_t vaddr);
+void page_unmap(uint32_t vaddr);
+void* mmio_map(uint32_t phy_addr);
 #endif
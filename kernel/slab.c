@@ -0,0 +1,218 @@
+#include "slab.h"
+#include "memory.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "../lib/string.h"
+#include "../lib/kernel/print.h"
+#include "../lib/kernel/stdio-kernel.h"
+
+#define PG_SIZE 4096
+#define SLAB_BUFCTL_END 0xffff // 空闲对象链的结尾
+#define SLAB_OFF_MAX_OBJS (PG_SIZE / SLAB_OFF_THRESHOLD) // 页外描述符的slab最多容纳的对象数
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+/** slab描述符,管理1页中的对象 */
+struct slab {
+    struct list_elem slab_tag;  // 在cache的slabs_full/partial/free中的标记
+    struct kmem_cache* cache;   // 所属cache
+    void* page;                 // slab所在页的虚拟地址
+    uint8_t* s_mem;             // 第一个对象的地址,已加上着色偏移
+    uint16_t inuse;             // 已分配出去的对象数
+    uint16_t free;              // 第一个空闲对象的下标
+    uint16_t bufctl[];          // bufctl[i]为对象i之后的下一个空闲对象的下标
+};
+
+static struct kmem_cache cache_cache;  // 存放各kmem_cache结构的cache
+static struct kmem_cache slab_cache;   // 存放页外slab描述符的cache
+static struct list cache_chain;        // 所有cache
+
+/** 按对象大小和对齐计算cache的布局 */
+static void cache_setup(struct kmem_cache* cache, const char* name,
+                        uint32_t size, uint32_t align, slab_ctor ctor) {
+    if (align < sizeof(uint32_t)) {
+        align = sizeof(uint32_t);
+    }
+    ASSERT((align & (align - 1)) == 0 && size > 0 && size <= PG_SIZE);
+    memset(cache, 0, sizeof(struct kmem_cache));
+    strcpy(cache->name, name);
+    cache->obj_size = ALIGN_UP(size, align);
+    cache->ctor = ctor;
+    cache->off_slab = cache->obj_size >= SLAB_OFF_THRESHOLD;
+    if (cache->off_slab) {
+        cache->obj_offset = 0;
+        cache->objs_per_slab = PG_SIZE / cache->obj_size;
+    } else {
+        // 页首依次是slab描述符、bufctl数组,之后按align对齐放对象
+        uint32_t cnt = (PG_SIZE - sizeof(struct slab)) / (cache->obj_size + sizeof(uint16_t));
+        while (ALIGN_UP(sizeof(struct slab) + cnt * sizeof(uint16_t), align) +
+               cnt * cache->obj_size > PG_SIZE) {
+            cnt--;
+        }
+        cache->objs_per_slab = cnt;
+        cache->obj_offset = ALIGN_UP(sizeof(struct slab) + cnt * sizeof(uint16_t), align);
+    }
+    // 剩余空间用于着色,使不同slab中同下标的对象落在不同的cache行上
+    uint32_t left_over = PG_SIZE - cache->obj_offset - cache->objs_per_slab * cache->obj_size;
+    cache->color_unit = ALIGN_UP(SLAB_CACHE_LINE, align);
+    cache->color_cnt = left_over / cache->color_unit + 1;
+    cache->color_next = 0;
+    list_init(&cache->slabs_full);
+    list_init(&cache->slabs_partial);
+    list_init(&cache->slabs_free);
+    list_append(&cache_chain, &cache->cache_tag);
+}
+
+/** 为cache新建一个slab,对象均已构造,失败返回NULL */
+static struct slab* cache_grow(struct kmem_cache* cache) {
+    void* page = get_kernel_pages(1);
+    if (page == NULL) {
+        return NULL;
+    }
+    struct slab* slab;
+    if (cache->off_slab) {
+        slab = kmem_cache_alloc(&slab_cache);
+        if (slab == NULL) {
+            mfree_page(PF_KERNEL, page, 1);
+            return NULL;
+        }
+    } else {
+        slab = page;
+    }
+    enum intr_status old_status = intr_disable();
+    uint32_t color = cache->color_next;
+    cache->color_next = (cache->color_next + 1) % cache->color_cnt;
+    intr_set_status(old_status);
+
+    slab->cache = cache;
+    slab->page = page;
+    slab->s_mem = (uint8_t*) page + cache->obj_offset + color * cache->color_unit;
+    slab->inuse = 0;
+    slab->free = 0;
+    uint32_t idx = 0;
+    while (idx < cache->objs_per_slab) {
+        slab->bufctl[idx] = idx + 1 < cache->objs_per_slab ? idx + 1 : SLAB_BUFCTL_END;
+        if (cache->ctor != NULL) {
+            cache->ctor(slab->s_mem + idx * cache->obj_size);
+        }
+        idx++;
+    }
+    page_slab_set(page, slab);
+    return slab;
+}
+
+/** 将空slab所在的页归还内核内存池 */
+static void slab_destroy(struct kmem_cache* cache, struct slab* slab) {
+    void* page = slab->page;
+    page_slab_set(page, NULL);
+    if (cache->off_slab) {
+        kmem_cache_free(&slab_cache, slab);
+    }
+    mfree_page(PF_KERNEL, page, 1);
+}
+
+/**
+ * 创建名为name的对象cache
+ * @param size  对象大小,不超过1页
+ * @param align 对象对齐,须为2的幂,0表示按4字节对齐
+ * @param ctor  对象构造函数,可为NULL
+ * @return 失败返回NULL
+ */
+struct kmem_cache* kmem_cache_create(const char* name, uint32_t size, uint32_t align, slab_ctor ctor) {
+    ASSERT(strlen(name) < SLAB_NAME_LEN);
+    struct kmem_cache* cache = kmem_cache_alloc(&cache_cache);
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache_setup(cache, name, size, align, ctor);
+    return cache;
+}
+
+/** 从cache分配一个已构造的对象,失败返回NULL */
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+    struct slab* slab;
+    enum intr_status old_status = intr_disable();
+    if (!list_empty(&cache->slabs_partial)) {
+        slab = elem2entry(struct slab, slab_tag, cache->slabs_partial.head.next);
+    } else if (!list_empty(&cache->slabs_free)) {
+        slab = elem2entry(struct slab, slab_tag, list_pop(&cache->slabs_free));
+        cache->free_slabs--;
+        list_push(&cache->slabs_partial, &slab->slab_tag);
+    } else {
+        // 新建slab要分配页,不能在关中断时进行
+        intr_set_status(old_status);
+        slab = cache_grow(cache);
+        if (slab == NULL) {
+            return NULL;
+        }
+        old_status = intr_disable();
+        list_push(&cache->slabs_partial, &slab->slab_tag);
+        cache->total_objs += cache->objs_per_slab;
+        cache->stat.grows++;
+    }
+    void* obj = slab->s_mem + slab->free * cache->obj_size;
+    slab->free = slab->bufctl[slab->free];
+    if (++slab->inuse == cache->objs_per_slab) {
+        list_remove(&slab->slab_tag);
+        list_push(&cache->slabs_full, &slab->slab_tag);
+    }
+    cache->active_objs++;
+    cache->stat.allocs++;
+    intr_set_status(old_status);
+    return obj;
+}
+
+/** 将对象obj归还cache,obj须保持构造后的状态 */
+void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+    struct slab* slab = page_slab_get(obj);
+    ASSERT(slab != NULL && slab->cache == cache);
+    uint32_t idx = ((uint8_t*) obj - slab->s_mem) / cache->obj_size;
+    ASSERT(idx < cache->objs_per_slab);
+    bool reap = false;
+    enum intr_status old_status = intr_disable();
+    slab->bufctl[idx] = slab->free;
+    slab->free = idx;
+    if (slab->inuse-- == cache->objs_per_slab) {
+        list_remove(&slab->slab_tag);
+        list_push(&cache->slabs_partial, &slab->slab_tag);
+    }
+    if (slab->inuse == 0) {
+        list_remove(&slab->slab_tag);
+        if (cache->free_slabs < SLAB_FREE_KEEP) {
+            list_push(&cache->slabs_free, &slab->slab_tag);
+            cache->free_slabs++;
+        } else {
+            cache->total_objs -= cache->objs_per_slab;
+            cache->stat.reaps++;
+            reap = true;
+        }
+    }
+    cache->active_objs--;
+    cache->stat.frees++;
+    intr_set_status(old_status);
+    if (reap) {
+        slab_destroy(cache, slab);
+    }
+}
+
+/** 打印所有cache的统计信息 */
+void kmem_cache_stat_print(void) {
+    struct list_elem* elem = cache_chain.head.next;
+    while (elem != &cache_chain.tail) {
+        struct kmem_cache* cache = elem2entry(struct kmem_cache, cache_tag, elem);
+        printk("slab %s: size %d  objs %d/%d  slabs %d  allocs %d  frees %d  grows %d  reaps %d\n",
+               cache->name, cache->obj_size, cache->active_objs, cache->total_objs,
+               cache->total_objs / cache->objs_per_slab, cache->stat.allocs,
+               cache->stat.frees, cache->stat.grows, cache->stat.reaps);
+        elem = elem->next;
+    }
+}
+
+/** slab分配器初始化,须在内存池建立之后进行 */
+void slab_init(void) {
+    put_str("   slab_init start\n");
+    list_init(&cache_chain);
+    cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL);
+    cache_setup(&slab_cache, "slab",
+                sizeof(struct slab) + SLAB_OFF_MAX_OBJS * sizeof(uint16_t), 0, NULL);
+    put_str("   slab_init done\n");
+}
@@ -0,0 +1,52 @@
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+#include "../lib/stdint.h"
+#include "../lib/kernel/list.h"
+#include "global.h"
+
+#define SLAB_NAME_LEN 16
+#define SLAB_CACHE_LINE 32     // 着色偏移的单位,即cache行大小
+#define SLAB_OFF_THRESHOLD 512 // 对象不小于此值时slab描述符放在页外
+#define SLAB_FREE_KEEP 2       // 每个cache最多保留的空slab数,多余的归还内核内存池
+
+/** 对象构造函数,slab新建时对每个对象调用一次,对象释放回cache时须保持构造后的状态 */
+typedef void (*slab_ctor)(void* obj);
+
+/** cache的统计信息 */
+struct kmem_cache_stat {
+    uint32_t allocs;  // 分配次数
+    uint32_t frees;   // 释放次数
+    uint32_t grows;   // 新建slab次数
+    uint32_t reaps;   // 空slab归还内存池的次数
+};
+
+/**
+ * 同一类型对象的缓存,每个slab占1页,
+ * 小对象的slab描述符放在页首,大对象的放在页外
+ */
+struct kmem_cache {
+    char name[SLAB_NAME_LEN];
+    uint32_t obj_size;      // 按align对齐后的对象大小
+    uint32_t objs_per_slab; // 每个slab的对象数
+    uint32_t obj_offset;    // 第一个对象相对页首的偏移,不含着色
+    uint32_t color_unit;    // 着色偏移的单位
+    uint32_t color_cnt;     // 可用的着色数
+    uint32_t color_next;    // 下一个新建slab使用的着色
+    bool off_slab;          // slab描述符是否在页外
+    slab_ctor ctor;
+    struct list slabs_full;    // 对象全部分配出去的slab
+    struct list slabs_partial; // 部分分配的slab
+    struct list slabs_free;    // 对象全部空闲的slab
+    uint32_t free_slabs;       // slabs_free中的slab数
+    uint32_t total_objs;       // 所有slab中的对象数
+    uint32_t active_objs;      // 已分配出去的对象数
+    struct kmem_cache_stat stat;
+    struct list_elem cache_tag; // 在cache_chain中的标记
+};
+
+void slab_init(void);
+struct kmem_cache* kmem_cache_create(const char* name, uint32_t size, uint32_t align, slab_ctor ctor);
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+void kmem_cache_stat_print(void);
+#endif
@@ -0,0 +1,275 @@
+#include "smp.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "../lib/string.h"
+#include "../lib/kernel/print.h"
+#include "../userprog/process.h"
+#include "../userprog/tss.h"
+#include "../device/lapic.h"
+#include "../device/timer.h"
+#include "../device/clock.h"
+
+#define PG_SIZE 4096
+#define LOW_MEM_VADDR(phy) ((void*) (0xc0000000 + (phy))) // loader映射的低端1MB
+#define AP_TRAMPOLINE_PHY 0x70000  // AP启动代码的物理地址,须与trampoline.S中的定义一致
+#define AP_BOOT_TIMEOUT_US 100000  // 等待AP启动的最长时间
+
+/* MP规范中的结构,BIOS以此描述系统中的处理器 */
+#define MP_FLOAT_SIG 0x5f504d5f   // "_MP_"
+#define MP_CONFIG_SIG 0x504d4350  // "PCMP"
+#define MP_ENTRY_PROCESSOR 0
+#define MP_PROC_ENABLED 0x01
+
+/** MP浮点结构,位于EBDA的第1KB、基本内存的最后1KB或BIOS ROM中,16字节对齐 */
+struct mp_float {
+    uint32_t signature;
+    uint32_t config_phy;  // MP配置表的物理地址,为0时使用默认配置
+    uint8_t length;       // 以16字节为单位
+    uint8_t spec_rev;
+    uint8_t checksum;
+    uint8_t features[5];
+} __attribute__ ((packed));
+
+/** MP配置表头,其后紧跟entry_count个表项 */
+struct mp_config {
+    uint32_t signature;
+    uint16_t base_length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table_phy;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_phy;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__ ((packed));
+
+/** 处理器表项,其余类型的表项都是8字节 */
+struct mp_processor {
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t apic_ver;
+    uint8_t flags;        // 位0为1表示可用,位1为1表示是BSP
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} __attribute__ ((packed));
+
+/** 由BSP填写在复制后的AP启动代码中,布局与trampoline.S中的ap_boot_params一致 */
+struct ap_boot_params {
+    uint32_t cr0;
+    uint32_t cr4;
+    uint32_t esp;
+    uint32_t entry;
+};
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_boot_params[];
+
+struct cpu cpus[SMP_MAX_CPUS] = {
+    {.active_pgdir = KERNEL_PGDIR_PHY_ADDR}
+};
+uint32_t cpu_cnt = 1;
+bool smp_active;
+
+/* 正在启动的AP的状态,由AP和BSP用cmpxchg从AP_WAITING改为后两者之一 */
+#define AP_WAITING 0
+#define AP_BOOTED 1     // AP在超时前进入了ap_main
+#define AP_ABANDONED 2  // BSP已放弃,此后才进入ap_main的AP停机
+static volatile uint32_t ap_state;
+
+/** 对[addr, addr + len)逐字节求和,MP规范的结构都要求和为0 */
+static uint8_t mp_sum(uint8_t* addr, uint32_t len) {
+    uint8_t sum = 0;
+    while (len-- > 0) {
+        sum += *addr++;
+    }
+    return sum;
+}
+
+/** 在物理地址[phy, phy + len)中找MP浮点结构,找不到返回NULL */
+static struct mp_float* mp_float_search(uint32_t phy, uint32_t len) {
+    uint8_t* addr = LOW_MEM_VADDR(phy);
+    uint8_t* end = addr + len;
+    while (addr + sizeof(struct mp_float) <= end) {
+        struct mp_float* mpf = (struct mp_float*) addr;
+        if (mpf->signature == MP_FLOAT_SIG && mp_sum(addr, sizeof(struct mp_float)) == 0) {
+            return mpf;
+        }
+        addr += 16;
+    }
+    return NULL;
+}
+
+/**
+ * 按MP规范查找系统中可用的处理器,apic id存入apic_ids
+ * @return 处理器数,没有MP表时返回0
+ */
+static uint32_t mp_scan(uint8_t* apic_ids) {
+    // BIOS数据区0x40e处为EBDA的段基址,0x413处为以KB为单位的基本内存大小
+    uint32_t ebda = (uint32_t) *(uint16_t*) LOW_MEM_VADDR(0x40e) << 4;
+    uint32_t base_kb = *(uint16_t*) LOW_MEM_VADDR(0x413);
+    struct mp_float* mpf = NULL;
+    if (ebda != 0) {
+        mpf = mp_float_search(ebda, 1024);
+    }
+    if (mpf == NULL) {
+        mpf = mp_float_search(base_kb * 1024 - 1024, 1024);
+    }
+    if (mpf == NULL) {
+        mpf = mp_float_search(0xf0000, 0x10000);
+    }
+    // 只处理低端1MB中的配置表,不支持没有配置表的默认配置
+    if (mpf == NULL || mpf->config_phy == 0 || mpf->config_phy >= 0x100000) {
+        return 0;
+    }
+    struct mp_config* conf = LOW_MEM_VADDR(mpf->config_phy);
+    if (conf->signature != MP_CONFIG_SIG || mp_sum((uint8_t*) conf, conf->base_length) != 0) {
+        return 0;
+    }
+    uint8_t* entry = (uint8_t*) (conf + 1);
+    uint32_t idx = 0, cnt = 0;
+    while (idx++ < conf->entry_count) {
+        if (*entry != MP_ENTRY_PROCESSOR) {
+            entry += 8;
+            continue;
+        }
+        struct mp_processor* proc = (struct mp_processor*) entry;
+        if ((proc->flags & MP_PROC_ENABLED) && cnt < SMP_MAX_CPUS) {
+            apic_ids[cnt++] = proc->apic_id;
+        }
+        entry += sizeof(struct mp_processor);
+    }
+    return cnt;
+}
+
+/** 以TSC忙等us微秒,启动AP时BSP关着中断,不能靠时钟中断计时 */
+static void smp_udelay(uint32_t us) {
+    uint64_t end = clock_ns() + (uint64_t) us * 1000;
+    while (clock_ns() < end) {
+        asm volatile ("pause");
+    }
+}
+
+/** AP进入内核后的入口,运行在其idle线程的pcb所在页上 */
+static void ap_main(void) {
+    if (!__sync_bool_compare_and_swap(&ap_state, AP_WAITING, AP_BOOTED)) {
+        // BSP等待超时后已释放了这个cpu号,不能再使用它的pcb和cpus[]中的项
+        while (1) {
+            asm volatile ("cli; hlt");
+        }
+    }
+    idt_load();
+    tss_ap_init();
+    lapic_ap_init();
+    // BSP在init_all中开中断时才放开内核锁,AP在此等待
+    intr_lock();
+    timer_ap_init();
+    thread_ap_idle();
+}
+
+/** 让其它cpu重新调度的核间中断 */
+static void intr_resched_handler(void) {
+    lapic_eoi();
+    if (this_cpu()->need_resched) {
+        schedule();
+    }
+}
+
+/** 给cpu发核间中断,使其重新调度,停机的cpu也会被唤醒 */
+void smp_resched(uint32_t cpu) {
+    lapic_ipi(cpus[cpu].apic_id, LAPIC_IPI_FIXED | SMP_RESCHED_VECTOR);
+}
+
+/**
+ * 按INIT-SIPI-SIPI的顺序启动apic id为apic_id的AP,使其成为第cpu_cnt个cpu
+ * @return AP在超时前进入了ap_main时返回true
+ */
+static bool ap_boot(uint8_t apic_id, struct ap_boot_params* params) {
+    struct task_struct* idle = thread_idle_create(cpu_cnt);
+    if (idle == NULL) {
+        return false;
+    }
+    params->esp = (uint32_t) idle + PG_SIZE;
+    ap_state = AP_WAITING;
+
+    lapic_ipi(apic_id, LAPIC_IPI_INIT);
+    smp_udelay(10000);
+    uint32_t sipi = 0;
+    while (sipi++ < 2 && ap_state == AP_WAITING) {
+        lapic_ipi(apic_id, LAPIC_IPI_STARTUP | (AP_TRAMPOLINE_PHY >> 12));
+        smp_udelay(200);
+    }
+    uint32_t waited = 0;
+    while (ap_state == AP_WAITING && waited < AP_BOOT_TIMEOUT_US) {
+        smp_udelay(100);
+        waited += 100;
+    }
+    // 与AP抢着改状态,AP恰在超时时进入ap_main也只有一方成功
+    if (__sync_bool_compare_and_swap(&ap_state, AP_WAITING, AP_ABANDONED)) {
+        // 迟到的AP仍可能在跳板代码中用idle页上的栈,这一页不再回收
+        release_pid(idle->pid);
+        return false;
+    }
+    struct cpu* cpu = &cpus[cpu_cnt];
+    cpu->apic_id = apic_id;
+    cpu->idle = cpu->current = idle;
+    cpu->active_pgdir = KERNEL_PGDIR_PHY_ADDR;
+    list_append(&thread_all_list, &idle->all_list_tag);
+    cpu_cnt++;
+    return true;
+}
+
+/**
+ * 查找并启动其它处理器.AP需要自己的lapic时钟中断,且要用TSC计时,
+ * 所以须在timer_init、thread_init和tss_init之后,开中断之前调用
+ */
+void smp_init(void) {
+    put_str("smp_init start\n");
+    uint8_t apic_ids[SMP_MAX_CPUS];
+    uint32_t cnt = 0;
+    if (timer_lapic_tick() && clock_tsc_khz() != 0) {
+        cnt = mp_scan(apic_ids);
+    }
+    if (cnt <= 1) {
+        put_str("   single cpu\n");
+        put_str("smp_init done\n");
+        return;
+    }
+    cpus[0].apic_id = lapic_id();
+    register_handler(SMP_RESCHED_VECTOR, intr_resched_handler);
+
+    uint32_t size = ap_trampoline_end - ap_trampoline_start;
+    memcpy(LOW_MEM_VADDR(AP_TRAMPOLINE_PHY), ap_trampoline_start, size);
+    struct ap_boot_params* params = LOW_MEM_VADDR(AP_TRAMPOLINE_PHY +
+            (ap_boot_params - ap_trampoline_start));
+    params->cr0 = cr0_read();
+    params->cr4 = cr4_read();
+    params->entry = (uint32_t) ap_main;
+
+    // BSP正关着中断,此后关中断要持有内核锁,先补上
+    smp_active = true;
+    intr_lock();
+    uint32_t idx;
+    for (idx = 0; idx < cnt; idx++) {
+        if (apic_ids[idx] == cpus[0].apic_id) {
+            continue;
+        }
+        if (!ap_boot(apic_ids[idx], params)) {
+            // 迟到的AP可能读到下一个AP的启动参数,不再启动其余的AP
+            put_str("   ap start failed, apic id 0x");
+            put_int(apic_ids[idx]);
+            put_str("\n");
+            break;
+        }
+    }
+    put_str("   cpus online: 0x");
+    put_int(cpu_cnt);
+    put_str("\n");
+    put_str("smp_init done\n");
+}
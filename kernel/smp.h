@@ -0,0 +1,32 @@
+#ifndef __KERNEL_SMP_H
+#define __KERNEL_SMP_H
+#include "../lib/stdint.h"
+#include "global.h"
+#include "../thread/thread.h"
+
+#define SMP_MAX_CPUS 8
+#define SMP_RESCHED_VECTOR 0x30  // 让其它cpu重新调度的核间中断
+
+/** 每个cpu私有的数据,以cpu_id()为下标,cpus[0]为BSP */
+struct cpu {
+    uint8_t apic_id;               // local APIC的id,发送核间中断时使用
+    bool need_resched;             // 被唤醒的任务级别高于此cpu的当前任务,尽快抢占
+    struct task_struct* current;   // 正在此cpu上运行的任务
+    struct task_struct* idle;      // 此cpu的idle线程
+    uint32_t active_pgdir;         // 此cpu的cr3中页目录的物理地址
+};
+
+extern struct cpu cpus[SMP_MAX_CPUS];
+extern uint32_t cpu_cnt;   // 已上线的cpu数
+extern bool smp_active;    // 有AP上线后为true,此后关中断的代码段由内核锁在cpu之间互斥
+
+/* 当前cpu的下标,记在正在运行的任务的pcb中,关中断期间任务不会被换到其它cpu */
+#define cpu_id() (running_thread()->cpu)
+
+static inline struct cpu* this_cpu(void) {
+    return &cpus[cpu_id()];
+}
+
+void smp_init(void);
+void smp_resched(uint32_t cpu);
+#endif
@@ -5,9 +5,58 @@
 #include "../../kernel/interrupt.h"
 #include "../../kernel/debug.h"
 
+#define WORD_BITS 32
+
+/* 位图以32位字为单位扫描,末尾不足一个字的部分按字节拼出,超出位图的位视为已置1 */
+static uint32_t word_get(struct bitmap* btmp, uint32_t word_idx) {
+    uint32_t byte_idx = word_idx * 4;
+    if (byte_idx + 4 <= btmp->btmp_bytes_len) {
+        return *(uint32_t*) (btmp->bits + byte_idx);
+    }
+    uint32_t w = 0xffffffff, byte_odd = 0;
+    while (byte_idx + byte_odd < btmp->btmp_bytes_len) {
+        w &= ~(0xffU << (byte_odd * 8));
+        w |= (uint32_t) btmp->bits[byte_idx + byte_odd] << (byte_odd * 8);
+        byte_odd++;
+    }
+    return w;
+}
+
+/* 根据第word_idx个字是否已全部置1更新摘要位图 */
+static void summary_update(struct bitmap* btmp, uint32_t word_idx) {
+    if (btmp->summary == NULL) {
+        return;
+    }
+    uint32_t mask = 1U << (word_idx % WORD_BITS);
+    if (word_get(btmp, word_idx) == 0xffffffff) {
+        btmp->summary[word_idx / WORD_BITS] |= mask;
+    } else {
+        btmp->summary[word_idx / WORD_BITS] &= ~mask;
+    }
+}
+
 /* 将位图btmp初始化 */
 void bitmap_init(struct bitmap* btmp) {
     memset(btmp->bits, 0, btmp->btmp_bytes_len);
+    btmp->hint = 0;
+    if (btmp->summary != NULL) {
+        memset(btmp->summary, 0, BITMAP_SUMMARY_BYTES(btmp->btmp_bytes_len));
+    }
+}
+
+/**
+ * 为位图挂上摘要位图并按当前内容建立,
+ * 此后对位图的修改须经bitmap_set/bitmap_set_range,否则摘要会失效
+ * @param summary 至少BITMAP_SUMMARY_BYTES(btmp->btmp_bytes_len)字节
+ */
+void bitmap_summary_init(struct bitmap* btmp, uint32_t* summary) {
+    btmp->summary = summary;
+    memset(summary, 0, BITMAP_SUMMARY_BYTES(btmp->btmp_bytes_len));
+    uint32_t word_cnt = DIV_ROUND_UP(btmp->btmp_bytes_len, 4);
+    uint32_t word_idx = 0;
+    while (word_idx < word_cnt) {
+        summary_update(btmp, word_idx++);
+    }
 }
 
 /* 判断bit_idx位是否为1, 若为1则返回true, 否则返回false */
@@ -17,51 +66,73 @@ bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx) {
     return (btmp->bits[byte_idx] & (BITMAP_MASK <<  bit_odd));
 }
 
-/* 在位图中申请连续cnt个位,成功则返回其起始位下标, 失败返回-1 */
-int bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
-    uint32_t idx_byte = 0;    // 用于记录空闲位所在的字节
-    // 先逐字节比较,蛮力法
-    while ((0xff == btmp->bits[idx_byte]) && (idx_byte < btmp->btmp_bytes_len)) {
-        // 1表示该位已分配,所以若为0xff,则表示该字节内已无空闲位,向下一字节继续找
-        idx_byte++;
+/**
+ * 在位图的[start, end)范围内从前往后找连续cnt个空闲位
+ * @return 起始位下标, 找不到返回-1
+ */
+int bitmap_scan_from(struct bitmap* btmp, uint32_t start, uint32_t end, uint32_t cnt) {
+    if (end > btmp->btmp_bytes_len * 8) {
+        end = btmp->btmp_bytes_len * 8;
     }
-
-    ASSERT(idx_byte < btmp->btmp_bytes_len);
-    if (idx_byte == btmp->btmp_bytes_len) { // 若该内存池找不到可用空间
-        return -1;
+    uint32_t bit_idx = start, run = 0, run_start = start;
+    // run为紧挨bit_idx之前已找到的连续空闲位数,剩余的位不够凑成cnt个时提前结束
+    while (bit_idx < end && end - bit_idx + run >= cnt) {
+        uint32_t word_idx = bit_idx / WORD_BITS;
+        uint32_t bit_odd = bit_idx % WORD_BITS;
+        if (bit_odd == 0 && btmp->summary != NULL) {
+            // 摘要位图中连续为1的字都已满,一次跳过
+            uint32_t s = btmp->summary[word_idx / WORD_BITS] >> (word_idx % WORD_BITS);
+            if (s & 1) {
+                bit_idx += (~s == 0 ? WORD_BITS : bit_ffs(~s)) * WORD_BITS;
+                run = 0;
+                continue;
+            }
+        }
+        // 本字中从bit_idx起可检查的位数
+        uint32_t avail = WORD_BITS - bit_odd;
+        if (avail > end - bit_idx) {
+            avail = end - bit_idx;
+        }
+        uint32_t used = word_get(btmp, word_idx) >> bit_odd;
+        if (avail < WORD_BITS) {
+            used &= (1U << avail) - 1;
+        }
+        if (run == 0) {
+            run_start = bit_idx;
+        }
+        if (used == 0) {
+            run += avail;
+            if (run >= cnt) {
+                return run_start;
+            }
+            bit_idx += avail;
+            continue;
+        }
+        if (run + bit_ffs(used) >= cnt) {
+            return run_start;
+        }
+        if (cnt >= WORD_BITS) {
+            // 字内两个置1位之间放不下cnt个空闲位,只能从本字最高的置1位之后开始
+            bit_idx += bit_fls(used) + 1;
+        } else {
+            bit_idx += bit_ffs(used) + 1;
+        }
+        run = 0;
     }
+    return -1;
+}
 
-    /* 若在位图数组范围内的某字节内找到了空闲位，
-     * 在该字节内逐位比对,返回空闲位的索引。*/
-    int idx_bit = 0;
-    // 该字节的逐个位进行对比
-    while ((uint8_t)(BITMAP_MASK << idx_bit) & btmp->bits[idx_byte]) {
-        idx_bit++;
+/* 在位图中申请连续cnt个位,从上次分配的结尾开始找(next-fit),成功则返回其起始位下标, 失败返回-1 */
+int bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
+    uint32_t total = btmp->btmp_bytes_len * 8;
+    uint32_t hint = btmp->hint < total ? btmp->hint : 0;
+    int bit_idx_start = bitmap_scan_from(btmp, hint, total, cnt);
+    if (bit_idx_start == -1 && hint > 0) {
+        // 回到开头再找,可以与hint之后的空闲位连成一片
+        bit_idx_start = bitmap_scan_from(btmp, 0, hint + cnt - 1, cnt);
     }
-    // 空闲位在位图内的下标
-    int bit_idx_start = idx_byte * 8 + idx_bit;
-    if (cnt == 1) {
-        return bit_idx_start;
-    }
-    // 记录还有多少位可以进行判断
-    uint32_t bit_left = (btmp->btmp_bytes_len * 8 - bit_idx_start);
-    uint32_t next_bit = (uint32_t) (bit_idx_start + 1);
-    // 用于记录找到空闲位的个数
-    uint32_t count = 1;
-
-    bit_idx_start = -1;
-    while (bit_left-- > 0) {
-        if (!bitmap_scan_test(btmp, next_bit)) {
-            count++;
-        } else {
-            count = 0;
-        }
-        if (count == cnt) {
-            // 找到连续cnt个位
-            bit_idx_start = next_bit - cnt + 1;
-            break;
-        }
-        next_bit++;
+    if (bit_idx_start != -1) {
+        btmp->hint = bit_idx_start + cnt;
     }
     return bit_idx_start;
 }
@@ -79,6 +150,42 @@ void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value) {
     } else {
         btmp->bits[byte_idx] &= ~(BITMAP_MASK << bit_odd);
     }
+    summary_update(btmp, bit_idx / WORD_BITS);
 }
 
-
+/* 将位图btmp从bit_idx起的连续cnt位设置为value,按字批量修改 */
+void bitmap_set_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt, int8_t value) {
+    ASSERT(value == 0 || value == 1);
+    ASSERT(bit_idx + cnt <= btmp->btmp_bytes_len * 8);
+    while (cnt > 0) {
+        uint32_t word_idx = bit_idx / WORD_BITS;
+        uint32_t bit_odd = bit_idx % WORD_BITS;
+        uint32_t bit_cnt = WORD_BITS - bit_odd;
+        if (bit_cnt > cnt) {
+            bit_cnt = cnt;
+        }
+        if ((word_idx + 1) * 4 <= btmp->btmp_bytes_len) {
+            uint32_t* w = (uint32_t*) (btmp->bits + word_idx * 4);
+            uint32_t mask = (bit_cnt == WORD_BITS ? 0xffffffff : (1U << bit_cnt) - 1) << bit_odd;
+            if (value) {
+                *w |= mask;
+            } else {
+                *w &= ~mask;
+            }
+        } else {
+            // 位图末尾不足一个字,逐位修改
+            uint32_t idx = bit_idx;
+            while (idx < bit_idx + bit_cnt) {
+                if (value) {
+                    btmp->bits[idx / 8] |= (BITMAP_MASK << (idx % 8));
+                } else {
+                    btmp->bits[idx / 8] &= ~(BITMAP_MASK << (idx % 8));
+                }
+                idx++;
+            }
+        }
+        summary_update(btmp, word_idx);
+        bit_idx += bit_cnt;
+        cnt -= bit_cnt;
+    }
+}
@@ -6,10 +6,32 @@ struct bitmap {
     uint32_t btmp_bytes_len;
 /* 在遍历位图时,整体上以字节为单位,细节上是以位为单位,所以此处位图的指针必须是单字节 */
     uint8_t* bits;
+    uint32_t hint;      // 下次扫描的起始位,上次分配的结尾,实现next-fit
+    uint32_t* summary;  // 摘要位图,第i位为1表示第i个32位字已全部置1,为NULL时不使用
 };
 
+/* 字节长度为bytes_len的位图所需摘要位图的字节数 */
+#define BITMAP_SUMMARY_BYTES(bytes_len) ((((bytes_len) + 127) / 128) * 4)
+
+/* 返回w中最低的置1位的下标,w不能为0 */
+static inline uint32_t bit_ffs(uint32_t w) {
+    uint32_t idx;
+    asm ("bsfl %1, %0" : "=r" (idx) : "rm" (w) : "cc");
+    return idx;
+}
+
+/* 返回w中最高的置1位的下标,w不能为0 */
+static inline uint32_t bit_fls(uint32_t w) {
+    uint32_t idx;
+    asm ("bsrl %1, %0" : "=r" (idx) : "rm" (w) : "cc");
+    return idx;
+}
+
 void bitmap_init(struct bitmap* btmp);
+void bitmap_summary_init(struct bitmap* btmp, uint32_t* summary);
 bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx);
 int bitmap_scan(struct bitmap* btmp, uint32_t cnt);
+int bitmap_scan_from(struct bitmap* btmp, uint32_t start, uint32_t end, uint32_t cnt);
 void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value);
-#endif
\ No newline at end of file
+void bitmap_set_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt, int8_t value);
+#endif
@@ -21,6 +21,11 @@ static inline void outb(uint16_t port, uint8_t data) {
    /****************************************************/
 }
 
+/* 向端口port写入一个双字 */
+static inline void outl(uint16_t port, uint32_t data) {
+   asm volatile ("outl %0, %w1" : : "a" (data), "Nd" (port));
+}
+
 /* 将addr处起始的word_cnt个字写入端口port */
 static inline void outsw(uint16_t port, const void* addr, uint32_t word_cnt) {
 /*********************************************************
@@ -38,6 +43,13 @@ static inline uint8_t inb(uint16_t port) {
    return data;
 }
 
+/* 将从端口port读入的一个双字返回 */
+static inline uint32_t inl(uint16_t port) {
+   uint32_t data;
+   asm volatile ("inl %w1, %0" : "=a" (data) : "Nd" (port));
+   return data;
+}
+
 /* 将从端口port读入的word_cnt个字写入addr */
 static inline void insw(uint16_t port, void* addr, uint32_t word_cnt) {
 /******************************************************
@@ -1,28 +1,122 @@
 #include "string.h"
 #include "user/assert.h"
 
-/* 将dst_起始的size个字节置为value */
+#define KERNEL_SPACE 0xc0000000 // 内核空间起始,与页表映射一致
+#define SSE2_COPY_MIN 512         // 不小于此长度的复制才值得走SSE2
+#define SSE2_CHUNK_BLOCKS 64      // 每次关中断复制的64字节块数,即4KB
+
+/**
+ * 是否用SSE2复制大块内存,由内核检测到SSE2并打开CR4.OSFXSR后置为1,
+ * 用户进程中始终为0
+ */
+int string_use_sse2 = 0;
+
+/* 从src复制dwords个双字和bytes个字节到dst,用rep movs完成 */
+static void copy_forward(uint8_t* dst, const uint8_t* src, uint32_t dwords, uint32_t bytes) {
+    asm volatile ("cld; rep movsl" : "+D" (dst), "+S" (src), "+c" (dwords) : : "memory");
+    asm volatile ("rep movsb" : "+D" (dst), "+S" (src), "+c" (bytes) : : "memory");
+}
+
+/**
+ * 用xmm0~xmm3以64字节为单位复制blocks块,dst须16字节对齐
+ * 内核切换任务时不保存xmm寄存器,所以每段复制都关中断进行,
+ * 且只用于内核地址,保证复制过程中不会缺页而被换下cpu
+ */
+static void copy_sse2(uint8_t* dst, const uint8_t* src, uint32_t blocks) {
+    while (blocks > 0) {
+        uint32_t chunk = blocks < SSE2_CHUNK_BLOCKS ? blocks : SSE2_CHUNK_BLOCKS;
+        blocks -= chunk;
+        asm volatile ("pushfl; cli\n"
+                      "1: movdqu (%1), %%xmm0\n"
+                      "movdqu 16(%1), %%xmm1\n"
+                      "movdqu 32(%1), %%xmm2\n"
+                      "movdqu 48(%1), %%xmm3\n"
+                      "movdqa %%xmm0, (%0)\n"
+                      "movdqa %%xmm1, 16(%0)\n"
+                      "movdqa %%xmm2, 32(%0)\n"
+                      "movdqa %%xmm3, 48(%0)\n"
+                      "addl $64, %1\n"
+                      "addl $64, %0\n"
+                      "decl %2\n"
+                      "jnz 1b\n"
+                      "popfl"
+                      : "+r" (dst), "+r" (src), "+r" (chunk) : : "memory", "cc");
+    }
+}
+
+/* 将dst_起始的size个字节置为value,先逐字节对齐到4字节边界,再用rep stosl按双字填充 */
 void memset(void* dst_, uint8_t value, uint32_t size) {
-    assert(dst_ != NULL);
     uint8_t* dst = (uint8_t*)dst_;
-    while (size-- > 0)
+    while (size > 0 && ((uint32_t) dst & 3)) {
         *dst++ = value;
+        size--;
+    }
+    uint32_t word = value * 0x01010101U;
+    uint32_t dwords = size / 4;
+    uint32_t bytes = size % 4;
+    asm volatile ("cld; rep stosl" : "+D" (dst), "+c" (dwords) : "a" (word) : "memory");
+    asm volatile ("rep stosb" : "+D" (dst), "+c" (bytes) : "a" (word) : "memory");
 }
 
-/* 将src_起始的size个字节复制到dst_ */
+/* 将src_起始的size个字节复制到dst_,两者不能重叠 */
 void memcpy(void* dst_, const void* src_, uint32_t size) {
-    assert(dst_ != NULL && src_ != NULL);
     uint8_t* dst = dst_;
     const uint8_t* src = src_;
-    while (size-- > 0)
-        *dst++ = *src++;
+    if (string_use_sse2 && size >= SSE2_COPY_MIN &&
+        (uint32_t) dst >= KERNEL_SPACE && (uint32_t) src >= KERNEL_SPACE) {
+        uint32_t head = (16 - ((uint32_t) dst & 15)) & 15;
+        copy_forward(dst, src, 0, head);
+        dst += head;
+        src += head;
+        size -= head;
+        copy_sse2(dst, src, size / 64);
+        dst += size & ~63U;
+        src += size & ~63U;
+        size &= 63;
+    }
+    // 先按字节把dst对齐到4字节边界,对齐后的rep movsl最快
+    uint32_t head = (4 - ((uint32_t) dst & 3)) & 3;
+    if (head > size) {
+        head = size;
+    }
+    copy_forward(dst, src, 0, head);
+    copy_forward(dst + head, src + head, (size - head) / 4, (size - head) % 4);
+}
+
+/* 将src_起始的size个字节复制到dst_,两者可以重叠 */
+void memmove(void* dst_, const void* src_, uint32_t size) {
+    uint8_t* dst = dst_;
+    const uint8_t* src = src_;
+    if (dst <= src || dst >= src + size) {
+        // 从前往后复制不会覆盖尚未复制的源数据
+        copy_forward(dst, src, size / 4, size % 4);
+        return;
+    }
+    // dst在src之后且有重叠,置DF后从末尾往前复制,先复制零头字节再复制双字
+    uint32_t dwords = size / 4;
+    uint32_t bytes = size % 4;
+    dst += size - 1;
+    src += size - 1;
+    asm volatile ("std; rep movsb" : "+D" (dst), "+S" (src), "+c" (bytes) : : "memory");
+    dst -= 3;
+    src -= 3;
+    asm volatile ("rep movsl; cld" : "+D" (dst), "+S" (src), "+c" (dwords) : : "memory");
 }
 
 /* 连续比较以地址a_和地址b_开头的size个字节,若相等则返回0,若a_大于b_返回+1,否则返回-1 */
 int memcmp(const void* a_, const void* b_, uint32_t size) {
     const char* a = a_;
     const char* b = b_;
-    assert(a != NULL || b != NULL);
+    // 先用repe cmpsl按双字跳过相同的部分,不同的那个双字再逐字节比较
+    uint32_t dwords = size / 4;
+    if (dwords > 0) {
+        uint32_t left = dwords;
+        asm volatile ("cld; repe cmpsl" : "+S" (a), "+D" (b), "+c" (left) : : "memory", "cc");
+        // 最后比较的双字无论是否相同都退回去逐字节比较
+        a -= 4;
+        b -= 4;
+        size -= (dwords - left - 1) * 4;
+    }
     while (size-- > 0) {
         if(*a != *b) {
             return *a > *b ? 1 : -1;
@@ -43,10 +137,24 @@ char* strcpy(char* dst_, const char* src_) {
 
 /* 返回字符串长度 */
 uint32_t strlen(const char* str) {
-    assert(str != NULL);
     const char* p = str;
-    while(*p++);
-    return (p - str - 1);
+    while (((uint32_t) p & 3) && *p) {
+        p++;
+    }
+    if (*p == 0) {
+        return p - str;
+    }
+    /* 对齐后一次检查4个字节,(w - 0x01010101) & ~w & 0x80808080非0当且仅当w中有0字节,
+     * 对齐的4字节不会跨页,读到串尾之后也不会缺页 */
+    const uint32_t* w = (const uint32_t*) p;
+    while (((*w - 0x01010101U) & ~*w & 0x80808080U) == 0) {
+        w++;
+    }
+    p = (const char*) w;
+    while (*p) {
+        p++;
+    }
+    return p - str;
 }
 
 /* 比较两个字符串,若a_中的字符大于b_中的字符返回1,相等时返回0,否则返回-1. */
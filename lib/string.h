@@ -1,8 +1,10 @@
 #ifndef __LIB_STRING_H
 #define __LIB_STRING_H
 #include "../lib/stdint.h"
+extern int string_use_sse2;
 void memset(void* dst_, uint8_t value, uint32_t size);
 void memcpy(void* dst_, const void* src_, uint32_t size);
+void memmove(void* dst_, const void* src_, uint32_t size);
 int memcmp(const void* a_, const void* b_, uint32_t size);
 char* strcpy(char* dst_, const char* src_);
 uint32_t strlen(const char* str);
@@ -0,0 +1,238 @@
+#include "malloc.h"
+#include "syscall.h"
+#include "assert.h"
+#include "../kernel/bitmap.h"
+#include "../../userprog/process.h"
+
+#define PG_SIZE 4096
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+#define HEAP_MAGIC 0x68656170  // "heap"
+#define CHUNK_ALIGN 8
+#define CHUNK_HDR 8            // 已分配块的开销:prev_size和head
+#define CHUNK_MIN 16           // 空闲块要容纳next和prev,不能更小
+#define C_INUSE 1              // 本块已分配
+#define P_INUSE 2              // 前一块已分配
+#define SIZE_MASK (~7U)
+#define SMALL_BINS 32          // 小于256字节的块按8字节分级,bins[i]中的块大小都是8i
+#define LARGE_BINS 24          // 不小于256字节的块按2的幂分级
+#define BIN_CNT (SMALL_BINS + LARGE_BINS)
+#define HEAP_GROW 0x10000      // 堆顶不够时每次至少扩展64KB
+#define HEAP_TRIM 0x20000      // 堆顶空闲超过128KB时把多出的部分还给内核
+
+/**
+ * 堆中的内存块,相邻块首尾相接,
+ * 已分配块只用到head,空闲块还在尾后下一块的prev_size中记录自身大小,释放时据此与前一块合并
+ */
+struct chunk {
+    uint32_t prev_size;  // 前一块空闲时为其大小
+    uint32_t head;       // 本块大小,低3位为C_INUSE、P_INUSE标志
+    struct chunk* next;  // 空闲时在bin中的后继
+    struct chunk* prev;  // 空闲时在bin中的前驱
+};
+
+/**
+ * 堆的管理信息,放在堆区起始处而非全局变量中:
+ * 用户进程的全局变量可能位于各进程共享的内核映像中,堆区则是每个进程私有的,
+ * fork时随地址空间复制,exec时随堆区一起清空,页全为0时表示尚未建立
+ */
+struct heap {
+    uint32_t magic;
+    uint32_t binmap[2];          // 第i位为1表示bins[i]非空
+    struct chunk* bins[BIN_CNT]; // 各级空闲块的双向链表
+    struct chunk* top;           // 堆顶尚未划分的块,一直延伸到brk,不在bins中
+};
+
+static struct heap* const heap = (struct heap*) USER_HEAP_START;
+
+static inline uint32_t chunk_size(struct chunk* c) {
+    return c->head & SIZE_MASK;
+}
+
+static inline struct chunk* chunk_at(struct chunk* c, uint32_t offset) {
+    return (struct chunk*) ((uint8_t*) c + offset);
+}
+
+/** 大小为size的块所在bin的下标 */
+static uint32_t bin_index(uint32_t size) {
+    if (size < SMALL_BINS * CHUNK_ALIGN) {
+        return size / CHUNK_ALIGN;
+    }
+    return SMALL_BINS + bit_fls(size) - 8;
+}
+
+static void bin_insert(struct chunk* c) {
+    uint32_t idx = bin_index(chunk_size(c));
+    c->prev = NULL;
+    c->next = heap->bins[idx];
+    if (c->next != NULL) {
+        c->next->prev = c;
+    }
+    heap->bins[idx] = c;
+    heap->binmap[idx / 32] |= 1U << (idx % 32);
+}
+
+static void bin_remove(struct chunk* c) {
+    uint32_t idx = bin_index(chunk_size(c));
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        heap->bins[idx] = c->next;
+        if (c->next == NULL) {
+            heap->binmap[idx / 32] &= ~(1U << (idx % 32));
+        }
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+}
+
+/** 返回不小于idx的第一个非空bin的下标,都为空时返回BIN_CNT */
+static uint32_t binmap_next(uint32_t idx) {
+    while (idx < BIN_CNT) {
+        uint32_t w = heap->binmap[idx / 32] & (0xffffffff << (idx % 32));
+        if (w != 0) {
+            return (idx & ~31U) + bit_ffs(w);
+        }
+        idx = (idx & ~31U) + 32;
+    }
+    return BIN_CNT;
+}
+
+/** 在bins中找一个不小于size的空闲块,找不到返回NULL */
+static struct chunk* bin_find(uint32_t size) {
+    uint32_t idx = bin_index(size);
+    if (idx >= SMALL_BINS) {
+        // 大块的bin中大小不一,本级中首次适配
+        struct chunk* c = heap->bins[idx];
+        while (c != NULL) {
+            if (chunk_size(c) >= size) {
+                return c;
+            }
+            c = c->next;
+        }
+        idx++;
+    }
+    // 更高级中的块都足够大,由binmap直接找到第一个非空的级
+    idx = binmap_next(idx);
+    return idx == BIN_CNT ? NULL : heap->bins[idx];
+}
+
+/** 将空闲块c标记为已分配,多出的部分不小于CHUNK_MIN时切下放回bins */
+static void chunk_use(struct chunk* c, uint32_t size) {
+    uint32_t c_size = chunk_size(c);
+    if (c_size - size >= CHUNK_MIN) {
+        struct chunk* rest = chunk_at(c, size);
+        rest->head = (c_size - size) | P_INUSE;
+        chunk_at(rest, c_size - size)->prev_size = c_size - size;
+        c->head = size | C_INUSE | (c->head & P_INUSE);
+        bin_insert(rest);
+    } else {
+        c->head |= C_INUSE;
+        chunk_at(c, c_size)->head |= P_INUSE;
+    }
+}
+
+/** 从堆顶切出size字节的块,堆顶不够时用sbrk扩展,失败返回NULL */
+static struct chunk* top_alloc(uint32_t size) {
+    struct chunk* c = heap->top;
+    uint32_t top_size = chunk_size(c);
+    // 堆顶至少留CHUNK_MIN字节,使其head总有地方存放
+    if (top_size < size + CHUNK_MIN) {
+        uint32_t grow = ALIGN_UP(size + CHUNK_MIN - top_size, HEAP_GROW);
+        if (sbrk(grow) == (void*) -1) {
+            return NULL;
+        }
+        top_size += grow;
+    }
+    uint32_t p_inuse = c->head & P_INUSE;
+    heap->top = chunk_at(c, size);
+    heap->top->head = (top_size - size) | P_INUSE;
+    c->head = size | C_INUSE | p_inuse;
+    return c;
+}
+
+/** 堆顶空闲过多时收缩brk,只保留HEAP_GROW左右 */
+static void heap_trim(void) {
+    uint32_t top_size = chunk_size(heap->top);
+    if (top_size <= HEAP_TRIM) {
+        return;
+    }
+    uint32_t release = (top_size - HEAP_GROW) & ~(PG_SIZE - 1);
+    if (sbrk(-(int32_t) release) != (void*) -1) {
+        heap->top->head -= release;
+    }
+}
+
+/** 在堆区起始处建立堆的管理信息,此时brk须在堆区起始处 */
+static bool heap_init(void) {
+    uint32_t hdr = ALIGN_UP(sizeof(struct heap), CHUNK_ALIGN);
+    if (sbrk(0) != (void*) USER_HEAP_START || sbrk(hdr + HEAP_GROW) == (void*) -1) {
+        return false;
+    }
+    // 堆区的页按需清0,bins和binmap不用再初始化
+    heap->top = (struct chunk*) (USER_HEAP_START + hdr);
+    heap->top->head = HEAP_GROW | P_INUSE;
+    heap->magic = HEAP_MAGIC;
+    return true;
+}
+
+/**
+ * 在用户态分配size字节的内存,只有堆需要扩展或收缩时才陷入内核
+ * @return 8字节对齐的地址,失败返回NULL
+ */
+void* malloc(uint32_t size) {
+    if (size == 0 || size >= USER_HEAP_SIZE) {
+        return NULL;
+    }
+    if (heap->magic != HEAP_MAGIC && !heap_init()) {
+        return NULL;
+    }
+    uint32_t need = ALIGN_UP(size + CHUNK_HDR, CHUNK_ALIGN);
+    if (need < CHUNK_MIN) {
+        need = CHUNK_MIN;
+    }
+    struct chunk* c = bin_find(need);
+    if (c != NULL) {
+        bin_remove(c);
+        chunk_use(c, need);
+    } else {
+        c = top_alloc(need);
+        if (c == NULL) {
+            return NULL;
+        }
+    }
+    return chunk_at(c, CHUNK_HDR);
+}
+
+/** 释放malloc得到的ptr,与相邻的空闲块合并 */
+void free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    struct chunk* c = chunk_at(ptr, -CHUNK_HDR);
+    assert(c->head & C_INUSE);
+    uint32_t size = chunk_size(c);
+    struct chunk* next = chunk_at(c, size);
+    if (!(c->head & P_INUSE)) {
+        // 相邻的空闲块总是已合并,前一块之前的块必然已分配
+        struct chunk* prev = chunk_at(c, -c->prev_size);
+        bin_remove(prev);
+        size += c->prev_size;
+        c = prev;
+    }
+    if (next == heap->top) {
+        c->head = (size + chunk_size(next)) | P_INUSE;
+        heap->top = c;
+        heap_trim();
+        return;
+    }
+    if (!(next->head & C_INUSE)) {
+        bin_remove(next);
+        size += chunk_size(next);
+    }
+    c->head = size | P_INUSE;
+    next = chunk_at(c, size);
+    next->prev_size = size;
+    next->head &= ~P_INUSE;
+    bin_insert(c);
+}
@@ -59,13 +59,13 @@ uint32_t write(int32_t fd, const void* buf, uint32_t count) {
    return _syscall3(SYS_WRITE, fd, buf, count);
 }
 
-/** 申请size字节大小的内存,并返回结果 */
-void* malloc(uint32_t size) {
+/** 由内核的sys_malloc申请size字节大小的内存,每次都陷入内核,一般应使用malloc */
+void* malloc_syscall(uint32_t size) {
    return (void*)_syscall1(SYS_MALLOC, size);
 }
 
-/** 释放ptr指向的内存 */
-void free(void* ptr) {
+/** 释放malloc_syscall得到的ptr指向的内存 */
+void free_syscall(void* ptr) {
    _syscall1(SYS_FREE, ptr);
 }
 
@@ -188,3 +188,36 @@ void fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd) {
 void help(void) {
    _syscall0(SYS_HELP);
 }
+
+/** 显示内核缓存统计信息 */
+void cachestat(void) {
+   _syscall0(SYS_CACHESTAT);
+}
+
+/** 运行名为name的内核基准测试 */
+int32_t bench(const char* name) {
+   return _syscall1(SYS_BENCH, name);
+}
+
+/** 将堆结尾设为addr,成功返回0,失败返回-1 */
+int32_t brk(void* addr) {
+   return (void*) _syscall1(SYS_BRK, addr) == addr ? 0 : -1;
+}
+
+/** 将堆结尾移动increment字节,成功返回原来的堆结尾,失败返回(void*) -1 */
+void* sbrk(int32_t increment) {
+   uint32_t old_brk = _syscall1(SYS_BRK, 0);
+   if (increment == 0) {
+      return (void*) old_brk;
+   }
+   uint32_t new_brk = old_brk + increment;
+   if ((uint32_t) _syscall1(SYS_BRK, new_brk) != new_brk) {
+      return (void*) -1;
+   }
+   return (void*) old_brk;
+}
+
+/** 获取自开机以来的时间,成功返回0 */
+int32_t clock_gettime(struct timespec* ts) {
+   return _syscall1(SYS_CLOCK_GETTIME, ts);
+}
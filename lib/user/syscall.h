@@ -2,6 +2,7 @@
 #define __LIB_USER_SYSCALL_H
 #include "../stdint.h"
 #include "../../fs/fs.h"
+#include "../../device/clock.h"
 enum SYSCALL_NR {
     SYS_GETPID,
     SYS_WRITE,
@@ -30,12 +31,16 @@ enum SYSCALL_NR {
     SYS_WAIT,
     SYS_PIPE,
     SYS_FD_REDIRECT,
-    SYS_HELP
+    SYS_HELP,
+    SYS_CACHESTAT,
+    SYS_BENCH,
+    SYS_BRK,
+    SYS_CLOCK_GETTIME
 };
 uint32_t getpid(void);
 uint32_t write(int32_t fd, const void* buf, uint32_t count);
-void* malloc(uint32_t size);
-void free(void* ptr);
+void* malloc_syscall(uint32_t size);
+void free_syscall(void* ptr);
 int16_t fork(void);
 int32_t read(int32_t fd, void* buf, uint32_t count);
 void putchar(char char_asci);
@@ -60,4 +65,9 @@ pid_t wait(int32_t* status);
 int32_t pipe(int32_t pipefd[2]);
 void fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd);
 void help(void);
+void cachestat(void);
+int32_t bench(const char* name);
+int32_t brk(void* addr);
+void* sbrk(int32_t increment);
+int32_t clock_gettime(struct timespec* ts);
 #endif
@@ -7,6 +7,7 @@
 #include "../fs/dir.h"
 #include "shell.h"
 #include "../lib/user/assert.h"
+#include "../lib/user/malloc.h"
 
 /** 将路径old_abs_path中的..和..转换为实际路径后存入new_abs_path */
 static void wash_path(char* old_abs_path, char* new_abs_path) {
@@ -197,6 +198,81 @@ void buildin_ps(uint32_t argc, char** argv UNUSED) {
     ps();
 }
 
+/** cachestat命令内建函数 */
+void buildin_cachestat(uint32_t argc, char** argv UNUSED) {
+    if (argc != 1) {
+        printf("cachestat: no argument support!\n");
+        return;
+    }
+    cachestat();
+}
+
+#define MALLOC_BENCH_BLOCKS 64
+#define MALLOC_BENCH_ROUNDS 100
+
+/** 用户态也可以执行rdtsc,取时间戳计数器的低32位 */
+static uint32_t rdtsc_low(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return low;
+}
+
+/**
+ * 每轮分配MALLOC_BENCH_BLOCKS个16B到2KB不等的块,再隔一个释放一个,使释放时有合并
+ * @return 平均每对malloc/free的周期数,分配失败返回0
+ */
+static uint32_t malloc_bench_case(void* (*alloc)(uint32_t), void (*release)(void*)) {
+    void* blocks[MALLOC_BENCH_BLOCKS];
+    uint32_t round = 0, idx;
+    uint32_t start = rdtsc_low();
+    while (round++ < MALLOC_BENCH_ROUNDS) {
+        for (idx = 0; idx < MALLOC_BENCH_BLOCKS; idx++) {
+            blocks[idx] = alloc(16 << (idx % 8));
+            if (blocks[idx] == NULL) {
+                while (idx-- > 0) {
+                    release(blocks[idx]);
+                }
+                return 0;
+            }
+        }
+        for (idx = 1; idx < MALLOC_BENCH_BLOCKS; idx += 2) {
+            release(blocks[idx]);
+        }
+        for (idx = 0; idx < MALLOC_BENCH_BLOCKS; idx += 2) {
+            release(blocks[idx]);
+        }
+    }
+    return (rdtsc_low() - start) / (MALLOC_BENCH_ROUNDS * MALLOC_BENCH_BLOCKS);
+}
+
+/** 比较每次陷入内核的sys_malloc与用户态malloc的分配速度 */
+static void malloc_bench(void) {
+    uint32_t sys_cycles = malloc_bench_case(malloc_syscall, free_syscall);
+    uint32_t user_cycles = malloc_bench_case(malloc, free);
+    if (sys_cycles == 0 || user_cycles == 0) {
+        printf("bench malloc: alloc memory failed\n");
+        return;
+    }
+    printf("%d blocks x %d rounds: syscall %d  user %d cycles/pair (%d -> %d pairs/Mcycle)\n",
+           MALLOC_BENCH_BLOCKS, MALLOC_BENCH_ROUNDS, sys_cycles, user_cycles,
+           1000000 / sys_cycles, 1000000 / user_cycles);
+}
+
+/** bench命令内建函数,不带参数时列出所有测试项,malloc在用户态测试,其余交给内核 */
+void buildin_bench(uint32_t argc, char** argv) {
+    if (argc > 2) {
+        printf("bench: only support 1 argument!\n");
+        return;
+    }
+    if (argc == 2 && !strcmp(argv[1], "malloc")) {
+        malloc_bench();
+        return;
+    }
+    if (bench(argc == 2 ? argv[1] : NULL) == -1) {
+        printf("       malloc: malloc/free pairs: syscall vs user-space size-class bins\n");
+    }
+}
+
 /** clear命令内建函数 */
 void buildin_clear(uint32_t argc, char** argv UNUSED) {
     if (argc != 1) {
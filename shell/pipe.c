@@ -1,10 +1,19 @@
 #include "pipe.h"
 #include "../kernel/memory.h"
+#include "../kernel/slab.h"
+#include "../kernel/debug.h"
 #include "../fs/fs.h"
 #include "../fs/file.h"
 #include "../device/ioqueue.h"
 #include "../thread/thread.h"
 
+static struct kmem_cache* pipe_slab; // 管道环形缓冲区的对象cache
+
+/** 构造环形缓冲区,归还cache时缓冲区已无人使用,只需把读写位置复位 */
+static void pipe_ctor(void* obj) {
+    ioqueue_init((struct ioqueue*) obj);
+}
+
 /** 判断文件描述符local_fd是否是管道 */
 bool is_pipe(uint32_t local_fd) {
     uint32_t global_fd = fd_local2global(local_fd);
@@ -14,10 +23,9 @@ bool is_pipe(uint32_t local_fd) {
 /** 创建管道,成功返回0,失败返回-1 */
 int32_t sys_pipe(int32_t pipefd[2]) {
     int32_t global_fd = get_free_slot_in_global();
-    // 申请一页内核内存做环形缓冲区
-    file_table[global_fd].fd_inode = get_kernel_pages(1);
-    // 初始化环形缓冲区
-    ioqueue_init((struct ioqueue*) file_table[global_fd].fd_inode);
+    if (global_fd == -1) return -1;
+    // 从cache取一个已构造好的环形缓冲区
+    file_table[global_fd].fd_inode = kmem_cache_alloc(pipe_slab);
     if (file_table[global_fd].fd_inode == NULL) return -1;
     // 将fd_flag复用为管道标志
     file_table[global_fd].fd_flag = PIPE_FLAG;
@@ -76,4 +84,20 @@ void sys_fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd) {
     }
 }
 
+/** 减少全局文件表中管道global_fd的打开数,无人打开时释放其环形缓冲区 */
+void pipe_release(uint32_t global_fd) {
+    if (--file_table[global_fd].fd_pos == 0) {
+        struct ioqueue* ioq = (struct ioqueue*) file_table[global_fd].fd_inode;
+        ioq->head = ioq->tail = 0;
+        kmem_cache_free(pipe_slab, ioq);
+        file_table[global_fd].fd_inode = NULL;
+    }
+}
 
+/** 创建管道环形缓冲区的对象cache */
+void pipe_init(void) {
+    pipe_slab = kmem_cache_create("pipe", sizeof(struct ioqueue), 0, pipe_ctor);
+    if (pipe_slab == NULL) {
+        PANIC("pipe_init: create slab cache failed!");
+    }
+}
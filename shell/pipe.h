@@ -10,5 +10,7 @@ int32_t sys_pipe(int32_t pipefd[2]);
 uint32_t pipe_read(int32_t fd, void* buf, uint32_t count);
 uint32_t pipe_write(uint32_t fd, const void* buf, uint32_t count);
 void sys_fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd);
+void pipe_release(uint32_t global_fd);
+void pipe_init(void);
 #endif
 
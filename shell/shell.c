@@ -122,6 +122,10 @@ static void cmd_execute(uint32_t argc, char** argv) {
         buildin_pwd(argc, argv);
     } else if (!strcmp("ps", argv[0])) {
         buildin_ps(argc, argv);
+    } else if (!strcmp("cachestat", argv[0])) {
+        buildin_cachestat(argc, argv);
+    } else if (!strcmp("bench", argv[0])) {
+        buildin_bench(argc, argv);
     } else if (!strcmp("clear", argv[0])) {
         buildin_clear(argc, argv);
     } else if (!strcmp("mkdir", argv[0])){
@@ -0,0 +1,39 @@
+#ifndef __THREAD_SPINLOCK_H
+#define __THREAD_SPINLOCK_H
+#include "../lib/stdint.h"
+#include "../kernel/global.h"
+
+/**
+ * 自旋锁,用于多个cpu之间的短时互斥,持有期间不能阻塞.
+ * 不负责关中断,与中断处理程序共享的数据须在关中断后再加锁
+ */
+struct spinlock {
+    volatile uint32_t locked;
+};
+
+static inline void spin_init(struct spinlock* lock) {
+    lock->locked = 0;
+}
+
+/** 尝试获取锁,成功返回true */
+static inline bool spin_trylock(struct spinlock* lock) {
+    uint32_t old = 1;
+    asm volatile ("xchgl %0, %1" : "+r" (old), "+m" (lock->locked) : : "memory");
+    return old == 0;
+}
+
+static inline void spin_lock(struct spinlock* lock) {
+    while (!spin_trylock(lock)) {
+        // 只读等待,锁被释放后再用xchg争抢,避免反复独占总线
+        while (lock->locked) {
+            asm volatile ("pause");
+        }
+    }
+}
+
+static inline void spin_unlock(struct spinlock* lock) {
+    // x86的写操作不会被重排到之前的读写之前,普通写加编译器屏障即可释放
+    asm volatile ("" : : : "memory");
+    lock->locked = 0;
+}
+#endif
@@ -6,10 +6,13 @@
 #include "../kernel/debug.h"
 #include "../kernel/interrupt.h"
 #include "../kernel/memory.h"
+#include "../kernel/slab.h"
 #include "../userprog/process.h"
 #include "sync.h"
 #include "../lib/stdio.h"
 #include "../fs/file.h"
+#include "../device/timer.h"
+#include "../kernel/smp.h"
 
 #define PG_SIZE 4096
 uint8_t pid_bitmap_bits[128] = {0};
@@ -22,20 +25,38 @@ struct pid_pool {
 }pid_pool;
 
 struct task_struct* main_thread;     // 主线程PCB
-struct task_struct* idle_thread;     // idle线程
-struct list thread_ready_list;       // 就绪队列
 struct list thread_all_list;         // 所有任务队列
-static struct list_elem* thread_tag; // 用于保存队列中的线程结点
+bool mlfq = true;                    // 为false时不再调整任务级别,也不抢占,供基准测试对比
+
+/**
+ * 多级就绪队列,每个cpu一个,任务按level挂在levels中,bitmap的第i位为1表示levels[i]非空.
+ * 新任务放到负载最轻的cpu,队列空了的cpu从其它cpu的队列中取任务
+ */
+static struct run_queue {
+    uint32_t bitmap;
+    uint32_t nr_ready;  // 队列中的任务数
+    struct list levels[RQ_LEVELS];
+} run_queues[SMP_MAX_CPUS];
+static struct kmem_cache* pcb_slab;  // pcb的对象cache,每个pcb独占按页对齐的1页
 
 extern void switch_to(struct task_struct* cur, struct task_struct* next);
 extern void init(void);
 
 /** 系统空闲时运行的线程 */
 static void idle(void* arg UNUSED) {
+    // 只在没有其它就绪任务时运行,固定在最低级
+    running_thread()->level = RQ_LEVELS - 1;
     while(1) {
         thread_block(TASK_BLOCKED);
+        intr_disable();
+        // 被调度上cpu之后又有任务被唤醒时不能停机
+        if (run_queues[cpu_id()].bitmap != 0) {
+            continue;
+        }
+        timer_idle_enter();
         //执行hlt时必须要保证目前处在开中断的情况下
-        asm volatile ("sti; hlt" : : : "memory");
+        intr_halt();
+        timer_idle_exit();
     }
 }
 
@@ -132,23 +153,33 @@ void init_thread(struct task_struct* pthread, char* name, int prio) {
     pthread->stack_magic = 0x19870916;   // 自定义的魔数
 }
 
+/** 分配一页pcb,pcb都位于内核空间,包括用户进程的pcb。内容由init_thread或fork初始化 */
+struct task_struct* pcb_alloc(void) {
+    return kmem_cache_alloc(pcb_slab);
+}
+
+/** 释放pcb_alloc分配的pcb */
+void pcb_free(struct task_struct* pthread) {
+    kmem_cache_free(pcb_slab, pthread);
+}
+
 /* 创建一优先级为prio的线程,线程名为name,线程所执行的函数是function(func_arg)*/
 struct task_struct* thread_start(char* name, int prio,
         thread_func function, void* func_arg) {
-    // pcb都位于内核空间,包括用户进程的pcb也是在内核空间
-    struct task_struct* thread = get_kernel_pages(1);
+    struct task_struct* thread = pcb_alloc();
 
     init_thread(thread, name, prio);
     thread_create(thread, function, func_arg);
 
-    // 确保之前不在队列中
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    // 加入到就绪线程队列中
-    list_append(&thread_ready_list, &thread->general_tag);
+    // 多个cpu时就绪队列和任务队列可能同时被其它cpu修改,须在关中断时加入
+    enum intr_status old_status = intr_disable();
+    // 加入到负载最轻的cpu的就绪线程队列中
+    runqueue_add_new(thread);
     // 确保之前不在全部线程队列中
     ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
     // 加入全部线程队列
     list_append(&thread_all_list, &thread->all_list_tag);
+    intr_set_status(old_status);
 
 //    asm volatile ("movl %0, %%esp; pop %%ebp; pop %%ebx; pop %%edi; pop %%esi; "
 //                  "ret" : : "g" (thread->self_kstack) : "memory");
@@ -162,40 +193,152 @@ static void make_main_thread(void) {
     // 不需要通过get_kernel_page另分配一个内存
     main_thread = running_thread();
     init_thread(main_thread, "main", 31);
+    cpus[0].current = main_thread;
 
     // 直接将main函数所在的线程加入到thread_all_list
     ASSERT(!elem_find(&thread_all_list, &main_thread->all_list_tag));
     list_append(&thread_all_list, &main_thread->all_list_tag);
 }
 
+/** pthread是否为某个cpu的idle线程,idle线程固定在自己的cpu上 */
+static bool is_idle(struct task_struct* pthread) {
+    return pthread == cpus[pthread->cpu].idle;
+}
+
+/**
+ * 将pthread加入pthread->cpu的就绪队列中其级别的一级,to_head为true时放到队首.
+ * 该cpu正在运行idle或需要抢占时,若不是当前cpu,发核间中断让它尽快调度
+ */
+void runqueue_add(struct task_struct* pthread, bool to_head) {
+    struct run_queue* rq = &run_queues[pthread->cpu];
+    struct list* queue = &rq->levels[pthread->level];
+    ASSERT(!elem_find(queue, &pthread->general_tag));
+    if (to_head) {
+        list_push(queue, &pthread->general_tag);
+    } else {
+        list_append(queue, &pthread->general_tag);
+    }
+    rq->bitmap |= 1U << pthread->level;
+    rq->nr_ready++;
+    struct cpu* cpu = &cpus[pthread->cpu];
+    if (cpu_cnt > 1 && pthread->cpu != cpu_id()) {
+        if (cpu->current == cpu->idle) {
+            cpu->need_resched = true;
+        }
+        if (cpu->need_resched) {
+            smp_resched(pthread->cpu);
+        }
+    }
+}
+
+/** cpu上等待运行的任务数,正在运行的非idle任务也算在内 */
+static uint32_t cpu_load(uint32_t cpu) {
+    return run_queues[cpu].nr_ready + (cpus[cpu].current != cpus[cpu].idle);
+}
+
+/** 为新任务选择负载最轻的cpu并加入其就绪队列 */
+void runqueue_add_new(struct task_struct* pthread) {
+    uint32_t best = 0, idx;
+    for (idx = 1; idx < cpu_cnt; idx++) {
+        if (cpu_load(idx) < cpu_load(best)) {
+            best = idx;
+        }
+    }
+    pthread->cpu = best;
+    runqueue_add(pthread, false);
+}
+
+/** pthread是否在就绪队列中 */
+static bool runqueue_has(struct task_struct* pthread) {
+    return elem_find(&run_queues[pthread->cpu].levels[pthread->level], &pthread->general_tag);
+}
+
+/** 将pthread移出就绪队列 */
+static void runqueue_remove(struct task_struct* pthread) {
+    struct run_queue* rq = &run_queues[pthread->cpu];
+    list_remove(&pthread->general_tag);
+    rq->nr_ready--;
+    if (list_empty(&rq->levels[pthread->level])) {
+        rq->bitmap &= ~(1U << pthread->level);
+    }
+}
+
+/**
+ * cpu的就绪队列已空时,从就绪任务最多的其它cpu取一个任务过来.
+ * 从最低的非空级别的队尾取,那里是最久没有运行过的计算型任务
+ */
+static void runqueue_steal(uint32_t cpu) {
+    uint32_t victim = cpu, idx;
+    for (idx = 0; idx < cpu_cnt; idx++) {
+        if (idx != cpu && run_queues[idx].nr_ready > run_queues[victim].nr_ready) {
+            victim = idx;
+        }
+    }
+    if (victim == cpu) {
+        return;
+    }
+    struct run_queue* rq = &run_queues[victim];
+    uint32_t bitmap = rq->bitmap;
+    while (bitmap != 0) {
+        uint32_t level = bit_fls(bitmap);
+        struct list_elem* elem = rq->levels[level].tail.prev;
+        while (elem != &rq->levels[level].head) {
+            struct task_struct* pthread = elem2entry(struct task_struct, general_tag, elem);
+            if (!is_idle(pthread)) {
+                runqueue_remove(pthread);
+                pthread->cpu = cpu;
+                runqueue_add(pthread, false);
+                return;
+            }
+            elem = elem->prev;
+        }
+        bitmap &= ~(1U << level);
+    }
+}
+
 /* 实现任务调度 */
 void schedule() {
     ASSERT(intr_get_status() == INTR_OFF);
 
     struct task_struct* cur = running_thread();
+    uint32_t cpu_idx = cur->cpu;
+    struct cpu* cpu = &cpus[cpu_idx];
+    struct run_queue* rq = &run_queues[cpu_idx];
     if (cur->status == TASK_RUNNING) {
-        // 若此线程只是cpu时间片到了,将其加入到就绪队列队尾
-        ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-        list_append(&thread_ready_list, &cur->general_tag);
-        // 重新设置当前线程的tick及其状态
-        cur->ticks = cur->priority;
+        // 时间片用完的任务降一级并重新设置tick,被抢占的保留原级别和剩余的tick,都加入队尾
+        if (cur->ticks == 0) {
+            if (mlfq && cur->level < RQ_LEVELS - 1) {
+                cur->level++;
+            }
+            cur->ticks = cur->priority;
+        }
+        runqueue_add(cur, false);
         cur->status = TASK_READY;
     } else {
         // todo
         // 若此线程需要某事件发生后才能继续上cpu运行,不需要将其加入队列
         // 因为当前线程不在就绪队列中
     }
-    // 如果就绪队列中没有可运行的任务 唤醒idle
-    if (list_empty(&thread_ready_list)) {
-        thread_unblock(idle_thread);
+    cpu->need_resched = false;
+    // 本cpu没有就绪任务时先从其它cpu取,仍然没有就唤醒idle
+    if (rq->bitmap == 0 && cpu_cnt > 1) {
+        runqueue_steal(cpu_idx);
+    }
+    if (rq->bitmap == 0) {
+        thread_unblock(cpu->idle);
+    }
+    ASSERT(rq->bitmap != 0);
+    // 弹出最高的非空级别的第一个就绪线程,准备将其调度上cpu
+    uint32_t level = bit_ffs(rq->bitmap);
+    struct list_elem* thread_tag = list_pop(&rq->levels[level]);
+    rq->nr_ready--;
+    if (list_empty(&rq->levels[level])) {
+        rq->bitmap &= ~(1U << level);
     }
-    ASSERT(!list_empty(&thread_ready_list));
-    thread_tag = NULL; // 清空thread_tag
-    // 将thread_ready_list队列中的第一个就绪线程弹出,准备将其调度上cpu
-    thread_tag = list_pop(&thread_ready_list);
     // 将general_tag地址转换为pcb所在地址
     struct task_struct* next = elem2entry(struct task_struct, general_tag, thread_tag);
     next->status = TASK_RUNNING;
+    cpu->current = next;
     // 激活任务页表等
     process_activate(next);
     switch_to(cur, next);
@@ -218,12 +361,20 @@ void thread_unblock(struct task_struct* pthread) {
     ASSERT((pthread->status == TASK_BLOCKED) || (pthread->status == TASK_WAITING)
            || (pthread->status == TASK_HANGING));
     if (pthread->status != TASK_READY) {
-        ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
-        if (elem_find(&thread_ready_list, &pthread->general_tag)) {
+        if (runqueue_has(pthread)) {
             PANIC("thread_unblock: blocked thread in ready_list\n");
         }
+        if (mlfq && !is_idle(pthread)) {
+            // 等待I/O等事件的任务被唤醒时升级,交互式任务由此保持在高级别
+            pthread->level = pthread->level > MLFQ_IO_BOOST ? pthread->level - MLFQ_IO_BOOST : 0;
+            // 在上次运行的cpu上唤醒,与该cpu的当前任务比较级别
+            struct cpu* cpu = &cpus[pthread->cpu];
+            if (pthread->level < cpu->current->level) {
+                cpu->need_resched = true;
+            }
+        }
         // 放到队首,让该线程尽早得到调度
-        list_push(&thread_ready_list, &pthread->general_tag);
+        runqueue_add(pthread, true);
         pthread->status = TASK_READY;
     }
     intr_set_status(old_status);
@@ -233,13 +384,34 @@ void thread_unblock(struct task_struct* pthread) {
 void thread_yield(void) {
     struct task_struct* cur = running_thread();
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-    list_append(&thread_ready_list, &cur->general_tag);
+    runqueue_add(cur, false);
     cur->status = TASK_READY;
     schedule();
     intr_set_status(old_status);
 }
 
+/** 在list_traversal中把一个任务提回最高级,就绪的任务随之换到最高级的队尾 */
+static bool thread_boost_one(struct list_elem* pelem, int arg UNUSED) {
+    struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
+    if (is_idle(pthread) || pthread->level == 0) {
+        return false;
+    }
+    if (pthread->status == TASK_READY) {
+        runqueue_remove(pthread);
+        pthread->level = 0;
+        runqueue_add(pthread, false);
+    } else {
+        pthread->level = 0;
+    }
+    return false;
+}
+
+/** 把所有任务提回最高级,长期占用cpu而降到低级别的任务不会被一直饿死,由时钟中断定期调用 */
+void thread_boost(void) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    list_traversal(&thread_all_list, thread_boost_one, 0);
+}
+
 /** 以填充空格的方式输出buf */
 static void pad_print(char* buf, int32_t buf_len, void* ptr, char format) {
     memset(buf, 0, buf_len);
@@ -310,24 +482,31 @@ void sys_ps(void) {
 
 /** 回收thread_over的pcb和页表,并将其从调度队列中去除 */
 void thread_exit(struct task_struct* thread_over, bool need_schedule) {
+    // 内核线程弹匣中的内存块和缓存的页块来自全局的内核池,pcb回收后就再也找不回来了.
+    // 归还时可能等待内存池的锁,须在标记为TASK_DIED之前进行
+    if (thread_over->pgdir == NULL) {
+        mag_drain(thread_over);
+        run_cache_drain(thread_over);
+    }
     intr_disable();  // 保证schedule在关中断情况下调用
     thread_over->status = TASK_DIED;
     // 如果thread_over不是当前线程,就有可能还在就绪队列中,将其从中删除
-    if (elem_find(&thread_ready_list, &thread_over->general_tag)) {
-        list_remove(&thread_over->general_tag);
+    if (runqueue_has(thread_over)) {
+        runqueue_remove(thread_over);
     }
     // 如果是进程,回收进程的页表
     if (thread_over->pgdir) {
+        page_dir_unload(thread_over->pgdir);
         mfree_page(PF_KERNEL, thread_over->pgdir, 1);
     }
     // 从all_thread_list中去掉此任务
     list_remove(&thread_over->all_list_tag);
-    // 回收pcb所在的页,主线程的pcb不在其中
+    // 归还pid,须在pcb回收之前读取
+    release_pid(thread_over->pid);
+    // 回收pcb,主线程的pcb不在其中
     if (thread_over != main_thread) {
-        mfree_page(PF_KERNEL, thread_over, 1);
+        pcb_free(thread_over);
     }
-    // 归还pid
-    release_pid(thread_over->pid);
     // 如果还需要下一轮调度则主动调用schedule
     if (need_schedule) {
         schedule();
@@ -354,19 +533,49 @@ struct task_struct* pid2thread(int32_t pid) {
 /** 初始化线程环境 */
 void thread_init(void) {
     put_str("thread_init start\n");
-    list_init(&thread_ready_list);
+    uint32_t cpu, level;
+    for (cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (level = 0; level < RQ_LEVELS; level++) {
+            list_init(&run_queues[cpu].levels[level]);
+        }
+    }
     list_init(&thread_all_list);
     pid_pool_init();
+    pcb_slab = kmem_cache_create("pcb", PG_SIZE, PG_SIZE, NULL);
+    if (pcb_slab == NULL) {
+        PANIC("thread_init: create pcb slab cache failed!");
+    }
 
     // 创建用户第一个进程
     process_execute(init, "init");
     // 将当前main函数创建为线程
     make_main_thread();
     // 创建idle线程
-    idle_thread = thread_start("idle", 10, idle, NULL);
+    cpus[0].idle = thread_start("idle", 10, idle, NULL);
     put_str("thread_init done\n");
 }
 
+/**
+ * 为AP创建idle线程的pcb,AP以pcb所在页为栈启动,就像main线程之于BSP.
+ * 尚未加入thread_all_list,AP上线后由smp_init加入
+ */
+struct task_struct* thread_idle_create(uint8_t cpu) {
+    struct task_struct* thread = pcb_alloc();
+    if (thread == NULL) {
+        return NULL;
+    }
+    init_thread(thread, "idle", 10);
+    thread->status = TASK_RUNNING;
+    thread->cpu = cpu;
+    return thread;
+}
+
+/** AP在自己的idle线程上完成初始化后调用,开中断并作为idle线程运行,不再返回 */
+void thread_ap_idle(void) {
+    intr_enable();
+    idle(NULL);
+}
+
 
 
 
@@ -7,6 +7,10 @@
 
 #define TASK_NAME_LEN 16
 #define MAX_FILES_OPEN_PER_PROC 8
+#define MAX_PROG_SEGMENTS 4 // 进程最多记录的可加载段数量
+#define RQ_LEVELS 32        // 就绪队列的级数,0级最高
+#define MLFQ_IO_BOOST 2     // 阻塞后被唤醒的任务提升的级数
+#define MLFQ_BOOST_TICKS 1000 // 每隔多少个tick把所有任务提回最高级,防止饿死
 /* 自定义通用函数类型,它将在很多线程函数中作为形参类型 */
 typedef void thread_func(void*);
 typedef int16_t pid_t;
@@ -75,6 +79,17 @@ struct thread_stack {
     void* func_arg;  // 由Kernel_thread所调用的函数所需的参数
 };
 
+/* exec记录的可加载段,段内的页在第一次访问时才从程序文件中读入 */
+struct prog_segment {
+    uint32_t vaddr;   // 段在内存中的起始虚拟地址
+    uint32_t offset;  // 段在文件内的起始偏移
+    uint32_t filesz;  // 段在文件中的大小
+    uint32_t memsz;   // 段在内存中的大小,超出filesz的部分(.bss)补0
+    bool writable;    // 段是否可写
+};
+
+struct inode;
+
 /* 进程或线程的pcb,程序控制块 */
 struct task_struct {
     uint32_t* self_kstack;    // 各内核线程都用自己的内核栈
@@ -83,24 +98,35 @@ struct task_struct {
     char name[16];
     uint8_t priority;        // 线程优先级
     uint8_t ticks;           // 每次在处理器上执行的时间滴答树
+    uint8_t level;           // 在多级反馈队列中的级别,用完时间片降一级,阻塞后被唤醒时升级
+    uint8_t cpu;             // 正在其上运行或在其就绪队列中的cpu
     uint32_t elapsed_ticks;  // 此任务上cpu后执行了多久
     int32_t fd_table[MAX_FILES_OPEN_PER_PROC]; // 文件描述符数组
     struct list_elem general_tag;  // 线程在一般队列中的节点
     struct list_elem all_list_tag; // 线程队列all_list_thread中的节点
     uint32_t* pgdir;   // 进程自己页表的虚拟空间
     struct virtual_addr userprog_vaddr; // 用户进程的虚拟地址
+    uint32_t brk;      // 用户堆区的当前结尾,由brk系统调用调整
     struct mem_block_desc u_block_desc[DESC_CNT]; // 用户进程内存块描述符
+    struct mem_magazine mags[DESC_CNT]; // sys_malloc各规格内存块的弹匣
+    struct mem_run_cache run_caches[RUN_CLASS_CNT]; // sys_malloc各级大块内存的缓存
+    uint32_t run_cache_pages; // run_caches中缓存的总页数
+    struct inode* prog_inode; // 进程体所在程序文件的inode,缺页时从中读入段内容
+    uint32_t prog_seg_cnt;    // 已记录的可加载段数量
+    struct prog_segment prog_segs[MAX_PROG_SEGMENTS]; // 可加载段描述
     uint32_t cwd_inode_nr; // 进程所在的工作目录的inode编号
     int16_t parent_pid; // 父进程pid
     int8_t exit_status; // 进程结束时直接调用exit传入的参数
     uint32_t stack_magic;  // 栈的边界标记,用于检测栈的溢出
 };
 
-extern struct list thread_ready_list;
 extern struct list thread_all_list;
+extern bool mlfq;
 
 void thread_create(struct task_struct* pthread, thread_func function, void* func_arg);
 void init_thread(struct task_struct* pthread, char* name, int prio);
+struct task_struct* pcb_alloc(void);
+void pcb_free(struct task_struct* pthread);
 struct task_struct* thread_start(char* name, int prio, thread_func function, void* func_arg);
 struct task_struct* running_thread(void);
 void schedule(void);
@@ -108,6 +134,11 @@ void thread_init(void);
 void thread_block(enum task_status stat);
 void thread_unblock(struct task_struct* pthread);
 void thread_yield(void);
+void runqueue_add(struct task_struct* pthread, bool to_head);
+void runqueue_add_new(struct task_struct* pthread);
+struct task_struct* thread_idle_create(uint8_t cpu);
+void thread_ap_idle(void);
+void thread_boost(void);
 pid_t fork_pid(void);
 void sys_ps(void);
 void thread_exit(struct task_struct* thread_over, bool need_schedule);
@@ -5,6 +5,10 @@
 #include "../lib/string.h"
 #include "../kernel/global.h"
 #include "../kernel/memory.h"
+#include "../fs/file.h"
+#include "../fs/inode.h"
+#include "../lib/kernel/bitmap.h"
+#include "process.h"
 
 extern void intr_exit(void);
 typedef uint32_t Elf32_Word, Elf32_Addr, Elf32_Off;
@@ -51,49 +55,125 @@ enum segment_type {
     PT_PHDR     // 程序头表
 };
 
+/** 段标志,本段可写 */
+#define PF_W 0x2
+
 /**
- * 将文件描述符fd指向的文件中,偏移offset,大小filesz
- * 的段加载到虚拟地址为vaddr的内存
- * @param fd 文件描述符
- * @param offset 相对于文件起始位置的偏移量
- * @param filesz 该段在文件中的大小
- * @param vaddr 虚拟地址
+ * 记录一个可加载段,不再立即读入段内容,
+ * 段内的页在第一次被访问时由缺页异常从程序文件中读入
+ * @param segs 可加载段数组
+ * @param seg_cnt 已记录的段数量
+ * @param phdr 程序头
  * @return 成功返回true
  */
-static bool segment_load(int32_t fd, uint32_t offset,
-                         uint32_t filesz, uint32_t vaddr) {
-    // vaddr地址所在页框的位置
-    uint32_t vaddr_first_page = vaddr & 0xfffff000;
-    // 加载到内存后,文件在第一个页框内的字节大小
-    uint32_t size_in_first_page = PG_SIZE - (vaddr & 0x00000fff);
-    uint32_t occupy_pages = 0;
-    // 若一个页容不下该段
-    if (filesz > size_in_first_page) {
-        uint32_t left_size = filesz - size_in_first_page;
-        occupy_pages = DIV_ROUND_UP(left_size, PG_SIZE) + 1;
-    } else {
-        occupy_pages = 1;
+static bool segment_load(struct prog_segment* segs, uint32_t* seg_cnt,
+                         struct Elf32_Phdr* phdr) {
+    if (phdr->p_memsz == 0) return true;
+    // 段必须完整落在为用户栈预留的区域之下,且不能与堆区重叠.
+    // 先单独检查p_vaddr的上界,否则下面的减法会回绕,落在内核空间的段也能通过检查
+    uint32_t seg_limit = USER_STACK3_VADDR + PG_SIZE - USER_STACK_PAGES * PG_SIZE;
+    if (*seg_cnt == MAX_PROG_SEGMENTS
+        || phdr->p_filesz > phdr->p_memsz
+        || phdr->p_vaddr < USER_VADDR_START
+        || phdr->p_vaddr >= seg_limit
+        || phdr->p_memsz > seg_limit - phdr->p_vaddr
+        || (phdr->p_vaddr < USER_HEAP_START + USER_HEAP_SIZE
+            && phdr->p_vaddr + phdr->p_memsz > USER_HEAP_START)) {
+        return false;
+    }
+    struct prog_segment* seg = &segs[*seg_cnt];
+    seg->vaddr = phdr->p_vaddr;
+    seg->offset = phdr->p_offset;
+    seg->filesz = phdr->p_filesz;
+    seg->memsz = phdr->p_memsz;
+    seg->writable = (phdr->p_flags & PF_W) != 0;
+    (*seg_cnt)++;
+    return true;
+}
+
+/**
+ * 用新记录的可加载段替换当前进程的进程体:解除段范围内原进程体页的映射,
+ * 使之后的访问触发缺页从新程序文件读入,并在虚拟地址位图中占用这些页
+ */
+static void segments_install(struct task_struct* cur, struct inode* prog_inode,
+                             struct prog_segment* segs, uint32_t seg_cnt) {
+    uint32_t seg_idx = 0;
+    while (seg_idx < seg_cnt) {
+        uint32_t vaddr_page = segs[seg_idx].vaddr & 0xfffff000;
+        uint32_t vaddr_end = segs[seg_idx].vaddr + segs[seg_idx].memsz;
+        while (vaddr_page < vaddr_end) {
+            page_unmap(vaddr_page);
+            uint32_t bit_idx = (vaddr_page - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
+            bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx, 1);
+            vaddr_page += PG_SIZE;
+        }
+        seg_idx++;
     }
-    // 为进程分配内存
-    uint32_t page_idx = 0;
-    uint32_t vaddr_page = vaddr_first_page;
-    while (page_idx < occupy_pages) {
-        uint32_t* pde = pde_ptr(vaddr_page);
-        uint32_t* pte = pte_ptr(vaddr_page);
+    if (cur->prog_inode != NULL) {
+        inode_close(cur->prog_inode);
+    }
+    cur->prog_inode = prog_inode;
+    memcpy(cur->prog_segs, segs, seg_cnt * sizeof(struct prog_segment));
+    cur->prog_seg_cnt = seg_cnt;
+}
 
-        // 如果pde不存在,或pte不存在就分配内存,pde的判断要在pte
-        // 之前,否则pde若不存在就会导致判断pte时缺页异常
-        if (!(*pde & 0x00000001) || !(*pte & 0x00000001)) {
-            if (get_a_page(PF_USER, vaddr_page) == NULL) {
-                return false;
+/**
+ * 缺页异常时调用,若vaddr落在当前进程记录的可加载段内,
+ * 则为其分配物理页并从程序文件中读入该页的内容
+ * @param vaddr 引发缺页的虚拟地址
+ * @return 成功建立映射返回1,vaddr不属于任何段时返回0,
+ *         分配物理页或读程序文件失败时返回-1,此时该页不会被映射
+ */
+int32_t segment_page_in(uint32_t vaddr) {
+    struct task_struct* cur = running_thread();
+    if (cur->prog_inode == NULL) return 0;
+    uint32_t vaddr_page = vaddr & 0xfffff000;
+    bool found = false, writable = false;
+    uint32_t seg_idx = 0;
+    // 相邻两段可能共用一页,该页的内容和权限由所有落在其中的段共同决定
+    while (seg_idx < cur->prog_seg_cnt) {
+        struct prog_segment* seg = &cur->prog_segs[seg_idx];
+        if (seg->vaddr < vaddr_page + PG_SIZE && seg->vaddr + seg->memsz > vaddr_page) {
+            found = true;
+            writable |= seg->writable;
+        }
+        seg_idx++;
+    }
+    if (!found) return 0;
+    // 虚拟地址已在exec时从位图中占用
+    if (get_a_page_without_opvaddrbitmap(PF_USER, vaddr_page) == NULL) {
+        return -1;
+    }
+    // 超出filesz的部分即.bss,需补0
+    memset((void*) vaddr_page, 0, PG_SIZE);
+    struct file prog_file;
+    prog_file.fd_flag = O_RDONLY;
+    prog_file.fd_inode = cur->prog_inode;
+    seg_idx = 0;
+    while (seg_idx < cur->prog_seg_cnt) {
+        struct prog_segment* seg = &cur->prog_segs[seg_idx];
+        uint32_t copy_start = seg->vaddr > vaddr_page ? seg->vaddr : vaddr_page;
+        uint32_t copy_end = seg->vaddr + seg->filesz;
+        if (copy_end > vaddr_page + PG_SIZE) {
+            copy_end = vaddr_page + PG_SIZE;
+        }
+        if (copy_start < copy_end) {
+            prog_file.fd_pos = seg->offset + (copy_start - seg->vaddr);
+            // 读不全时该页只有部分内容,不能让进程在其上运行
+            if (file_read(&prog_file, (void*) copy_start, copy_end - copy_start)
+                    != (int32_t) (copy_end - copy_start)) {
+                page_unmap(vaddr_page);
+                return -1;
             }
-        } // 如果原进程的页表已经分配了,利用现有的物理页,直接覆盖进程体
-        vaddr_page += PG_SIZE;
-        page_idx++;
+        }
+        seg_idx++;
     }
-    sys_lseek(fd, offset, SEEK_SET);
-    sys_read(fd, (void*) vaddr, filesz);
-    return true;
+    // 只读段映射为只读页,fork时也就无需写时复制
+    if (!writable) {
+        *pte_ptr(vaddr_page) &= ~PG_RW_W;
+        asm volatile ("invlpg %0"::"m" (vaddr_page):"memory");
+    }
+    return 1;
 }
 
 /** 从文件系统上加载用户程序pathname,成功则返回程序的起始地址,否则返回-1 */
@@ -101,6 +181,8 @@ static int32_t load(const char* pathname) {
     int32_t ret = -1;
     struct Elf32_Ehdr elf_header;
     struct Elf32_Phdr prog_header;
+    struct prog_segment segs[MAX_PROG_SEGMENTS];
+    uint32_t seg_cnt = 0;
     memset(&elf_header, 0, sizeof(struct Elf32_Ehdr));
 
     int32_t fd = sys_open(pathname, O_RDONLY);
@@ -110,7 +192,6 @@ static int32_t load(const char* pathname) {
         ret = -1;
         goto done;
     }
-    // 校验elf头
     /* 校验elf头 */
     if (memcmp(elf_header.e_ident, "\177ELF\1\1\1", 7) != 0
         || elf_header.e_type != 2
@@ -136,9 +217,9 @@ static int32_t load(const char* pathname) {
             ret = -1;
             goto done;
         }
-        // 如果是可加载段就调用segment_load加载到内存
+        // 如果是可加载段就调用segment_load记录下来
         if (PT_LOAD == prog_header.p_type) {
-            if (!segment_load(fd, prog_header.p_offset, prog_header.p_filesz, prog_header.p_vaddr)) {
+            if (!segment_load(segs, &seg_cnt, &prog_header)) {
                 ret = -1;
                 goto done;
             }
@@ -147,6 +228,10 @@ static int32_t load(const char* pathname) {
         prog_header_offset += elf_header.e_phentsize;
         prog_idx++;
     }
+    // 所有程序头都合法后才替换进程体,程序文件的inode在进程退出或再次exec前保持打开
+    struct inode* prog_inode = inode_open(cur_part,
+            file_table[fd_local2global(fd)].fd_inode->i_no);
+    segments_install(running_thread(), prog_inode, segs, seg_cnt);
     ret = elf_header.e_entry;
 done:
     sys_close(fd);
@@ -159,6 +244,7 @@ int32_t sys_execv(const char* path, const char* argv[]) {
     while (argv[argc]) argc++;
     int32_t entry_point = load(path); // 加载程序文件
     if (entry_point == -1) return -1; // 加载失败返回-1
+    sys_brk(USER_HEAP_START); // 原进程体的堆不再保留
 
     struct task_struct* cur = running_thread();
     // 修改进程名
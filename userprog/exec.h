@@ -1,5 +1,7 @@
 #ifndef __USERPROG_EXEC_H
 #define __USERPROG_EXEC_H
 #include "../lib/stdint.h"
+#include "../kernel/global.h"
 int32_t sys_execv(const char* path, const char* argv[]);
+int32_t segment_page_in(uint32_t vaddr);
 #endif
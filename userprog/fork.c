@@ -1,11 +1,13 @@
 #include "fork.h"
 #include "process.h"
 #include "../kernel/memory.h"
+#include "../kernel/cpu.h"
 #include "../kernel/interrupt.h"
 #include "../kernel/debug.h"
 #include "../thread/thread.h"
 #include "../lib/string.h"
 #include "../fs/file.h"
+#include "../fs/inode.h"
 #include "../shell/pipe.h"
 
 extern void intr_exit(void);
@@ -29,14 +31,17 @@ static int32_t copy_pcb_vaddrbitmap_stack0(struct task_struct* child_thread,
     child_thread->general_tag.prev = child_thread->general_tag.next = NULL;
     child_thread->all_list_tag.prev = child_thread->all_list_tag.prev = NULL;
     block_desc_init(child_thread->u_block_desc);
+    // 弹匣已由sys_fork清空,复制过来的也是空弹匣
     // b.复制父进程的虚拟地址池的范围
     uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8, PG_SIZE);
-    void* vaddr_btmp = get_kernel_pages(bitmap_pg_cnt);
+    void* vaddr_btmp = get_kernel_pages(bitmap_pg_cnt + 1);
     if (vaddr_btmp == NULL) return -1;
     // 此时child_thread->userprog_vaddr.vaddr_bitmap.bits还是指向父进程虚拟地址
-    // 的位图地址,下面指向自己的位图vaddr_btmp
+    // 的位图地址,下面指向自己的位图vaddr_btmp,其后一页存放摘要位图
     memcpy(vaddr_btmp, child_thread->userprog_vaddr.vaddr_bitmap.bits, bitmap_pg_cnt * PG_SIZE);
     child_thread->userprog_vaddr.vaddr_bitmap.bits = vaddr_btmp;
+    bitmap_summary_init(&child_thread->userprog_vaddr.vaddr_bitmap,
+                        (uint32_t*) ((uint8_t*) vaddr_btmp + bitmap_pg_cnt * PG_SIZE));
     // 调试使用
     ASSERT(strlen(child_thread->name) < 11); // pcb.name的长度是16,为避免下面strcat越界
     strcat(child_thread->name, "_fork");
@@ -44,45 +49,100 @@ static int32_t copy_pcb_vaddrbitmap_stack0(struct task_struct* child_thread,
 }
 
 /**
- * 复制子进程的进程体(代码和数据)及用户栈
+ * copy_body_stack3在第end_pde_idx个页目录项处失败后的回滚:
+ * 归还已增加的页框引用数,释放子进程已建好的页表.
+ * 父进程中被改为只读的写时复制页保持原样,引用数回到1后,
+ * 写异常时cow_page_copy会直接恢复其写权限
+ * @param buf_pte 失败的页目录项对应的页表副本
+ */
+static void copy_body_stack3_undo(struct task_struct* child_thread, struct task_struct* parent_thread,
+                                  uint32_t* buf_pte, uint32_t end_pde_idx) {
+    uint32_t pde_idx = 0, pte_idx = 0;
+    uint32_t pde_vaddr = 0, pte = 0;
+    uint32_t* first_pte_vaddr_in_pde = NULL;
+    // 1.失败的页目录项,引用数已加但还未复制给子进程
+    while (pte_idx < 1024) {
+        if (buf_pte[pte_idx] & PG_P_1) {
+            free_a_phy_page(buf_pte[pte_idx] & 0xfffff000);
+        }
+        pte_idx++;
+    }
+    // 2.之前的页目录项已复制到子进程的页表中
+    page_dir_activate(child_thread);
+    while (pde_idx < end_pde_idx) {
+        pde_vaddr = pde_idx * 0x400000;
+        if (*pde_ptr(pde_vaddr) & PG_P_1) {
+            first_pte_vaddr_in_pde = pte_ptr(pde_vaddr);
+            pte_idx = 0;
+            while (pte_idx < 1024) {
+                pte = first_pte_vaddr_in_pde[pte_idx];
+                if (pte & PG_P_1) {
+                    free_a_phy_page(pte & 0xfffff000);
+                }
+                pte_idx++;
+            }
+            free_a_phy_page(*pde_ptr(pde_vaddr) & 0xfffff000);
+            *pde_ptr(pde_vaddr) = 0;
+        }
+        pde_idx++;
+    }
+    page_dir_activate(parent_thread);
+}
+
+/**
+ * 以写时复制的方式让子进程共享父进程的进程体(代码和数据)及用户栈
+ * 以页表为单位处理:父进程中可写的用户页去掉写权限并标记为PG_COW_1,
+ * 页框引用数加1,再把整张页表通过内核缓冲区复制到子进程的页表中,
+ * 双方谁先写该页,谁就在缺页异常中得到自己的副本
  * @param child_thread 子进程
  * @param parent_thread 父进程
  * @param buf_page 内核缓冲区
+ * @return 成功返回0,为子进程分配页表失败时回滚已做的共享并返回-1
  */
-static void copy_body_stack3(struct task_struct* child_thread,
-                             struct task_struct* parent_thread, void* buf_page) {
-    uint8_t* vaddr_btmp = parent_thread->userprog_vaddr.vaddr_bitmap.bits;
-    uint32_t btmp_bytes_len = parent_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len;
-    uint32_t vaddr_start = parent_thread->userprog_vaddr.vaddr_start;
-    uint32_t idx_byte = 0;
-    uint32_t idx_bit = 0;
-    uint32_t prog_vaddr = 0;
-    // 在父进程的用户空间中查找已有数据的页
-    while (idx_byte < btmp_bytes_len) {
-        if (vaddr_btmp[idx_byte]) {
-            idx_bit = 0;
-            while (idx_bit < 8) {
-                if ((BITMAP_MASK << idx_bit) & vaddr_btmp[idx_byte]) {
-                    prog_vaddr = vaddr_start + (idx_byte*8 + idx_bit) * PG_SIZE;
-                    /** 将父进程用户空间中的数据通过内核空间做中转,最终复制到子进程的用户空间 */
-                    // a.将父进程用户空间中的数据复制到内核缓冲区buf_page,目的是切换
-                    // 到子进程的页表后,还能访问到父进程的数据
-                    memcpy(buf_page, (void*) prog_vaddr, PG_SIZE);
-                    // b.将页表切换到子进程,目的是避免下面申请内存的函数将
-                    // pte及pde安装在父进程的页表中
-                    page_dir_activate(child_thread);
-                    // c.申请虚拟地址prog_vaddr
-                    get_a_page_without_opvaddrbitmap(PF_USER, prog_vaddr);
-                    // d.从内核缓冲区将父进程的数据复制到子进程的用户空间
-                    memcpy((void*) prog_vaddr, buf_page, PG_SIZE);
-                    // e.恢复父进程页表
-                    page_dir_activate(parent_thread);
+static int32_t copy_body_stack3(struct task_struct* child_thread,
+                                struct task_struct* parent_thread, void* buf_page) {
+    uint32_t pde_idx = 0, pte_idx = 0;
+    uint32_t pde_vaddr = 0, pte = 0;
+    uint32_t* first_pte_vaddr_in_pde = NULL;
+    uint32_t* buf_pte = (uint32_t*) buf_page;
+    int32_t ret = 0;
+    // 只处理用户空间,也就是第0~767个页目录项
+    while (pde_idx < 768) {
+        pde_vaddr = pde_idx * 0x400000;
+        if (*pde_ptr(pde_vaddr) & PG_P_1) {
+            first_pte_vaddr_in_pde = pte_ptr(pde_vaddr);
+            pte_idx = 0;
+            while (pte_idx < 1024) {
+                pte = first_pte_vaddr_in_pde[pte_idx];
+                if (pte & PG_P_1) {
+                    if (pte & PG_RW_W) {
+                        // 可写页改为只读的写时复制页,父子进程的pte都以此为准
+                        pte = (pte & ~PG_RW_W) | PG_COW_1;
+                        first_pte_vaddr_in_pde[pte_idx] = pte;
+                    }
+                    page_ref_inc(pte & 0xfffff000);
                 }
-                idx_bit++;
+                buf_pte[pte_idx] = pte;
+                pte_idx++;
+            }
+            // 切换到子进程页表,为其分配同一位置的页表后整体复制
+            page_dir_activate(child_thread);
+            if (!page_table_create(pde_vaddr)) {
+                page_dir_activate(parent_thread);
+                copy_body_stack3_undo(child_thread, parent_thread, buf_pte, pde_idx);
+                ret = -1;
+                break;
             }
+            memcpy(pte_ptr(pde_vaddr), buf_page, PG_SIZE);
+            page_dir_activate(parent_thread);
         }
-        idx_byte++;
+        pde_idx++;
     }
+    // 父进程的pte被改为只读,重新加载cr3使tlb中的旧表项失效,
+    // 页目录已在cr3中时page_dir_activate不会重新加载,所以显式刷新
+    page_dir_activate(parent_thread);
+    tlb_flush();
+    return ret;
 }
 
 /** 为子进程构建thread_stack和修改返回值 */
@@ -126,22 +186,34 @@ static void update_inode_open_cnts(struct task_struct* thread) {
         }
         local_fd++;
     }
+    // 子进程与父进程共用同一个程序文件按需读入进程体
+    if (thread->prog_inode != NULL) {
+        thread->prog_inode->i_open_cnts++;
+    }
 }
 
 /** 拷贝父进程本身所占用资源给子进程 */
 static int32_t copy_process(struct task_struct* child_thread,
                             struct task_struct* parent_thread) {
-    // 内核缓冲区,作为父进程用户空间的数据复制到子进程用户空间的中转
+    // 内核缓冲区,作为父进程页表复制到子进程页表的中转
     void* buf_page = get_kernel_pages(1);
     if (buf_page == NULL) return -1;
 
     // a.复制父进程的pcb、虚拟地址位图、内核栈到子进程
-    if (copy_pcb_vaddrbitmap_stack0(child_thread, parent_thread) == -1) return -1;
+    if (copy_pcb_vaddrbitmap_stack0(child_thread, parent_thread) == -1) {
+        // 失败时子进程已分到pid,位图尚未分配
+        release_pid(child_thread->pid);
+        goto free_buf;
+    }
     // b.为子进程创建页表,此页表仅包括内核空间
     child_thread->pgdir = create_page_dir();
-    if (child_thread->pgdir == NULL) return -1;
-    // c.复制父进程进程体及用户栈给子进程
-    copy_body_stack3(child_thread, parent_thread, buf_page);
+    if (child_thread->pgdir == NULL) goto free_bitmap;
+    // c.以写时复制的方式共享父进程进程体及用户栈给子进程
+    if (copy_body_stack3(child_thread, parent_thread, buf_page) == -1) {
+        // 子进程的页表已由copy_body_stack3回收,只剩页目录
+        mfree_page(PF_KERNEL, child_thread->pgdir, 1);
+        goto free_bitmap;
+    }
     // d.构建子进程thread_stack和修改返回值pid
     build_child_stack(child_thread);
     // e.更新文件inode的打开数
@@ -149,19 +221,32 @@ static int32_t copy_process(struct task_struct* child_thread,
 
     mfree_page(PF_KERNEL, buf_page, 1);
     return 0;
+
+free_bitmap:
+    release_pid(child_thread->pid);
+    mfree_page(PF_KERNEL, child_thread->userprog_vaddr.vaddr_bitmap.bits,
+               DIV_ROUND_UP(child_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len, PG_SIZE) + 1);
+free_buf:
+    mfree_page(PF_KERNEL, buf_page, 1);
+    return -1;
 }
 
 /** fork子进程,内核线程不可以直接调用 */
 pid_t sys_fork(void) {
     struct task_struct* parent_thread = running_thread();
-    struct task_struct* child_thread = get_kernel_pages(1); // 为子进程创建pcb
+    struct task_struct* child_thread = pcb_alloc(); // 为子进程创建pcb
     if (child_thread == NULL) return -1;
     ASSERT(INTR_OFF == intr_get_status() && parent_thread->pgdir != NULL);
-    if (copy_process(child_thread, parent_thread) == -1) return -1;
+    // 弹匣中的块还没还给arena,地址空间复制后子进程无从归还,
+    // 复制前先由父进程在自己的地址空间中归还,双方的arena就都是完整的
+    mag_drain(parent_thread);
+    if (copy_process(child_thread, parent_thread) == -1) {
+        pcb_free(child_thread);
+        return -1;
+    }
 
     // 添加到就绪线程队列和所有线程队列,子进程由调试器安排运行
-    ASSERT(!elem_find(&thread_ready_list, &child_thread->general_tag));
-    list_append(&thread_ready_list, &child_thread->general_tag);
+    runqueue_add_new(child_thread);
     ASSERT(!elem_find(&thread_all_list, &child_thread->all_list_tag));
     list_append(&thread_all_list, &child_thread->all_list_tag);
     // 父进程返回子进程的pid
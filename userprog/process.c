@@ -8,6 +8,7 @@
 #include "../kernel/interrupt.h"
 #include "../lib/string.h"
 #include "../device/console.h"
+#include "../kernel/smp.h"
 
 extern void intr_exit(void);
 
@@ -24,27 +25,55 @@ void start_process(void* filename_) {
     proc_stack->eip = function; // 待执行的用户程序地址
     proc_stack->cs = SELECTOR_U_CODE;
     proc_stack->eflags = (EFLAGS_IOPL_0 | EFLAGS_MBS | EFLAGS_IF_1);
-    proc_stack->esp = (void*)((uint32_t)get_a_page(PF_USER, USER_STACK3_VADDR) + PG_SIZE);
+    // 栈区已在虚拟地址位图中占用,栈页在第一次访问时由缺页异常分配
+    proc_stack->esp = (void*) (USER_STACK3_VADDR + PG_SIZE);
     proc_stack->ss = SELECTOR_U_DATA;
     asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (proc_stack) : "memory");
 }
 
+/* 为true时切换到内核线程或同一地址空间的任务时不重新加载cr3 */
+bool lazy_tlb = true;
+/* 重新加载cr3的次数,只用于观察 */
+uint32_t cr3_reloads;
+
 /** 激活页表 */
 void page_dir_activate(struct task_struct* p_thread) {
     /********************************************************
-     * 执行此函数时,当前任务可能是线程。
-     * 之所以对线程也要重新安装页表, 原因是上一次被调度的可能是进程,
-     * 否则不恢复页表的话,线程就会使用进程的页表了。
+     * 内核线程只访问内核空间,而各页目录中表示内核空间的pde都相同,
+     * 所以内核线程可以借用上一个任务的页目录,不必重新加载cr3(lazy TLB),
+     * 下一个任务的页目录已在cr3中时同样不必加载,TLB得以保留.
+     * 借用的页目录在回收前由page_dir_unload换下.
+     * 多个cpu时不借用:其它cpu无法替本cpu换下页目录,进程在别的cpu上
+     * 改动的映射也不会从本cpu的TLB中清除.这样cr3中只会是内核页目录
+     * 或本cpu当前任务的页目录,任务离开时cr3随之重新加载,TLB不会过时
      ********************************************************/
-    // 若为内核线程,需要重新填充页表为0x100000
-    // 默认为内核的页目录物理地址,也是内核线程所用的页目录表
-    uint32_t pagedir_phy_addr = 0x100000;
+    struct cpu* cpu = this_cpu();
+    uint32_t pagedir_phy_addr = KERNEL_PGDIR_PHY_ADDR;
     if (p_thread->pgdir != NULL) {
         // 用户态进程有自己的页目录表,则更新需要填充的物理地址
         pagedir_phy_addr = addr_v2p((uint32_t) p_thread->pgdir);
+    } else if (lazy_tlb && cpu_cnt == 1) {
+        return;
+    }
+    if (lazy_tlb && pagedir_phy_addr == cpu->active_pgdir) {
+        return;
     }
     // 更新页目录寄存器cr3,使页表生效
     asm volatile ("movl %0, %%cr3" : : "r" (pagedir_phy_addr) : "memory");
+    cpu->active_pgdir = pagedir_phy_addr;
+    cr3_reloads++;
+}
+
+/** 页目录pgdir即将被回收,若内核线程仍借用着它,换回内核页目录 */
+void page_dir_unload(uint32_t* pgdir) {
+    enum intr_status old_status = intr_disable();
+    struct cpu* cpu = this_cpu();
+    if (addr_v2p((uint32_t) pgdir) == cpu->active_pgdir) {
+        asm volatile ("movl %0, %%cr3" : : "r" (KERNEL_PGDIR_PHY_ADDR) : "memory");
+        cpu->active_pgdir = KERNEL_PGDIR_PHY_ADDR;
+        cr3_reloads++;
+    }
+    intr_set_status(old_status);
 }
 
 /** 激活线程或进程的页表,更新tss中的esp0为进程的特权级0的栈 */
@@ -83,19 +112,29 @@ uint32_t* create_page_dir(void) {
     return page_dir_vaddr;
 }
 
-/** 创建用户进程虚拟地址位图 */
+/** 创建用户进程虚拟地址位图,位图之后的一页存放其摘要位图 */
 void create_user_vaddr_bitmap(struct task_struct* user_prog) {
     user_prog->userprog_vaddr.vaddr_start = USER_VADDR_START;
     uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8, PG_SIZE);
-    user_prog->userprog_vaddr.vaddr_bitmap.bits = get_kernel_pages(bitmap_pg_cnt);
+    user_prog->userprog_vaddr.vaddr_bitmap.bits = get_kernel_pages(bitmap_pg_cnt + 1);
     user_prog->userprog_vaddr.vaddr_bitmap.btmp_bytes_len = (0xc0000000 - USER_VADDR_START) / PG_SIZE / 8;
+    user_prog->userprog_vaddr.vaddr_bitmap.summary =
+            (uint32_t*) (user_prog->userprog_vaddr.vaddr_bitmap.bits + bitmap_pg_cnt * PG_SIZE);
     bitmap_init(&user_prog->userprog_vaddr.vaddr_bitmap);
+    // 占用用户空间顶部的栈区,栈在其中按需向下增长,堆不会分配到这里
+    bitmap_set_range(&user_prog->userprog_vaddr.vaddr_bitmap,
+                     (USER_STACK3_VADDR + PG_SIZE - USER_VADDR_START) / PG_SIZE - USER_STACK_PAGES,
+                     USER_STACK_PAGES, 1);
+    // 堆区同样整体占用,sys_malloc不会分配到这里,由brk决定其中哪些页可用
+    bitmap_set_range(&user_prog->userprog_vaddr.vaddr_bitmap,
+                     (USER_HEAP_START - USER_VADDR_START) / PG_SIZE, USER_HEAP_SIZE / PG_SIZE, 1);
+    user_prog->brk = USER_HEAP_START;
 }
 
 /** 创建用户进程 */
 void process_execute(void* filename, char* name) {
-    // pcb内核的数据结构,由内核来维护进程信息,因此要在内核内存池中申请
-    struct task_struct* thread = get_kernel_pages(1);
+    // pcb内核的数据结构,由内核来维护进程信息
+    struct task_struct* thread = pcb_alloc();
     init_thread(thread, name, default_prio);
     create_user_vaddr_bitmap(thread);
     thread_create(thread, start_process, filename);
@@ -103,8 +142,7 @@ void process_execute(void* filename, char* name) {
     block_desc_init(thread->u_block_desc);
 
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    runqueue_add_new(thread);
 
     ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
     list_append(&thread_all_list, &thread->all_list_tag);
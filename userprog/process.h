@@ -4,11 +4,18 @@
 #include "../lib/stdint.h"
 #define default_prio 31
 #define USER_STACK3_VADDR (0xc0000000 - 0x1000)
+#define USER_STACK_PAGES 2048  // 用户栈最大8MB,从USER_STACK3_VADDR所在页向下按需增长
 #define USER_VADDR_START 0x8048000
+#define KERNEL_PGDIR_PHY_ADDR 0x100000 // 内核的页目录物理地址,也是内核线程所用的页目录表
+#define USER_HEAP_START 0x40000000  // brk堆区的起始,其中的页在brk之下按需分配
+#define USER_HEAP_SIZE 0x4000000    // brk堆区最大64MB
+extern bool lazy_tlb;
+extern uint32_t cr3_reloads;
 void process_execute(void* filename, char* name);
 void start_process(void* filename);
 void process_activate(struct task_struct* p_thread);
 void page_dir_activate(struct task_struct* p_thread);
+void page_dir_unload(uint32_t* pgdir);
 uint32_t* create_page_dir(void);
 void create_user_vaddr_bitmap(struct task_struct* user_prog);
 #endif
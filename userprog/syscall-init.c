@@ -10,6 +10,8 @@
 #include "exec.h"
 #include "wait_exit.h"
 #include "../shell/pipe.h"
+#include "../kernel/bench.h"
+#include "../device/clock.h"
 
 #define syscall_nr 32
 typedef void* syscall;
@@ -51,6 +53,10 @@ void syscall_init(void) {
     syscall_table[SYS_PIPE] = sys_pipe;
     syscall_table[SYS_FD_REDIRECT] = sys_fd_redirect;
     syscall_table[SYS_HELP] = sys_help;
+    syscall_table[SYS_CACHESTAT] = sys_cachestat;
+    syscall_table[SYS_BENCH] = sys_bench;
+    syscall_table[SYS_BRK] = sys_brk;
+    syscall_table[SYS_CLOCK_GETTIME] = sys_clock_gettime;
     put_str("syscall_init done\n");
 }
 
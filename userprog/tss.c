@@ -3,6 +3,10 @@
 #include "../kernel/global.h"
 #include "../lib/string.h"
 #include "../lib/kernel/print.h"
+#include "../kernel/smp.h"
+
+#define GDT_DESC_CNT 7          // 空描述符、内核代码段、数据段、显存段、tss、用户代码段、数据段
+#define LOADER_GDT 0xc0000900  // loader建立的gdt,前4个描述符由各cpu的gdt复制
 
 /** 任务状态段tss结构 */
 struct tss {
@@ -34,11 +38,13 @@ struct tss {
     uint32_t trace;
     uint32_t io_base;
 };
-static struct tss tss;
+/* 每个cpu各有一个tss,tss描述符中有忙标志,所以gdt也是每个cpu一份 */
+static struct tss tss[SMP_MAX_CPUS];
+static struct gdt_desc gdt[SMP_MAX_CPUS][GDT_DESC_CNT];
 
-/** 更新tss中esp0字段的值为pthread的0级栈 */
+/** 更新当前cpu的tss中esp0字段的值为pthread的0级栈 */
 void update_tss_esp(struct task_struct* pthread) {
-    tss.esp0 = (uint32_t*)((uint32_t)pthread + PG_SIZE);
+    tss[cpu_id()].esp0 = (uint32_t*)((uint32_t)pthread + PG_SIZE);
 }
 
 /** 创建gdt描述符 */
@@ -55,26 +61,43 @@ static struct gdt_desc make_gdt_desc(uint32_t* desc_addr, uint32_t limit,
     return desc;
 }
 
-/** 在gdt中创建tss并重新加载gdt */
-void tss_init() {
-    put_str("tss_init start\n");
+/**
+ * 为当前cpu建立gdt和tss并加载.
+ * 各cpu的gdt都复制loader的前4个描述符,选择子在所有cpu上相同
+ */
+static void tss_load(void) {
+    uint32_t cpu = cpu_id();
     uint32_t tss_size = sizeof(struct tss);
-    memset(&tss, 0, tss_size);
-    tss.ss0 = SELECTOR_K_STACK;
-    tss.io_base = tss_size;
+    memset(&tss[cpu], 0, tss_size);
+    tss[cpu].ss0 = SELECTOR_K_STACK;
+    tss[cpu].io_base = tss_size;
 
-    // gdt段基址为0x900,把tss放到第4个位置,也就是0x900+0x20的位置
-
-    // 在gdt中添加dpl为0的TSS描述符
-    *((struct gdt_desc*)0xc0000920) = make_gdt_desc((uint32_t *) &tss, tss_size - 1, TSS_ATTR_LOW, TSS_ATTR_HIGH);
+    memcpy(gdt[cpu], (void*) LOADER_GDT, 4 * sizeof(struct gdt_desc));
+    // 第4个位置为dpl为0的TSS描述符
+    gdt[cpu][4] = make_gdt_desc((uint32_t *) &tss[cpu], tss_size - 1, TSS_ATTR_LOW, TSS_ATTR_HIGH);
 
     // 在gdt中添加dpl为3的数据段和代码段描述符
-    *((struct gdt_desc*)0xc0000928) = make_gdt_desc((uint32_t*)0, 0xfffff, GDT_CODE_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
-    *((struct gdt_desc*)0xc0000930) = make_gdt_desc((uint32_t*)0, 0xfffff, GDT_DATA_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
+    gdt[cpu][5] = make_gdt_desc((uint32_t*)0, 0xfffff, GDT_CODE_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
+    gdt[cpu][6] = make_gdt_desc((uint32_t*)0, 0xfffff, GDT_DATA_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
 
     // gdt 16位的limit 32位的段基址
-    uint64_t gdt_operand = ((8 * 7 - 1) | ((uint64_t)(uint32_t)0xc0000900 << 16));   // 7个描述符大小
+    uint64_t gdt_operand = ((sizeof(gdt[cpu]) - 1) | ((uint64_t)(uint32_t)gdt[cpu] << 16));
     asm volatile ("lgdt %0" : : "m" (gdt_operand));
+    // 重新加载段寄存器,AP从启动代码的临时gdt过来,还没有显存段
+    asm volatile ("movw %w0, %%ds; movw %w0, %%es; movw %w0, %%fs; movw %w0, %%ss; "
+                  "movw %w1, %%gs; ljmp %2, $1f; 1:"
+                  : : "r" (SELECTOR_K_DATA), "r" (SELECTOR_K_GS), "i" (SELECTOR_K_CODE) : "memory");
     asm volatile ("ltr %w0" : : "r" (SELECTOR_TSS));
+}
+
+/** 为BSP建立gdt和tss */
+void tss_init() {
+    put_str("tss_init start\n");
+    tss_load();
     put_str("tss_init and ltr done\n");
+}
+
+/** AP启动时为自己建立gdt和tss */
+void tss_ap_init(void) {
+    tss_load();
 }
\ No newline at end of file
@@ -9,12 +9,14 @@
 #include "../fs/fs.h"
 #include "../shell/pipe.h"
 #include "../fs/file.h"
+#include "../fs/inode.h"
 
 /**
  * 释放用户进程资源:
  *  1.页表中对应的物理页
  *  2.虚拟内存池占用的物理页
  *  3.关闭打开的文件
+ *  4.关闭进程体所在的程序文件
  * @param release_thread
  */
 static void release_prog_resource(struct task_struct* release_thread) {
@@ -52,8 +54,8 @@ static void release_prog_resource(struct task_struct* release_thread) {
         }
         pde_idx++;
     }
-    // 2.回收用户虚拟地址池所占用的物理内存
-    uint32_t bitmap_pg_cnt = (release_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len) / PG_SIZE;
+    // 2.回收用户虚拟地址池所占用的物理内存,包括位图之后存放摘要位图的一页
+    uint32_t bitmap_pg_cnt = DIV_ROUND_UP(release_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len, PG_SIZE) + 1;
     uint8_t* user_vaddr_pool_bitmap = release_thread->userprog_vaddr.vaddr_bitmap.bits;
     mfree_page(PF_KERNEL, user_vaddr_pool_bitmap, bitmap_pg_cnt);
 
@@ -62,17 +64,19 @@ static void release_prog_resource(struct task_struct* release_thread) {
     while (local_fd < MAX_FILES_OPEN_PER_PROC) {
         if (release_thread->fd_table[local_fd] != -1) {
             if (is_pipe(local_fd)) {
-                uint32_t global_fd = fd_local2global(local_fd);
-                if (--file_table[global_fd].fd_pos == 0) {
-                    mfree_page(PF_KERNEL, file_table[global_fd].fd_inode, 1);
-                    file_table[global_fd].fd_inode = NULL;
-                }
+                pipe_release(fd_local2global(local_fd));
             } else {
                 sys_close(local_fd);
             }
         }
         local_fd++;
     }
+
+    // 4.关闭exec时为按需读入进程体而保持打开的程序文件
+    if (release_thread->prog_inode != NULL) {
+        inode_close(release_thread->prog_inode);
+        release_thread->prog_inode = NULL;
+    }
 }
 
 /** list_traversal的回调函数,